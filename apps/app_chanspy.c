@@ -41,7 +41,6 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/channel.h"
 #include "callweaver/features.h"
 #include "callweaver/options.h"
-#include "callweaver/slinfactory.h"
 #include "callweaver/app.h"
 #include "callweaver/utils.h"
 #include "callweaver/say.h"
@@ -98,7 +97,6 @@ struct chanspy_translation_helper
     struct cw_channel_spy spy;
     int volfactor;
     int fd;
-    struct cw_slinfactory slinfactory[2];
 };
 
 /* Prototypes */
@@ -106,8 +104,6 @@ static struct cw_channel *local_get_channel_begin_name(char *name);
 static struct cw_channel *local_channel_walk(struct cw_channel *chan);
 static void spy_release(struct cw_channel *chan, void *data);
 static void *spy_alloc(struct cw_channel *chan, void *params);
-static struct cw_frame *spy_queue_shift(struct cw_channel_spy *spy, int qnum);
-static void cw_flush_spy_queue(struct cw_channel_spy *spy);
 static int spy_generate(struct cw_channel *chan, void *data, int len);
 static void start_spying(struct cw_channel *chan, struct cw_channel *spychan, struct cw_channel_spy *spy);
 static void stop_spying(struct cw_channel *chan, struct cw_channel_spy *spy);
@@ -164,53 +160,14 @@ static struct cw_channel *local_get_channel_begin_name(char *name)
 
 static void spy_release(struct cw_channel *chan, void *data)
 {
-    struct chanspy_translation_helper *csth = data;
-
-    cw_slinfactory_destroy(&csth->slinfactory[0]);
-    cw_slinfactory_destroy(&csth->slinfactory[1]);
-
     return;
 }
 
 static void *spy_alloc(struct cw_channel *chan, void *params)
 {
-    struct chanspy_translation_helper *csth = params;
-    cw_slinfactory_init(&csth->slinfactory[0]);
-    cw_slinfactory_init(&csth->slinfactory[1]);
     return params;
 }
 
-static struct cw_frame *spy_queue_shift(struct cw_channel_spy *spy, int qnum)
-{
-    struct cw_frame *f;
-
-    if (qnum < 0  ||  qnum > 1)
-        return NULL;
-
-    f = spy->queue[qnum];
-    if (f)
-    {
-        spy->queue[qnum] = f->next;
-        return f;
-    }
-    return NULL;
-}
-
-static void cw_flush_spy_queue(struct cw_channel_spy *spy)
-{
-    struct cw_frame *f = NULL;
-    int x = 0;
-    
-    cw_mutex_lock(&spy->lock);
-    for (x = 0;  x < 2;  x++)
-    {
-        f = NULL;
-        while ((f = spy_queue_shift(spy, x)))
-            cw_fr_free(f);
-    }
-    cw_mutex_unlock(&spy->lock);
-}
-
 #if 0
 static int extract_audio(short *buf, size_t len, struct cw_trans_pvt *trans, struct cw_frame *fr, int *maxsamp)
 {
@@ -249,35 +206,17 @@ static int extract_audio(short *buf, size_t len, struct cw_trans_pvt *trans, str
 
     return retlen;
 }
-
-static int spy_queue_ready(struct cw_channel_spy *spy)
-{
-    int res = 0;
-
-    cw_mutex_lock(&spy->lock);
-    if (spy->status == CHANSPY_RUNNING)
-    {
-        res = (spy->queue[0]  &&  spy->queue[1])  ?  1  :  0;
-    }
-    else
-    {
-        res = (spy->queue[0] || spy->queue[1])  ?  1  :  -1;
-    }
-    cw_mutex_unlock(&spy->lock);
-    return res;
-}
 #endif
 
 static int spy_generate(struct cw_channel *chan, void *data, int sample)
 {
 
     struct chanspy_translation_helper *csth = data;
-    struct cw_frame frame, *f;
+    struct cw_frame frame;
     int len0 = 0;
     int len1 = 0;
     int samp0 = 0;
     int samp1 = 0;
-    int len;
     int x;
     int vf;
     int minsamp;
@@ -290,34 +229,16 @@ static int spy_generate(struct cw_channel *chan, void *data, int sample)
         return -1;
     }
 
-    len = sample * sizeof(int16_t);
+    if (sample > 1280)
+        sample = 1280;
 
-    cw_mutex_lock(&csth->spy.lock);
-    while((f = csth->spy.queue[0]))
-    {
-        csth->spy.queue[0] = f->next;
-        cw_slinfactory_feed(&csth->slinfactory[0], f);
-        cw_fr_free(f);
-    }
-    cw_mutex_unlock(&csth->spy.lock);
-    cw_mutex_lock(&csth->spy.lock);
-    while((f = csth->spy.queue[1]))
-    {
-        csth->spy.queue[1] = f->next;
-        cw_slinfactory_feed(&csth->slinfactory[1], f);
-        cw_fr_free(f);
-    }
-    cw_mutex_unlock(&csth->spy.lock);
-
-    if (csth->slinfactory[0].size < len || csth->slinfactory[1].size < len)
-    {
+    if (cw_channel_spy_avail(&csth->spy, 0) < sample  ||  cw_channel_spy_avail(&csth->spy, 1) < sample)
         return 0;
-    }
 
-    len0 = cw_slinfactory_read(&csth->slinfactory[0], buf0, len);
-    samp0 = len0/sizeof(int16_t);
-    len1 = cw_slinfactory_read(&csth->slinfactory[1], buf1, len);
-    samp1 = len1/sizeof(int16_t);
+    samp0 = cw_channel_spy_read(&csth->spy, 0, buf0, sample);
+    len0 = samp0*sizeof(int16_t);
+    samp1 = cw_channel_spy_read(&csth->spy, 1, buf1, sample);
+    len1 = samp1*sizeof(int16_t);
 
     vf = db_to_scaling_factor(csth->volfactor) >> 4;
 
@@ -426,8 +347,10 @@ static void stop_spying(struct cw_channel *chan, struct cw_channel_spy *spy)
             }
             else
             {
-                chan->spiers = NULL;
+                chan->spiers = cptr->next;
+                cptr->next = NULL;
             }
+            break;
         }
         prev = cptr;
     }
@@ -473,8 +396,7 @@ static int channel_spy(struct cw_channel *chan, struct cw_channel *spyee, int *v
             cw_verbose(VERBOSE_PREFIX_2 "Spying on channel %s\n", name);
 
         memset(&csth, 0, sizeof(csth));
-        csth.spy.status = CHANSPY_RUNNING;
-        cw_mutex_init(&csth.spy.lock);
+        cw_channel_spy_init(&csth.spy);
         csth.volfactor = *volfactor;
         set_volume(chan, &csth);
 
@@ -540,13 +462,12 @@ static int channel_spy(struct cw_channel *chan, struct cw_channel *spyee, int *v
 
         if (option_verbose >= 2)
             cw_verbose(VERBOSE_PREFIX_2 "Done Spying on channel %s\n", name);
-        cw_flush_spy_queue(&csth.spy);
+        cw_channel_spy_destroy(&csth.spy);
     }
     else
     {
         running = 0;
     }
-    cw_mutex_destroy(&csth.spy.lock);
     return running;
 }
 
@@ -247,7 +247,6 @@ static int group_show_channels(int fd, int argc, char *argv[])
 	struct cw_channel *c = NULL;
 	int numchans = 0;
 	struct cw_var_t *current;
-	struct varshead *headp;
 	regex_t regexbuf;
 	int havepattern = 0;
 
@@ -262,8 +261,7 @@ static int group_show_channels(int fd, int argc, char *argv[])
 
 	cw_cli(fd, FORMAT_STRING, "Channel", "Group", "Category");
 	while ( (c = cw_channel_walk_locked(c)) != NULL) {
-		headp=&c->varshead;
-		CW_LIST_TRAVERSE(headp,current,entries) {
+		CW_CHANNEL_VARS_TRAVERSE(c, current) {
 			if (!strncmp(cw_var_name(current), GROUP_CATEGORY_PREFIX "_", strlen(GROUP_CATEGORY_PREFIX) + 1)) {
 				if (!havepattern || !regexec(&regexbuf, cw_var_value(current), 0, NULL, 0)) {
 					cw_cli(fd, FORMAT_STRING, c->name, cw_var_value(current),
@@ -38,7 +38,6 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/file.h"
 #include "callweaver/logger.h"
 #include "callweaver/channel.h"
-#include "callweaver/slinfactory.h"
 #include "callweaver/app.h"
 #include "callweaver/pbx.h"
 #include "callweaver/translate.h"
@@ -184,32 +183,6 @@ static void startmon(struct cw_channel *chan, struct cw_channel_spy *spy)
     }
 }
 
-static int spy_queue_translate(struct cw_channel_spy *spy,
-                               struct cw_slinfactory *slinfactory0,
-                               struct cw_slinfactory *slinfactory1)
-{
-    int res = 0;
-    struct cw_frame *f;
-    
-    cw_mutex_lock(&spy->lock);
-    while ((f = spy->queue[0]))
-    {
-        spy->queue[0] = f->next;
-        cw_slinfactory_feed(slinfactory0, f);
-        cw_fr_free(f);
-    }
-    cw_mutex_unlock(&spy->lock);
-    cw_mutex_lock(&spy->lock);
-    while ((f = spy->queue[1]))
-    {
-        spy->queue[1] = f->next;
-        cw_slinfactory_feed(slinfactory1, f);
-        cw_fr_free(f);
-    }
-    cw_mutex_unlock(&spy->lock);
-    return res;
-}
-
 static void *muxmon_thread(void *obj) 
 {
 
@@ -217,7 +190,7 @@ static void *muxmon_thread(void *obj)
     int len1 = 0;
     int samp0 = 0;
     int samp1 = 0;
-    int framelen;
+    int framesamp;
     int minsamp;
     int x = 0;
     short buf0[1280], buf1[1280], buf[1280];
@@ -228,18 +201,15 @@ static void *muxmon_thread(void *obj)
     char *ext;
     char *name;
     unsigned int oflags;
-    struct cw_slinfactory slinfactory[2];
     char post_process[1024] = "";
     
     name = cw_strdupa(muxmon->chan->name);
 
-    framelen = 160*sizeof(int16_t);
+    framesamp = 160;
     cw_fr_init_ex(&frame, CW_FRAME_VOICE, CW_FORMAT_SLINEAR, NULL);
     frame.data = buf;
     cw_set_flag(muxmon, MUXFLAG_RUNNING);
     oflags = O_CREAT|O_WRONLY;
-    cw_slinfactory_init(&slinfactory[0]);
-    cw_slinfactory_init(&slinfactory[1]);
 
     /* For efficiency, use a flag to bypass volume logic when it's not needed */
     if (muxmon->readvol  ||  muxmon->writevol)
@@ -250,10 +220,7 @@ static void *muxmon_thread(void *obj)
     else
         ext = "raw";
 
-    memset(&spy, 0, sizeof(spy));
-    spy.status = CHANSPY_RUNNING;
-    spy.next = NULL;
-    cw_mutex_init(&spy.lock);
+    cw_channel_spy_init(&spy);
     startmon(muxmon->chan, &spy);
     if (cw_test_flag(muxmon, MUXFLAG_RUNNING))
     {
@@ -298,19 +265,17 @@ static void *muxmon_thread(void *obj)
                     continue;
                 }
                 
-                spy_queue_translate(&spy, &slinfactory[0], &slinfactory[1]);
-                
-                if (slinfactory[0].size < framelen || slinfactory[1].size < framelen)
+                if (cw_channel_spy_avail(&spy, 0) < framesamp  ||  cw_channel_spy_avail(&spy, 1) < framesamp)
                 {
                     usleep(1000);
                     sched_yield();
                     continue;
                 }
 
-                len0 = cw_slinfactory_read(&slinfactory[0], buf0, framelen);
-                samp0 = len0/sizeof(int16_t);
-                len1 = cw_slinfactory_read(&slinfactory[1], buf1, framelen);
-                samp1 = len1/sizeof(int16_t);
+                samp0 = cw_channel_spy_read(&spy, 0, buf0, framesamp);
+                len0 = samp0*sizeof(int16_t);
+                samp1 = cw_channel_spy_read(&spy, 1, buf1, framesamp);
+                len1 = samp1*sizeof(int16_t);
                 if (cw_test_flag(muxmon, MUXFLAG_VOLUME))
                 {
                     for (x = 0;  x < samp0;  x++)
@@ -374,14 +339,11 @@ static void *muxmon_thread(void *obj)
          stopmon(muxmon->chan, &spy);  
     if (option_verbose > 1)
         cw_verbose(VERBOSE_PREFIX_2 "Finished Recording %s\n", name);
-    cw_mutex_destroy(&spy.lock);
+    cw_channel_spy_destroy(&spy);
     
     if (fs)
         cw_closestream(fs);
     
-    cw_slinfactory_destroy(&slinfactory[0]);
-    cw_slinfactory_destroy(&slinfactory[1]);
-
     if (muxmon)
     {
         if (muxmon->filename)
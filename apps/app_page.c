@@ -109,7 +109,7 @@ static void launch_page(struct cw_channel *chan, const char *nconferenceopts, co
 		cw_copy_string(cd->resource, resource, sizeof(cd->resource));
 		cw_copy_string(cd->nconferenceopts, nconferenceopts, sizeof(cd->nconferenceopts));
 
-		CW_LIST_TRAVERSE(&chan->varshead, varptr, entries) {
+		CW_CHANNEL_VARS_TRAVERSE(chan, varptr) {
 			if (!(varname = cw_var_full_name(varptr)))
 				continue;
 			if (varname[0] == '_') {
@@ -65,6 +65,7 @@
 #include <stdio.h>
 #include <sys/time.h>
 #include <sys/signal.h>
+#include <fcntl.h>
 #include <netinet/in.h>
 
 #include "callweaver.h"
@@ -92,6 +93,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/causes.h"
 #include "callweaver/callweaver_db.h"
 #include "callweaver/devicestate.h"
+#include "callweaver/callweaver_hash.h"
 
 
 static void *queueagentcount_function;
@@ -125,6 +127,7 @@ static struct strategy
 #define DEFAULT_RETRY		5
 #define DEFAULT_TIMEOUT		15
 #define RECHECK			1		/* Recheck every second to see we we're at the top yet */
+#define RECHECK_IDLE		30		/* Recheck this often when the distributor can wake us */
 
 #define	RES_OKAY	0		/* Action completed */
 #define	RES_EXISTS	(-1)		/* Entry already exists */
@@ -194,11 +197,11 @@ static const char *app_pqm_synopsis = "Pauses a queue member" ;
 static const char *app_pqm_syntax = "PauseQueueMember([queuename], interface)";
 static const char *app_pqm_descrip =
     "Pauses (blocks calls for) a queue member.\n"
-    "The given interface will be paused in the given queue. This prevents\n"
-    "any calls from being sent from the queue to the interface until it is\n"
-    "unpaused with UnpauseQueueMember or the manager interface. If no\n"
-    "queuename is given, the interface is paused in every queue it is a\n"
-    "member of."
+    "The given interface will be paused. This prevents any calls from being\n"
+    "sent to the interface until it is unpaused with UnpauseQueueMember or\n"
+    "the manager interface. The pause applies to every queue the interface\n"
+    "is a member of; if a queuename is given, the interface must be a\n"
+    "member of that queue."
     "  This application sets the following channel variable upon completion:\n"
     "     PQMSTATUS      The status of the attempt to pause a queue member as a\n"
     "                     text string, one of\n"
@@ -267,7 +270,6 @@ struct localuser
     char interface[256];
     int stillgoing;
     int metric;
-    int oldstatus;
     time_t lastcall;
     struct member *member;
     struct localuser *next;
@@ -292,6 +294,9 @@ struct queue_ent
     int handled;			/*!< Whether our call was handled */
     time_t start;			/*!< When we started holding */
     time_t expire;			/*!< When this entry should expire (time out of queue) */
+    int wakefd[2];			/*!< Pipe the distributor wakes us through, -1 if none.
+    					     Costs two fds per waiting caller */
+    int wakeup;			/*!< A wakeup is pending on wakefd */
     struct cw_channel *chan;	/*!< Our channel */
     struct queue_ent *next;		/*!< The next queue entry */
 };
@@ -300,14 +305,36 @@ struct member
 {
     char interface[80];		/*!< Technology/Location */
     int penalty;			/*!< Are we a last resort? */
-    int calls;			/*!< Number of calls serviced by this member */
     int dynamic;			/*!< Are we dynamically added? */
-    int status;			/*!< Status of queue member */
-    int paused;			/*!< Are we paused (not accepting calls)? */
-    time_t lastcall;		/*!< When last successful call was hungup */
+    struct member_iface *iface;	/*!< Shared interface state: status, pause and call stats */
     int dead;			/*!< Used to detect members deleted in realtime */
     time_t added;		/* used to track when member was added */
     struct member *next;		/*!< Next member */
+    struct cw_call_queue *parent;	/*!< Queue we are a member of */
+    struct member *inext;		/*!< Next membership of the same interface */
+    int pos;			/*!< Position in the member list, as of the last ordering */
+    int ounavail;			/*!< Was unavailable when last ordered */
+    struct member *onext;		/*!< Next member in the queue's order */
+    struct member *oprev;		/*!< Previous member in the queue's order */
+};
+
+/* State shared by all memberships of an interface. Holds one reference
+   per membership. The status is only changed through member_iface_set()
+   and is read without a lock. The pause and the call stats are changed
+   with qlock held, and read under either qlock or a queue lock. */
+struct member_iface
+{
+    char interface[80];		/*!< Technology/Location */
+    volatile int status;		/*!< Device state of the interface */
+    int paused;			/*!< Are we paused (not accepting calls)? */
+    int calls;			/*!< Number of calls serviced, in all queues */
+    time_t lastcall;		/*!< When last successful call was hungup */
+    int refs;			/*!< Number of memberships */
+    unsigned int hash;		/*!< Hash of the interface */
+    struct member *members;		/*!< Memberships, linked through inext */
+    struct member_iface *next;	/*!< Next interface in the hash bucket */
+    int pending;			/*!< On the wake_pending list */
+    struct member_iface *wnext;	/*!< Next interface on the wake_pending list */
 };
 
 /* values used in multi-bit flags in cw_call_queue */
@@ -335,6 +362,7 @@ struct cw_call_queue
     unsigned int strategy: 3;
     unsigned int maskmemberstatus: 1;
     unsigned int realtime: 1;
+    unsigned int ordered: 1;        /*!< The member order is up to date */
     int announcefrequency;          /*!< How often to announce their position */
     int periodicannouncefrequency;	/*!< How often to play periodic announcement */
     int roundingseconds;            /*!< How many seconds do we round to? */
@@ -371,6 +399,7 @@ struct cw_call_queue
     int memberdelay;		        /*!< Seconds to delay connecting member to caller */
 
     struct member *members;		    /*!< Head of the list of members */
+    struct member *order;		    /*!< Members in the order the strategy tries them */
     struct queue_ent *head;		    /*!< Head of the list of callers */
     struct cw_call_queue *next;	/*!< Next call queue */
 };
@@ -378,6 +407,141 @@ struct cw_call_queue
 static struct cw_call_queue *queues = NULL;
 CW_MUTEX_DEFINE_STATIC(qlock);
 
+/* The interfaces of all queue members, hashed by name so that a device
+   state change is applied once and only visits the memberships it
+   concerns. Protected by qlock. */
+#define MEMBER_BUCKETS 1024
+static struct member_iface *member_index[MEMBER_BUCKETS];
+
+/* Interfaces whose status changed while a queue was locked, so that their
+   other queues could not be told yet. Protected by wakelock, which nests
+   inside both qlock and the queue locks. */
+static struct member_iface *wake_pending = NULL;
+CW_MUTEX_DEFINE_STATIC(wakelock);
+
+/* Set the status of an interface. Returns non-zero if it changed. */
+static int member_iface_set(struct member_iface *iface, int status)
+{
+    int old;
+
+    do
+    {
+        if ((old = iface->status) == status)
+            return 0;
+    }
+    while (!cw_atomic_cmpxchg_int(&iface->status, old, status));
+    return 1;
+}
+
+static struct member_iface *member_iface_find(const char *interface, unsigned int hash)
+{
+    struct member_iface *iface;
+
+    for (iface = member_index[hash % MEMBER_BUCKETS];  iface;  iface = iface->next)
+    {
+        if (iface->hash == hash  &&  !strcasecmp(iface->interface, interface))
+            return iface;
+    }
+    return NULL;
+}
+
+/* Attach a new member to the shared state of its interface, creating it
+   on first use. Called with qlock held. */
+static int member_index_add(struct cw_call_queue *q, struct member *m)
+{
+    struct member_iface *iface;
+    unsigned int hash;
+
+    hash = cw_hash_string_tolower(m->interface);
+    if (!(iface = member_iface_find(m->interface, hash)))
+    {
+        if (!(iface = malloc(sizeof(*iface))))
+            return -1;
+        memset(iface, 0, sizeof(*iface));
+        cw_copy_string(iface->interface, m->interface, sizeof(iface->interface));
+        iface->hash = hash;
+        member_iface_set(iface, cw_device_state(m->interface));
+        iface->next = member_index[hash % MEMBER_BUCKETS];
+        member_index[hash % MEMBER_BUCKETS] = iface;
+    }
+    iface->refs++;
+    m->iface = iface;
+    m->parent = q;
+    m->inext = iface->members;
+    iface->members = m;
+    q->ordered = 0;
+    return 0;
+}
+
+/* Detach a member from its interface, freeing the interface with its
+   last membership. Called with qlock held. */
+static void member_index_del(struct member *m)
+{
+    struct member_iface *iface = m->iface;
+    struct member_iface **ip;
+    struct member **p;
+
+    m->parent->ordered = 0;
+    for (p = &iface->members;  *p;  p = &(*p)->inext)
+    {
+        if (*p == m)
+        {
+            *p = m->inext;
+            break;
+        }
+    }
+    if (--iface->refs > 0)
+        return;
+    if (iface->pending)
+    {
+        cw_mutex_lock(&wakelock);
+        for (ip = &wake_pending;  *ip;  ip = &(*ip)->wnext)
+        {
+            if (*ip == iface)
+            {
+                *ip = iface->wnext;
+                break;
+            }
+        }
+        cw_mutex_unlock(&wakelock);
+    }
+    for (ip = &member_index[iface->hash % MEMBER_BUCKETS];  *ip;  ip = &(*ip)->next)
+    {
+        if (*ip == iface)
+        {
+            *ip = iface->next;
+            break;
+        }
+    }
+    free(iface);
+}
+
+/* Called with qlock held */
+static void free_members(struct cw_call_queue *q, int all)
+{
+    /* Free non-dynamic members */
+    struct member *curm, *next, *prev;
+
+    curm = q->members;
+    prev = NULL;
+    while (curm)
+    {
+        next = curm->next;
+        if (all  ||  !curm->dynamic)
+        {
+            if (prev)
+                prev->next = next;
+            else
+                q->members = next;
+            member_index_del(curm);
+            free(curm);
+        }
+        else
+            prev = curm;
+        curm = next;
+    }
+}
+
 static void set_queue_result(struct cw_channel *chan, enum queue_result res)
 {
     int i;
@@ -454,7 +618,7 @@ static enum queue_member_status get_member_status(struct cw_call_queue *q)
     cw_mutex_lock(&q->lock);
     for (member = q->members; member; member = member->next)
     {
-        switch (member->status)
+        switch (member->iface->status)
         {
         case CW_DEVICE_INVALID:
             /* nothing to do */
@@ -471,95 +635,326 @@ static enum queue_member_status get_member_status(struct cw_call_queue *q)
     return result;
 }
 
-struct statechange
+static int member_available(struct member *m)
 {
-    int state;
-    char dev[0];
-};
+    return !m->iface->paused  &&  (m->iface->status == CW_DEVICE_NOT_INUSE  ||  m->iface->status == CW_DEVICE_UNKNOWN);
+}
 
-static void *changethread(void *data)
+/* The leastrecent, fewestcalls and rrmemory strategies keep their members
+   in a standing order, so that a caller does not have to rank every member
+   on every attempt. Members that were unavailable when last ordered go
+   last, as ringing them would fail anyway, then it is by penalty and by
+   what the strategy ranks on. The order is kept up to date as calls
+   complete and pauses and statuses change, and rebuilt when the members
+   change. The other strategies rank members afresh each time. Called with
+   the queue locked. */
+static int member_order_used(struct cw_call_queue *q)
 {
-    struct cw_call_queue *q;
-    struct statechange *sc = data;
-    struct member *cur;
-    char *loc;
-    char *technology;
+    return q->strategy == QUEUE_STRATEGY_LEASTRECENT
+           ||  q->strategy == QUEUE_STRATEGY_FEWESTCALLS
+           ||  q->strategy == QUEUE_STRATEGY_RRMEMORY;
+}
 
-    technology = cw_strdupa(sc->dev);
-    loc = strchr(technology, '/');
-    if (loc)
+static int member_order_cmp(struct cw_call_queue *q, struct member *a, struct member *b)
+{
+    int d;
+
+    if ((d = a->ounavail - b->ounavail))
+        return d;
+    if ((d = a->penalty - b->penalty))
+        return d;
+    switch (q->strategy)
     {
-        *loc = '\0';
-        loc++;
+    case QUEUE_STRATEGY_FEWESTCALLS:
+        if ((d = a->iface->calls - b->iface->calls))
+            return d;
+        break;
+    case QUEUE_STRATEGY_LEASTRECENT:
+        if (a->iface->lastcall != b->iface->lastcall)
+            return (a->iface->lastcall < b->iface->lastcall)  ?  -1  :  1;
+        break;
+    case QUEUE_STRATEGY_RRMEMORY:
+        return a->pos - b->pos;
+    }
+    /* Ties go the way the ranked list always broke them, last member first */
+    return b->pos - a->pos;
+}
+
+static struct member *member_order_sort(struct cw_call_queue *q, struct member *list)
+{
+    struct member *a, *b, *slow, *fast, *head, **tail;
+
+    if (!list  ||  !list->onext)
+        return list;
+
+    slow = list;
+    fast = list->onext;
+    while (fast  &&  fast->onext)
+    {
+        slow = slow->onext;
+        fast = fast->onext->onext;
+    }
+    b = slow->onext;
+    slow->onext = NULL;
+    a = member_order_sort(q, list);
+    b = member_order_sort(q, b);
+
+    head = NULL;
+    tail = &head;
+    while (a  &&  b)
+    {
+        if (member_order_cmp(q, b, a) < 0)
+        {
+            *tail = b;
+            b = b->onext;
+        }
+        else
+        {
+            *tail = a;
+            a = a->onext;
+        }
+        tail = &(*tail)->onext;
     }
+    *tail = a  ?  a  :  b;
+    return head;
+}
+
+static void member_order_rebuild(struct cw_call_queue *q)
+{
+    struct member *m, *prev;
+    int pos = 0;
+
+    for (m = q->members;  m;  m = m->next)
+    {
+        m->pos = pos++;
+        m->ounavail = !member_available(m);
+        m->onext = m->next;
+    }
+    q->order = member_order_sort(q, q->members);
+    for (prev = NULL, m = q->order;  m;  prev = m, m = m->onext)
+        m->oprev = prev;
+    q->ordered = 1;
+}
+
+/* Move a member whose availability, pause or call stats changed */
+static void member_order_update(struct cw_call_queue *q, struct member *m)
+{
+    struct member *cur, *prev;
+
+    if (!q->ordered  ||  !member_order_used(q))
+        return;
+    if (m->oprev)
+        m->oprev->onext = m->onext;
+    else
+        q->order = m->onext;
+    if (m->onext)
+        m->onext->oprev = m->oprev;
+
+    m->ounavail = !member_available(m);
+    for (prev = NULL, cur = q->order;  cur  &&  member_order_cmp(q, cur, m) < 0;  prev = cur, cur = cur->onext)
+        ;
+    m->oprev = prev;
+    m->onext = cur;
+    if (prev)
+        prev->onext = m;
     else
+        q->order = m;
+    if (cur)
+        cur->oprev = m;
+}
+
+static int member_order_group(struct member *a, struct member *b)
+{
+    return b  &&  a->ounavail == b->ounavail  &&  a->penalty == b->penalty;
+}
+
+/* The member to try after cur, or the first one if cur is NULL. rrmemory
+   keeps each group of equal availability and penalty by position and
+   takes it from rrpos on, then from its start up to rrpos, the way
+   calc_metric() would rank it. *group tracks the start of the group. */
+static struct member *member_order_next(struct cw_call_queue *q, struct member *cur, struct member **group)
+{
+    struct member *m;
+
+    if (q->strategy != QUEUE_STRATEGY_RRMEMORY)
+        return (cur)  ?  cur->onext  :  q->order;
+
+    if (cur == NULL)
+    {
+        m = q->order;
+    }
+    else if (cur->pos >= q->rrpos)
     {
-        free(sc);
+        if (member_order_group(*group, cur->onext))
+            return cur->onext;
+        if ((*group)->pos < q->rrpos)
+            return *group;
+        m = cur->onext;
+    }
+    else
+    {
+        if (member_order_group(*group, cur->onext)  &&  cur->onext->pos < q->rrpos)
+            return cur->onext;
+        for (m = cur->onext;  member_order_group(*group, m);  m = m->onext)
+            ;
+    }
+    /* Start on the next group */
+    if ((*group = m) == NULL)
         return NULL;
+    for (  ;  member_order_group(*group, m);  m = m->onext)
+    {
+        if (m->pos >= q->rrpos)
+            return m;
     }
-    if (option_debug)
-        cw_log(LOG_DEBUG, "Device '%s/%s' changed to state '%d' (%s)\n", technology, loc, sc->state, devstate2str(sc->state));
-    cw_mutex_lock(&qlock);
-    for (q = queues; q; q = q->next)
+    return *group;
+}
+
+/* Wake a caller sleeping in wait_our_turn() or wait_a_bit().
+   Called with the queue locked. */
+static void queue_wake(struct queue_ent *qe)
+{
+    if (qe->wakefd[1] > -1  &&  !qe->wakeup)
     {
+        qe->wakeup = 1;
+        /* A full pipe already holds a wakeup. Anything else and the
+           caller could sleep through this one, so it goes back to
+           polling the queue. */
+        if (write(qe->wakefd[1], "", 1) < 0  &&  errno != EAGAIN)
+        {
+            cw_log(LOG_WARNING, "Unable to wake %s, it will poll the queue: %s\n", qe->chan->name, strerror(errno));
+            close(qe->wakefd[1]);
+            qe->wakefd[1] = -1;
+        }
+    }
+}
+
+static void queue_wake_all(struct cw_call_queue *q)
+{
+    struct queue_ent *qe;
+
+    for (qe = q->head;  qe;  qe = qe->next)
+        queue_wake(qe);
+}
+
+/* The queue distributor. Called with the queue locked whenever callers
+   join, leave or take their turn, and when a member becomes available.
+   Rather than have every caller poll the queue, it wakes the one caller
+   that can make progress: the first caller not yet trying members, or,
+   if a member just became free, the caller at the head of the queue.
+
+   It only wakes callers. It does not hand a particular member to a
+   particular caller: the woken caller rings members itself, through
+   try_calling() in the strategy's order. So when several callers are
+   trying members at once, two of them can still ring the same free
+   member. Only one gets it, and the other finds it busy and waits for
+   the next wakeup or its retry. */
+static void queue_dispatch(struct cw_call_queue *q, int member_free)
+{
+    struct queue_ent *qe;
+
+    for (qe = q->head;  qe;  qe = qe->next)
+    {
+        if (member_free  ||  !qe->trying_agent)
+        {
+            queue_wake(qe);
+            break;
+        }
+    }
+}
+
+/* Let every queue the interface is a member of react to a new status.
+   Called with qlock held and no queue locked. */
+static void member_iface_notify(struct member_iface *iface)
+{
+    struct cw_call_queue *q;
+    struct member *cur;
+    int state = iface->status;
+
+    for (cur = iface->members;  cur;  cur = cur->inext)
+    {
+        q = cur->parent;
         cw_mutex_lock(&q->lock);
-        cur = q->members;
-        while (cur)
+        member_order_update(q, cur);
+        if (member_available(cur))
+            queue_dispatch(q, 1);
+        else if (q->leavewhenempty)
+            queue_wake_all(q);
+        if (!q->maskmemberstatus)
         {
-            if (!strcasecmp(sc->dev, cur->interface))
-            {
-                if (cur->status != sc->state)
-                {
-                    cur->status = sc->state;
-                    if (!q->maskmemberstatus)
-                    {
-                        manager_event(EVENT_FLAG_AGENT, "QueueMemberStatus",
-                                      "Queue: %s\r\n"
-                                      "Location: %s\r\n"
-                                      "Membership: %s\r\n"
-                                      "Penalty: %d\r\n"
-                                      "CallsTaken: %d\r\n"
-                                      "LastCall: %ld\r\n"
-                                      "Status: %d\r\n"
-                                      "Paused: %d\r\n",
-                                      q->name, cur->interface, cur->dynamic ? "dynamic" : "static",
-                                      cur->penalty, cur->calls, cur->lastcall, cur->status, cur->paused);
-                    }
-                }
-            }
-            cur = cur->next;
+            manager_event(EVENT_FLAG_AGENT, "QueueMemberStatus",
+                          "Queue: %s\r\n"
+                          "Location: %s\r\n"
+                          "Membership: %s\r\n"
+                          "Penalty: %d\r\n"
+                          "CallsTaken: %d\r\n"
+                          "LastCall: %ld\r\n"
+                          "Status: %d\r\n"
+                          "Paused: %d\r\n",
+                          q->name, cur->interface, cur->dynamic ? "dynamic" : "static",
+                          cur->penalty, iface->calls, iface->lastcall, state, iface->paused);
         }
         cw_mutex_unlock(&q->lock);
     }
-    cw_mutex_unlock(&qlock);
-    free(sc);
-    return NULL;
 }
 
-static int statechange_queue(const char *dev, int state, void *ign)
+/* Notify the queues of the interfaces update_status() changed. Must be
+   called with no queue locked. */
+static void queue_wake_pending(void)
 {
-    /* Avoid potential for deadlocks by spawning a new thread to handle the event */
-    struct statechange *sc;
-    pthread_t t;
-    pthread_attr_t attr;
-
-    sc = malloc(sizeof(struct statechange) + strlen(dev) + 1);
-    if (sc)
-    {
-        sc->state = state;
-        strcpy(sc->dev, dev);
-        pthread_attr_init(&attr);
-        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-        if (cw_pthread_create(&t, &attr, changethread, sc))
+    struct member_iface *iface;
+
+    if (!wake_pending)
+        return;
+    cw_mutex_lock(&qlock);
+    for (;;)
+    {
+        cw_mutex_lock(&wakelock);
+        if ((iface = wake_pending))
         {
-            cw_log(LOG_WARNING, "Failed to create update thread!\n");
-            free(sc);
+            wake_pending = iface->wnext;
+            iface->pending = 0;
         }
+        cw_mutex_unlock(&wakelock);
+        if (!iface)
+            break;
+        member_iface_notify(iface);
+    }
+    cw_mutex_unlock(&qlock);
+}
+
+/* Called by the device state engine, which serialises calls and holds
+   none of its own locks, so the queues can be updated in place. */
+static int statechange_queue(const char *dev, int state, void *ign)
+{
+    struct member_iface *iface;
+    unsigned int hash;
+    char *loc;
+    char *technology;
+
+    technology = cw_strdupa(dev);
+    loc = strchr(technology, '/');
+    if (loc)
+    {
+        *loc = '\0';
+        loc++;
+    }
+    else
+    {
+        return 0;
     }
+    if (option_debug)
+        cw_log(LOG_DEBUG, "Device '%s/%s' changed to state '%d' (%s)\n", technology, loc, state, devstate2str(state));
+    hash = cw_hash_string_tolower(dev);
+    cw_mutex_lock(&qlock);
+    /* One update for all memberships, then let each queue react */
+    if ((iface = member_iface_find(dev, hash))  &&  member_iface_set(iface, state))
+        member_iface_notify(iface);
+    cw_mutex_unlock(&qlock);
     return 0;
 }
 
-static struct member *create_queue_member(char *interface, int penalty, int paused)
+/* Called with qlock held, the new member is entered in the interface index */
+static struct member *create_queue_member(struct cw_call_queue *q, char *interface, int penalty, int paused)
 {
     struct member *cur;
 
@@ -569,12 +964,20 @@ static struct member *create_queue_member(char *interface, int penalty, int paus
     {
         memset(cur, 0, sizeof(struct member));
         cur->penalty = penalty;
-        cur->paused = paused;
         cw_copy_string(cur->interface, interface, sizeof(cur->interface));
         if (!strchr(cur->interface, '/'))
             cw_log(LOG_WARNING, "No location at interface '%s'\n", interface);
-        cur->status = cw_device_state(interface);
         cur->added = time(NULL);
+        if (member_index_add(q, cur))
+        {
+            free(cur);
+            cur = NULL;
+        }
+        else if (paused)
+        {
+            /* The pause is shared, so only ever add one here */
+            cur->iface->paused = 1;
+        }
     }
 
     return cur;
@@ -774,6 +1177,7 @@ static void queue_set_param(struct cw_call_queue *q, const char *param, const ch
     else if (!strcasecmp(param, "strategy"))
     {
         q->strategy = strat2int(val);
+        q->ordered = 0;
         if (q->strategy < 0)
         {
             cw_log(LOG_WARNING, "'%s' isn't a valid strategy for queue '%s', using ringall instead\n",
@@ -843,6 +1247,7 @@ static void queue_set_param(struct cw_call_queue *q, const char *param, const ch
 
 static void rt_handle_member_record(struct cw_call_queue *q, char *interface, const char *penalty_str)
 {
+    struct member_iface *iface;
     struct member *m, *prev_m;
     int penalty = 0;
 
@@ -853,19 +1258,24 @@ static void rt_handle_member_record(struct cw_call_queue *q, char *interface, co
             penalty = 0;
     }
 
-    /* Find the member, or the place to put a new one. */
-    prev_m = NULL;
-    m = q->members;
-    while (m && strcmp(m->interface, interface))
+    /* Find the member through its interface */
+    m = NULL;
+    if ((iface = member_iface_find(interface, cw_hash_string_tolower(interface))))
     {
-        prev_m = m;
-        m = m->next;
+        for (m = iface->members;  m;  m = m->inext)
+        {
+            if (m->parent == q  &&  !strcmp(m->interface, interface))
+                break;
+        }
     }
 
     /* Create a new one if not found, else update penalty */
     if (!m)
     {
-        m = create_queue_member(interface, penalty, 0);
+        /* Find the place to put it */
+        for (prev_m = q->members;  prev_m  &&  prev_m->next;  prev_m = prev_m->next)
+            ;
+        m = create_queue_member(q, interface, penalty, 0);
         if (m)
         {
             m->dead = 0;
@@ -882,6 +1292,8 @@ static void rt_handle_member_record(struct cw_call_queue *q, char *interface, co
     else
     {
         m->dead = 0;	/* Do not delete this one. */
+        if (m->penalty != penalty)
+            q->ordered = 0;
         m->penalty = penalty;
     }
 }
@@ -957,6 +1369,7 @@ static struct cw_call_queue *reload_queue_rt(const char *queuename, struct cw_va
                 {
                     prev_q->next = q->next;
                 }
+                free_members(q, 1);
                 cw_mutex_unlock(&q->lock);
                 free(q);
             }
@@ -1028,6 +1441,7 @@ static struct cw_call_queue *reload_queue_rt(const char *queuename, struct cw_va
                 prev_m->next = next_m;
             else
                 q->members = next_m;
+            member_index_del(m);
             free(m);
         }
         else
@@ -1138,30 +1552,6 @@ static int join_queue(char *queuename, struct queue_ent *qe, enum queue_result *
     return res;
 }
 
-static void free_members(struct cw_call_queue *q, int all)
-{
-    /* Free non-dynamic members */
-    struct member *curm, *next, *prev;
-
-    curm = q->members;
-    prev = NULL;
-    while (curm)
-    {
-        next = curm->next;
-        if (all  ||  !curm->dynamic)
-        {
-            if (prev)
-                prev->next = next;
-            else
-                q->members = next;
-            free(curm);
-        }
-        else
-            prev = curm;
-        curm = next;
-    }
-}
-
 static void destroy_queue(struct cw_call_queue *q)
 {
     struct cw_call_queue *cur, *prev = NULL;
@@ -1181,8 +1571,8 @@ static void destroy_queue(struct cw_call_queue *q)
             prev = cur;
         }
     }
-    cw_mutex_unlock(&qlock);
     free_members(q, 1);
+    cw_mutex_unlock(&qlock);
     cw_mutex_destroy(&q->lock);
     free(q);
 }
@@ -1429,6 +1819,7 @@ static void leave_queue(struct queue_ent *qe)
         }
         cur = cur->next;
     }
+    queue_dispatch(q, 0);
     cw_mutex_unlock(&q->lock);
     if (q->dead && !q->count)
     {
@@ -1453,41 +1844,43 @@ static void hangupcalls(struct localuser *outgoing, struct cw_channel *exception
     }
 }
 
+/* May be called with the queue, and qlock, locked. Taking qlock here would
+   invert the lock order, so the member's queues, this one included, are
+   notified by the next queue_wake_pending(). */
 static int update_status(struct cw_call_queue *q, struct member *member, int status)
 {
+    struct member_iface *iface;
     struct member *cur;
 
     /* Since a reload could have taken place, we have to traverse the list to
     	be sure it's still valid */
     cw_mutex_lock(&q->lock);
-    cur = q->members;
-    while (cur)
+    for (cur = q->members;  cur;  cur = cur->next)
     {
         if (member == cur)
         {
-            cur->status = status;
-            if (!q->maskmemberstatus)
+            iface = cur->iface;
+            if (member_iface_set(iface, status))
             {
-                manager_event(EVENT_FLAG_AGENT, "QueueMemberStatus",
-                              "Queue: %s\r\n"
-                              "Location: %s\r\n"
-                              "Membership: %s\r\n"
-                              "Penalty: %d\r\n"
-                              "CallsTaken: %d\r\n"
-                              "LastCall: %ld\r\n"
-                              "Status: %d\r\n"
-                              "Paused: %d\r\n",
-                              q->name, cur->interface, cur->dynamic ? "dynamic" : "static",
-                              cur->penalty, cur->calls, cur->lastcall, cur->status, cur->paused);
+                cw_mutex_lock(&wakelock);
+                if (!iface->pending)
+                {
+                    iface->pending = 1;
+                    iface->wnext = wake_pending;
+                    wake_pending = iface;
+                }
+                cw_mutex_unlock(&wakelock);
             }
             break;
         }
-        cur = cur->next;
     }
     cw_mutex_unlock(&q->lock);
     return 0;
 }
 
+/* Record what a failed dial says about the device. Other causes say
+   nothing about it, and the status is shared by all of the interface's
+   queues, so they leave it alone. */
 static int update_dial_status(struct cw_call_queue *q, struct member *member, int status)
 {
     if (status == CW_CAUSE_BUSY)
@@ -1497,7 +1890,7 @@ static int update_dial_status(struct cw_call_queue *q, struct member *member, in
     else if (status == CW_CAUSE_NOSUCHDRIVER)
         status = CW_DEVICE_INVALID;
     else
-        status = CW_DEVICE_UNKNOWN;
+        return 0;
     return update_status(q, member, status);
 }
 
@@ -1557,7 +1950,7 @@ static int ring_entry(struct queue_ent *qe, struct localuser *tmp, int *busies)
         return 0;
     }
 
-    if (tmp->member->paused)
+    if (tmp->member->iface->paused)
     {
         if (option_debug)
             cw_log(LOG_DEBUG, "%s paused, can't receive call\n", tmp->interface);
@@ -1602,8 +1995,6 @@ static int ring_entry(struct queue_ent *qe, struct localuser *tmp, int *busies)
         (*busies)++;
         return 0;
     }
-    else if (status != tmp->oldstatus)
-        update_dial_status(qe->parent, tmp->member, status);
 
     tmp->chan->appl = "AppQueue (Outgoing Line)";
     tmp->chan->whentohangup = 0;
@@ -1675,34 +2066,27 @@ static int ring_one(struct queue_ent *qe, struct localuser *outgoing, int *busie
 
     do
     {
-        best = NULL;
-        cur = outgoing;
-        while (cur)
+        /* outgoing is sorted by metric, so the first one left is the best */
+        for (best = outgoing;  best;  best = best->next)
         {
-            if (cur->stillgoing &&					/* Not already done */
-                    !cur->chan &&					/* Isn't already going */
-                    (!best || (cur->metric < bestmetric)))
-            {	/* We haven't found one yet, or it's better */
-                bestmetric = cur->metric;
-                best = cur;
-            }
-            cur = cur->next;
+            if (best->stillgoing &&					/* Not already done */
+                    !best->chan)					/* Isn't already going */
+                break;
         }
         if (best)
         {
+            bestmetric = best->metric;
             if (!qe->parent->strategy)
             {
                 /* Ring everyone who shares this best metric (for ringall) */
-                cur = outgoing;
-                while (cur)
+                for (cur = best;  cur  &&  cur->metric <= bestmetric;  cur = cur->next)
                 {
-                    if (cur->stillgoing && !cur->chan && (cur->metric <= bestmetric))
+                    if (cur->stillgoing && !cur->chan)
                     {
                         if (option_debug)
                             cw_log(LOG_DEBUG, "(Parallel) Trying '%s' with metric %d\n", cur->interface, cur->metric);
                         ring_entry(qe, cur, busies);
                     }
-                    cur = cur->next;
                 }
             }
             else
@@ -1726,22 +2110,14 @@ static int ring_one(struct queue_ent *qe, struct localuser *outgoing, int *busie
 
 static int store_next(struct queue_ent *qe, struct localuser *outgoing)
 {
-    struct localuser *cur;
     struct localuser *best;
-    int bestmetric=0;
 
-    best = NULL;
-    cur = outgoing;
-    while (cur)
+    /* outgoing is sorted by metric, so the first one left is the best */
+    for (best = outgoing;  best;  best = best->next)
     {
-        if (cur->stillgoing &&					/* Not already done */
-                !cur->chan &&					/* Isn't already going */
-                (!best || (cur->metric < bestmetric)))
-        {	/* We haven't found one yet, or it's better */
-            bestmetric = cur->metric;
-            best = cur;
-        }
-        cur = cur->next;
+        if (best->stillgoing &&					/* Not already done */
+                !best->chan)					/* Isn't already going */
+            break;
     }
     if (best)
     {
@@ -1879,6 +2255,7 @@ static struct localuser *wait_for_answer(struct queue_ent *qe, struct localuser
 
     while (*to && !peer)
     {
+        queue_wake_pending();
         BUILD_WATCHERS;
         if ((found < 0) && stillgoing && !qe->parent->strategy)
         {
@@ -1940,8 +2317,6 @@ static struct localuser *wait_for_answer(struct queue_ent *qe, struct localuser
                         cw_verbose(VERBOSE_PREFIX_3 "Now forwarding %s to '%s/%s' (thanks to %s)\n", in->name, tech, stuff, o->chan->name);
                     /* Setup parameters */
                     o->chan = cw_request(tech, in->nativeformats, stuff, &status);
-                    if (status != o->oldstatus)
-                        update_dial_status(qe->parent, o->member, status);
                     if (!o->chan)
                     {
                         cw_log(LOG_NOTICE, "Unable to create local channel for call forward to '%s/%s'\n", tech, stuff);
@@ -2166,6 +2541,7 @@ static int is_our_turn(struct queue_ent *qe)
     if (ch == qe)
     {
         qe->trying_agent = 1;
+        queue_dispatch(qe->parent, 0);
         res = 1;
         if (option_debug)
             cw_log(LOG_DEBUG, "It's Head turn (%s).\n", qe->chan->name);
@@ -2184,6 +2560,7 @@ static int is_our_turn(struct queue_ent *qe)
         if (ch->trying_agent == 1 && cur_qe && qe == cur_qe)
         {
             qe->trying_agent = 1;
+            queue_dispatch(qe->parent, 0);
             if (option_debug)
                 cw_log(LOG_DEBUG, "It's our turn (%s).\n", qe->chan->name);
             res = 1;
@@ -2201,6 +2578,57 @@ static int is_our_turn(struct queue_ent *qe)
     return res;
 }
 
+/* Milliseconds until the next timeout or announcement of a waiting caller */
+static int queue_next_event(struct queue_ent *qe, int ringing)
+{
+    struct cw_call_queue *q = qe->parent;
+    time_t now = time(NULL);
+    time_t next = now + RECHECK_IDLE;
+    time_t t;
+
+    if (qe->expire  &&  qe->expire + 1 < next)
+        next = qe->expire + 1;
+    if (q->announcefrequency  &&  !ringing)
+    {
+        t = qe->last_pos + ((qe->last_pos_said != qe->pos  ||  q->announcefrequency < 15)  ?  15  :  q->announcefrequency);
+        if (t < next)
+            next = t;
+    }
+    if (q->periodicannouncefrequency  &&  !ringing)
+    {
+        t = qe->last_periodic_announce_time + q->periodicannouncefrequency;
+        if (t < next)
+            next = t;
+    }
+    if (next < now + RECHECK)
+        next = now + RECHECK;
+    return (next - now) * 1000;
+}
+
+/* Wait up to ms milliseconds for a digit or a wakeup from the distributor.
+   Returns 0 on timeout or wakeup, the digit, or -1 on hangup. */
+static int queue_sleep(struct queue_ent *qe, int ms)
+{
+    char buf[16];
+    int res;
+
+    /* Without a wakeup pipe, or if waking through it failed, we can only poll */
+    if (qe->wakefd[1] < 0)
+        return cw_waitfordigit(qe->chan, (ms < RECHECK * 1000)  ?  ms  :  RECHECK * 1000);
+
+    res = cw_waitfordigit_full(qe->chan, ms, -1, qe->wakefd[0]);
+    if (res == 1)
+    {
+        cw_mutex_lock(&qe->parent->lock);
+        while (read(qe->wakefd[0], buf, sizeof(buf)) > 0)
+            ;
+        qe->wakeup = 0;
+        cw_mutex_unlock(&qe->parent->lock);
+        res = 0;
+    }
+    return res;
+}
+
 static int wait_our_turn(struct queue_ent *qe, int ringing, enum queue_result *reason)
 {
     int res = 0;
@@ -2251,9 +2679,9 @@ static int wait_our_turn(struct queue_ent *qe, int ringing, enum queue_result *r
         if (qe->parent->periodicannouncefrequency && !ringing)
             res = say_periodic_announcement(qe);
 
-        /* Wait a second before checking again */
+        /* Sleep until the distributor wakes us or something is due */
         if (!res)
-            res = cw_waitfordigit(qe->chan, RECHECK * 1000);
+            res = queue_sleep(qe, queue_next_event(qe, ringing));
         if (res)
             break;
     }
@@ -2262,24 +2690,34 @@ static int wait_our_turn(struct queue_ent *qe, int ringing, enum queue_result *r
 
 static int update_queue(struct cw_call_queue *q, struct member *member)
 {
-    struct member *cur;
+    struct member *cur, *mem;
 
     /* Since a reload could have taken place, we have to traverse the list to
-    	be sure it's still valid */
+    	be sure it's still valid. The stats are shared by all of the member's
+    	queues, so qlock is needed to change them. */
+    cw_mutex_lock(&qlock);
     cw_mutex_lock(&q->lock);
     cur = q->members;
     while (cur)
     {
         if (member == cur)
         {
-            time(&cur->lastcall);
-            cur->calls++;
+            time(&cur->iface->lastcall);
+            cur->iface->calls++;
             break;
         }
         cur = cur->next;
     }
     q->callscompleted++;
     cw_mutex_unlock(&q->lock);
+    /* Every queue the interface is in ranks it on the shared stats */
+    for (mem = (cur)  ?  cur->iface->members  :  NULL;  mem;  mem = mem->inext)
+    {
+        cw_mutex_lock(&mem->parent->lock);
+        member_order_update(mem->parent, mem);
+        cw_mutex_unlock(&mem->parent->lock);
+    }
+    cw_mutex_unlock(&qlock);
     return 0;
 }
 
@@ -2328,14 +2766,14 @@ static int calc_metric(struct cw_call_queue *q, struct member *mem, int pos, str
         tmp->metric += mem->penalty * 1000000;
         break;
     case QUEUE_STRATEGY_FEWESTCALLS:
-        tmp->metric = mem->calls;
+        tmp->metric = mem->iface->calls;
         tmp->metric += mem->penalty * 1000000;
         break;
     case QUEUE_STRATEGY_LEASTRECENT:
-        if (!mem->lastcall)
+        if (!mem->iface->lastcall)
             tmp->metric = 0;
         else
-            tmp->metric = 1000000 - (time(NULL) - mem->lastcall);
+            tmp->metric = 1000000 - (time(NULL) - mem->iface->lastcall);
         tmp->metric += mem->penalty * 1000000;
         break;
     default:
@@ -2345,6 +2783,48 @@ static int calc_metric(struct cw_call_queue *q, struct member *mem, int pos, str
     return 0;
 }
 
+/* Stable merge sort of the outgoing list by metric, so that ring_one()
+   and store_next() find the best member at the head instead of scanning
+   every member for every attempt. Equal metrics keep their list order. */
+static struct localuser *sort_outgoing(struct localuser *list)
+{
+    struct localuser *a, *b, *slow, *fast, *head, **tail;
+
+    if (!list  ||  !list->next)
+        return list;
+
+    slow = list;
+    fast = list->next;
+    while (fast  &&  fast->next)
+    {
+        slow = slow->next;
+        fast = fast->next->next;
+    }
+    b = slow->next;
+    slow->next = NULL;
+    a = sort_outgoing(list);
+    b = sort_outgoing(b);
+
+    head = NULL;
+    tail = &head;
+    while (a  &&  b)
+    {
+        if (b->metric < a->metric)
+        {
+            *tail = b;
+            b = b->next;
+        }
+        else
+        {
+            *tail = a;
+            a = a->next;
+        }
+        tail = &(*tail)->next;
+    }
+    *tail = a  ?  a  :  b;
+    return head;
+}
+
 static int try_calling(struct queue_ent *qe, const char *options, char *announceoverride, const char *url, int *go_on)
 {
     struct member *cur;
@@ -2369,6 +2849,9 @@ static int try_calling(struct queue_ent *qe, const char *options, char *announce
     time_t now = time(NULL);
     struct cw_bridge_config bridge_config;
     char nondataquality = 1;
+    struct localuser **otail = &outgoing;
+    struct member *group = NULL;
+    int ordered;
 
     memset(&bridge_config, 0, sizeof(bridge_config));
     time(&now);
@@ -2415,7 +2898,16 @@ static int try_calling(struct queue_ent *qe, const char *options, char *announce
                  qe->chan->name);
     }
     cw_copy_string(queuename, qe->parent->name, sizeof(queuename));
-    cur = qe->parent->members;
+    if ((ordered = member_order_used(qe->parent)))
+    {
+        if (!qe->parent->ordered)
+            member_order_rebuild(qe->parent);
+        cur = member_order_next(qe->parent, NULL, &group);
+    }
+    else
+    {
+        cur = qe->parent->members;
+    }
     if (!cw_strlen_zero(qe->announce))
         announce = qe->announce;
     if (!cw_strlen_zero(announceoverride))
@@ -2443,8 +2935,7 @@ static int try_calling(struct queue_ent *qe, const char *options, char *announce
         }
 
         tmp->member = cur;		/* Never directly dereference!  Could change on reload */
-        tmp->oldstatus = cur->status;
-        tmp->lastcall = cur->lastcall;
+        tmp->lastcall = cur->iface->lastcall;
         cw_copy_string(tmp->interface, cur->interface, sizeof(tmp->interface));
         /* If we're dialing by extension, look at the extension to know what to dial */
         if ((newnum = strstr(tmp->interface, "/BYEXTENSION")))
@@ -2455,29 +2946,47 @@ static int try_calling(struct queue_ent *qe, const char *options, char *announce
             if (option_debug)
                 cw_log(LOG_DEBUG, "Dialing by extension %s\n", tmp->interface);
         }
-        /* Special case: If we ring everyone, go ahead and ring them, otherwise
-           just calculate their metric for the appropriate strategy */
-        calc_metric(qe->parent, cur, x++, qe, tmp);
-        /* Put them in the list of outgoing thingies...  We're ready now.
-           XXX If we're forcibly removed, these outgoing calls won't get
-           hung up XXX */
-        tmp->next = outgoing;
-        outgoing = tmp;
+        if (ordered)
+        {
+            /* Already in order. rrmemory still needs the metric, as
+               store_next() takes the position to resume from out of it. */
+            if (qe->parent->strategy == QUEUE_STRATEGY_RRMEMORY)
+                calc_metric(qe->parent, cur, cur->pos, qe, tmp);
+            else
+                tmp->metric = x++;
+            *otail = tmp;
+            otail = &tmp->next;
+        }
+        else
+        {
+            /* Special case: If we ring everyone, go ahead and ring them, otherwise
+               just calculate their metric for the appropriate strategy */
+            calc_metric(qe->parent, cur, x++, qe, tmp);
+            /* Put them in the list of outgoing thingies...  We're ready now.
+               XXX If we're forcibly removed, these outgoing calls won't get
+               hung up XXX */
+            tmp->next = outgoing;
+            outgoing = tmp;
+        }
         /* If this line is up, don't try anybody else */
-        if (outgoing->chan && (outgoing->chan->_state == CW_STATE_UP))
+        if (tmp->chan && (tmp->chan->_state == CW_STATE_UP))
             break;
 
-        cur = cur->next;
+        cur = (ordered)  ?  member_order_next(qe->parent, cur, &group)  :  cur->next;
     }
     if (qe->parent->timeout)
         to = qe->parent->timeout * 1000;
     else
         to = -1;
+    if (!ordered)
+        outgoing = sort_outgoing(outgoing);
     ring_one(qe, outgoing, &numbusies);
     cw_mutex_unlock(&qe->parent->lock);
     if (use_weight)
         cw_mutex_unlock(&qlock);
+    queue_wake_pending();
     lpeer = wait_for_answer(qe, outgoing, &to, &digit, numbusies, cw_test_flag(&(bridge_config.features_caller), CW_FEATURE_DISCONNECT));
+    queue_wake_pending();
     cw_mutex_lock(&qe->parent->lock);
     if (qe->parent->strategy == QUEUE_STRATEGY_RRMEMORY)
         store_next(qe, outgoing);
@@ -2702,6 +3211,9 @@ static int wait_a_bit(struct queue_ent *qe)
     /* Don't need to hold the lock while we setup the outgoing calls */
     int retrywait = qe->parent->retry * 1000;
 
+    /* The distributor cuts this short when a member becomes free */
+    if (qe->wakefd[0] > -1)
+        return queue_sleep(qe, retrywait);
     return cw_waitfordigit(qe->chan, retrywait);
 }
 
@@ -2744,7 +3256,7 @@ static void dump_queue_members(struct cw_call_queue *pm_queue)
             continue;
 
         res = snprintf(value + value_len, sizeof(value) - value_len, "%s;%d;%d%s",
-                       cur_member->interface, cur_member->penalty, cur_member->paused,
+                       cur_member->interface, cur_member->penalty, cur_member->iface->paused,
                        cur_member->next ? "," : "");
         if (res != strlen(value + value_len))
         {
@@ -2802,7 +3314,10 @@ static int remove_from_queue(char *queuename, char *interface, time_t *added)
                               q->name, last_member->interface);
                 if (added != NULL)
                     *added = last_member->added;
+                member_index_del(last_member);
                 free(last_member);
+                if (q->leavewhenempty)
+                    queue_wake_all(q);
 
                 if (queue_persistent_members)
                     dump_queue_members(q);
@@ -2827,14 +3342,23 @@ static int update_queue_member(char *queuename, char *interface, int penalty, in
 	struct cw_call_queue *q;
 	struct member *last_member, *look;
 	int res = RES_NOSUCHQUEUE;
+	int changed = 0;
 
 	cw_mutex_lock(&qlock);
 	for (q = queues ; q ; q = q->next) {
 		cw_mutex_lock(&q->lock);
 		if (!strcmp(q->name, queuename)) {
 			if ((last_member = interface_exists(q, interface)) != NULL) {
+				if (last_member->penalty != penalty)
+					q->ordered = 0;
 				last_member->penalty = penalty;
-				last_member->paused = paused;
+				/* The pause is shared by all of the interface's queues */
+				if (last_member->iface->paused != paused) {
+					last_member->iface->paused = paused;
+					changed = 1;
+				}
+				if (member_available(last_member))
+					queue_dispatch(q, 1);
 				manager_event(EVENT_FLAG_AGENT, "QueueMemberUpdated",
 					"Queue: %s\r\n"
 					"Location: %s\r\n"
@@ -2845,7 +3369,7 @@ static int update_queue_member(char *queuename, char *interface, int penalty, in
 					"Status: %d\r\n"
 					"Paused: %d\r\n",
 				    q->name, last_member->interface, last_member->dynamic ? "dynamic" : "static",
-				    last_member->penalty, last_member->calls, last_member->lastcall, last_member->status, last_member->paused);
+				    last_member->penalty, last_member->iface->calls, last_member->iface->lastcall, last_member->iface->status, last_member->iface->paused);
 
 				if (dump)
 					dump_queue_members(q);
@@ -2859,6 +3383,18 @@ static int update_queue_member(char *queuename, char *interface, int penalty, in
 		}
 		cw_mutex_unlock(&q->lock);
 	}
+	/* Let the interface's other queues see the new pause, now that no
+	   queue is locked */
+	if (changed) {
+		member_iface_notify(last_member->iface);
+		for (look = last_member->iface->members;  dump  &&  look;  look = look->inext) {
+			if (look->parent != q) {
+				cw_mutex_lock(&look->parent->lock);
+				dump_queue_members(look->parent);
+				cw_mutex_unlock(&look->parent->lock);
+			}
+		}
+	}
 	cw_mutex_unlock(&qlock);
 	return res;
 }
@@ -2868,6 +3404,7 @@ static int add_to_queue(char *queuename, char *interface, int penalty, int pause
     struct cw_call_queue *q;
     struct member *new_member;
     int res = RES_NOSUCHQUEUE;
+    int changed = 0;
 
     cw_mutex_lock(&qlock);
     for (q = queues;  q;  q = q->next)
@@ -2877,7 +3414,7 @@ static int add_to_queue(char *queuename, char *interface, int penalty, int pause
         {
             if (interface_exists(q, interface) == NULL)
             {
-                new_member = create_queue_member(interface, penalty, paused);
+                new_member = create_queue_member(q, interface, penalty, paused);
 
                 if (new_member != NULL)
                 {
@@ -2894,11 +3431,18 @@ static int add_to_queue(char *queuename, char *interface, int penalty, int pause
                                   "Status: %d\r\n"
                                   "Paused: %d\r\n",
                                   q->name, new_member->interface, new_member->dynamic ? "dynamic" : "static",
-                                  new_member->penalty, new_member->calls, new_member->lastcall, new_member->status, new_member->paused);
+                                  new_member->penalty, new_member->iface->calls, new_member->iface->lastcall, new_member->iface->status, new_member->iface->paused);
+
+                    if (member_available(new_member))
+                        queue_dispatch(q, 1);
 
                     if (dump)
                         dump_queue_members(q);
 
+                    /* Adding a paused membership pauses the interface in
+                       its other queues too */
+                    if (paused  &&  new_member->iface->refs > 1)
+                        changed = 1;
                     res = RES_OKAY;
                 }
                 else
@@ -2911,6 +3455,8 @@ static int add_to_queue(char *queuename, char *interface, int penalty, int pause
                 res = RES_EXISTS;
             }
             cw_mutex_unlock(&q->lock);
+            if (changed)
+                member_iface_notify(new_member->iface);
             break;
         }
         cw_mutex_unlock(&q->lock);
@@ -2923,6 +3469,7 @@ static int set_member_paused(char *queuename, char *interface, int paused)
 {
     int found = 0;
     struct cw_call_queue *q;
+    struct member_iface *iface;
     struct member *mem;
 
     /* Special event for when all queues are paused - individual events still generated */
@@ -2931,31 +3478,41 @@ static int set_member_paused(char *queuename, char *interface, int paused)
         cw_queue_log("NONE", "NONE", interface, (paused ? "PAUSEALL" : "UNPAUSEALL"), "%s", "");
 
     cw_mutex_lock(&qlock);
-    for (q = queues ; q ; q = q->next)
+    if ((iface = member_iface_find(interface, cw_hash_string_tolower(interface))))
     {
-        cw_mutex_lock(&q->lock);
-        if (cw_strlen_zero(queuename)  ||  !strcasecmp(q->name, queuename))
+        /* The pause is shared by every queue the interface is a member of,
+           so a named queue only has to be one of them */
+        for (mem = iface->members;  mem;  mem = mem->inext)
         {
-            if ((mem = interface_exists(q, interface)))
-            {
+            if (cw_strlen_zero(queuename)  ||  !strcasecmp(mem->parent->name, queuename))
                 found++;
-                if (mem->paused == paused)
-                    cw_log(LOG_DEBUG, "%spausing already-%spaused queue member %s:%s\n", (paused ? "" : "un"), (paused ? "" : "un"), q->name, interface);
-                mem->paused = paused;
+        }
+    }
+    if (found)
+    {
+        if (iface->paused == paused)
+            cw_log(LOG_DEBUG, "%spausing already-%spaused queue member %s\n", (paused ? "" : "un"), (paused ? "" : "un"), interface);
+        iface->paused = paused;
+        for (mem = iface->members;  mem;  mem = mem->inext)
+        {
+            q = mem->parent;
+            cw_mutex_lock(&q->lock);
+            member_order_update(q, mem);
+            if (member_available(mem))
+                queue_dispatch(q, 1);
 
-                if (queue_persistent_members)
-                    dump_queue_members(q);
+            if (queue_persistent_members)
+                dump_queue_members(q);
 
-                cw_queue_log(q->name, "NONE", interface, (paused ? "PAUSE" : "UNPAUSE"), "%s", "");
+            cw_queue_log(q->name, "NONE", interface, (paused ? "PAUSE" : "UNPAUSE"), "%s", "");
 
-                manager_event(EVENT_FLAG_AGENT, "QueueMemberPaused",
-                              "Queue: %s\r\n"
-                              "Location: %s\r\n"
-                              "Paused: %d\r\n",
-                              q->name, mem->interface, paused);
-            }
+            manager_event(EVENT_FLAG_AGENT, "QueueMemberPaused",
+                          "Queue: %s\r\n"
+                          "Location: %s\r\n"
+                          "Paused: %d\r\n",
+                          q->name, mem->interface, paused);
+            cw_mutex_unlock(&q->lock);
         }
-        cw_mutex_unlock(&q->lock) ;
     }
     cw_mutex_unlock(&qlock);
 
@@ -3320,6 +3877,19 @@ static int queue_exec(struct cw_channel *chan, int argc, char **argv)
     qe.last_pos = 0;
     qe.trying_agent=0;
     qe.last_periodic_announce_time = time(NULL);
+    /* Each waiting caller holds a pipe, so a queue of N callers uses 2N
+       descriptors on top of their channels'. If we are out of them the
+       caller polls the queue instead, as before. */
+    if (pipe(qe.wakefd))
+    {
+        cw_log(LOG_WARNING, "Unable to create wakeup pipe, %s will poll the queue: %s\n", chan->name, strerror(errno));
+        qe.wakefd[0] = qe.wakefd[1] = -1;
+    }
+    else
+    {
+        fcntl(qe.wakefd[0], F_SETFL, fcntl(qe.wakefd[0], F_GETFL) | O_NONBLOCK);
+        fcntl(qe.wakefd[1], F_SETFL, fcntl(qe.wakefd[1], F_GETFL) | O_NONBLOCK);
+    }
     if (!join_queue(argv[0], &qe, &reason))
     {
         cw_queue_log(argv[0],
@@ -3524,6 +4094,10 @@ check_turns:
         set_queue_result(chan, reason);
         res = 0;
     }
+    if (qe.wakefd[0] > -1)
+        close(qe.wakefd[0]);
+    if (qe.wakefd[1] > -1)
+        close(qe.wakefd[1]);
     LOCAL_USER_REMOVE(u);
     return res;
 }
@@ -3562,7 +4136,7 @@ static char *queue_function_qac(struct cw_channel *chan, int argc, char **argv,
         for (m = q->members;  m;  m = m->next)
         {
             /* Count the agents who are logged in and presently answering calls */
-            if ((m->status != CW_DEVICE_UNAVAILABLE) && (m->status != CW_DEVICE_INVALID))
+            if ((m->iface->status != CW_DEVICE_UNAVAILABLE) && (m->iface->status != CW_DEVICE_INVALID))
                 count++;
         }
         cw_mutex_unlock(&q->lock);
@@ -3580,7 +4154,9 @@ static void reload_queues(void)
     char *cat, *tmp;
     struct cw_variable *var;
     struct member *prev, *cur;
+    struct member_iface *iface;
     int new;
+    int i;
     char *general_val = NULL;
     char interface[80];
     int penalty;
@@ -3664,7 +4240,7 @@ static void reload_queues(void)
                         }
                         else
                             penalty = 0;
-                        cur = create_queue_member(interface, penalty, 0);
+                        cur = create_queue_member(q, interface, penalty, 0);
                         if (cur)
                         {
                             if (prev)
@@ -3704,18 +4280,25 @@ static void reload_queues(void)
             else
                 queues = q->next;
             if (!q->count)
+            {
+                free_members(q, 1);
                 free(q);
+            }
             else
                 cw_log(LOG_WARNING, "XXX Leaking a little memory :( XXX\n");
         }
         else
         {
-            for (cur = q->members; cur; cur = cur->next)
-                cur->status = cw_device_state(cur->interface);
             ql = q;
         }
         q = qn;
     }
+    /* Refresh each interface once, however many queues it is in */
+    for (i = 0;  i < MEMBER_BUCKETS;  i++)
+    {
+        for (iface = member_index[i];  iface;  iface = iface->next)
+            member_iface_set(iface, cw_device_state(iface->interface));
+    }
     cw_mutex_unlock(&qlock);
 }
 
@@ -3787,13 +4370,13 @@ static int __queues_show(int manager, int fd, int argc, char **argv, int queue_s
                     cw_build_string(&max, &max_left, " with penalty %d", mem->penalty);
                 if (mem->dynamic)
                     cw_build_string(&max, &max_left, " (dynamic)");
-                if (mem->paused)
+                if (mem->iface->paused)
                     cw_build_string(&max, &max_left, " (paused)");
-                cw_build_string(&max, &max_left, " (%s)", devstate2str(mem->status));
-                if (mem->calls)
+                cw_build_string(&max, &max_left, " (%s)", devstate2str(mem->iface->status));
+                if (mem->iface->calls)
                 {
                     cw_build_string(&max, &max_left, " has taken %d calls (last was %ld secs ago)",
-                                      mem->calls, (long)(time(NULL) - mem->lastcall));
+                                      mem->iface->calls, (long)(time(NULL) - mem->iface->lastcall));
                 }
                 else
                     cw_build_string(&max, &max_left, " has taken no calls yet");
@@ -3922,7 +4505,7 @@ static int manager_queues_status( struct mansession *s, struct message *m )
                              "%s"
                              "\r\n",
                              q->name, mem->interface, mem->dynamic ? "dynamic" : "static",
-                             mem->penalty, mem->calls, mem->lastcall, mem->status, mem->paused, idText);
+                             mem->penalty, mem->iface->calls, mem->iface->lastcall, mem->iface->status, mem->iface->paused, idText);
                 }
             }
             /* List Queue Entries */
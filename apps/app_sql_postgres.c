@@ -336,10 +336,8 @@ static int aPGSQL_fetch(struct cw_channel *chan, void *data) {
 	int *lalares=NULL;
 	int nres;
         struct cw_var_t *variables;
-        struct varshead *headp;
 	char *stringp=NULL;
         
-        headp=&chan->varshead;
 	
 	res=0;
 	l=strlen(data)+2;
@@ -354,7 +352,7 @@ static int aPGSQL_fetch(struct cw_channel *chan, void *data) {
 	  var=fetchid_var; /* fetchid */
 		fnd=0;
 		
-		CW_LIST_TRAVERSE(headp,variables,entries) {
+		CW_CHANNEL_VARS_TRAVERSE(chan,variables) {
 	    if (strncasecmp(cw_var_name(variables),fetchid_var,strlen(fetchid_var))==0) {
 	                        s7=cw_var_value(variables);
 	                        fnd=1;
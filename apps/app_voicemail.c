@@ -72,9 +72,13 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/cli.h"
 #include "callweaver/utils.h"
 #include "callweaver/phone_no_utils.h"
+#include "callweaver/callweaver_hash.h"
 
 #ifdef USE_ODBC_STORAGE
 #include "callweaver/res_odbc.h"
+#elif defined(__linux__)
+#include <sys/inotify.h>
+#define VM_USE_INOTIFY
 #endif
 
 #define COMMAND_TIMEOUT 5000
@@ -778,7 +782,7 @@ static int retrieve_file(char *dir, int msgnum)
 	char msgnums[80];
 	
 	odbc_obj *obj;
-	obj = fetch_odbc_obj(odbc_database, 0);
+	obj = odbc_request_obj(odbc_database, 0);
 	if (obj) {
 		cw_copy_string(fmt, vmfmts, sizeof(fmt));
 		c = strchr(fmt, ',');
@@ -888,6 +892,8 @@ static int retrieve_file(char *dir, int msgnum)
 	} else
 		cw_log(LOG_WARNING, "Failed to obtain database object for '%s'!\n", odbc_database);
 yuck:	
+	if (obj)
+		odbc_release_obj(obj);
 	if (f)
 		fclose(f);
 	if (fdm)
@@ -923,7 +929,7 @@ static int last_message_index(struct cw_vm_user *vmu, char *dir)
 	char rowdata[20];
 	
 	odbc_obj *obj;
-	obj = fetch_odbc_obj(odbc_database, 0);
+	obj = odbc_request_obj(odbc_database, 0);
 	if (obj) {
 		res = SQLAllocHandle(SQL_HANDLE_STMT, obj->con, &stmt);
 		if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
@@ -962,6 +968,8 @@ static int last_message_index(struct cw_vm_user *vmu, char *dir)
 	} else
 		cw_log(LOG_WARNING, "Failed to obtain database object for '%s'!\n", odbc_database);
 yuck:	
+	if (obj)
+		odbc_release_obj(obj);
 	return x - 1;
 }
 
@@ -975,7 +983,7 @@ static int message_exists(char *dir, int msgnum)
 	char msgnums[20];
 	
 	odbc_obj *obj;
-	obj = fetch_odbc_obj(odbc_database, 0);
+	obj = odbc_request_obj(odbc_database, 0);
 	if (obj) {
 		snprintf(msgnums, sizeof(msgnums), "%d", msgnum);
 		res = SQLAllocHandle(SQL_HANDLE_STMT, obj->con, &stmt);
@@ -1016,6 +1024,8 @@ static int message_exists(char *dir, int msgnum)
 	} else
 		cw_log(LOG_WARNING, "Failed to obtain database object for '%s'!\n", odbc_database);
 yuck:	
+	if (obj)
+		odbc_release_obj(obj);
 	return x;
 }
 
@@ -1032,7 +1042,7 @@ static void delete_file(char *sdir, int smsg)
 	char msgnums[20];
 	
 	odbc_obj *obj;
-	obj = fetch_odbc_obj(odbc_database, 0);
+	obj = odbc_request_obj(odbc_database, 0);
 	if (obj) {
 		snprintf(msgnums, sizeof(msgnums), "%d", smsg);
 		res = SQLAllocHandle(SQL_HANDLE_STMT, obj->con, &stmt);
@@ -1059,6 +1069,8 @@ static void delete_file(char *sdir, int smsg)
 	} else
 		cw_log(LOG_WARNING, "Failed to obtain database object for '%s'!\n", odbc_database);
 yuck:
+	if (obj)
+		odbc_release_obj(obj);
 	return;	
 }
 
@@ -1072,7 +1084,7 @@ static void copy_file(char *sdir, int smsg, char *ddir, int dmsg, char *dmailbox
 	odbc_obj *obj;
 
 	delete_file(ddir, dmsg);
-	obj = fetch_odbc_obj(odbc_database, 0);
+	obj = odbc_request_obj(odbc_database, 0);
 	if (obj) {
 		snprintf(msgnums, sizeof(msgnums), "%d", smsg);
 		snprintf(msgnumd, sizeof(msgnumd), "%d", dmsg);
@@ -1113,6 +1125,8 @@ static void copy_file(char *sdir, int smsg, char *ddir, int dmsg, char *dmailbox
 	} else
 		cw_log(LOG_WARNING, "Failed to obtain database object for '%s'!\n", odbc_database);
 yuck:
+	if (obj)
+		odbc_release_obj(obj);
 	return;	
 }
 
@@ -1137,7 +1151,7 @@ static int store_file(char *dir, char *mailboxuser, char *mailboxcontext, int ms
 	odbc_obj *obj;
 
 	delete_file(dir, msgnum);
-	obj = fetch_odbc_obj(odbc_database, 0);
+	obj = odbc_request_obj(odbc_database, 0);
 	if (obj) {
 		cw_copy_string(fmt, vmfmts, sizeof(fmt));
 		c = strchr(fmt, ',');
@@ -1232,6 +1246,8 @@ static int store_file(char *dir, char *mailboxuser, char *mailboxcontext, int ms
 	} else
 		cw_log(LOG_WARNING, "Failed to obtain database object for '%s'!\n", odbc_database);
 yuck:	
+	if (obj)
+		odbc_release_obj(obj);
 	if (cfg)
 		cw_config_destroy(cfg);
 	if (fdm)
@@ -1251,7 +1267,7 @@ static void rename_file(char *sdir, int smsg, char *mailboxuser, char *mailboxco
 	odbc_obj *obj;
 
 	delete_file(ddir, dmsg);
-	obj = fetch_odbc_obj(odbc_database, 0);
+	obj = odbc_request_obj(odbc_database, 0);
 	if (obj) {
 		snprintf(msgnums, sizeof(msgnums), "%d", smsg);
 		snprintf(msgnumd, sizeof(msgnumd), "%d", dmsg);
@@ -1292,6 +1308,8 @@ static void rename_file(char *sdir, int smsg, char *mailboxuser, char *mailboxco
 	} else
 		cw_log(LOG_WARNING, "Failed to obtain database object for '%s'!\n", odbc_database);
 yuck:
+	if (obj)
+		odbc_release_obj(obj);
 	return;	
 }
 
@@ -1948,7 +1966,7 @@ static int messagecount(const char *mailbox, int *newmsgs, int *oldmsgs)
                 context = "default";
 	
 	odbc_obj *obj;
-	obj = fetch_odbc_obj(odbc_database, 0);
+	obj = odbc_request_obj(odbc_database, 0);
 	if (obj) {
 		res = SQLAllocHandle(SQL_HANDLE_STMT, obj->con, &stmt);
 		if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
@@ -2020,6 +2038,8 @@ static int messagecount(const char *mailbox, int *newmsgs, int *oldmsgs)
 		cw_log(LOG_WARNING, "Failed to obtain database object for '%s'!\n", odbc_database);
 		
 yuck:	
+	if (obj)
+		odbc_release_obj(obj);
 	return x;
 }
 
@@ -2048,7 +2068,7 @@ static int has_voicemail(const char *mailbox, const char *folder)
                 context = "default";
 
         odbc_obj *obj;
-        obj = fetch_odbc_obj(odbc_database, 0);
+        obj = odbc_request_obj(odbc_database, 0);
         if (obj) {
                 res = SQLAllocHandle(SQL_HANDLE_STMT, obj->con, &stmt);
                 if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
@@ -2086,6 +2106,8 @@ static int has_voicemail(const char *mailbox, const char *folder)
                 cw_log(LOG_WARNING, "Failed to obtain database object for '%s'!\n", odbc_database);
 
 yuck:
+	if (obj)
+		odbc_release_obj(obj);
 	if (nummsgs>=1)
 		return 1;
 	else
@@ -2215,6 +2237,423 @@ static int messagecount(const char *mailbox, int *newmsgs, int *oldmsgs)
 
 #endif
 
+/*
+ * Mailbox message count cache.
+ *
+ * Counting messages means scanning the INBOX and Old folders of a mailbox,
+ * and channel drivers ask for every peer with a mailbox every few seconds.
+ * The counts are kept here instead. They are refreshed when voicemail itself
+ * stores or removes messages and, on Linux, when inotify reports that a
+ * message file appeared or vanished. Every change is published through
+ * cw_mwi_changed() so channel drivers can notify phones straight away.
+ */
+#define MWI_CACHE_BUCKETS	1024
+
+struct mwi_entry {
+	struct mwi_entry *next;
+	unsigned int hash;
+	int newmsgs;
+	int oldmsgs;
+	time_t updated;
+#ifdef VM_USE_INOTIFY
+	int wd[2];		/* Watches on INBOX and Old */
+#endif
+	char mailbox[1];	/* mailbox@context */
+};
+
+static struct mwi_entry *mwi_cache[MWI_CACHE_BUCKETS];
+CW_MUTEX_DEFINE_STATIC(mwi_lock);
+/* Serialises recounts so an older scan never overwrites a newer one */
+CW_MUTEX_DEFINE_STATIC(mwi_refresh_lock);
+static int mwi_cache_enabled = 1;
+static int mwi_cache_expire = 0;
+static int mwi_entries = 0;
+static unsigned long mwi_hits = 0;
+static unsigned long mwi_misses = 0;
+static unsigned long mwi_refreshes = 0;
+static unsigned long mwi_published = 0;
+
+#ifdef VM_USE_INOTIFY
+struct mwi_watch {
+	struct mwi_watch *next;
+	int wd;
+	struct mwi_entry *entry;
+};
+
+static struct mwi_watch *mwi_watches[MWI_CACHE_BUCKETS];
+static int mwi_inotify_fd = -1;
+static pthread_t mwi_thread = CW_PTHREADT_NULL;
+static unsigned long mwi_events = 0;
+#endif
+
+static void mwi_key(char *buf, size_t len, const char *mailbox)
+{
+	if (strchr(mailbox, '@'))
+		cw_copy_string(buf, mailbox, len);
+	else
+		snprintf(buf, len, "%s@default", mailbox);
+}
+
+/* Must be called with mwi_lock held */
+static struct mwi_entry *mwi_find(const char *key, unsigned int hash)
+{
+	struct mwi_entry *e;
+
+	for (e = mwi_cache[hash % MWI_CACHE_BUCKETS];  e;  e = e->next) {
+		if (e->hash == hash && !strcmp(e->mailbox, key))
+			return e;
+	}
+	return NULL;
+}
+
+#ifdef VM_USE_INOTIFY
+/* Must be called with mwi_lock held */
+static void mwi_watch_add(struct mwi_entry *e)
+{
+	char tmp[256];
+	char dir[256];
+	char *context;
+	struct mwi_watch *w;
+	int x;
+
+	if (mwi_inotify_fd < 0)
+		return;
+	cw_copy_string(tmp, e->mailbox, sizeof(tmp));
+	if ((context = strchr(tmp, '@')))
+		*context++ = '\0';
+	else
+		context = "default";
+	for (x = 0;  x < 2;  x++) {
+		if (e->wd[x] > -1)
+			continue;
+		/* The folder may not exist yet; voicemail refreshes us when it creates it */
+		make_dir(dir, sizeof(dir), context, tmp, x ? "Old" : "INBOX");
+		if ((e->wd[x] = inotify_add_watch(mwi_inotify_fd, dir, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO)) < 0)
+			continue;
+		if ((w = malloc(sizeof(*w))) == NULL) {
+			inotify_rm_watch(mwi_inotify_fd, e->wd[x]);
+			e->wd[x] = -1;
+			continue;
+		}
+		w->wd = e->wd[x];
+		w->entry = e;
+		w->next = mwi_watches[w->wd % MWI_CACHE_BUCKETS];
+		mwi_watches[w->wd % MWI_CACHE_BUCKETS] = w;
+	}
+}
+
+/* Must be called with mwi_lock held */
+static struct mwi_watch *mwi_watch_find(int wd, int unlink)
+{
+	struct mwi_watch *w;
+	struct mwi_watch *prev = NULL;
+
+	for (w = mwi_watches[wd % MWI_CACHE_BUCKETS];  w;  prev = w, w = w->next) {
+		if (w->wd == wd) {
+			if (unlink) {
+				if (prev)
+					prev->next = w->next;
+				else
+					mwi_watches[wd % MWI_CACHE_BUCKETS] = w->next;
+			}
+			return w;
+		}
+	}
+	return NULL;
+}
+#endif
+
+/* Must be called with mwi_lock held. Returns non-zero if the counts changed. */
+static int mwi_store(const char *key, unsigned int hash, int newmsgs, int oldmsgs)
+{
+	struct mwi_entry *e;
+	int changed;
+
+	if ((e = mwi_find(key, hash))) {
+		changed = (e->newmsgs != newmsgs  ||  e->oldmsgs != oldmsgs);
+	} else {
+		if ((e = calloc(1, sizeof(*e) + strlen(key))) == NULL)
+			return 1;
+		strcpy(e->mailbox, key);
+		e->hash = hash;
+#ifdef VM_USE_INOTIFY
+		e->wd[0] = e->wd[1] = -1;
+#endif
+		e->next = mwi_cache[hash % MWI_CACHE_BUCKETS];
+		mwi_cache[hash % MWI_CACHE_BUCKETS] = e;
+		mwi_entries++;
+		changed = 1;
+	}
+	e->newmsgs = newmsgs;
+	e->oldmsgs = oldmsgs;
+	time(&e->updated);
+#ifdef VM_USE_INOTIFY
+	mwi_watch_add(e);
+#endif
+	return changed;
+}
+
+static void mwi_cache_flush(void)
+{
+	struct mwi_entry *e;
+	int x;
+
+	cw_mutex_lock(&mwi_lock);
+	for (x = 0;  x < MWI_CACHE_BUCKETS;  x++) {
+		while ((e = mwi_cache[x])) {
+			mwi_cache[x] = e->next;
+			free(e);
+		}
+	}
+#ifdef VM_USE_INOTIFY
+	for (x = 0;  x < MWI_CACHE_BUCKETS;  x++) {
+		struct mwi_watch *w;
+
+		while ((w = mwi_watches[x])) {
+			mwi_watches[x] = w->next;
+			inotify_rm_watch(mwi_inotify_fd, w->wd);
+			free(w);
+		}
+	}
+#endif
+	mwi_entries = 0;
+	cw_mutex_unlock(&mwi_lock);
+}
+
+/*! \brief Recount a mailbox and publish its counts if they changed */
+static void mwi_refresh(const char *mailbox)
+{
+	char key[256];
+	int newmsgs = 0;
+	int oldmsgs = 0;
+	int changed = 1;
+
+	if (cw_strlen_zero(mailbox))
+		return;
+	mwi_key(key, sizeof(key), mailbox);
+	cw_mutex_lock(&mwi_refresh_lock);
+	messagecount(key, &newmsgs, &oldmsgs);
+	if (mwi_cache_enabled) {
+		cw_mutex_lock(&mwi_lock);
+		mwi_refreshes++;
+		changed = mwi_store(key, cw_hash_string(key), newmsgs, oldmsgs);
+		if (changed)
+			mwi_published++;
+		cw_mutex_unlock(&mwi_lock);
+	}
+	cw_mutex_unlock(&mwi_refresh_lock);
+	if (changed)
+		cw_mwi_changed(key, newmsgs, oldmsgs);
+}
+
+static void mwi_lookup(const char *mailbox, int *newmsgs, int *oldmsgs)
+{
+	char key[256];
+	struct mwi_entry *e;
+	unsigned int hash;
+	int existed;
+	int changed;
+
+	mwi_key(key, sizeof(key), mailbox);
+	hash = cw_hash_string(key);
+	cw_mutex_lock(&mwi_lock);
+	e = mwi_find(key, hash);
+	if (e  &&  (!mwi_cache_expire  ||  time(NULL) - e->updated < mwi_cache_expire)) {
+		mwi_hits++;
+		*newmsgs = e->newmsgs;
+		*oldmsgs = e->oldmsgs;
+		cw_mutex_unlock(&mwi_lock);
+		return;
+	}
+	existed = (e != NULL);
+	mwi_misses++;
+	cw_mutex_unlock(&mwi_lock);
+
+	cw_mutex_lock(&mwi_refresh_lock);
+	messagecount(key, newmsgs, oldmsgs);
+	cw_mutex_lock(&mwi_lock);
+	changed = mwi_store(key, hash, *newmsgs, *oldmsgs);
+	if (changed  &&  existed)
+		mwi_published++;
+	cw_mutex_unlock(&mwi_lock);
+	cw_mutex_unlock(&mwi_refresh_lock);
+
+	/* An expired entry may have been changed behind our back (e.g. on NFS) */
+	if (changed  &&  existed)
+		cw_mwi_changed(key, *newmsgs, *oldmsgs);
+}
+
+static int mwi_messagecount(const char *mailbox, int *newmsgs, int *oldmsgs)
+{
+	char tmp[256];
+	char *mb, *cur;
+	int tmpnew, tmpold;
+
+	if (!mwi_cache_enabled)
+		return messagecount(mailbox, newmsgs, oldmsgs);
+	if (newmsgs)
+		*newmsgs = 0;
+	if (oldmsgs)
+		*oldmsgs = 0;
+	/* If no mailbox, return immediately */
+	if (cw_strlen_zero(mailbox))
+		return 0;
+	cw_copy_string(tmp, mailbox, sizeof(tmp));
+	mb = tmp;
+	while ((cur = strsep(&mb, ", "))) {
+		if (!cw_strlen_zero(cur)) {
+			mwi_lookup(cur, &tmpnew, &tmpold);
+			if (newmsgs)
+				*newmsgs += tmpnew;
+			if (oldmsgs)
+				*oldmsgs += tmpold;
+		}
+	}
+	return 0;
+}
+
+static int mwi_has_voicemail(const char *mailbox, const char *folder)
+{
+	int newmsgs = 0;
+
+	if (!mwi_cache_enabled  ||  (folder  &&  strcmp(folder, "INBOX")))
+		return has_voicemail(mailbox, folder);
+	mwi_messagecount(mailbox, &newmsgs, NULL);
+	return newmsgs  ?  1  :  0;
+}
+
+#ifdef VM_USE_INOTIFY
+static void *mwi_watcher(void *data)
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char key[256];
+	char last[256];
+	struct inotify_event *ev;
+	struct mwi_watch *w;
+	ssize_t len;
+	size_t namelen;
+	char *p;
+
+	/* Only allow cancellation while waiting, never with a lock held */
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		len = read(mwi_inotify_fd, buf, sizeof(buf));
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (len <= 0) {
+			if (len < 0  &&  errno == EINTR)
+				continue;
+			cw_log(LOG_WARNING, "Voicemail inotify watcher stopped: %s\n", strerror(errno));
+			break;
+		}
+		last[0] = '\0';
+		for (p = buf;  p < buf + len;  p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) p;
+			key[0] = '\0';
+			cw_mutex_lock(&mwi_lock);
+			mwi_events++;
+			if (ev->mask & IN_IGNORED) {
+				/* The folder went away; drop the watch and recount */
+				if ((w = mwi_watch_find(ev->wd, 1))) {
+					if (w->entry->wd[0] == ev->wd)
+						w->entry->wd[0] = -1;
+					if (w->entry->wd[1] == ev->wd)
+						w->entry->wd[1] = -1;
+					cw_copy_string(key, w->entry->mailbox, sizeof(key));
+					free(w);
+				}
+			} else if (ev->len  &&  (namelen = strlen(ev->name)) > 4  &&  !strcasecmp(ev->name + namelen - 4, ".txt")) {
+				/* Every message has exactly one .txt file, so ignore the sound and lock files */
+				if ((w = mwi_watch_find(ev->wd, 0)))
+					cw_copy_string(key, w->entry->mailbox, sizeof(key));
+			}
+			cw_mutex_unlock(&mwi_lock);
+			/* A single move or delete touches both folders of a mailbox */
+			if (key[0]  &&  strcmp(key, last)) {
+				mwi_refresh(key);
+				strcpy(last, key);
+			}
+		}
+	}
+	return NULL;
+}
+
+static void mwi_watcher_start(void)
+{
+	pthread_attr_t attr;
+
+	if (!mwi_cache_enabled  ||  mwi_inotify_fd > -1)
+		return;
+	if ((mwi_inotify_fd = inotify_init()) < 0) {
+		cw_log(LOG_WARNING, "Unable to initialise inotify, mailbox counts will only be refreshed by voicemail itself: %s\n", strerror(errno));
+		return;
+	}
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+	if (cw_pthread_create(&mwi_thread, &attr, mwi_watcher, NULL) < 0) {
+		cw_log(LOG_WARNING, "Unable to start voicemail inotify watcher\n");
+		close(mwi_inotify_fd);
+		mwi_inotify_fd = -1;
+		mwi_thread = CW_PTHREADT_NULL;
+	}
+	pthread_attr_destroy(&attr);
+}
+
+static void mwi_watcher_stop(void)
+{
+	if (mwi_thread != CW_PTHREADT_NULL) {
+		pthread_cancel(mwi_thread);
+		pthread_join(mwi_thread, NULL);
+		mwi_thread = CW_PTHREADT_NULL;
+	}
+	if (mwi_inotify_fd > -1) {
+		close(mwi_inotify_fd);
+		mwi_inotify_fd = -1;
+	}
+}
+#endif
+
+static char show_voicemail_cache_help[] =
+"Usage: show voicemail cache\n"
+"       Shows the mailbox message count cache and its hit rate\n";
+
+static int handle_show_voicemail_cache(int fd, int argc, char *argv[])
+{
+	unsigned long lookups;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	cw_mutex_lock(&mwi_lock);
+	lookups = mwi_hits + mwi_misses;
+	cw_cli(fd, "Message count cache: %s\n", mwi_cache_enabled  ?  "enabled"  :  "disabled");
+	cw_cli(fd, "  Mailboxes cached:    %d\n", mwi_entries);
+	cw_cli(fd, "  Lookups:             %lu\n", lookups);
+	cw_cli(fd, "  Hits:                %lu (%.1f%%)\n", mwi_hits, lookups  ?  100.0*mwi_hits/lookups  :  0.0);
+	cw_cli(fd, "  Misses:              %lu\n", mwi_misses);
+	cw_cli(fd, "  Refreshes:           %lu\n", mwi_refreshes);
+	cw_cli(fd, "  Changes published:   %lu\n", mwi_published);
+	if (mwi_cache_expire)
+		cw_cli(fd, "  Expiry:              %d secs\n", mwi_cache_expire);
+	else
+		cw_cli(fd, "  Expiry:              never\n");
+#ifdef VM_USE_INOTIFY
+	if (mwi_inotify_fd > -1)
+		cw_cli(fd, "  inotify:             active, %lu events\n", mwi_events);
+	else
+		cw_cli(fd, "  inotify:             inactive\n");
+#else
+	cw_cli(fd, "  inotify:             not available\n");
+#endif
+	cw_mutex_unlock(&mwi_lock);
+	return RESULT_SUCCESS;
+}
+
+static struct cw_cli_entry show_voicemail_cache_cli =
+	{ { "show", "voicemail", "cache", NULL },
+	handle_show_voicemail_cache, "Show mailbox message count cache statistics",
+	show_voicemail_cache_help, NULL };
+
 static int notify_new_message(struct cw_channel *chan, struct cw_vm_user *vmu, int msgnum, long duration, char *fmt, char *cidnum, char *cidname);
 
 static int copy_message(struct cw_channel *chan, struct cw_vm_user *vmu, int imbox, int msgnum, long duration, struct cw_vm_user *recip, char *fmt)
@@ -2273,7 +2712,7 @@ static void run_externnotify(char *context, char *extension)
 		cw_copy_string(ext_context, extension, sizeof(ext_context));
 
 	if (!cw_strlen_zero(externnotify)) {
-		if (messagecount(ext_context, &newvoicemails, &oldvoicemails)) {
+		if (mwi_messagecount(ext_context, &newvoicemails, &oldvoicemails)) {
 			cw_log(LOG_ERROR, "Problem in calculating number of voicemail messages available for extension %s\n", extension);
 		} else {
 			snprintf(arguments, sizeof(arguments), "%s %s %s %d&", externnotify, context, extension, newvoicemails);
@@ -3257,6 +3696,7 @@ static int notify_new_message(struct cw_channel *chan, struct cw_vm_user *vmu, i
 	}
 
 	/* Leave voicemail for someone */
+	mwi_refresh(ext_context);
 	if (cw_app_has_voicemail(ext_context, NULL)) {
 		cw_app_messagecount(ext_context, &newmsgs, &oldmsgs);
 	}
@@ -3473,7 +3913,8 @@ static int forward_message(struct cw_channel *chan, char *context, char *dir, in
 					cw_config_destroy(mif); /* or here */
 				}
 				/* Leave voicemail for someone */
-				manager_event(EVENT_FLAG_CALL, "MessageWaiting", "Mailbox: %s\r\nWaiting: %d\r\n", ext_context, has_voicemail(ext_context, NULL));
+				mwi_refresh(ext_context);
+				manager_event(EVENT_FLAG_CALL, "MessageWaiting", "Mailbox: %s\r\nWaiting: %d\r\n", ext_context, mwi_has_voicemail(ext_context, NULL));
 				run_externnotify(vmtmp->context, vmtmp->mailbox);
 	
 				saved_messages++;
@@ -5392,7 +5833,8 @@ out:
 		close_mailbox(&vms, vmu);
 	if (valid) {
 		snprintf(ext_context, sizeof(ext_context), "%s@%s", vms.username, vmu->context);
-		manager_event(EVENT_FLAG_CALL, "MessageWaiting", "Mailbox: %s\r\nWaiting: %d\r\n", ext_context, has_voicemail(ext_context, NULL));
+		mwi_refresh(ext_context);
+		manager_event(EVENT_FLAG_CALL, "MessageWaiting", "Mailbox: %s\r\nWaiting: %d\r\n", ext_context, mwi_has_voicemail(ext_context, NULL));
 		run_externnotify(vmu->context, vmu->mailbox);
 	}
 	if (vmu)
@@ -5724,6 +6166,7 @@ static int load_config(void)
 	char *exitcxt = NULL;	
 	char *extpc;
 	char *emaildateformatstr;
+	char *mwistr;
 	int x;
 	int tmpadsi[4];
 
@@ -5791,6 +6234,21 @@ static int load_config(void)
 			}
 		}
 
+		/* Mailbox message count cache */
+		if ((mwistr = cw_variable_retrieve(cfg, "general", "mwicache")))
+			mwi_cache_enabled = cw_true(mwistr);
+		else
+			mwi_cache_enabled = 1;
+		mwi_cache_expire = 0;
+		if ((mwistr = cw_variable_retrieve(cfg, "general", "mwicacheexpire"))) {
+			if (sscanf(mwistr, "%d", &mwi_cache_expire) != 1  ||  mwi_cache_expire < 0) {
+				cw_log(LOG_WARNING, "Invalid mwicacheexpire value '%s'. Entries will not expire\n", mwistr);
+				mwi_cache_expire = 0;
+			}
+		}
+		/* Mailboxes may have moved or vanished over a reload */
+		mwi_cache_flush();
+
 		/* Load date format config for voicemail mail */
 		if ((emaildateformatstr = cw_variable_retrieve(cfg, "general", "emaildateformat"))) {
 			cw_copy_string(emaildateformat, emaildateformatstr, sizeof(emaildateformat));
@@ -6143,7 +6601,12 @@ int unload_module(void)
 	res |= cw_unregister_application(app4);
 	cw_cli_unregister(&show_voicemail_users_cli);
 	cw_cli_unregister(&show_voicemail_zones_cli);
+	cw_cli_unregister(&show_voicemail_cache_cli);
 	cw_uninstall_vm_functions();
+#ifdef VM_USE_INOTIFY
+	mwi_watcher_stop();
+#endif
+	mwi_cache_flush();
 	return res;
 }
 
@@ -6162,11 +6625,15 @@ int load_module(void)
 
 	cw_cli_register(&show_voicemail_users_cli);
 	cw_cli_register(&show_voicemail_zones_cli);
+	cw_cli_register(&show_voicemail_cache_cli);
 
 	/* compute the location of the voicemail spool directory */
 	snprintf(VM_SPOOL_DIR, sizeof(VM_SPOOL_DIR), "%s/voicemail/", cw_config_CW_SPOOL_DIR);
 
-	cw_install_vm_functions(has_voicemail, messagecount);
+#ifdef VM_USE_INOTIFY
+	mwi_watcher_start();
+#endif
+	cw_install_vm_functions(mwi_has_voicemail, mwi_messagecount);
 
 #if defined(USE_ODBC_STORAGE) && !defined(EXTENDED_ODBC_STORAGE)
 	cw_log(LOG_WARNING, "The current ODBC storage table format will be changed soon."
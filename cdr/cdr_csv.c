@@ -251,6 +251,58 @@ static int csv_log(struct cw_cdr *cdr)
 	return 0;
 }
 
+/* Writes a whole batch with the master file opened once and each account
+   file opened once per run of records with the same account code */
+static int csv_log_batch(struct cw_cdr **cdrs, int count)
+{
+	char buf[1024];
+	char csvmaster[CW_CONFIG_MAX_PATH];
+	char tmp[CW_CONFIG_MAX_PATH];
+	char acc[CW_MAX_ACCOUNT_CODE] = "";
+	FILE *mf;
+	FILE *af = NULL;
+	struct cw_cdr *cdr;
+	int x;
+
+	snprintf(csvmaster, sizeof(csvmaster),"%s/%s/%s", cw_config_CW_LOG_DIR, CSV_LOG_DIR, CSV_MASTER);
+	if (!(mf = fopen(csvmaster, "a"))) {
+		cw_log(LOG_ERROR, "Unable to re-open master file %s : %s\n", csvmaster, strerror(errno));
+		return -1;
+	}
+	for (x = 0;  x < count;  x++) {
+		cdr = cdrs[x];
+		if (build_csv_record(buf, sizeof(buf), cdr)) {
+			cw_log(LOG_WARNING, "Unable to create CSV record in %d bytes.  CDR not recorded!\n", (int)sizeof(buf));
+			continue;
+		}
+		fputs(buf, mf);
+
+		if (cw_strlen_zero(cdr->accountcode))
+			continue;
+		if (!af || strcmp(acc, cdr->accountcode)) {
+			if (af)
+				fclose(af);
+			af = NULL;
+			cw_copy_string(acc, cdr->accountcode, sizeof(acc));
+			if (strchr(acc, '/') || (acc[0] == '.')) {
+				cw_log(LOG_WARNING, "Account code '%s' insecure for writing file\n", acc);
+				continue;
+			}
+			snprintf(tmp, sizeof(tmp), "%s/%s/%s.csv", (char *)cw_config_CW_LOG_DIR, CSV_LOG_DIR, acc);
+			if (!(af = fopen(tmp, "a"))) {
+				cw_log(LOG_WARNING, "Unable to write CSV record to account file '%s' : %s\n", acc, strerror(errno));
+				continue;
+			}
+		}
+		fputs(buf, af);
+	}
+	if (af)
+		fclose(af);
+	if (fclose(mf))
+		cw_log(LOG_ERROR, "Unable to write master file %s : %s\n", csvmaster, strerror(errno));
+	return 0;
+}
+
 char *description(void)
 {
 	return desc;
@@ -266,7 +318,7 @@ int load_module(void)
 {
 	int res;
 
-	res = cw_cdr_register(name, desc, csv_log);
+	res = cw_cdr_register_batch(name, desc, csv_log, csv_log_batch);
 	if (res)
 		cw_log(LOG_ERROR, "Unable to register CSV CDR handling\n");
 	return res;
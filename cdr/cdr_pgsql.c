@@ -210,6 +210,126 @@ static int pgsql_log(struct cw_cdr *cdr)
 	return 0;
 }
 
+/* Appends s to a COPY text format row, followed by sep. Returns -1 if it doesn't fit */
+static int copy_field(char *buf, size_t *pos, size_t size, const char *s, char sep)
+{
+	size_t p = *pos;
+
+	for (  ;  *s;  s++) {
+		if (p + 3 >= size)
+			return -1;
+		switch (*s) {
+		case '\\':
+			buf[p++] = '\\';
+			buf[p++] = '\\';
+			break;
+		case '\t':
+			buf[p++] = '\\';
+			buf[p++] = 't';
+			break;
+		case '\n':
+			buf[p++] = '\\';
+			buf[p++] = 'n';
+			break;
+		case '\r':
+			buf[p++] = '\\';
+			buf[p++] = 'r';
+			break;
+		default:
+			buf[p++] = *s;
+			break;
+		}
+	}
+	buf[p++] = sep;
+	*pos = p;
+	return 0;
+}
+
+/* Streams a whole batch into the table with a single COPY */
+static int pgsql_log_batch(struct cw_cdr **cdrs, int count)
+{
+	PGresult *res;
+	struct cw_cdr *cdr;
+	struct tm tm;
+	char sql[512];
+	char row[8192];
+	char timestr[128];
+	char num[3][20];
+	size_t pos;
+	int ok = 1;
+	int x;
+
+	snprintf(sql, sizeof(sql), "COPY %s (calldate,clid,src,dst,dcontext,channel,dstchannel,"
+		"lastapp,lastdata,duration,billsec,disposition,amaflags,accountcode,uniqueid,userfield) FROM STDIN",
+		table);
+
+	cw_mutex_lock(&pgsql_lock);
+	if (pgsql_reconnect() < 0) {
+		cw_mutex_unlock(&pgsql_lock);
+		cw_log(LOG_ERROR, "Unable to reconnect to database server. Some calls will not be logged!\n");
+		return -1;
+	}
+	res = PQexec(conn, sql);
+	if (PQresultStatus(res) != PGRES_COPY_IN) {
+		cw_log(LOG_ERROR, "Failed to start copying call detail records into database!\n");
+		cw_log(LOG_ERROR, "Reason: %s\n", PQresultErrorMessage(res));
+		PQclear(res);
+		cw_mutex_unlock(&pgsql_lock);
+		return -1;
+	}
+	PQclear(res);
+
+	cw_log(LOG_DEBUG, "Copying %d CDR records.\n", count);
+	for (x = 0;  x < count  &&  ok;  x++) {
+		cdr = cdrs[x];
+		localtime_r(&cdr->start.tv_sec, &tm);
+		strftime(timestr, sizeof(timestr), DATE_FORMAT, &tm);
+		snprintf(num[0], sizeof(num[0]), "%d", cdr->duration);
+		snprintf(num[1], sizeof(num[1]), "%d", cdr->billsec);
+		snprintf(num[2], sizeof(num[2]), "%d", cdr->amaflags);
+
+		pos = 0;
+		if (copy_field(row, &pos, sizeof(row), timestr, '\t')
+			|| copy_field(row, &pos, sizeof(row), cdr->clid, '\t')
+			|| copy_field(row, &pos, sizeof(row), cdr->src, '\t')
+			|| copy_field(row, &pos, sizeof(row), cdr->dst, '\t')
+			|| copy_field(row, &pos, sizeof(row), cdr->dcontext, '\t')
+			|| copy_field(row, &pos, sizeof(row), cdr->channel, '\t')
+			|| copy_field(row, &pos, sizeof(row), cdr->dstchannel, '\t')
+			|| copy_field(row, &pos, sizeof(row), cdr->lastapp, '\t')
+			|| copy_field(row, &pos, sizeof(row), cdr->lastdata, '\t')
+			|| copy_field(row, &pos, sizeof(row), num[0], '\t')
+			|| copy_field(row, &pos, sizeof(row), num[1], '\t')
+			|| copy_field(row, &pos, sizeof(row), cw_cdr_disp2str(cdr->disposition), '\t')
+			|| copy_field(row, &pos, sizeof(row), num[2], '\t')
+			|| copy_field(row, &pos, sizeof(row), cdr->accountcode, '\t')
+			|| copy_field(row, &pos, sizeof(row), cdr->uniqueid, '\t')
+			|| copy_field(row, &pos, sizeof(row), cdr->userfield, '\n')) {
+			cw_log(LOG_ERROR, "Call detail record on channel '%s' too long to copy\n", cdr->channel);
+			ok = 0;
+			break;
+		}
+		if (PQputCopyData(conn, row, pos) != 1)
+			ok = 0;
+	}
+
+	/* An aborted COPY stores nothing, so the records can be inserted one by one instead */
+	if (PQputCopyEnd(conn, ok  ?  NULL  :  "aborted") != 1)
+		ok = 0;
+	while ((res = PQgetResult(conn))) {
+		if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+			if (ok) {
+				cw_log(LOG_ERROR, "Failed to copy call detail records into database!\n");
+				cw_log(LOG_ERROR, "Reason: %s\n", PQresultErrorMessage(res));
+			}
+			ok = 0;
+		}
+		PQclear(res);
+	}
+	cw_mutex_unlock(&pgsql_lock);
+	return ok  ?  0  :  -1;
+}
+
 char *description(void)
 {
 	return desc;
@@ -229,7 +349,7 @@ static int my_load_module(void)
 	
 	pgsql_reconnect();
 
-	res = cw_cdr_register(name, desc, pgsql_log);
+	res = cw_cdr_register_batch(name, desc, pgsql_log, pgsql_log_batch);
 	if (res) {
 		cw_log(LOG_ERROR, "Unable to register PGSQL CDR handling\n");
 	}
@@ -197,6 +197,121 @@ static int sqlite_log(struct cw_cdr *cdr)
 	return res;
 }
 
+static void format_date(char *buf, size_t len, struct timeval tv)
+{
+	struct tm tm;
+	time_t t;
+
+	t = tv.tv_sec;
+	localtime_r(&t, &tm);
+	strftime(buf, len, DATE_FORMAT, &tm);
+}
+
+/* Inserts a whole batch in one transaction with one prepared statement */
+static int sqlite_log_batch(struct cw_cdr **cdrs, int count)
+{
+	static const char sql[] = "INSERT INTO cdr ("
+			"clid,src,dst,dcontext,"
+			"channel,dstchannel,lastapp,lastdata, "
+			"start,answer,end,"
+			"duration,billsec,disposition,amaflags, "
+			"accountcode"
+#			if LOG_UNIQUEID
+			",uniqueid"
+#			endif
+#			if LOG_USERFIELD
+			",userfield"
+#			endif
+		") VALUES (?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?, ?"
+#			if LOG_UNIQUEID
+			", ?"
+#			endif
+#			if LOG_USERFIELD
+			", ?"
+#			endif
+		")";
+	sqlite3_stmt *stmt = NULL;
+	struct cw_cdr *cdr;
+	char startstr[80], answerstr[80], endstr[80];
+	char fn[PATH_MAX];
+	int res;
+	int x;
+
+	cw_mutex_lock(&sqlite3_lock);
+
+	snprintf(fn, sizeof(fn), "%s/cdr.db", cw_config_CW_LOG_DIR);
+	if (sqlite3_open(fn, &db) != SQLITE_OK) {
+		cw_log(LOG_ERROR, "cdr_sqlite: %s\n", sqlite3_errmsg(db));
+		goto err;
+	}
+	sqlite3_busy_timeout(db, 1000);
+
+	if (sqlite3_exec(db, "BEGIN TRANSACTION;", NULL, NULL, NULL) != SQLITE_OK) {
+		cw_log(LOG_ERROR, "cdr_sqlite: Unable to begin transaction: %s\n", sqlite3_errmsg(db));
+		goto err;
+	}
+	if (sqlite3_prepare(db, sql, -1, &stmt, NULL) != SQLITE_OK) {
+		cw_log(LOG_ERROR, "cdr_sqlite: Unable to prepare insert: %s\n", sqlite3_errmsg(db));
+		goto rollback;
+	}
+	for (x = 0;  x < count;  x++) {
+		cdr = cdrs[x];
+		format_date(startstr, sizeof(startstr), cdr->start);
+		format_date(answerstr, sizeof(answerstr), cdr->answer);
+		format_date(endstr, sizeof(endstr), cdr->end);
+
+		sqlite3_bind_text(stmt, 1, cdr->clid, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 2, cdr->src, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 3, cdr->dst, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 4, cdr->dcontext, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 5, cdr->channel, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 6, cdr->dstchannel, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 7, cdr->lastapp, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 8, cdr->lastdata, -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 9, startstr, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(stmt, 10, answerstr, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_text(stmt, 11, endstr, -1, SQLITE_TRANSIENT);
+		sqlite3_bind_int(stmt, 12, cdr->duration);
+		sqlite3_bind_int(stmt, 13, cdr->billsec);
+		sqlite3_bind_int(stmt, 14, cdr->disposition);
+		sqlite3_bind_int(stmt, 15, cdr->amaflags);
+		sqlite3_bind_text(stmt, 16, cdr->accountcode, -1, SQLITE_STATIC);
+#if LOG_UNIQUEID
+		sqlite3_bind_text(stmt, 17, cdr->uniqueid, -1, SQLITE_STATIC);
+#endif
+#if LOG_USERFIELD
+		sqlite3_bind_text(stmt, 17 + LOG_UNIQUEID, cdr->userfield, -1, SQLITE_STATIC);
+#endif
+		res = sqlite3_step(stmt);
+		if (res != SQLITE_DONE) {
+			cw_log(LOG_ERROR, "cdr_sqlite: Insert failed: %s\n", sqlite3_errmsg(db));
+			goto rollback;
+		}
+		sqlite3_reset(stmt);
+	}
+	sqlite3_finalize(stmt);
+	stmt = NULL;
+
+	if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK) {
+		cw_log(LOG_ERROR, "cdr_sqlite: Unable to commit %d records: %s\n", count, sqlite3_errmsg(db));
+		goto rollback;
+	}
+	sqlite3_close(db);
+	db = NULL;
+	cw_mutex_unlock(&sqlite3_lock);
+	return 0;
+
+rollback:
+	if (stmt)
+		sqlite3_finalize(stmt);
+	sqlite3_exec(db, "ROLLBACK;", NULL, NULL, NULL);
+err:
+	if (db)
+		sqlite3_close(db);
+	db = NULL;
+	cw_mutex_unlock(&sqlite3_lock);
+	return -1;
+}
 
 char *description(void)
 {
@@ -238,7 +353,7 @@ int load_module(void)
 		/* TODO: here we should probably create an index */
 	}
 	
-	res = cw_cdr_register(name, desc, sqlite_log);
+	res = cw_cdr_register_batch(name, desc, sqlite_log, sqlite_log_batch);
 	if (res) {
 		cw_log(LOG_ERROR, "Unable to register SQLite CDR handling\n");
 		goto err;
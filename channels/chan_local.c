@@ -364,14 +364,16 @@ static int local_call(struct cw_channel *ast, char *dest, int timeout)
 
 	/* copy the channel variables from the incoming channel to the outgoing channel */
 	/* Note that due to certain assumptions, they MUST be in the same order */
-	CW_LIST_TRAVERSE(&p->owner->varshead, varptr, entries) {
+	CW_CHANNEL_VARS_TRAVERSE(p->owner, varptr) {
 		namelen = strlen(varptr->name);
 		len = sizeof(struct cw_var_t) + namelen + strlen(varptr->value) + 2;
 		new = malloc(len);
 		if (new) {
 			memcpy(new, varptr, len);
 			new->value = &(new->name[0]) + namelen + 1;
+			new->shared = 0;
 			CW_LIST_INSERT_TAIL(&p->chan->varshead, new, entries);
+			cw_var_index_add(&p->chan->varsindex, new, 0);
 		} else {
 			cw_log(LOG_ERROR, "Out of memory!\n");
 		}
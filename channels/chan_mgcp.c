@@ -895,7 +895,6 @@ static int mgcp_call(struct cw_channel *ast, char *dest, int timeout)
 	struct mgcp_subchannel *sub;
 	char tone[50] = "";
 	char *distinctive_ring = NULL;
-	struct varshead *headp;
 	struct cw_var_t *current;
 
 	if (mgcpdebug) {
@@ -903,8 +902,7 @@ static int mgcp_call(struct cw_channel *ast, char *dest, int timeout)
 	}
 	sub = ast->tech_pvt;
 	p = sub->parent;
-	headp = &ast->varshead;
-	CW_LIST_TRAVERSE(headp,current,entries) {
+	CW_CHANNEL_VARS_TRAVERSE(ast, current) {
 		/* Check whether there is an ALERT_INFO variable */
 		if (strcasecmp(cw_var_name(current),"ALERT_INFO") == 0) {
 			distinctive_ring = cw_var_value(current);
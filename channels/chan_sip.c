@@ -89,6 +89,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/localtime.h"
 #include "callweaver/udpfromto.h"
 #include "callweaver/stun.h"
+#include "callweaver/callweaver_hash.h"
 
 #ifdef ENABLE_SIP_CALL_LIMIT
 # warning "Broken SIP call limit enabled"
@@ -646,6 +647,38 @@ struct domain {
 
 static CW_LIST_HEAD_STATIC(domain_list, domain);    /*!< The SIP domain list */
 
+/*! \brief Mailboxes voicemail reported as changed, waiting for the monitor thread */
+struct sip_mwi_change {
+    CW_LIST_ENTRY(sip_mwi_change) list;
+    char mailbox[1];
+};
+
+static CW_LIST_HEAD_STATIC(mwi_changes, sip_mwi_change);
+
+/*! \brief Peers with a mailbox, kept in the order they are due for an MWI check,
+    with each of their mailboxes hashed to find them by. A peer is entered when
+    it is linked into peerl and taken out when it is unlinked. */
+struct sip_mwi_peer {
+    struct sip_mwi_peer *next;
+    struct sip_mwi_peer *prev;
+    struct sip_peer *peer;        /*!< Holds a reference */
+    struct sip_mwi_key *keys;    /*!< The peer's mailboxes */
+};
+
+struct sip_mwi_key {
+    struct sip_mwi_key *next;    /*!< Next key in the hash bucket */
+    struct sip_mwi_key *knext;    /*!< Next mailbox of the same peer */
+    unsigned int hash;
+    struct sip_mwi_peer *mp;
+    char mailbox[1];            /*!< mailbox@context */
+};
+
+#define SIP_MWI_BUCKETS 256
+static struct sip_mwi_key *mwi_keys[SIP_MWI_BUCKETS];
+static struct sip_mwi_peer *mwi_due_head, *mwi_due_tail;
+/*! \brief Protects the MWI index and peer->mwi. Only the mwi_changes lock is taken while it is held */
+CW_MUTEX_DEFINE_STATIC(mwilock);
+
 int allow_external_domains;        /*!< Accept calls to external SIP domains? */
 
 /*! \brief sip_history: Structure for saving transactions within a SIP dialog */
@@ -972,6 +1005,7 @@ struct sip_peer {
     struct cw_codec_pref prefs;    /*!<  codec prefs */
     int lastmsgssent;
     time_t    lastmsgcheck;        /*!<  Last time we checked for MWI */
+    struct sip_mwi_peer *mwi;    /*!<  Entry in the MWI index, while in peerl */
     unsigned int flags;        /*!<  SIP flags */    
     unsigned int sipoptions;    /*!<  Supported SIP options */
     struct cw_flags flags_page2;    /*!<  SIP_PAGE2 flags */
@@ -999,6 +1033,10 @@ struct sip_peer {
     int lastmsg;
 };
 
+static void sip_mwi_peer_add(struct sip_peer *peer);
+static void sip_mwi_peer_del(struct sip_peer *peer);
+static void sip_mwi_peer_del_marked(void);
+
 CW_MUTEX_DEFINE_STATIC(sip_reload_lock);
 static int sip_reloading = 0;
 
@@ -2633,6 +2671,7 @@ static struct sip_peer *realtime_peer(const char *peername, struct sockaddr_in *
             peer->expire = cw_sched_add(sched, (global_rtautoclear) * 1000, expire_register, (void *)peer);
         }
         CWOBJ_CONTAINER_LINK(&peerl,peer);
+        sip_mwi_peer_add(peer);
     }
     else
     {
@@ -2960,7 +2999,6 @@ static int sip_call(struct cw_channel *ast, char *dest, int timeout)
 #ifdef OSP_SUPPORT
     char *osphandle = NULL;
 #endif    
-    struct varshead *headp;
     struct cw_var_t *current;
 
 
@@ -2975,8 +3013,7 @@ static int sip_call(struct cw_channel *ast, char *dest, int timeout)
 
     /* Check whether there is vxml_url, distinctive ring variables */
 
-    headp=&ast->varshead;
-    CW_LIST_TRAVERSE(headp,current,entries)
+    CW_CHANNEL_VARS_TRAVERSE(ast, current)
     {
         /* Check whether there is a VXML_URL variable */
         if (!p->options->vxml_url && !strcasecmp(cw_var_name(current), "VXML_URL"))
@@ -7155,7 +7192,7 @@ static int transmit_invite(struct sip_pvt *p, int sipmethod, int sdp, int init)
                 cw_log(LOG_WARNING,"No Headp for the channel...ooops!\n");
             else
             {
-                CW_LIST_TRAVERSE(headp, current, entries)
+                CW_CHANNEL_VARS_TRAVERSE(ast, current)
                 { 
                     /* SIPADDHEADER: Add SIP header to outgoing call        */
                     if (!strncasecmp(cw_var_name(current), "SIPADDHEADER", strlen("SIPADDHEADER")))
@@ -7982,6 +8019,8 @@ static int expire_register(void *data)
     if (cw_test_flag(peer, SIP_SELFDESTRUCT) || cw_test_flag((&peer->flags_page2), SIP_PAGE2_RTAUTOCLEAR))
     {
         peer = CWOBJ_CONTAINER_UNLINK(&peerl, peer);
+        if (peer)
+            sip_mwi_peer_del(peer);
         CWOBJ_UNREF(peer, sip_destroy_peer);
     }
 
@@ -8852,6 +8891,7 @@ static int register_verify(struct sip_pvt *p, struct sockaddr_in *sin, struct si
         if (peer)
         {
             CWOBJ_CONTAINER_LINK(&peerl, peer);
+            sip_mwi_peer_add(peer);
             sip_cancel_destroy(p);
             switch (parse_register_contact(p, peer, req))
             {
@@ -10336,6 +10376,7 @@ static int sip_prune_realtime(int fd, int argc, char *argv[])
             } while (0) );
             if (pruned)
             {
+                sip_mwi_peer_del_marked();
                 CWOBJ_CONTAINER_PRUNE_MARKED(&peerl, sip_destroy_peer);
                 cw_cli(fd, "%d peers pruned.\n", pruned);
             }
@@ -10384,7 +10425,10 @@ static int sip_prune_realtime(int fd, int argc, char *argv[])
                     CWOBJ_CONTAINER_LINK(&peerl, peer);
                 }
                 else
+                {
+                    sip_mwi_peer_del(peer);
                     cw_cli(fd, "Peer '%s' pruned.\n", name);
+                }
                 CWOBJ_UNREF(peer, sip_destroy_peer);
             }
             else
@@ -14684,16 +14728,230 @@ static int sip_send_mwi_to_peer(struct sip_peer *peer)
     return 0;
 }
 
+/*! \brief  sip_mwi_event: Voicemail tells us a mailbox changed; queue it for the monitor thread.
+    This may be called with a peer locked, so it must not touch the peer list itself. */
+static int sip_mwi_event(const char *mailbox, int newmsgs, int oldmsgs, void *data)
+{
+    struct sip_mwi_change *change;
+
+    if ((change = malloc(sizeof(*change) + strlen(mailbox))) == NULL)
+        return -1;
+    strcpy(change->mailbox, mailbox);
+    CW_LIST_LOCK(&mwi_changes);
+    CW_LIST_INSERT_TAIL(&mwi_changes, change, list);
+    CW_LIST_UNLOCK(&mwi_changes);
+    return 0;
+}
+
+/*! \brief  sip_mwi_due_unlink: Take a peer off the MWI due list */
+static void sip_mwi_due_unlink(struct sip_mwi_peer *mp)
+{
+    if (mp->prev)
+        mp->prev->next = mp->next;
+    else
+        mwi_due_head = mp->next;
+    if (mp->next)
+        mp->next->prev = mp->prev;
+    else
+        mwi_due_tail = mp->prev;
+}
+
+/*! \brief  sip_mwi_index_free: Drop the MWI index and its peer references */
+static void sip_mwi_index_free(void)
+{
+    struct sip_mwi_key *key;
+    struct sip_mwi_peer *mp;
+    int i;
+
+    cw_mutex_lock(&mwilock);
+    for (i = 0;  i < SIP_MWI_BUCKETS;  i++)
+    {
+        while ((key = mwi_keys[i]))
+        {
+            mwi_keys[i] = key->next;
+            free(key);
+        }
+    }
+    while ((mp = mwi_due_head))
+    {
+        mwi_due_head = mp->next;
+        mp->peer->mwi = NULL;
+        CWOBJ_UNREF(mp->peer, sip_destroy_peer);
+        free(mp);
+    }
+    mwi_due_tail = NULL;
+    cw_mutex_unlock(&mwilock);
+}
+
+/*! \brief  sip_mwi_key_new: Key one mailbox of a peer, a bare mailbox being in context default */
+static void sip_mwi_key_new(struct sip_mwi_peer *mp, const char *mailbox)
+{
+    struct sip_mwi_key *key;
+    size_t len = strlen(mailbox);
+
+    if ((key = malloc(sizeof(*key) + len + sizeof("@default"))) == NULL)
+        return;
+    strcpy(key->mailbox, mailbox);
+    if (strchr(mailbox, '@') == NULL)
+        strcpy(key->mailbox + len, "@default");
+    key->hash = cw_hash_string_tolower(key->mailbox);
+    key->mp = mp;
+    key->knext = mp->keys;
+    mp->keys = key;
+}
+
+/*! \brief  sip_mwi_peer_free: Free an index entry which is no longer linked */
+static void sip_mwi_peer_free(struct sip_mwi_peer *mp)
+{
+    struct sip_mwi_key *key;
+
+    while ((key = mp->keys))
+    {
+        mp->keys = key->knext;
+        free(key);
+    }
+    CWOBJ_UNREF(mp->peer, sip_destroy_peer);
+    free(mp);
+}
+
+/*! \brief  sip_mwi_peer_add: Enter a peer just linked into peerl in the MWI index */
+static void sip_mwi_peer_add(struct sip_peer *peer)
+{
+    struct sip_mwi_peer *mp;
+    struct sip_mwi_peer *after;
+    struct sip_mwi_key *key;
+    char tmp[CW_MAX_EXTENSION];
+    char *mb;
+    char *cur;
+
+    if (cw_strlen_zero(peer->mailbox)  ||  (mp = malloc(sizeof(*mp))) == NULL)
+        return;
+    mp->peer = CWOBJ_REF(peer);
+    mp->keys = NULL;
+    cw_copy_string(tmp, peer->mailbox, sizeof(tmp));
+    mb = tmp;
+    while ((cur = strsep(&mb, ", ")))
+    {
+        if (!cw_strlen_zero(cur))
+            sip_mwi_key_new(mp, cur);
+    }
+
+    cw_mutex_lock(&mwilock);
+    if (peer->mwi)
+    {
+        cw_mutex_unlock(&mwilock);
+        sip_mwi_peer_free(mp);
+        return;
+    }
+    for (key = mp->keys;  key;  key = key->knext)
+    {
+        key->next = mwi_keys[key->hash % SIP_MWI_BUCKETS];
+        mwi_keys[key->hash % SIP_MWI_BUCKETS] = key;
+    }
+    /* Keep the due list in order of the last check. A peer never checked is
+       due at once, and a recently checked one belongs at or near the tail. */
+    for (after = mwi_due_tail;  after  &&  after->peer->lastmsgcheck > peer->lastmsgcheck;  after = after->prev)
+        ;
+    mp->prev = after;
+    mp->next = (after)  ?  after->next  :  mwi_due_head;
+    if (mp->next)
+        mp->next->prev = mp;
+    else
+        mwi_due_tail = mp;
+    if (after)
+        after->next = mp;
+    else
+        mwi_due_head = mp;
+    peer->mwi = mp;
+    cw_mutex_unlock(&mwilock);
+}
+
+/*! \brief  sip_mwi_peer_del: Take a peer being unlinked from peerl out of the MWI index */
+static void sip_mwi_peer_del(struct sip_peer *peer)
+{
+    struct sip_mwi_peer *mp;
+    struct sip_mwi_key *key;
+    struct sip_mwi_key **kp;
+
+    cw_mutex_lock(&mwilock);
+    if ((mp = peer->mwi) == NULL)
+    {
+        cw_mutex_unlock(&mwilock);
+        return;
+    }
+    peer->mwi = NULL;
+    for (key = mp->keys;  key;  key = key->knext)
+    {
+        for (kp = &mwi_keys[key->hash % SIP_MWI_BUCKETS];  *kp;  kp = &(*kp)->next)
+        {
+            if (*kp == key)
+            {
+                *kp = key->next;
+                break;
+            }
+        }
+    }
+    sip_mwi_due_unlink(mp);
+    cw_mutex_unlock(&mwilock);
+    sip_mwi_peer_free(mp);
+}
+
+/*! \brief  sip_mwi_peer_del_marked: Take the peers about to be pruned from peerl out of the MWI index */
+static void sip_mwi_peer_del_marked(void)
+{
+    CWOBJ_CONTAINER_TRAVERSE(&peerl, 1, do {
+        if (iterator->objflags & CWOBJ_FLAG_MARKED)
+            sip_mwi_peer_del(iterator);
+    } while (0)
+    );
+}
+
+/*! \brief  sip_mwi_flush_changes: Make peers whose mailbox changed due for an immediate MWI check.
+    Called with mwilock held */
+static void sip_mwi_flush_changes(void)
+{
+    struct sip_mwi_change *change;
+    struct sip_mwi_key *key;
+    struct sip_mwi_peer *mp;
+    unsigned int hash;
+
+    for (;;)
+    {
+        CW_LIST_LOCK(&mwi_changes);
+        change = CW_LIST_REMOVE_HEAD(&mwi_changes, list);
+        CW_LIST_UNLOCK(&mwi_changes);
+        if (change == NULL)
+            break;
+        hash = cw_hash_string_tolower(change->mailbox);
+        for (key = mwi_keys[hash % SIP_MWI_BUCKETS];  key;  key = key->next)
+        {
+            if (key->hash != hash  ||  strcasecmp(key->mailbox, change->mailbox))
+                continue;
+            /* Move it to the front of the due list */
+            mp = key->mp;
+            mp->peer->lastmsgcheck = 0;
+            if (mp != mwi_due_head)
+            {
+                sip_mwi_due_unlink(mp);
+                mp->prev = NULL;
+                mp->next = mwi_due_head;
+                mwi_due_head->prev = mp;
+                mwi_due_head = mp;
+            }
+        }
+        free(change);
+    }
+}
+
 /*! \brief  do_monitor: The SIP monitoring thread */
 static void *do_monitor(void *data)
 {
     int res;
     struct sip_pvt *sip;
-    struct sip_peer *peer = NULL;
+    struct sip_mwi_peer *mp;
+    struct sip_peer *peer;
     time_t t;
     int fastrestart =0;
-    int lastpeernum = -1;
-    int curpeernum;
     int reloading;
 
     /* Add an I/O event to our UDP socket */
@@ -14822,32 +15080,35 @@ restartsearch:
 			cw_log(LOG_DEBUG, "chan_sip: cw_sched_runq ran %d all at once\n", res);
 	}
 
+        cw_mutex_lock(&mwilock);
+        /* Peers whose mailbox voicemail told us about are due right now */
+        sip_mwi_flush_changes();
+
         /* needs work to send mwi to realtime peers */
         time(&t);
         fastrestart = 0;
-        curpeernum = 0;
         peer = NULL;
-        CWOBJ_CONTAINER_TRAVERSE(&peerl, !peer, do {
-            if ((curpeernum > lastpeernum) && !cw_strlen_zero(iterator->mailbox) && ((t - iterator->lastmsgcheck) > global_mwitime))
+        if ((mp = mwi_due_head)  &&  (t - mp->peer->lastmsgcheck) > global_mwitime)
+        {
+            fastrestart = 1;
+            /* Checking it makes it the last one due */
+            if (mp != mwi_due_tail)
             {
-                fastrestart = 1;
-                lastpeernum = curpeernum;
-                peer = CWOBJ_REF(iterator);
-            };
-            curpeernum++;
-        } while (0)
-        );
+                sip_mwi_due_unlink(mp);
+                mp->next = NULL;
+                mp->prev = mwi_due_tail;
+                mwi_due_tail->next = mp;
+                mwi_due_tail = mp;
+            }
+            peer = CWOBJ_REF(mp->peer);
+        }
+        cw_mutex_unlock(&mwilock);
         if (peer)
         {
             CWOBJ_WRLOCK(peer);
             sip_send_mwi_to_peer(peer);
             CWOBJ_UNLOCK(peer);
-            CWOBJ_UNREF(peer,sip_destroy_peer);
-        }
-        else
-        {
-            /* Reset where we come from */
-            lastpeernum = -1;
+            CWOBJ_UNREF(peer, sip_destroy_peer);
         }
         cw_mutex_unlock(&monlock);
     }
@@ -15670,6 +15931,9 @@ static struct sip_peer *build_peer(const char *name, struct cw_variable *v, int
            during reload
         */
         peer = CWOBJ_CONTAINER_FIND_UNLINK_FULL(&peerl, name, name, 0, 0, strcmp);
+        /* The mailbox may change, so it is entered again when relinked */
+        if (peer)
+            sip_mwi_peer_del(peer);
 	}
 	if (option_debug > 5)
 		cw_log(LOG_DEBUG, "build_peer() called for peer \"%s\" with realtime = %d\n", name, realtime);
@@ -16536,6 +16800,7 @@ static int reload_config(void)
                     if (peer)
                     {
                         CWOBJ_CONTAINER_LINK(&peerl,peer);
+                        sip_mwi_peer_add(peer);
                         CWOBJ_UNREF(peer, sip_destroy_peer);
                     }
                 }
@@ -17396,6 +17661,7 @@ static int sip_do_reload(void)
     CWOBJ_CONTAINER_MARKALL(&peerl);
     reload_config();
     /* Prune peers who still are supposed to be deleted */
+    sip_mwi_peer_del_marked();
     CWOBJ_CONTAINER_PRUNE_MARKED(&peerl, sip_destroy_peer);
 
     sip_poke_all_peers();
@@ -17505,6 +17771,7 @@ int load_module(void)
     dtmfmode_app = cw_register_application(dtmfmode_name, sip_dtmfmode, dtmfmode_synopsis, dtmfmode_syntax, dtmfmode_description);
     sipt38switchover_app = cw_register_application(sipt38switchover_name, sip_t38switchover, sipt38switchover_synopsis, sipt38switchover_syntax, sipt38switchover_description);
     cw_install_t38_functions(sip_do_t38switchover);
+    cw_mwi_add(sip_mwi_event, NULL);
 
     /* These will be removed soon */
     sipaddheader_app = cw_register_application(sipaddheader_name, sip_addheader, sipaddheader_synopsis, sipaddheader_syntax, sipaddheader_description);
@@ -17553,6 +17820,7 @@ int unload_module(void)
 
     res |= cw_unregister_application(sipt38switchover_app);
     cw_uninstall_t38_functions();
+    cw_mwi_del(sip_mwi_event, NULL);
     res |= cw_unregister_application(dtmfmode_app);
     res |= cw_unregister_application(sipaddheader_app);
     res |= cw_unregister_application(siposd_app);
@@ -17626,6 +17894,7 @@ int unload_module(void)
 
     CWOBJ_CONTAINER_DESTROYALL(&userl, sip_destroy_user);
     CWOBJ_CONTAINER_DESTROY(&userl);
+    sip_mwi_index_free();
     CWOBJ_CONTAINER_DESTROYALL(&peerl, sip_destroy_peer);
     CWOBJ_CONTAINER_DESTROY(&peerl);
     CWOBJ_CONTAINER_DESTROYALL(&regl, sip_registry_destroy);
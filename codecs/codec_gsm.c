@@ -305,6 +305,15 @@ static void gsm_destroy_stuff(struct cw_translator_pvt *pvt)
     cw_update_use_count();
 }
 
+static void gsm_reset(struct cw_translator_pvt *pvt)
+{
+    /* The buffers only matter up to tail, so there is no need to clear them */
+    memset(&pvt->f, 0, sizeof(pvt->f));
+    pvt->tail = 0;
+    gsm0610_init(pvt->gsm, GSM0610_PACKING_VOIP);
+    plc_init(&pvt->plc);
+}
+
 static struct cw_translator gsmtolin =
 {
     "gsmtolin", 
@@ -316,7 +325,8 @@ static struct cw_translator gsmtolin =
     gsmtolin_framein,
     gsmtolin_frameout,
     gsm_destroy_stuff,
-    gsmtolin_sample
+    gsmtolin_sample,
+    gsm_reset
 };
 
 static struct cw_translator lintogsm =
@@ -330,7 +340,8 @@ static struct cw_translator lintogsm =
     lintogsm_framein,
     lintogsm_frameout,
     gsm_destroy_stuff,
-    lintogsm_sample
+    lintogsm_sample,
+    gsm_reset
 };
 
 static void parse_config(void)
@@ -400,5 +411,7 @@ int usecount(void)
     int res;
 
     STANDARD_USECOUNT(res);
+    /* Pooled workspaces belong to the core, not to any call */
+    res -= cw_translator_pooled(&gsmtolin) + cw_translator_pooled(&lintogsm);
     return res;
 }
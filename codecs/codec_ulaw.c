@@ -45,6 +45,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/translate.h"
 #include "callweaver/channel.h"
 #include "callweaver/ulaw.h"
+#include "callweaver/pcm.h"
 
 #define BUFFER_SIZE   8096    /* size for the translation buffers */
 
@@ -169,7 +170,6 @@ static struct cw_translator_pvt *lintoulaw_new(void)
 static int ulawtolin_framein(struct cw_translator_pvt *pvt, struct cw_frame *f)
 {
     struct ulaw_decoder_pvt *tmp = (struct ulaw_decoder_pvt *) pvt;
-    int x;
     unsigned char *b;
 
     if (f->datalen == 0) {
@@ -192,8 +192,7 @@ static int ulawtolin_framein(struct cw_translator_pvt *pvt, struct cw_frame *f)
 
     /* Reset ssindex and signal to frame's specified values */
     b = f->data;
-    for (x = 0;  x < f->datalen;  x++)
-        tmp->outbuf[tmp->tail + x] = CW_MULAW(b[x]);
+    cw_ulaw_to_slin(tmp->outbuf + tmp->tail, b, f->datalen);
 
     if (useplc)
         plc_rx(&tmp->plc, tmp->outbuf+tmp->tail, f->datalen);
@@ -243,7 +242,6 @@ static struct cw_frame *ulawtolin_frameout(struct cw_translator_pvt *pvt)
 static int lintoulaw_framein(struct cw_translator_pvt *pvt, struct cw_frame *f)
 {
     struct ulaw_encoder_pvt *tmp = (struct ulaw_encoder_pvt *) pvt;
-    int x;
     int16_t *s;
   
     if (tmp->tail + f->datalen/sizeof(int16_t) >= sizeof(tmp->outbuf))
@@ -252,8 +250,7 @@ static int lintoulaw_framein(struct cw_translator_pvt *pvt, struct cw_frame *f)
         return -1;
     }
     s = f->data;
-    for (x = 0;  x < f->datalen/sizeof(int16_t);  x++) 
-        tmp->outbuf[x + tmp->tail] = CW_LIN2MU(s[x]);
+    cw_slin_to_ulaw(tmp->outbuf + tmp->tail, s, f->datalen/sizeof(int16_t));
     tmp->tail += f->datalen/sizeof(int16_t);
     return 0;
 }
@@ -315,6 +312,166 @@ static struct cw_frame *lintoulaw_sample(void)
     return &f;
 }
 
+/* Most samples a batch converts with one call into its scratch buffer */
+#define BATCH_SAMPLES 4096
+
+/*!
+ * \brief ulawtolin_framein_batch
+ *  Feed one frame into each of a set of decoder workspaces.
+ *
+ *  Frames whose payloads follow on from each other in memory, or repeat
+ *  the payload of the frame before (one leg fanned out to many states),
+ *  are decoded with a single call over the whole contiguous block, and
+ *  each workspace takes its slice of the result.
+ */
+static int ulawtolin_framein_batch(struct cw_translator_pvt **pvt, struct cw_frame **f, int n)
+{
+    struct ulaw_decoder_pvt *tmp;
+    int16_t lin[BATCH_SAMPLES];
+    uint8_t *base;
+    int len;
+    int res;
+    int i;
+    int j;
+    int k;
+
+    res = 0;
+    for (i = 0;  i < n;  i = j)
+    {
+        base = f[i]->data;
+        len = f[i]->datalen;
+        for (j = i + 1;  j < n  &&  len > 0;  j++)
+        {
+            if (f[j]->datalen == 0)
+                break;
+            if (f[j]->data == f[j - 1]->data  &&  f[j]->datalen == f[j - 1]->datalen)
+                continue;
+            if ((uint8_t *) f[j]->data != (uint8_t *) f[j - 1]->data + f[j - 1]->datalen
+                ||
+                len + f[j]->datalen > BATCH_SAMPLES)
+            {
+                break;
+            }
+            len += f[j]->datalen;
+        }
+        if (j == i + 1  ||  len <= 0  ||  len > BATCH_SAMPLES)
+        {
+            /* Nothing to share with the next frame */
+            if (ulawtolin_framein(pvt[i], f[i]))
+                res = -1;
+            j = i + 1;
+            continue;
+        }
+        cw_ulaw_to_slin(lin, base, len);
+        for (k = i;  k < j;  k++)
+        {
+            tmp = (struct ulaw_decoder_pvt *) pvt[k];
+            if ((tmp->tail + f[k]->datalen)*sizeof(int16_t) > sizeof(tmp->outbuf))
+            {
+                cw_log(LOG_WARNING, "Out of buffer space\n");
+                res = -1;
+                continue;
+            }
+            memcpy(tmp->outbuf + tmp->tail, lin + ((uint8_t *) f[k]->data - base), f[k]->datalen*sizeof(int16_t));
+            if (useplc)
+                plc_rx(&tmp->plc, tmp->outbuf + tmp->tail, f[k]->datalen);
+            tmp->tail += f[k]->datalen;
+        }
+    }
+    return res;
+}
+
+/*!
+ * \brief lintoulaw_framein_batch
+ *  Feed one frame into each of a set of encoder workspaces.
+ *
+ *  Frames whose payloads follow on from each other in memory, as a mixer
+ *  building every leg's audio in one array hands them over, or repeat the
+ *  payload of the frame before, are encoded with a single call over the
+ *  whole contiguous block, and each workspace takes its slice of the result.
+ */
+static int lintoulaw_framein_batch(struct cw_translator_pvt **pvt, struct cw_frame **f, int n)
+{
+    struct ulaw_encoder_pvt *tmp;
+    uint8_t law[BATCH_SAMPLES];
+    int16_t *base;
+    int samples;
+    int len;
+    int res;
+    int i;
+    int j;
+    int k;
+
+    res = 0;
+    for (i = 0;  i < n;  i = j)
+    {
+        base = f[i]->data;
+        len = f[i]->datalen/sizeof(int16_t);
+        for (j = i + 1;  j < n  &&  len > 0;  j++)
+        {
+            if (f[j]->datalen == 0)
+                break;
+            if (f[j]->data == f[j - 1]->data  &&  f[j]->datalen == f[j - 1]->datalen)
+                continue;
+            if ((uint8_t *) f[j]->data != (uint8_t *) f[j - 1]->data + f[j - 1]->datalen
+                ||
+                (f[j]->datalen & 1)
+                ||
+                len + f[j]->datalen/sizeof(int16_t) > BATCH_SAMPLES)
+            {
+                break;
+            }
+            len += f[j]->datalen/sizeof(int16_t);
+        }
+        if (j == i + 1  ||  len <= 0  ||  len > BATCH_SAMPLES  ||  (f[i]->datalen & 1))
+        {
+            /* Nothing to share with the next frame */
+            if (lintoulaw_framein(pvt[i], f[i]))
+                res = -1;
+            j = i + 1;
+            continue;
+        }
+        cw_slin_to_ulaw(law, base, len);
+        for (k = i;  k < j;  k++)
+        {
+            tmp = (struct ulaw_encoder_pvt *) pvt[k];
+            samples = f[k]->datalen/sizeof(int16_t);
+            if (tmp->tail + samples >= sizeof(tmp->outbuf))
+            {
+                cw_log(LOG_WARNING, "Out of buffer space\n");
+                res = -1;
+                continue;
+            }
+            memcpy(tmp->outbuf + tmp->tail, law + ((int16_t *) f[k]->data - base), samples);
+            tmp->tail += samples;
+        }
+    }
+    return res;
+}
+
+/*!
+ * \brief ulaw_decoder_reset
+ *  Return a decoder workspace to the state ulawtolin_new leaves it in.
+ */
+static void ulaw_decoder_reset(struct cw_translator_pvt *pvt)
+{
+    struct ulaw_decoder_pvt *tmp = (struct ulaw_decoder_pvt *) pvt;
+
+    memset(tmp, 0, sizeof(*tmp));
+    plc_init(&tmp->plc);
+}
+
+/*!
+ * \brief ulaw_encoder_reset
+ *  Return an encoder workspace to the state lintoulaw_new leaves it in.
+ */
+static void ulaw_encoder_reset(struct cw_translator_pvt *pvt)
+{
+    struct ulaw_encoder_pvt *tmp = (struct ulaw_encoder_pvt *) pvt;
+
+    memset(tmp, 0, sizeof(*tmp));
+}
+
 /*!
  * \brief ulaw_destroy
  *  Destroys a private workspace.
@@ -346,7 +503,9 @@ static struct cw_translator ulawtolin =
     ulawtolin_framein,
     ulawtolin_frameout,
     ulaw_destroy,
-    ulawtolin_sample
+    ulawtolin_sample,
+    ulaw_decoder_reset,
+    ulawtolin_framein_batch
 };
 
 /*!
@@ -363,7 +522,9 @@ static struct cw_translator lintoulaw =
     lintoulaw_framein,
     lintoulaw_frameout,
     ulaw_destroy,
-    lintoulaw_sample
+    lintoulaw_sample,
+    ulaw_encoder_reset,
+    lintoulaw_framein_batch
 };
 
 static void parse_config(void)
@@ -436,5 +597,7 @@ int usecount(void)
     int res;
   
     STANDARD_USECOUNT(res);
+    /* Pooled workspaces belong to the core, not to any call */
+    res -= cw_translator_pooled(&ulawtolin) + cw_translator_pooled(&lintoulaw);
     return res;
 }
@@ -51,6 +51,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/options.h"
 #include "callweaver/utils.h"
 #include "callweaver/lock.h"
+#include "callweaver/linkedlists.h"
 #include "callweaver/indications.h"
 
 #define MAX_OTHER_FORMATS 10
@@ -298,6 +299,64 @@ int cw_app_messagecount(const char *mailbox, int *newmsgs, int *oldmsgs)
 	return 0;
 }
 
+/* mwi_cb: A message waiting watcher (callback) */
+struct mwi_cb {
+	void *data;
+	cw_mwi_cb_type callback;
+	CW_LIST_ENTRY(mwi_cb) list;
+};
+
+static CW_LIST_HEAD_STATIC(mwi_cbs, mwi_cb);
+
+int cw_mwi_add(cw_mwi_cb_type callback, void *data)
+{
+	struct mwi_cb *mwicb;
+
+	if (!callback)
+		return -1;
+
+	if ((mwicb = calloc(1, sizeof(*mwicb))) == NULL)
+		return -1;
+
+	mwicb->data = data;
+	mwicb->callback = callback;
+
+	CW_LIST_LOCK(&mwi_cbs);
+	CW_LIST_INSERT_HEAD(&mwi_cbs, mwicb, list);
+	CW_LIST_UNLOCK(&mwi_cbs);
+
+	return 0;
+}
+
+void cw_mwi_del(cw_mwi_cb_type callback, void *data)
+{
+	struct mwi_cb *mwicb;
+
+	CW_LIST_LOCK(&mwi_cbs);
+	CW_LIST_TRAVERSE_SAFE_BEGIN(&mwi_cbs, mwicb, list) {
+		if ((mwicb->callback == callback) && (mwicb->data == data)) {
+			CW_LIST_REMOVE_CURRENT(&mwi_cbs, list);
+			free(mwicb);
+			break;
+		}
+	}
+	CW_LIST_TRAVERSE_SAFE_END;
+	CW_LIST_UNLOCK(&mwi_cbs);
+}
+
+void cw_mwi_changed(const char *mailbox, int newmsgs, int oldmsgs)
+{
+	struct mwi_cb *mwicb;
+
+	if (option_debug > 2)
+		cw_log(LOG_DEBUG, "Message counts for %s changed - %d new, %d old\n", mailbox, newmsgs, oldmsgs);
+
+	CW_LIST_LOCK(&mwi_cbs);
+	CW_LIST_TRAVERSE(&mwi_cbs, mwicb, list)
+		mwicb->callback(mailbox, newmsgs, oldmsgs, mwicb->data);
+	CW_LIST_UNLOCK(&mwi_cbs);
+}
+
 int cw_dtmf_stream(struct cw_channel *chan,struct cw_channel *peer,char *digits,int between) 
 {
 	char *ptr;
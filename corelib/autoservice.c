@@ -29,6 +29,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
+#include <sys/epoll.h>
 #include <signal.h>
 #include <errno.h>
 #include <unistd.h>
@@ -53,119 +54,377 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/lock.h"
 #include "callweaver/utils.h"
 
-#define MAX_AUTOMONS 256
+/* Channels are spread across this many service threads, each waiting on
+   its own epoll set, so there is no limit on how many can be serviced */
+#define AUTOSERVICE_THREADS	4
+#define AUTOSERVICE_HASH	256
+/* Most ready descriptors handled per wakeup */
+#define AUTOSERVICE_EVENTS	64
+/* How often (ms) to catch up with changed descriptors, masquerades and
+   hangup timeouts, which don't show up as descriptor activity */
+#define AUTOSERVICE_SWEEP	1000
 
-CW_MUTEX_DEFINE_STATIC(autolock);
+struct asent;
+
+/* One registered descriptor of a serviced channel */
+struct asfd {
+	struct asent *as;
+	int fd;				/* as registered with epoll, or -1 */
+	struct asfd *fnext;		/* shard's descriptor hash chain */
+};
 
 struct asent {
 	struct cw_channel *chan;
+	struct asshard *shard;
+	struct asfd fd[CW_MAX_FDS];
+	int busy;			/* being read by the service thread */
+	int removed;			/* stopped, waiting to be freed */
+	int parked;			/* hung up, so not being watched */
+	struct asent *hnext;		/* hash chain */
+	struct asent *prev;		/* shard list */
 	struct asent *next;
+	struct asent *kick;		/* sweep list */
+};
+
+struct asshard {
+	cw_mutex_t lock;
+	cw_cond_t idle;			/* signalled when a removed entry stops being busy */
+	int epfd;
+	pthread_t thread;
+	int count;
+	struct asent *list;
+	/* Which channel each registered descriptor belongs to. A channel can
+	   close a descriptor and another open the same number before the
+	   first is synced, so registrations are only dropped by their owner */
+	struct asfd *fdhash[AUTOSERVICE_HASH];
+	/* Stopped entries, freed once the thread is done with the batch of
+	   events which might still refer to them */
+	struct asent *graveyard;
 };
 
-static struct asent *aslist = NULL;
-static pthread_t asthread = CW_PTHREADT_NULL;
+CW_MUTEX_DEFINE_STATIC(autolock);
+
+static struct asent *ashash[AUTOSERVICE_HASH];
+static struct asshard shards[AUTOSERVICE_THREADS];
+static int shards_ready = 0;
 
-static void *autoservice_run(void *ign)
+static inline unsigned int as_hash(struct cw_channel *chan)
 {
-	struct cw_channel *mons[MAX_AUTOMONS];
-	int x;
-	int ms;
-	struct cw_channel *chan;
-	struct asent *as;
-	struct cw_frame *f;
-	for(;;) {
-		x = 0;
-		cw_mutex_lock(&autolock);
-		as = aslist;
-		while(as) {
-			if (!as->chan->_softhangup) {
-				if (x < MAX_AUTOMONS)
-					mons[x++] = as->chan;
-				else
-					cw_log(LOG_WARNING, "Exceeded maximum number of automatic monitoring events.  Fix autoservice.c\n");
+	return (unsigned int) (((unsigned long) chan) >> 4) % AUTOSERVICE_HASH;
+}
+
+static struct asfd **as_fd_slot(struct asshard *sh, struct asfd *afd)
+{
+	struct asfd **p;
+
+	for (p = &sh->fdhash[afd->fd % AUTOSERVICE_HASH]; *p; p = &(*p)->fnext) {
+		if (*p == afd)
+			break;
+	}
+	return p;
+}
+
+static void as_fd_unhash(struct asshard *sh, struct asfd *afd)
+{
+	struct asfd **p;
+
+	if (*(p = as_fd_slot(sh, afd)))
+		*p = afd->fnext;
+	afd->fd = -1;
+}
+
+/* Register fd for afd, taking it over from any channel which closed it
+   without being synced since. Called with the shard lock held */
+static void as_fd_add(struct asshard *sh, struct asfd *afd, int fd)
+{
+	struct epoll_event ev;
+	struct asfd *old;
+
+	for (old = sh->fdhash[fd % AUTOSERVICE_HASH]; old; old = old->fnext) {
+		if (old->fd == fd)
+			break;
+	}
+	if (old) {
+		/* The kernel dropped the registration when the old channel
+		   closed it, unless the number is shared, so this may fail */
+		as_fd_unhash(sh, old);
+		epoll_ctl(sh->epfd, EPOLL_CTL_DEL, fd, NULL);
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLPRI;
+	ev.data.ptr = afd;
+	if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, fd, &ev)
+		&& (errno != EEXIST || epoll_ctl(sh->epfd, EPOLL_CTL_MOD, fd, &ev)))
+		return;
+	afd->fd = fd;
+	afd->fnext = sh->fdhash[fd % AUTOSERVICE_HASH];
+	sh->fdhash[fd % AUTOSERVICE_HASH] = afd;
+}
+
+/* Make the descriptors registered with epoll match the channel's.
+   A channel which closes a descriptor and opens another with the same
+   number looks unchanged, but the kernel dropped the registration on
+   close, so the sweep passes recheck to register any such again.
+   Called with the shard lock held */
+static void as_sync(struct asshard *sh, struct asent *as, int recheck)
+{
+	struct epoll_event ev;
+	struct asfd *afd;
+	int want;
+	int y;
+
+	for (y = 0; y < CW_MAX_FDS; y++) {
+		afd = &as->fd[y];
+		want = (as->parked || as->removed) ? -1 : as->chan->fds[y];
+		if (afd->fd == want) {
+			if (recheck && want > -1) {
+				memset(&ev, 0, sizeof(ev));
+				ev.events = EPOLLIN | EPOLLPRI;
+				ev.data.ptr = afd;
+				/* EEXIST means it is still registered */
+				if (epoll_ctl(sh->epfd, EPOLL_CTL_ADD, want, &ev) && errno != EEXIST)
+					as_fd_unhash(sh, afd);
 			}
-			as = as->next;
+			continue;
 		}
-		cw_mutex_unlock(&autolock);
+		if (afd->fd > -1) {
+			epoll_ctl(sh->epfd, EPOLL_CTL_DEL, afd->fd, NULL);
+			as_fd_unhash(sh, afd);
+		}
+		if (want > -1)
+			as_fd_add(sh, afd, want);
+	}
+}
+
+/* Read and ignore whatever the channel has for us */
+static void as_service(struct asshard *sh, struct asent *as, int index, uint32_t events)
+{
+	struct cw_channel *chan = as->chan;
+	struct cw_frame *f;
+
+	cw_mutex_lock(&sh->lock);
+	if (as->removed) {
+		cw_mutex_unlock(&sh->lock);
+		return;
+	}
+	if (chan->_softhangup && !chan->masq) {
+		/* Leave it alone until it is stopped, or the hangup is cleared */
+		as->parked = 1;
+		as_sync(sh, as, 0);
+		cw_mutex_unlock(&sh->lock);
+		return;
+	}
+	as->busy = 1;
+	cw_mutex_unlock(&sh->lock);
+
+	if (index > -1) {
+		if (events & EPOLLPRI)
+			cw_set_flag(chan, CW_FLAG_EXCEPTION);
+		else
+			cw_clear_flag(chan, CW_FLAG_EXCEPTION);
+		chan->fdno = index;
+	}
+	if ((f = cw_read(chan)))
+		cw_fr_free(f);
 
-/* 		if (!aslist)
-			break; */
-		ms = 500;
-		chan = cw_waitfor_n(mons, x, &ms);
-		if (chan) {
-			/* Read and ignore anything that occurs */
-			f = cw_read(chan);
-			if (f)
-				cw_fr_free(f);
+	cw_mutex_lock(&sh->lock);
+	as->busy = 0;
+	if (as->removed) {
+		cw_cond_broadcast(&sh->idle);
+	} else {
+		as->parked = (chan->_softhangup) ? 1 : 0;
+		as_sync(sh, as, 0);
+	}
+	cw_mutex_unlock(&sh->lock);
+}
+
+static void as_sweep(struct asshard *sh)
+{
+	struct asent *kick = NULL;
+	struct asent *as;
+	struct cw_channel *chan;
+	time_t now;
+
+	time(&now);
+	cw_mutex_lock(&sh->lock);
+	for (as = sh->list; as; as = as->next) {
+		chan = as->chan;
+		if (chan->whentohangup && now > chan->whentohangup)
+			chan->_softhangup |= CW_SOFTHANGUP_TIMEOUT;
+		if (chan->masq) {
+			/* A read performs the masquerade */
+			as->kick = kick;
+			kick = as;
+			continue;
+		}
+		as->parked = (chan->_softhangup) ? 1 : 0;
+		as_sync(sh, as, 1);
+	}
+	cw_mutex_unlock(&sh->lock);
+	while ((as = kick)) {
+		kick = as->kick;
+		as_service(sh, as, -1, 0);
+	}
+}
+
+static void *autoservice_run(void *data)
+{
+	struct asshard *sh = data;
+	struct epoll_event ev[AUTOSERVICE_EVENTS];
+	struct asfd *afd;
+	struct asent *dead;
+	struct asent *as;
+	struct timeval sweep;
+	int ms;
+	int n;
+	int i;
+
+	sweep = cw_tvadd(cw_tvnow(), cw_samp2tv(AUTOSERVICE_SWEEP, 1000));
+	for (;;) {
+		ms = cw_tvdiff_ms(sweep, cw_tvnow());
+		n = epoll_wait(sh->epfd, ev, AUTOSERVICE_EVENTS, (ms > 0) ? ms : 0);
+		/* Service every channel which is ready, not just the first */
+		for (i = 0; i < n; i++) {
+			afd = ev[i].data.ptr;
+			as_service(sh, afd->as, (int) (afd - afd->as->fd), ev[i].events);
+		}
+		if (cw_tvdiff_ms(cw_tvnow(), sweep) >= 0) {
+			as_sweep(sh);
+			sweep = cw_tvadd(cw_tvnow(), cw_samp2tv(AUTOSERVICE_SWEEP, 1000));
+		}
+		cw_mutex_lock(&sh->lock);
+		dead = sh->graveyard;
+		sh->graveyard = NULL;
+		cw_mutex_unlock(&sh->lock);
+		while ((as = dead)) {
+			dead = as->next;
+			free(as);
 		}
 	}
-	asthread = CW_PTHREADT_NULL;
 	return NULL;
 }
 
+/* Called with autolock held */
+static int shards_init(void)
+{
+	int i;
+
+	for (i = 0; i < AUTOSERVICE_THREADS; i++) {
+		cw_mutex_init(&shards[i].lock);
+		cw_cond_init(&shards[i].idle, NULL);
+		shards[i].thread = CW_PTHREADT_NULL;
+		if ((shards[i].epfd = epoll_create(AUTOSERVICE_EVENTS)) < 0) {
+			cw_log(LOG_WARNING, "Unable to create autoservice epoll set: %s\n", strerror(errno));
+			while (i-- > 0)
+				close(shards[i].epfd);
+			return -1;
+		}
+	}
+	shards_ready = 1;
+	return 0;
+}
+
 int cw_autoservice_start(struct cw_channel *chan)
 {
-	int res = -1;
+	struct asshard *sh;
 	struct asent *as;
-	int needstart;
+	pthread_attr_t attr;
+	unsigned int h;
+	int i;
+	int y;
+
+	h = as_hash(chan);
 	cw_mutex_lock(&autolock);
-	needstart = (asthread == CW_PTHREADT_NULL) ? 1 : 0 /* aslist ? 0 : 1 */;
-	as = aslist;
-	while(as) {
-		if (as->chan == chan)
-			break;
-		as = as->next;
-	}
-	if (!as) {
-		as = malloc(sizeof(struct asent));
-		if (as) {
-			memset(as, 0, sizeof(struct asent));
-			as->chan = chan;
-			as->next = aslist;
-			aslist = as;
-			res = 0;
-			if (needstart) {
-				if (cw_pthread_create(&asthread, NULL, autoservice_run, NULL)) {
-					cw_log(LOG_WARNING, "Unable to create autoservice thread :(\n");
-					free(aslist);
-					aslist = NULL;
-					res = -1;
-				} else
-					pthread_kill(asthread, SIGURG);
-			}
+	for (as = ashash[h]; as; as = as->hnext) {
+		if (as->chan == chan) {
+			cw_mutex_unlock(&autolock);
+			return -1;
+		}
+	}
+	if (!shards_ready && shards_init()) {
+		cw_mutex_unlock(&autolock);
+		return -1;
+	}
+
+	/* Put it with the fewest other channels */
+	sh = &shards[0];
+	for (i = 1; i < AUTOSERVICE_THREADS; i++) {
+		if (shards[i].count < sh->count)
+			sh = &shards[i];
+	}
+	if (sh->thread == CW_PTHREADT_NULL) {
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (cw_pthread_create(&sh->thread, &attr, autoservice_run, sh)) {
+			cw_log(LOG_WARNING, "Unable to create autoservice thread :(\n");
+			sh->thread = CW_PTHREADT_NULL;
+			cw_mutex_unlock(&autolock);
+			return -1;
 		}
 	}
+
+	if ((as = malloc(sizeof(*as))) == NULL) {
+		cw_mutex_unlock(&autolock);
+		return -1;
+	}
+	memset(as, 0, sizeof(*as));
+	as->chan = chan;
+	as->shard = sh;
+	for (y = 0; y < CW_MAX_FDS; y++) {
+		as->fd[y].as = as;
+		as->fd[y].fd = -1;
+	}
+	as->hnext = ashash[h];
+	ashash[h] = as;
+
+	cw_mutex_lock(&sh->lock);
+	if ((as->next = sh->list))
+		as->next->prev = as;
+	sh->list = as;
+	sh->count++;
+	as->parked = (chan->_softhangup) ? 1 : 0;
+	as_sync(sh, as, 0);
+	cw_mutex_unlock(&sh->lock);
+
 	cw_mutex_unlock(&autolock);
-	return res;
+	return 0;
 }
 
 int cw_autoservice_stop(struct cw_channel *chan)
 {
-	int res = -1;
-	struct asent *as, *prev;
+	struct asshard *sh;
+	struct asent **pas;
+	struct asent *as;
+
 	cw_mutex_lock(&autolock);
-	as = aslist;
-	prev = NULL;
-	while(as) {
+	for (pas = &ashash[as_hash(chan)]; (as = *pas); pas = &as->hnext) {
 		if (as->chan == chan)
 			break;
-		prev = as;
-		as = as->next;
-	}
-	if (as) {
-		if (prev)
-			prev->next = as->next;
-		else
-			aslist = as->next;
-		free(as);
-		if (!chan->_softhangup)
-			res = 0;
 	}
-	if (asthread != CW_PTHREADT_NULL) 
-		pthread_kill(asthread, SIGURG);
+	if (as)
+		*pas = as->hnext;
 	cw_mutex_unlock(&autolock);
-	/* Wait for it to un-block */
-	while(cw_test_flag(chan, CW_FLAG_BLOCKING))
-		usleep(1000);
-	return res;
+	if (!as)
+		return -1;
+
+	sh = as->shard;
+	cw_mutex_lock(&sh->lock);
+	if (as->prev)
+		as->prev->next = as->next;
+	else
+		sh->list = as->next;
+	if (as->next)
+		as->next->prev = as->prev;
+	sh->count--;
+	as->removed = 1;
+	as_sync(sh, as, 0);
+	/* Don't hand the channel back while we are still reading from it */
+	while (as->busy)
+		cw_cond_wait(&sh->idle, &sh->lock);
+	as->next = sh->graveyard;
+	sh->graveyard = as;
+	cw_mutex_unlock(&sh->lock);
+
+	return (chan->_softhangup) ? -1 : 0;
 }
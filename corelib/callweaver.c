@@ -69,6 +69,9 @@
 #include <errno.h>
 #include <ctype.h>
 #include <sys/resource.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <stdint.h>
 #include <grp.h>
 #include <pwd.h>
 #include <sys/stat.h>
@@ -97,6 +100,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/channel.h"
 #include "callweaver/ulaw.h"
 #include "callweaver/alaw.h"
+#include "callweaver/pcm.h"
 #include "callweaver/phone_no_utils.h"
 #include "callweaver/module.h"
 #include "callweaver/image.h"
@@ -118,6 +122,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/config.h"
 #include "callweaver/linkedlists.h"
 #include "callweaver/devicestate.h"
+#include "callweaver/generic_jb.h"
 
 #include <readline/readline.h>
 #include <readline/history.h>
@@ -154,12 +159,14 @@ int option_timestamp = 0;
 int option_overrideconfig = 0;
 int option_reconnect = 0;
 int option_transcode_slin = 1;
+int option_transcode_prompts = 0;
 int option_maxcalls = 0;
 double option_maxload = 0.0;
 int option_dontwarn = 0;
 int option_priority_jumping = 1;
 int fully_booted = 0;
 char record_cache_dir[CW_CACHE_DIR_LEN] = cwtmpdir_default;
+char transcoded_prompt_dir[CW_CACHE_DIR_LEN] = cwtmpdir_default "/prompts";
 char debug_filename[CW_FILENAME_MAX] = "";
 
 static int cw_socket = -1;		/*!< UNIX Socket for allowing remote control */
@@ -439,14 +446,178 @@ static void null_sig_handler(int signal)
 
 }
 
+#if defined(__linux__)  &&  defined(SYS_getdents64)
+struct spawn_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[1];
+};
+#endif
+
+/*! Close every descriptor from lowfd up. This runs in the vfork()ed child
+ * of cw_spawn(), so it makes plain system calls only. close_range() does
+ * it in one go. On kernels without it only the descriptors listed in
+ * /proc/self/fd are closed, and only if that is missing is every possible
+ * descriptor up to the limit tried in turn.
+ */
+static void spawn_close_from(int lowfd)
+{
+#if defined(__linux__)  &&  defined(SYS_getdents64)
+    struct spawn_dirent64 *d;
+    char buf[1024];
+    const char *s;
+    int dirfd;
+    int closed;
+    int pos;
+    int len;
+#endif
+    struct rlimit rl;
+    int maxfd;
+    int fd;
+
+#if defined(SYS_close_range)
+    if (syscall(SYS_close_range, (unsigned int) lowfd, ~0U, 0) == 0)
+        return;
+#endif
+#if defined(__linux__)  &&  defined(SYS_getdents64)
+    if ((dirfd = open("/proc/self/fd", O_RDONLY | O_DIRECTORY)) >= 0)
+    {
+        do
+        {
+            /* Closing descriptors while reading the listing may make it
+               skip some, so go over it again until nothing is left */
+            closed = 0;
+            while ((len = syscall(SYS_getdents64, dirfd, buf, sizeof(buf))) > 0)
+            {
+                for (pos = 0;  pos < len;  pos += d->d_reclen)
+                {
+                    d = (struct spawn_dirent64 *) (buf + pos);
+                    fd = 0;
+                    for (s = d->d_name;  *s >= '0'  &&  *s <= '9';  s++)
+                        fd = fd*10 + *s - '0';
+                    if (*s  ||  s == d->d_name  ||  fd < lowfd  ||  fd == dirfd)
+                        continue;
+                    close(fd);
+                    closed = 1;
+                }
+            }
+            if (closed)
+                lseek(dirfd, 0, SEEK_SET);
+        }
+        while (closed);
+        close(dirfd);
+        return;
+    }
+#endif
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0  &&  rl.rlim_cur != RLIM_INFINITY)
+        maxfd = rl.rlim_cur;
+    else
+        maxfd = 65536;
+    for (fd = lowfd;  fd < maxfd;  fd++)
+        close(fd);
+}
+
+/*! Start a program without duplicating our address space.
+ *
+ * fork() has to copy the page tables of the whole process, which with a
+ * large resident set and many threads stalls the caller for milliseconds.
+ * vfork() shares the parent's memory until the child calls exec, so the
+ * child below only makes async-signal-safe calls and never touches the
+ * heap. All signals are blocked around vfork() so none of our handlers
+ * can run in the child on the shared stack.
+ */
+pid_t cw_spawn(const char *path, char *const argv[], const int *fds, int nfds, const char *dir)
+{
+    volatile int exec_errno = 0;
+    int moved[CW_SPAWN_MAX_FDS];
+    struct sched_param sched;
+    sigset_t all;
+    sigset_t old;
+    pid_t pid;
+    int x;
+
+    if (nfds > CW_SPAWN_MAX_FDS)
+    {
+        cw_log(LOG_WARNING, "Too many descriptors for '%s'\n", path);
+        return -1;
+    }
+    memset(&sched, 0, sizeof(sched));
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+
+    pid = vfork();
+    if (pid == 0)
+    {
+        /* Move the descriptors we keep out of the way first, so mapping
+           one of them never clobbers another that is still to be mapped */
+        for (x = 0;  x < nfds;  x++)
+        {
+            moved[x] = -1;
+            if (fds[x] > -1  &&  (moved[x] = fcntl(fds[x], F_DUPFD, nfds)) < 0)
+            {
+                exec_errno = errno;
+                _exit(127);
+            }
+        }
+        for (x = 0;  x < nfds;  x++)
+        {
+            if (moved[x] > -1)
+                dup2(moved[x], x);
+            else
+                close(x);
+        }
+        spawn_close_from(nfds);
+
+        for (x = 1;  x < NSIG;  x++)
+            signal(x, SIG_DFL);
+        sigemptyset(&all);
+        sigprocmask(SIG_SETMASK, &all, NULL);
+
+        /* Don't run children with realtime priority -- it causes audio stutter */
+#ifdef __linux__
+        if (option_highpriority)
+            sched_setscheduler(0, SCHED_OTHER, &sched);
+#else
+        if (option_highpriority)
+            setpriority(PRIO_PROCESS, 0, 0);
+#endif
+        if (dir)
+            chdir(dir);
+        execv(path, argv);
+        exec_errno = errno;
+        _exit(127);
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (pid < 0)
+    {
+        cw_log(LOG_WARNING, "vfork failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (exec_errno)
+    {
+        /* The child has already exited; reap it so it doesn't linger */
+        waitpid(pid, NULL, 0);
+        cw_log(LOG_WARNING, "Unable to execute '%s': %s\n", path, strerror(exec_errno));
+        errno = exec_errno;
+        return -1;
+    }
+    return pid;
+}
+
 CW_MUTEX_DEFINE_STATIC(safe_system_lock);
 static unsigned int safe_system_level = 0;
 static void *safe_system_prev_handler;
 
 int cw_safe_system(const char *s)
 {
+    static const int fds[3] = { STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO };
+    char *argv[4];
     pid_t pid;
-    int x;
     int res;
     struct rusage rusage;
     int status;
@@ -464,17 +635,13 @@ int cw_safe_system(const char *s)
 
     cw_mutex_unlock(&safe_system_lock);
 
-    pid = fork();
+    argv[0] = "/bin/sh";
+    argv[1] = "-c";
+    argv[2] = (char *) s;
+    argv[3] = NULL;
+    pid = cw_spawn(argv[0], argv, fds, 3, NULL);
 
-    if (pid == 0)
-    {
-        /* Close file descriptors and launch system command */
-        for (x = STDERR_FILENO + 1; x < 4096; x++)
-            close(x);
-        execl("/bin/sh", "/bin/sh", "-c", s, NULL);
-        exit(1);
-    }
-    else if (pid > 0)
+    if (pid > 0)
     {
         for (;;)
         {
@@ -490,7 +657,6 @@ int cw_safe_system(const char *s)
     }
     else
     {
-        cw_log(LOG_WARNING, "Fork failed: %s\n", strerror(errno));
         res = -1;
     }
 
@@ -506,6 +672,100 @@ int cw_safe_system(const char *s)
     return res;
 }
 
+static char spawn_benchmark_help[] =
+"Usage: spawn benchmark [<count> [<MB>]]\n"
+"       Starts /bin/true <count> times (default 100) with cw_spawn() and with\n"
+"a plain fork(), and shows how long the calling thread was held up each\n"
+"way. <MB> megabytes of memory are touched first, to see how a larger\n"
+"resident set changes things.\n";
+
+static int handle_spawn_benchmark(int fd, int argc, char *argv[])
+{
+    static const int fds[3] = { -1, -1, -1 };
+    char *args[] = { "/bin/true", NULL };
+    struct rusage ru;
+    struct timeval start;
+    struct timeval held;
+    char *ballast;
+    long us;
+    long min;
+    long max;
+    long total;
+    pid_t pid;
+    int count;
+    int mb;
+    int way;
+    int i;
+
+    if (argc > 4)
+        return RESULT_SHOWUSAGE;
+    count = (argc > 2)  ?  atoi(argv[2])  :  100;
+    mb = (argc > 3)  ?  atoi(argv[3])  :  0;
+    if (count < 1  ||  count > 100000  ||  mb < 0  ||  mb > 65536)
+        return RESULT_SHOWUSAGE;
+    ballast = NULL;
+    if (mb  &&  (ballast = malloc((size_t) mb << 20)) == NULL)
+    {
+        cw_cli(fd, "Unable to allocate %d MB\n", mb);
+        return RESULT_SUCCESS;
+    }
+    if (ballast)
+        memset(ballast, 1, (size_t) mb << 20);
+
+    /* Reap the children here, not in child_handler */
+    cw_mutex_lock(&safe_system_lock);
+    if (safe_system_level++ == 0)
+        safe_system_prev_handler = signal(SIGCHLD, null_sig_handler);
+    cw_mutex_unlock(&safe_system_lock);
+
+    getrusage(RUSAGE_SELF, &ru);
+    cw_cli(fd, "Peak resident set %ld MB, %d spawns each way\n", ru.ru_maxrss/1024, count);
+    cw_cli(fd, "%-10s %10s %10s %10s\n", "Method", "Min us", "Avg us", "Max us");
+    for (way = 0;  way < 2;  way++)
+    {
+        min = LONG_MAX;
+        max = 0;
+        total = 0;
+        for (i = 0;  i < count;  i++)
+        {
+            start = cw_tvnow();
+            if (way == 0)
+            {
+                pid = cw_spawn(args[0], args, fds, 3, NULL);
+            }
+            else if ((pid = fork()) == 0)
+            {
+                execv(args[0], args);
+                _exit(127);
+            }
+            held = cw_tvsub(cw_tvnow(), start);
+            if (pid < 0)
+            {
+                cw_cli(fd, "Unable to start %s: %s\n", args[0], strerror(errno));
+                break;
+            }
+            while (waitpid(pid, NULL, 0) < 0  &&  errno == EINTR)
+                ;
+            us = held.tv_sec*1000000L + held.tv_usec;
+            if (us < min)
+                min = us;
+            if (us > max)
+                max = us;
+            total += us;
+        }
+        if (i > 0)
+            cw_cli(fd, "%-10s %10ld %10ld %10ld\n", (way == 0)  ?  "cw_spawn"  :  "fork", min, total/i, max);
+    }
+
+    cw_mutex_lock(&safe_system_lock);
+    if (--safe_system_level == 0)
+        signal(SIGCHLD, safe_system_prev_handler);
+    cw_mutex_unlock(&safe_system_lock);
+
+    free(ballast);
+    return RESULT_SUCCESS;
+}
+
 /*!
  * write the string to all attached console clients
  */
@@ -1289,6 +1549,9 @@ static struct cw_cli_entry core_cli[] =
     { { "!", NULL }, handle_bang,
         "Execute a shell command", bang_help
     },
+    { { "spawn", "benchmark", NULL }, handle_spawn_benchmark,
+        "Measure program start latency", spawn_benchmark_help
+    },
 #if !defined(LOW_MEMORY)
     {
         { "show", "version", "files", NULL
@@ -2118,6 +2381,18 @@ static void cw_readconfig(void)
         {
             option_transcode_slin = cw_true(v->value);
         }
+        else if (!strcasecmp(v->name, "transcode_prompts"))
+        {
+            /* Keep copies of prompts in the codecs channels ask for */
+            if (!strcasecmp(v->value, "persist"))
+                option_transcode_prompts = CW_TRANSCODE_PROMPTS_PERSIST;
+            else
+                option_transcode_prompts = cw_true(v->value)  ?  CW_TRANSCODE_PROMPTS_CACHE  :  0;
+        }
+        else if (!strcasecmp(v->name, "transcoded_prompt_dir"))
+        {
+            cw_copy_string(transcoded_prompt_dir, v->value, CW_CACHE_DIR_LEN);
+        }
         else if (!strcasecmp(v->name, "maxcalls"))
         {
             if ((sscanf(v->value, "%d", &option_maxcalls) != 1) || (option_maxcalls < 0))
@@ -2200,6 +2475,7 @@ int callweaver_main(int argc, char *argv[])
     cw_mainpid = getpid();
     cw_ulaw_init();
     cw_alaw_init();
+    cw_pcm_init();
     cw_utils_init();
     /* When CallWeaver restarts after it has dropped the root privileges,
      * it can't issue setuid(), setgid(), setgroups() or set_priority()
@@ -2648,6 +2924,7 @@ int callweaver_main(int argc, char *argv[])
     {
         cw_exit(1);
     }
+    cw_jb_init();
     if (load_modules(0))
     {
         cw_exit(1);
@@ -1372,6 +1372,7 @@ static yyconst yy_state_type yy_NUL_trans[54] =
 #include <limits.h>
 
 #include "callweaver/callweaver_expr.h"
+#include "callweaver/lock.h"
 #include "callweaver/logger.h"
 #include "callweaver/strings.h"
 
@@ -3100,7 +3101,111 @@ void cw_yyfree (void * ptr , yyscan_t yyscanner)
 int cw_yyparse(void *); /* need to/should define this prototype for the call to yyparse */
 int cw_yyerror(const char *, YYLTYPE *, struct parse_io *); /* likewise */
 
+/* Results of recent expressions, keyed by their text after variable
+   substitution.  An expression's value depends on nothing but its text,
+   so loops evaluating the same condition over and over only run the
+   scanner and parser once.  Expressions that fail to parse are never
+   cached, so their errors are still logged every time.
+
+   Every channel thread evaluates through here, so the cache takes no
+   lock.  Each slot has a sequence number that is odd while the slot is
+   being written.  Readers retry nothing: a slot that changed under them
+   is just a miss.  A writer that finds the slot already being written
+   leaves it alone. */
+#define EXPR_CACHE_SIZE		1024	/* Must be a power of 2 */
+#define EXPR_CACHE_MAX_LEN	128	/* Longer expressions or results are not cached */
+
+struct expr_cache_entry {
+	volatile int seq;
+	unsigned int hash;
+	int len;
+	char expr[EXPR_CACHE_MAX_LEN];
+	char result[EXPR_CACHE_MAX_LEN];
+};
+
+static struct expr_cache_entry expr_cache[EXPR_CACHE_SIZE];
+/* Counted per slot, so threads only share counters when they share an expression */
+static volatile int expr_cache_hits[EXPR_CACHE_SIZE];
+static volatile int expr_cache_misses[EXPR_CACHE_SIZE];
+
+static unsigned int expr_hash(const char *s)
+{
+	unsigned int h = 0;
+
+	while (*s)
+		h = h*33 + (unsigned char) *s++;
+	return h;
+}
+
+static int expr_parse(char *expr, char *buf, int length, int *parsed);
+
 int cw_expr(char *expr, char *buf, int length)
+{
+	struct expr_cache_entry *ent;
+	unsigned int hash;
+	unsigned int slot;
+	int parsed;
+	int seq;
+	int res;
+
+	if (strlen(expr) >= EXPR_CACHE_MAX_LEN)
+		return expr_parse(expr, buf, length, &parsed);
+
+	hash = expr_hash(expr);
+	slot = hash & (EXPR_CACHE_SIZE - 1);
+	ent = &expr_cache[slot];
+	seq = ent->seq;
+	cw_memory_barrier();
+	/* The last byte of expr is only ever zero, so strcmp stops even on a
+	   slot torn by a writer; the sequence check then rejects it */
+	if (!(seq & 1)  &&  ent->expr[0]  &&  ent->hash == hash
+		&&  (res = ent->len) < length  &&  res < EXPR_CACHE_MAX_LEN  &&  !strcmp(ent->expr, expr)) {
+		memcpy(buf, ent->result, res);
+		buf[res] = '\0';
+		cw_memory_barrier();
+		if (ent->seq == seq) {
+			cw_atomic_fetchadd_int(&expr_cache_hits[slot], 1);
+			return res;
+		}
+	}
+	cw_atomic_fetchadd_int(&expr_cache_misses[slot], 1);
+
+	res = expr_parse(expr, buf, length, &parsed);
+	seq = ent->seq;
+	if (parsed  &&  res < length  &&  res < EXPR_CACHE_MAX_LEN
+		&&  !(seq & 1)  &&  cw_atomic_cmpxchg_int(&ent->seq, seq, seq + 1)) {
+		ent->hash = hash;
+		ent->len = res;
+		strcpy(ent->expr, expr);
+		memcpy(ent->result, buf, res);
+		ent->result[res] = '\0';
+		cw_memory_barrier();
+		ent->seq = seq + 2;
+	}
+	return res;
+}
+
+/* Evaluate without looking at the cache */
+int cw_expr_uncached(char *expr, char *buf, int length)
+{
+	int parsed;
+
+	return expr_parse(expr, buf, length, &parsed);
+}
+
+void cw_expr_cache_stats(unsigned int *hits, unsigned int *misses)
+{
+	int x;
+
+	*hits = 0;
+	*misses = 0;
+	for (x = 0;  x < EXPR_CACHE_SIZE;  x++) {
+		*hits += expr_cache_hits[x];
+		*misses += expr_cache_misses[x];
+	}
+}
+
+static int expr_parse(char *expr, char *buf, int length, int *parsed)
 {
 	struct parse_io io;
 	int return_value = 0;
@@ -3116,6 +3221,7 @@ int cw_expr(char *expr, char *buf, int length)
 
 	cw_yylex_destroy(io.scanner);
 
+	*parsed = (io.val != NULL);
 	if (!io.val) {
 		if (length > 1) {
 			strcpy(buf, "0");
@@ -59,6 +59,7 @@ struct cw_cdr_beitem {
 	char name[20];
 	char desc[80];
 	cw_cdrbe be;
+	cw_cdrbe_batch be_batch;
 	CW_LIST_ENTRY(cw_cdr_beitem) list;
 };
 
@@ -83,6 +84,10 @@ static pthread_t cdr_thread = CW_PTHREADT_NULL;
 #define BATCH_TIME_DEFAULT 300
 #define BATCH_SCHEDULER_ONLY_DEFAULT 0
 #define BATCH_SAFE_SHUTDOWN_DEFAULT 1
+#define BATCH_MAX_PENDING_DEFAULT 10000
+
+/* Most records handed to a batch backend in one call */
+#define BATCH_POST_MAX 1000
 
 static int enabled;
 static int batchmode;
@@ -90,12 +95,26 @@ static int batchsize;
 static int batchtime;
 static int batchscheduleronly;
 static int batchsafeshutdown;
+static int batchmaxpending;
 
 CW_MUTEX_DEFINE_STATIC(cdr_batch_lock);
 
 /* these are used to wake up the CDR thread when there's work to do */
 CW_MUTEX_DEFINE_STATIC(cdr_pending_lock);
 
+/* Batches waiting for the CDR posting thread.  Submitting a batch only
+   queues it here; the one long-lived posting thread hands the records to
+   the backends.  When more than batchmaxpending records are queued, callers
+   of cw_cdr_detach() wait for the posting thread to catch up. */
+CW_MUTEX_DEFINE_STATIC(cdr_post_lock);
+static cw_cond_t cdr_post_cond;
+static cw_cond_t cdr_post_done;
+static struct cw_cdr_batch_item *post_head = NULL;
+static struct cw_cdr_batch_item *post_tail = NULL;
+static int post_pending;
+static int post_busy;
+static int post_stop;
+
 /*
  * We do a lot of checking here in the CDR code to try to be sure we don't ever let a CDR slip
  * through our fingers somehow.  If someone allocates a CDR, it must be completely handled normally
@@ -104,6 +123,11 @@ CW_MUTEX_DEFINE_STATIC(cdr_pending_lock);
  */
 
 int cw_cdr_register(char *name, char *desc, cw_cdrbe be)
+{
+	return cw_cdr_register_batch(name, desc, be, NULL);
+}
+
+int cw_cdr_register_batch(char *name, char *desc, cw_cdrbe be, cw_cdrbe_batch be_batch)
 {
 	struct cw_cdr_beitem *i;
 
@@ -132,6 +156,7 @@ int cw_cdr_register(char *name, char *desc, cw_cdrbe be)
 
 	memset(i, 0, sizeof(*i));
 	i->be = be;
+	i->be_batch = be_batch;
 	cw_copy_string(i->name, name, sizeof(i->name));
 	cw_copy_string(i->desc, desc, sizeof(i->desc));
 
@@ -792,20 +817,26 @@ int cw_cdr_amaflags2int(const char *flag)
 	return -1;
 }
 
-static void post_cdr(struct cw_cdr *cdr)
+static void check_post(struct cw_cdr *cdr)
 {
 	char *chan;
+
+	chan = !cw_strlen_zero(cdr->channel) ? cdr->channel : "<unknown>";
+	if (cw_test_flag(cdr, CW_CDR_FLAG_POSTED))
+		cw_log(LOG_WARNING, "CDR on channel '%s' already posted\n", chan);
+	if (cw_tvzero(cdr->end))
+		cw_log(LOG_WARNING, "CDR on channel '%s' lacks end\n", chan);
+	if (cw_tvzero(cdr->start))
+		cw_log(LOG_WARNING, "CDR on channel '%s' lacks start\n", chan);
+	cw_set_flag(cdr, CW_CDR_FLAG_POSTED);
+}
+
+static void post_cdr(struct cw_cdr *cdr)
+{
 	struct cw_cdr_beitem *i;
 
 	while (cdr) {
-		chan = !cw_strlen_zero(cdr->channel) ? cdr->channel : "<unknown>";
-		if (cw_test_flag(cdr, CW_CDR_FLAG_POSTED))
-			cw_log(LOG_WARNING, "CDR on channel '%s' already posted\n", chan);
-		if (cw_tvzero(cdr->end))
-			cw_log(LOG_WARNING, "CDR on channel '%s' lacks end\n", chan);
-		if (cw_tvzero(cdr->start))
-			cw_log(LOG_WARNING, "CDR on channel '%s' lacks start\n", chan);
-		cw_set_flag(cdr, CW_CDR_FLAG_POSTED);
+		check_post(cdr);
 		CW_LIST_LOCK(&be_list);
 		CW_LIST_TRAVERSE(&be_list, i, list) {
 			i->be(cdr);
@@ -892,56 +923,162 @@ static int init_batch(void)
 	return 0;
 }
 
-static void *do_batch_backend_process(void *data)
+/* Post count records to every backend, in one call for backends that take batches */
+static void post_cdr_batch(struct cw_cdr **cdrs, int count)
+{
+	struct cw_cdr_beitem *i;
+	int x;
+
+	for (x = 0;  x < count;  x++)
+		check_post(cdrs[x]);
+	CW_LIST_LOCK(&be_list);
+	CW_LIST_TRAVERSE(&be_list, i, list) {
+		if (i->be_batch && !i->be_batch(cdrs, count))
+			continue;
+		if (i->be_batch)
+			cw_log(LOG_WARNING, "CDR backend '%s' failed to store a batch, posting records one by one\n", i->name);
+		for (x = 0;  x < count;  x++)
+			i->be(cdrs[x]);
+	}
+	CW_LIST_UNLOCK(&be_list);
+}
+
+static void do_batch_backend_process(struct cw_cdr_batch_item *batchitem)
 {
 	struct cw_cdr_batch_item *processeditem;
-	struct cw_cdr_batch_item *batchitem = data;
+	struct cw_cdr_batch_item *item;
+	struct cw_cdr **cdrs;
+	struct cw_cdr *cdr;
+	int count = 0;
+	int x;
 
-	/* Push each CDR into storage mechanism(s) and free all the memory */
+	for (item = batchitem;  item;  item = item->next) {
+		for (cdr = item->cdr;  cdr;  cdr = cdr->next)
+			count++;
+	}
+	if ((cdrs = malloc(count * sizeof(*cdrs)))) {
+		count = 0;
+		for (item = batchitem;  item;  item = item->next) {
+			for (cdr = item->cdr;  cdr;  cdr = cdr->next)
+				cdrs[count++] = cdr;
+		}
+		for (x = 0;  x < count;  x += BATCH_POST_MAX)
+			post_cdr_batch(cdrs + x, (count - x > BATCH_POST_MAX)  ?  BATCH_POST_MAX  :  count - x);
+		free(cdrs);
+	} else {
+		cw_log(LOG_WARNING, "CDR: out of memory while building a batch, posting records one by one\n");
+		for (item = batchitem;  item;  item = item->next)
+			post_cdr(item->cdr);
+	}
+
+	/* Free all the memory */
 	while (batchitem) {
-		post_cdr(batchitem->cdr);
 		cw_cdr_free(batchitem->cdr);
 		processeditem = batchitem;
 		batchitem = batchitem->next;
 		free(processeditem);
 	}
+}
 
+static void *do_cdr_post(void *data)
+{
+	struct cw_cdr_batch_item *items;
+	int count;
+
+	cw_mutex_lock(&cdr_post_lock);
+	for (;;) {
+		while (!post_head && !post_stop)
+			cw_cond_wait(&cdr_post_cond, &cdr_post_lock);
+		/* Only leave once everything queued has been posted */
+		if (!post_head)
+			break;
+		items = post_head;
+		count = post_pending;
+		post_head = NULL;
+		post_tail = NULL;
+		post_busy = 1;
+		cw_mutex_unlock(&cdr_post_lock);
+
+		if (option_debug)
+			cw_log(LOG_DEBUG, "CDR posting %d records\n", count);
+		do_batch_backend_process(items);
+
+		cw_mutex_lock(&cdr_post_lock);
+		post_pending -= count;
+		post_busy = 0;
+		cw_cond_broadcast(&cdr_post_done);
+	}
+	cw_mutex_unlock(&cdr_post_lock);
 	return NULL;
 }
 
-void cw_cdr_submit_batch(int shutdown)
+static void start_post_thread(void)
 {
-	struct cw_cdr_batch_item *oldbatchitems = NULL;
-	pthread_attr_t attr;
-	pthread_t batch_post_thread = CW_PTHREADT_NULL;
+	post_stop = 0;
+	if (cw_pthread_create(&cdr_thread, NULL, do_cdr_post, NULL)) {
+		cw_log(LOG_WARNING, "Unable to start CDR posting thread, batches will be posted by the scheduler\n");
+		cdr_thread = CW_PTHREADT_NULL;
+	}
+}
 
-	/* if there's no batch, or no CDRs in the batch, then there's nothing to do */
-	if (!batch || !batch->head)
+/* Waits for everything already queued to be posted */
+static void stop_post_thread(void)
+{
+	pthread_t thread = cdr_thread;
+
+	if (thread == CW_PTHREADT_NULL)
 		return;
+	cw_mutex_lock(&cdr_post_lock);
+	post_stop = 1;
+	cw_cond_broadcast(&cdr_post_cond);
+	cw_cond_broadcast(&cdr_post_done);
+	cw_mutex_unlock(&cdr_post_lock);
+	pthread_join(thread, NULL);
+	cdr_thread = CW_PTHREADT_NULL;
+}
+
+void cw_cdr_submit_batch(int shutdown)
+{
+	struct cw_cdr_batch_item *oldbatchitems = NULL;
+	struct cw_cdr_batch_item *oldbatchtail = NULL;
+	int oldbatchsize = 0;
 
 	/* move the old CDRs aside, and prepare a new CDR batch */
-	cw_mutex_lock(&cdr_batch_lock);
-	oldbatchitems = batch->head;
-	reset_batch();
-	cw_mutex_unlock(&cdr_batch_lock);
+	if (batch && batch->head) {
+		cw_mutex_lock(&cdr_batch_lock);
+		oldbatchitems = batch->head;
+		oldbatchtail = batch->tail;
+		oldbatchsize = batch->size;
+		reset_batch();
+		cw_mutex_unlock(&cdr_batch_lock);
+	}
 
-	/* if configured, spawn a new thread to post these CDRs,
-	   also try to save as much as possible if we are shutting down safely */
-	if (batchscheduleronly || shutdown) {
-		if (option_debug)
-			cw_log(LOG_DEBUG, "CDR single-threaded batch processing begins now\n");
-		do_batch_backend_process(oldbatchitems);
-	} else {
-		pthread_attr_init(&attr);
-		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-		if (cw_pthread_create(&batch_post_thread, &attr, do_batch_backend_process, oldbatchitems)) {
-			cw_log(LOG_WARNING, "CDR processing thread could not detach, now trying in this thread\n");
-			do_batch_backend_process(oldbatchitems);
-		} else {
+	/* without a posting thread, or if configured, post these CDRs right here */
+	if (batchscheduleronly || cdr_thread == CW_PTHREADT_NULL) {
+		if (oldbatchitems) {
 			if (option_debug)
-				cw_log(LOG_DEBUG, "CDR multi-threaded batch processing begins now\n");
+				cw_log(LOG_DEBUG, "CDR single-threaded batch processing begins now\n");
+			do_batch_backend_process(oldbatchitems);
 		}
+		return;
+	}
+
+	cw_mutex_lock(&cdr_post_lock);
+	if (oldbatchitems) {
+		if (post_tail)
+			post_tail->next = oldbatchitems;
+		else
+			post_head = oldbatchitems;
+		post_tail = oldbatchtail;
+		post_pending += oldbatchsize;
+		cw_cond_signal(&cdr_post_cond);
+	}
+	/* try to save as much as possible if we are shutting down safely */
+	if (shutdown) {
+		while ((post_head || post_busy) && !post_stop)
+			cw_cond_wait(&cdr_post_done, &cdr_post_lock);
 	}
+	cw_mutex_unlock(&cdr_post_lock);
 }
 
 static int submit_scheduled_batch(void *data)
@@ -990,6 +1127,14 @@ void cw_cdr_detach(struct cw_cdr *cdr)
 	if (option_debug)
 		cw_log(LOG_DEBUG, "CDR detaching from this thread\n");
 
+	/* hold the caller back while the posting thread is too far behind */
+	if (cdr_thread != CW_PTHREADT_NULL && batchmaxpending > 0) {
+		cw_mutex_lock(&cdr_post_lock);
+		while (post_pending >= batchmaxpending && !post_stop)
+			cw_cond_wait(&cdr_post_done, &cdr_post_lock);
+		cw_mutex_unlock(&cdr_post_lock);
+	}
+
 	/* we'll need a new tail for every CDR */
 	newtail = malloc(sizeof(*newtail));
 	if (!newtail) {
@@ -1040,15 +1185,16 @@ static int handle_cli_status(int fd, int argc, char *argv[])
 			if (cdr_sched > -1)
 				nextbatchtime = cw_sched_when(sched, cdr_sched);
 			cw_cli(fd, "CDR safe shut down: %s\n", batchsafeshutdown ? "enabled" : "disabled");
-			cw_cli(fd, "CDR batch threading model: %s\n", batchscheduleronly ? "scheduler only" : "scheduler plus separate threads");
+			cw_cli(fd, "CDR batch threading model: %s\n", batchscheduleronly ? "scheduler only" : "scheduler plus posting thread");
 			cw_cli(fd, "CDR current batch size: %d record%s\n", cnt, (cnt != 1) ? "s" : "");
+			cw_cli(fd, "CDR records waiting to be posted: %d (maximum %d)\n", post_pending, batchmaxpending);
 			cw_cli(fd, "CDR maximum batch size: %d record%s\n", batchsize, (batchsize != 1) ? "s" : "");
 			cw_cli(fd, "CDR maximum batch time: %d second%s\n", batchtime, (batchtime != 1) ? "s" : "");
 			cw_cli(fd, "CDR next scheduled batch processing time: %ld second%s\n", nextbatchtime, (nextbatchtime != 1) ? "s" : "");
 		}
 		CW_LIST_LOCK(&be_list);
 		CW_LIST_TRAVERSE(&be_list, beitem, list) {
-			cw_cli(fd, "CDR registered backend: %s\n", beitem->name);
+			cw_cli(fd, "CDR registered backend: %s%s\n", beitem->name, beitem->be_batch ? " (batch)" : "");
 		}
 		CW_LIST_UNLOCK(&be_list);
 	}
@@ -1095,6 +1241,7 @@ static int do_reload(void)
 	const char *batchsafeshutdown_value = NULL;
 	const char *size_value = NULL;
 	const char *time_value = NULL;
+	const char *maxpending_value = NULL;
 	int cfg_size;
 	int cfg_time;
 	int was_enabled;
@@ -1107,6 +1254,7 @@ static int do_reload(void)
 	batchtime = BATCH_TIME_DEFAULT;
 	batchscheduleronly = BATCH_SCHEDULER_ONLY_DEFAULT;
 	batchsafeshutdown = BATCH_SAFE_SHUTDOWN_DEFAULT;
+	batchmaxpending = BATCH_MAX_PENDING_DEFAULT;
 	was_enabled = enabled;
 	was_batchmode = batchmode;
 	enabled = 1;
@@ -1149,6 +1297,14 @@ static int do_reload(void)
 			else
 				batchtime = cfg_time;
 		}
+		if ((maxpending_value = cw_variable_retrieve(config, "general", "maxpending"))) {
+			if (sscanf(maxpending_value, "%d", &cfg_size) < 1)
+				cw_log(LOG_WARNING, "Unable to convert '%s' to a numeric value.\n", maxpending_value);
+			else if (cfg_size < 0)
+				cw_log(LOG_WARNING, "Invalid maximum pending records '%d' specified, using default\n", cfg_size);
+			else
+				batchmaxpending = cfg_size;
+		}
 	}
 
 	if (enabled && !batchmode) {
@@ -1163,13 +1319,14 @@ static int do_reload(void)
 	/* if this reload enabled the CDR batch mode, create the background thread
 	   if it does not exist */
 	if (enabled && batchmode && (!was_enabled || !was_batchmode) && (cdr_thread == CW_PTHREADT_NULL)) {
+		start_post_thread();
 		cw_cli_register(&cli_submit);
 		cw_register_atexit(cw_cdr_engine_term);
 		res = 0;
 	/* if this reload disabled the CDR and/or batch mode and there is a background thread,
 	   kill it */
 	}else if (((!enabled && was_enabled) || (!batchmode && was_batchmode)) && (cdr_thread != CW_PTHREADT_NULL)) {
-		cdr_thread = CW_PTHREADT_NULL;
+		stop_post_thread();
 		cw_cli_unregister(&cli_submit);
 		cw_unregister_atexit(cw_cdr_engine_term);
 		res = 0;
@@ -1198,6 +1355,9 @@ int cw_cdr_engine_init(void)
 		return -1;
 	}
 
+	cw_cond_init(&cdr_post_cond, NULL);
+	cw_cond_init(&cdr_post_done, NULL);
+
 	cw_cli_register(&cli_status);
 
 	res = do_reload();
@@ -62,6 +62,8 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/app.h"
 #include "callweaver/transcap.h"
 #include "callweaver/devicestate.h"
+#include "callweaver/ulaw.h"
+#include "callweaver/alaw.h"
 
 /* uncomment if you have problems with 'monitoring' synchronized files */
 #if 0
@@ -990,6 +992,9 @@ void cw_channel_free(struct cw_channel *chan)
 	
 	headp=&chan->varshead;
 	
+	/* Stop the jitterbuffer playout before anything it writes through goes */
+	cw_jb_destroy(chan);
+
 	cw_mutex_lock(&chlock);
 	cur = channels;
 	while (cur)
@@ -1064,9 +1069,9 @@ void cw_channel_free(struct cw_channel *chan)
 	    vardata = CW_LIST_REMOVE_HEAD(headp, entries);
 	    cw_var_delete(vardata);
 	}
-
-	/* Destroy the jitterbuffer */
-	cw_jb_destroy(chan);
+	cw_var_index_free(&chan->varsindex);
+	cw_var_shared_unref(chan->varsinherited);
+	cw_var_shared_unref(chan->varsexport);
 
 	free(chan);
 	cw_mutex_unlock(&chlock);
@@ -1115,49 +1120,328 @@ int cw_softhangup(struct cw_channel *chan, int cause)
 	return res;
 }
 
-static void cw_queue_spy_frame(struct cw_channel_spy *spy, struct cw_frame *f, int pos) 
+void cw_channel_spy_init(struct cw_channel_spy *spy)
 {
-	struct cw_frame *tmpf = NULL;
-	int count = 0;
+	memset(spy, 0, sizeof(*spy));
+	spy->status = CHANSPY_RUNNING;
+}
 
-	cw_mutex_lock(&spy->lock);
-	for (tmpf = spy->queue[pos];  tmpf  &&  tmpf->next;  tmpf = tmpf->next)
-		count++;
+void cw_channel_spy_destroy(struct cw_channel_spy *spy)
+{
+	int pos;
 
-	if (count > 1000)
+	for (pos = 0;  pos < 2;  pos++)
 	{
-		struct cw_frame *freef;
-		struct cw_frame *headf;
-
-		cw_log(LOG_ERROR, "Too many frames queued at once, flushing cache.\n");
-		headf = spy->queue[pos];
-		/* deref the queue right away so it looks empty */
-		spy->queue[pos] = NULL;
-		tmpf = headf;
-		/* Free the wasted frames */
-		while (tmpf)
-    		{
-			freef = tmpf;
-			tmpf = tmpf->next;
-			cw_fr_free(freef);
+		if (spy->trans[pos])
+		{
+			cw_translator_free_path(spy->trans[pos]);
+			spy->trans[pos] = NULL;
+		}
+	}
+}
+
+/* Append signed linear audio to a spy ring, keeping only what fits */
+static void spy_ring_put(struct cw_spy_ring *ring, const int16_t *s, int samples)
+{
+	unsigned int head;
+	int skip;
+	int i;
+
+	head = ring->head;
+	skip = (samples > CW_SPY_RING_SAMPLES)  ?  samples - CW_SPY_RING_SAMPLES  :  0;
+	for (i = skip;  i < samples;  i++)
+		ring->buf[(head + i - skip) & CW_SPY_RING_MASK] = s[i];
+	/* Publish the samples before the new head */
+	cw_memory_barrier();
+	ring->head = head + samples - skip;
+}
+
+/* Get the decoder a spy uses for one direction, building it on first use
+   or when the format changes */
+static struct cw_trans_pvt *spy_trans(struct cw_channel_spy *spy, int format, int pos)
+{
+	if (spy->trans[pos]  &&  spy->format[pos] != format)
+	{
+		cw_translator_free_path(spy->trans[pos]);
+		spy->trans[pos] = NULL;
+	}
+	if (spy->trans[pos] == NULL)
+	{
+		if ((spy->trans[pos] = cw_translator_build_path(CW_FORMAT_SLINEAR, 8000, format, 8000)) == NULL)
+			return NULL;
+		spy->format[pos] = format;
+	}
+	return spy->trans[pos];
+}
+
+void cw_channel_spy_feed(struct cw_channel_spy *spy, struct cw_frame *f, int pos) 
+{
+	struct cw_spy_ring *ring = &spy->ring[pos];
+	struct cw_frame *lin;
+	unsigned int head;
+	uint8_t *u;
+	int samples;
+	int skip;
+	int i;
+
+	switch (f->subclass)
+	{
+	case CW_FORMAT_ULAW:
+	case CW_FORMAT_ALAW:
+		head = ring->head;
+		u = f->data;
+		samples = f->datalen;
+		skip = (samples > CW_SPY_RING_SAMPLES)  ?  samples - CW_SPY_RING_SAMPLES  :  0;
+		if (f->subclass == CW_FORMAT_ULAW)
+		{
+			for (i = skip;  i < samples;  i++)
+				ring->buf[(head + i - skip) & CW_SPY_RING_MASK] = CW_MULAW(u[i]);
 		}
-		cw_mutex_unlock(&spy->lock);
+		else
+		{
+			for (i = skip;  i < samples;  i++)
+				ring->buf[(head + i - skip) & CW_SPY_RING_MASK] = CW_ALAW(u[i]);
+		}
+		/* Publish the samples before the new head */
+		cw_memory_barrier();
+		ring->head = head + samples - skip;
+		break;
+	case CW_FORMAT_SLINEAR:
+		spy_ring_put(ring, f->data, f->datalen/sizeof(int16_t));
+		break;
+	default:
+		if (spy_trans(spy, f->subclass, pos) == NULL)
+			return;
+		/* The translated frame belongs to the path - don't free it */
+		if ((lin = cw_translate(spy->trans[pos], f, 0)) == NULL)
+			return;
+		spy_ring_put(ring, lin->data, lin->datalen/sizeof(int16_t));
+		break;
+	}
+}
+
+void cw_channel_spy_feed_list(struct cw_channel_spy *spiers, struct cw_frame *f, int pos)
+{
+	struct cw_channel_spy *spy[CW_TRANSLATE_BATCH_MAX];
+	struct cw_trans_pvt *paths[CW_TRANSLATE_BATCH_MAX];
+	struct cw_frame *in[CW_TRANSLATE_BATCH_MAX];
+	struct cw_frame *out[CW_TRANSLATE_BATCH_MAX];
+	int n;
+	int i;
+
+	if (f->subclass == CW_FORMAT_ULAW  ||  f->subclass == CW_FORMAT_ALAW  ||  f->subclass == CW_FORMAT_SLINEAR  ||  spiers == NULL  ||  spiers->next == NULL)
+	{
+		for (  ;  spiers;  spiers = spiers->next)
+			cw_channel_spy_feed(spiers, f, pos);
 		return;
 	}
+	/* Every spy decodes the same frame, so run all their paths together */
+	while (spiers)
+	{
+		for (n = 0;  spiers  &&  n < CW_TRANSLATE_BATCH_MAX;  spiers = spiers->next)
+		{
+			if ((paths[n] = spy_trans(spiers, f->subclass, pos)) == NULL)
+				continue;
+			spy[n] = spiers;
+			in[n++] = f;
+		}
+		/* The translated frames belong to the paths - don't free them */
+		cw_translate_batch(paths, in, out, n, 0);
+		for (i = 0;  i < n;  i++)
+		{
+			if (out[i])
+				spy_ring_put(&spy[i]->ring[pos], out[i]->data, out[i]->datalen/sizeof(int16_t));
+		}
+	}
+}
+
+int cw_channel_spy_avail(struct cw_channel_spy *spy, int pos)
+{
+	struct cw_spy_ring *ring = &spy->ring[pos];
+	unsigned int avail;
 
-	if (tmpf)
+	avail = ring->head - ring->tail;
+	return (avail > CW_SPY_RING_SAMPLES)  ?  CW_SPY_RING_SAMPLES  :  (int) avail;
+}
+
+int cw_channel_spy_read(struct cw_channel_spy *spy, int pos, int16_t *buf, int samples)
+{
+	struct cw_spy_ring *ring = &spy->ring[pos];
+	unsigned int head;
+	unsigned int tail;
+	unsigned int lost;
+	int avail;
+	int i;
+
+	head = ring->head;
+	cw_memory_barrier();
+	tail = ring->tail;
+	if (head - tail > CW_SPY_RING_SAMPLES)
 	{
-		if ((tmpf->next = cw_frdup(f)) == NULL)
-    		cw_log(LOG_WARNING, "Unable to duplicate frame\n");
+		/* The producer lapped us; skip to the oldest audio still held */
+		ring->overruns += head - tail - CW_SPY_RING_SAMPLES;
+		tail = head - CW_SPY_RING_SAMPLES;
+	}
+	avail = head - tail;
+	if (samples > avail)
+		samples = avail;
+	for (i = 0;  i < samples;  i++)
+		buf[i] = ring->buf[(tail + i) & CW_SPY_RING_MASK];
+
+	ring->tail = tail + samples;
+
+	/* Anything the producer overwrote while we were copying is garbage */
+	cw_memory_barrier();
+	head = ring->head;
+	if (head - tail > CW_SPY_RING_SAMPLES)
+	{
+		lost = head - tail - CW_SPY_RING_SAMPLES;
+		if (lost >= (unsigned int) samples)
+		{
+			ring->overruns += samples;
+			return 0;
+		}
+		memmove(buf, buf + lost, (samples - lost)*sizeof(int16_t));
+		ring->overruns += lost;
+		samples -= lost;
 	}
-	else
+	return samples;
+}
+
+#define SPY_BENCH_SAMPLES	160
+#define SPY_BENCH_SPIES		4
+/* Frames fed between drains. The rings must hold them all, or the reads
+   would be timing overruns rather than copies */
+#define SPY_BENCH_BATCH		(CW_SPY_RING_SAMPLES/SPY_BENCH_SAMPLES)
+
+static long spy_bench_us(struct timeval end, struct timeval start)
+{
+	return (end.tv_sec - start.tv_sec)*1000000L + (end.tv_usec - start.tv_usec);
+}
+
+/*--- spy_benchmark: Time what spying costs per 20ms frame. Each frame is fed
+	to every spy in both directions, as cw_read() and cw_write() do, and
+	each spy drains its rings as ChanSpy does. Feeding and draining are
+	timed apart, since they run on different threads in a real call. */
+static int spy_benchmark(int fd, int argc, char *argv[])
+{
+	static const int counts[] = { 0, 1, SPY_BENCH_SPIES };
+	static const int formats[] = { CW_FORMAT_ULAW, CW_FORMAT_SLINEAR };
+	struct cw_channel_spy *spies;
+	struct cw_channel_spy *spiers;
+	struct cw_channel_spy *spying;
+	struct cw_frame f;
+	struct timeval start;
+	struct timeval t0;
+	struct timeval t1;
+	struct timeval t2;
+	int16_t slin[SPY_BENCH_SAMPLES];
+	int16_t out[SPY_BENCH_SAMPLES];
+	uint8_t ulaw[SPY_BENCH_SAMPLES];
+	long frames;
+	long feed_us;
+	long read_us;
+	int ms;
+	int i;
+	int j;
+	int n;
+
+	if (argc > 3)
+		return RESULT_SHOWUSAGE;
+	ms = (argc > 2)  ?  atoi(argv[2])  :  200;
+	if (ms < 10  ||  ms > 10000)
+	{
+		cw_cli(fd, "Time per run must be between 10 and 10000 ms\n");
+		return RESULT_SHOWUSAGE;
+	}
+	if ((spies = malloc(SPY_BENCH_SPIES*sizeof(*spies))) == NULL)
+	{
+		cw_cli(fd, "Out of memory\n");
+		return RESULT_FAILURE;
+	}
+	for (i = 0;  i < SPY_BENCH_SAMPLES;  i++)
 	{
-    	if ((spy->queue[pos] = cw_frdup(f)) == NULL)
-    		cw_log(LOG_WARNING, "Unable to duplicate frame\n");
+		slin[i] = (int16_t) ((i*7919) & 0xFFFF);
+		ulaw[i] = (uint8_t) (i*13);
+	}
+
+	cw_cli(fd, "%-8s %5s %14s %14s %14s\n", "Format", "Spies", "Frames/sec", "Feed ns/frame", "Read ns/frame");
+	for (i = 0;  i < sizeof(formats)/sizeof(formats[0]);  i++)
+	{
+		cw_fr_init_ex(&f, CW_FRAME_VOICE, formats[i], "spy benchmark");
+		if (formats[i] == CW_FORMAT_ULAW)
+		{
+			f.data = ulaw;
+			f.datalen = sizeof(ulaw);
+		}
+		else
+		{
+			f.data = slin;
+			f.datalen = sizeof(slin);
+		}
+		f.samples = SPY_BENCH_SAMPLES;
+		for (j = 0;  j < sizeof(counts)/sizeof(counts[0]);  j++)
+		{
+			spiers = NULL;
+			for (n = counts[j] - 1;  n >= 0;  n--)
+			{
+				cw_channel_spy_init(&spies[n]);
+				spies[n].next = spiers;
+				spiers = &spies[n];
+			}
+			frames = 0;
+			feed_us = 0;
+			read_us = 0;
+			start = cw_tvnow();
+			do
+			{
+				t0 = cw_tvnow();
+				for (n = 0;  n < SPY_BENCH_BATCH;  n++)
+				{
+					for (spying = spiers;  spying;  spying = spying->next)
+						cw_channel_spy_feed(spying, &f, 0);
+					for (spying = spiers;  spying;  spying = spying->next)
+						cw_channel_spy_feed(spying, &f, 1);
+				}
+				t1 = cw_tvnow();
+				for (n = 0;  n < SPY_BENCH_BATCH;  n++)
+				{
+					for (spying = spiers;  spying;  spying = spying->next)
+					{
+						cw_channel_spy_read(spying, 0, out, SPY_BENCH_SAMPLES);
+						cw_channel_spy_read(spying, 1, out, SPY_BENCH_SAMPLES);
+					}
+				}
+				t2 = cw_tvnow();
+				feed_us += spy_bench_us(t1, t0);
+				read_us += spy_bench_us(t2, t1);
+				frames += SPY_BENCH_BATCH;
+			}
+			while (cw_tvdiff_ms(cw_tvnow(), start) < ms);
+			if (feed_us + read_us <= 0)
+				feed_us = 1;
+			cw_cli(fd, "%-8s %5d %14.0f %14.1f %14.1f\n", cw_getformatname(formats[i]), counts[j],
+				(double) frames*1.0e6/(double) (feed_us + read_us),
+				(double) feed_us*1.0e3/(double) frames,
+				(double) read_us*1.0e3/(double) frames);
+			for (n = 0;  n < counts[j];  n++)
+				cw_channel_spy_destroy(&spies[n]);
+		}
 	}
-	cw_mutex_unlock(&spy->lock);
+	free(spies);
+	return RESULT_SUCCESS;
 }
 
+static char spy_benchmark_usage[] =
+"Usage: spy benchmark [<ms per run>]\n"
+"       Times feeding 20ms frames to 0, 1 and 4 spies in both directions\n"
+"and draining their rings, for G.711 and signed linear audio. Feeding and\n"
+"draining are shown per frame separately, and Frames/sec is for the two\n"
+"together.\n";
+
+static struct cw_cli_entry cli_spy_benchmark =
+	{ { "spy", "benchmark", NULL }, spy_benchmark, "Measure the cost of channel spies", spy_benchmark_usage };
+
 static void free_translation(struct cw_channel *clone)
 {
 	if (clone->writetrans)
@@ -1762,10 +2046,7 @@ struct cw_frame *cw_read(struct cw_channel *chan)
         	{
     			if (chan->spiers)
             		{
-    				struct cw_channel_spy *spying;
-
-    				for (spying = chan->spiers;  spying;  spying = spying->next)
-    					cw_queue_spy_frame(spying, f, 0);
+    				cw_channel_spy_feed_list(chan->spiers, f, 0);
     			}
     			if (chan->monitor && chan->monitor->read_stream)
             		{
@@ -2196,10 +2477,7 @@ int cw_write(struct cw_channel *chan, struct cw_frame *fr)
 
 				if (f->frametype == CW_FRAME_VOICE  &&  chan->spiers)
                 {
-					struct cw_channel_spy *spying;
-
-					for (spying = chan->spiers;  spying;  spying = spying->next)
-						cw_queue_spy_frame(spying, f, 1);
+					cw_channel_spy_feed_list(chan->spiers, f, 1);
 				}
 
 				if( chan->monitor && chan->monitor->write_stream &&
@@ -2804,52 +3082,134 @@ void cw_change_name(struct cw_channel *chan, char *newname)
 	manager_event(EVENT_FLAG_CALL, "Rename", "Oldname: %s\r\nNewname: %s\r\nUniqueid: %s\r\n", tmp, chan->name, chan->uniqueid);
 }
 
-void cw_channel_inherit_variables(const struct cw_channel *parent, struct cw_channel *child)
+struct cw_var_t *cw_channel_var_find(struct cw_channel *chan, const char *name)
+{
+	struct cw_var_t *var;
+
+	if ((var = cw_var_index_find(&chan->varsindex, &chan->varshead, name)) == NULL
+	&& chan->varsinherited)
+		var = cw_var_index_find(&chan->varsinherited->idx, &chan->varsinherited->head, name);
+	return var;
+}
+
+struct cw_var_t *cw_channel_var_first(struct cw_channel *chan)
+{
+	struct cw_var_t *var;
+
+	if ((var = CW_LIST_FIRST(&chan->varshead)) == NULL && chan->varsinherited)
+		var = CW_LIST_FIRST(&chan->varsinherited->head);
+	return var;
+}
+
+struct cw_var_t *cw_channel_var_next(struct cw_channel *chan, struct cw_var_t *var)
+{
+	struct cw_var_t *next;
+
+	if ((next = CW_LIST_NEXT(var, entries)) == NULL && !var->shared && chan->varsinherited)
+		next = CW_LIST_FIRST(&chan->varsinherited->head);
+	return next;
+}
+
+static void channel_vars_export_drop(struct cw_channel *chan)
+{
+	cw_var_shared_unref(chan->varsexport);
+	chan->varsexport = NULL;
+}
+
+void cw_channel_vars_own(struct cw_channel *chan)
 {
+	struct cw_var_shared *sh = chan->varsinherited;
 	struct cw_var_t *current, *newvar;
+
+	if (sh == NULL)
+		return;
+	/* They go after the channel's own, where a lookup or a walk met them */
+	CW_LIST_TRAVERSE(&sh->head, current, entries)
+	{
+		if ((newvar = cw_var_assign(cw_var_full_name(current), cw_var_value(current))))
+		{
+			CW_LIST_INSERT_TAIL(&chan->varshead, newvar, entries);
+			cw_var_index_add(&chan->varsindex, newvar, 0);
+		}
+	}
+	chan->varsinherited = NULL;
+	cw_var_shared_unref(sh);
+}
+
+void cw_channel_var_changing(struct cw_channel *chan, const char *name)
+{
+	struct cw_var_t *var;
+
+	if (chan->varsinherited
+	&& cw_var_index_find(&chan->varsinherited->idx, &chan->varsinherited->head, name))
+		cw_channel_vars_own(chan);
+	if (chan->varsexport)
+	{
+		var = cw_var_index_find(&chan->varsindex, &chan->varshead, name);
+		if (name[0] == '_' || (var && cw_var_full_name(var)[0] == '_'))
+			channel_vars_export_drop(chan);
+	}
+}
+
+/* Work out what the children of a channel inherit.  When the channel has
+   no inheritable variables of its own and everything it inherited passes
+   on unchanged, its children share its parent's copies too. */
+static struct cw_var_shared *channel_vars_export(struct cw_channel *chan)
+{
+	struct cw_var_shared *sh;
+	struct cw_var_t *current;
 	char *varname;
+	int own = 0;
 
-	CW_LIST_TRAVERSE(&parent->varshead, current, entries)
-    {
-		int vartype = 0;
+	if (chan->varsexport)
+		return chan->varsexport;
+
+	CW_LIST_TRAVERSE(&chan->varshead, current, entries)
+	{
+		if (cw_var_full_name(current)[0] == '_')
+			own++;
+	}
+	if (own == 0 && (chan->varsinherited == NULL || chan->varsinherited->hard))
+		return (chan->varsexport = cw_var_shared_ref(chan->varsinherited));
 
+	if ((sh = cw_var_shared_new()) == NULL)
+		return NULL;
+	CW_CHANNEL_VARS_TRAVERSE(chan, current)
+	{
 		varname = cw_var_full_name(current);
-		if (!varname)
+		if (varname[0] != '_')
+		{
+			if (option_debug)
+				cw_log(LOG_DEBUG, "Not copying variable %s.\n", cw_var_name(current));
 			continue;
-
-		if (varname[0] == '_')
-        {
-			vartype = 1;
-			if (varname[1] == '_')
-				vartype = 2;
 		}
-
-		switch (vartype)
-        {
-		case 1:
-			newvar = cw_var_assign(&varname[1], cw_var_value(current));
-			if (newvar)
-            {
-				CW_LIST_INSERT_TAIL(&child->varshead, newvar, entries);
-				if (option_debug)
-					cw_log(LOG_DEBUG, "Copying soft-transferable variable %s.\n", cw_var_name(newvar));
-			}
-			break;
-		case 2:
-			newvar = cw_var_assign(cw_var_full_name(current), cw_var_value(current));
-			if (newvar)
-            {
-				CW_LIST_INSERT_TAIL(&child->varshead, newvar, entries);
-				if (option_debug)
-					cw_log(LOG_DEBUG, "Copying hard-transferable variable %s.\n", cw_var_name(newvar));
-			}
-			break;
-		default:
+		if (varname[1] == '_')
+		{
+			cw_var_shared_append(sh, varname, cw_var_value(current));
 			if (option_debug)
-				cw_log(LOG_DEBUG, "Not copying variable %s.\n", cw_var_name(current));
-			break;
+				cw_log(LOG_DEBUG, "Copying hard-transferable variable %s.\n", cw_var_name(current));
+		}
+		else
+		{
+			cw_var_shared_append(sh, &varname[1], cw_var_value(current));
+			if (option_debug)
+				cw_log(LOG_DEBUG, "Copying soft-transferable variable %s.\n", cw_var_name(current));
 		}
 	}
+	return (chan->varsexport = sh);
+}
+
+void cw_channel_inherit_variables(struct cw_channel *parent, struct cw_channel *child)
+{
+	struct cw_var_shared *sh;
+
+	if ((sh = channel_vars_export(parent)) == NULL || CW_LIST_EMPTY(&sh->head))
+		return;
+
+	/* A second inheritance goes after the first, as the copies used to */
+	cw_channel_vars_own(child);
+	channel_vars_export_drop(child);
+	child->varsinherited = cw_var_shared_ref(sh);
 }
 
 /* Clone channel variables from 'clone' channel into 'original' channel
@@ -2883,6 +3243,7 @@ static void clone_variables(struct cw_channel *original, struct cw_channel *clon
 	/* XXX Is this always correct?  We have to in order to keep PROCS working XXX */
 	if (CW_LIST_FIRST(&clone->varshead))
 		CW_LIST_INSERT_TAIL(&original->varshead, CW_LIST_FIRST(&clone->varshead), entries);
+	cw_var_index_rebuild(&original->varsindex, &original->varshead);
 }
 
 /*--- cw_do_masquerade: Masquerade a channel */
@@ -3042,8 +3403,13 @@ int cw_do_masquerade(struct cw_channel *original)
 	/* Copy the FD's */
 	for (x = 0;  x < CW_MAX_FDS;  x++)
 		original->fds[x] = clone->fds[x];
+	cw_channel_vars_own(original);
+	cw_channel_vars_own(clone);
+	channel_vars_export_drop(original);
+	channel_vars_export_drop(clone);
 	clone_variables(original, clone);
 	CW_LIST_HEAD_INIT_NOLOCK(&clone->varshead);
+	cw_var_index_free(&clone->varsindex);
 	/* Presense of ADSI capable CPE follows clone */
 	original->adsicpe = clone->adsicpe;
 	/* Bridge remains the same */
@@ -3287,6 +3653,7 @@ static enum cw_bridge_result cw_generic_bridge(struct cw_channel *c0,
 	
 	/* Indicates whether a frame was queued into a jitterbuffer */
 	int frame_put_in_jb;
+	int jb_res;
 
 	cs[0] = c0;
 	cs[1] = c1;
@@ -3386,7 +3753,15 @@ static enum cw_bridge_result cw_generic_bridge(struct cw_channel *c0,
 		}
 
 		/* Try add the frame info the who's bridged channel jitterbuff */
-		frame_put_in_jb = !cw_jb_put((who == c0) ? c1 : c0, f, f->subclass);
+		jb_res = cw_jb_put((who == c0) ? c1 : c0, f, f->subclass);
+		if (jb_res == CW_JB_PUT_OWNED) {
+			/* The jitterbuffer kept the frame itself, and will play it
+			 * out and free it. It is no longer ours to look at. Without
+			 * a playout timer it is still up to us to deliver what's due. */
+			cw_jb_get_and_deliver(c0, c1);
+			goto swap_priority;
+		}
+		frame_put_in_jb = !jb_res;
 
 		if ((f->frametype == CW_FRAME_CONTROL) && !(config->flags & CW_BRIDGE_IGNORE_SIGS)) {
 			if ((f->subclass == CW_CONTROL_HOLD) || (f->subclass == CW_CONTROL_UNHOLD) ||
@@ -3441,6 +3816,7 @@ tackygoto:
 		}
 		cw_fr_free(f);
 
+swap_priority:
 		/* Swap who gets priority */
 		cs[2] = cs[0];
 		cs[0] = cs[1];
@@ -3934,6 +4310,7 @@ void cw_moh_cleanup(struct cw_channel *chan)
 void cw_channels_init(void)
 {
 	cw_cli_register(&cli_show_channeltypes);
+	cw_cli_register(&cli_spy_benchmark);
 }
 
 /*--- cw_print_group: Print call group and pickup group ---*/
@@ -27,12 +27,14 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include "callweaver.h"
 
 CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branches/rel/1.2/corelib/chanvars.c $", "$Revision: 4723 $")
 
 #include "callweaver/chanvars.h"
+#include "callweaver/lock.h"
 #include "callweaver/logger.h"
 #include "callweaver/strings.h"
 #include "callweaver/callweaver_hash.h"
@@ -43,12 +45,15 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
  *		This file has been modified to accommodate the new hash code based system
  * to recognise identifiers, which increases the efficiency of dialplan execution.
  *
- *		As a result of the change to the hash code based system, variable names
- * are no longer case insensitive. If the old behaviour is desired, this file
+ *		As a result of the change to the hash code based system, the hash kept
+ * in each variable is case sensitive. If the old behaviour is desired, this file
  * should be compiled with the following macro defined:
  *
  *		o  CW_USE_CASE_INSENSITIVE_VAR_NAMES
  *
+ *		The variable index below hashes and compares names case folded either
+ * way, so ${} and the getvar functions match names regardless of case.
+ *
  */
 
 
@@ -116,6 +121,240 @@ char *cw_var_value(struct cw_var_t *var)
 	return (var ? var->value : NULL);
 }
 
+/* Variable index.  Open addressing with linear probing; a slot keeps the
+   first variable of its name in list order, which is the one a list walk
+   would find, and how many variables share that name so that removing
+   one only walks the list when a shadowed duplicate has to take over. */
+
+#define VAR_INDEX_TOMB		((struct cw_var_t *) -1)
+#define VAR_INDEX_MIN_SIZE	16
+
+#define var_name_cmp(a, b)	strcasecmp(a, b)
+#define var_index_hash(x)	cw_hash_string_toupper(x)
+
+static const char *var_strip(const char *name)
+{
+	if (name[0] == '_') {
+		if (name[1] == '_')
+			return name + 2;
+		return name + 1;
+	}
+	return name;
+}
+
+/* Find the slot for name, or the slot it would go in */
+static struct cw_var_slot *var_index_slot(struct cw_var_index *idx, const char *name, unsigned int hash)
+{
+	struct cw_var_slot *slot, *tomb = NULL;
+	unsigned int mask = idx->size - 1;
+	unsigned int i;
+
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		slot = &idx->slots[i];
+		if (slot->var == NULL)
+			return (tomb) ? tomb : slot;
+		if (slot->var == VAR_INDEX_TOMB) {
+			if (!tomb)
+				tomb = slot;
+		} else if (slot->hash == hash && !var_name_cmp(cw_var_name(slot->var), name)) {
+			return slot;
+		}
+	}
+}
+
+static int var_index_resize(struct cw_var_index *idx, unsigned int size)
+{
+	struct cw_var_slot *old = idx->slots;
+	unsigned int oldsize = idx->size;
+	struct cw_var_slot *slot;
+	unsigned int i;
+
+	if ((idx->slots = calloc(size, sizeof(*idx->slots))) == NULL) {
+		idx->slots = old;
+		return -1;
+	}
+	idx->size = size;
+	idx->tombs = 0;
+	for (i = 0; i < oldsize; i++) {
+		if (old[i].var && old[i].var != VAR_INDEX_TOMB) {
+			slot = var_index_slot(idx, cw_var_name(old[i].var), old[i].hash);
+			*slot = old[i];
+		}
+	}
+	free(old);
+	return 0;
+}
+
+static void var_index_fail(struct cw_var_index *idx)
+{
+	cw_log(LOG_WARNING, "Out of memory, variable lookups fall back to a list search\n");
+	cw_var_index_free(idx);
+	idx->invalid = 1;
+}
+
+/*! \brief Look a variable up by name, which may carry inheritance underscores */
+struct cw_var_t *cw_var_index_find(struct cw_var_index *idx, struct varshead *head, const char *name)
+{
+	struct cw_var_slot *slot;
+	struct cw_var_t *var;
+
+	name = var_strip(name);
+	if (idx->invalid) {
+		if (head) {
+			CW_LIST_TRAVERSE(head, var, entries) {
+				if (!var_name_cmp(cw_var_name(var), name))
+					return var;
+			}
+		}
+		return NULL;
+	}
+	if (idx->used == 0)
+		return NULL;
+	slot = var_index_slot(idx, name, var_index_hash(name));
+	return (slot->var == VAR_INDEX_TOMB) ? NULL : slot->var;
+}
+
+/*! \brief Index a variable just added to the list.  first is non-zero if
+ *  it went in ahead of any others of the same name. */
+void cw_var_index_add(struct cw_var_index *idx, struct cw_var_t *var, int first)
+{
+	struct cw_var_slot *slot;
+	const char *name = cw_var_name(var);
+	unsigned int hash = var_index_hash(name);
+	unsigned int size;
+
+	if (idx->invalid)
+		return;
+	if ((idx->used + idx->tombs + 1)*4 > idx->size*3) {
+		/* Grow, or just sweep out the tombstones if they are what filled it */
+		size = (idx->size) ? idx->size : VAR_INDEX_MIN_SIZE;
+		while ((idx->used + 1)*2 > size)
+			size *= 2;
+		if (var_index_resize(idx, size)) {
+			var_index_fail(idx);
+			return;
+		}
+	}
+	slot = var_index_slot(idx, name, hash);
+	if (slot->var == NULL || slot->var == VAR_INDEX_TOMB) {
+		if (slot->var == VAR_INDEX_TOMB)
+			idx->tombs--;
+		slot->hash = hash;
+		slot->count = 1;
+		slot->var = var;
+		idx->used++;
+		return;
+	}
+	slot->count++;
+	if (first)
+		slot->var = var;
+}
+
+/*! \brief Drop a variable that has just been taken off the list */
+void cw_var_index_remove(struct cw_var_index *idx, struct varshead *head, struct cw_var_t *var)
+{
+	struct cw_var_slot *slot;
+	struct cw_var_t *cur;
+	const char *name = cw_var_name(var);
+
+	if (idx->invalid || idx->used == 0)
+		return;
+	slot = var_index_slot(idx, name, var_index_hash(name));
+	if (slot->var == NULL || slot->var == VAR_INDEX_TOMB)
+		return;
+	if (--slot->count == 0) {
+		slot->var = VAR_INDEX_TOMB;
+		idx->used--;
+		idx->tombs++;
+		return;
+	}
+	if (slot->var == var) {
+		/* A variable it was shadowing takes over */
+		slot->var = VAR_INDEX_TOMB;
+		CW_LIST_TRAVERSE(head, cur, entries) {
+			if (!var_name_cmp(cw_var_name(cur), name)) {
+				slot->var = cur;
+				break;
+			}
+		}
+		if (slot->var == VAR_INDEX_TOMB) {
+			idx->used--;
+			idx->tombs++;
+		}
+	}
+}
+
+/*! \brief Index a whole list from scratch */
+void cw_var_index_rebuild(struct cw_var_index *idx, struct varshead *head)
+{
+	struct cw_var_t *var;
+
+	cw_var_index_free(idx);
+	CW_LIST_TRAVERSE(head, var, entries)
+		cw_var_index_add(idx, var, 0);
+}
+
+/*! \brief Forget the index.  The variables themselves are not touched. */
+void cw_var_index_free(struct cw_var_index *idx)
+{
+	free(idx->slots);
+	idx->slots = NULL;
+	idx->size = 0;
+	idx->used = 0;
+	idx->tombs = 0;
+	idx->invalid = 0;
+}
+
+/*! \brief A new, empty shared list holding one reference */
+struct cw_var_shared *cw_var_shared_new(void)
+{
+	struct cw_var_shared *sh;
+
+	if ((sh = calloc(1, sizeof(*sh))) == NULL) {
+		cw_log(LOG_WARNING, "Out of memory\n");
+		return NULL;
+	}
+	sh->refs = 1;
+	sh->hard = 1;
+	CW_LIST_HEAD_INIT_NOLOCK(&sh->head);
+	return sh;
+}
+
+/*! \brief Add a variable to the tail of a shared list that nobody else
+ *  has seen yet */
+int cw_var_shared_append(struct cw_var_shared *sh, const char *name, const char *value)
+{
+	struct cw_var_t *var;
+
+	if ((var = cw_var_assign(name, value)) == NULL)
+		return -1;
+	var->shared = 1;
+	if (name[0] != '_' || name[1] != '_')
+		sh->hard = 0;
+	CW_LIST_INSERT_TAIL(&sh->head, var, entries);
+	cw_var_index_add(&sh->idx, var, 0);
+	return 0;
+}
+
+struct cw_var_shared *cw_var_shared_ref(struct cw_var_shared *sh)
+{
+	if (sh)
+		cw_atomic_fetchadd_int(&sh->refs, 1);
+	return sh;
+}
+
+void cw_var_shared_unref(struct cw_var_shared *sh)
+{
+	struct cw_var_t *var;
+
+	if (sh == NULL || !cw_atomic_dec_and_test(&sh->refs))
+		return;
+	while ((var = CW_LIST_REMOVE_HEAD(&sh->head, entries)))
+		cw_var_delete(var);
+	cw_var_index_free(&sh->idx);
+	free(sh);
+}
+
 
 // END OF FILE
 
@@ -54,6 +54,8 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/utils.h"
 #include "callweaver/channel.h"
 #include "callweaver/app.h"
+#include "callweaver/manager.h"
+#include "callweaver/callweaver_hash.h"
 
 #define MAX_NESTED_COMMENTS 128
 #define COMMENT_START ";--"
@@ -75,6 +77,55 @@ static struct cw_config_map {
 CW_MUTEX_DEFINE_STATIC(config_lock);
 static struct cw_config_engine *config_engine_list;
 
+/*
+ * Realtime lookup cache. Results of cw_load_realtime() and
+ * cw_load_realtime_multientry() are kept per family for the time given
+ * in the [cache] section of extconfig.conf, misses included. Callers
+ * always get their own copy. cw_update_realtime() drops the entries of
+ * the family it may have changed: those holding the updated row, those
+ * looked up by its key, and those looked up on a field it set. Entries
+ * are also chained per family so that this never scans the whole cache.
+ */
+#define RTCACHE_BUCKETS		1024
+#define RTCACHE_MAX		8192
+#define RTCACHE_KEYLEN		512
+
+struct rtcache_entry {
+	struct rtcache_entry *next;
+	struct rtcache_entry *fnext;	/* next entry of the same family */
+	struct rtcache_entry **fpprev;
+	unsigned int hash;
+	time_t expires;
+	int multi;
+	struct cw_variable *var;	/* single entry result, NULL if not found */
+	struct cw_config *cfg;		/* multi entry result, NULL if not found */
+	int famlen;
+	int keylen;
+	char key[0];			/* family followed by the lookup fields */
+};
+
+static struct rtcache_ttl {
+	struct rtcache_ttl *next;
+	int ttl;
+	int negttl;
+	char family[0];
+} *rtcache_ttls = NULL;
+
+static struct rtcache_family {
+	struct rtcache_family *next;
+	struct rtcache_entry *entries;
+	char name[0];
+} *rtcache_families = NULL;
+
+CW_MUTEX_DEFINE_STATIC(rtcache_lock);
+static struct rtcache_entry *rtcache[RTCACHE_BUCKETS];
+static int rtcache_entries;
+static unsigned int rtcache_gen;	/* bumped on every flush */
+static int rtcache_default_ttl;
+static int rtcache_default_negttl;
+static unsigned long rtcache_hits;
+static unsigned long rtcache_misses;
+
 #define MAX_INCLUDE_LEVEL 10
 
 struct cw_comment {
@@ -793,6 +844,224 @@ static int append_mapping(char *name, char *driver, char *database, char *table)
 	return 0;
 }
 
+static void rtcache_entry_free(struct rtcache_entry *e)
+{
+	if (e->var)
+		cw_variables_destroy(e->var);
+	if (e->cfg)
+		cw_config_destroy(e->cfg);
+	free(e);
+}
+
+/*--- rtcache_unlink: Take an entry off its hash bucket and family chain. Called with rtcache_lock held */
+static void rtcache_unlink(struct rtcache_entry *e)
+{
+	struct rtcache_entry **p;
+
+	for (p = &rtcache[e->hash % RTCACHE_BUCKETS]; *p != e; p = &(*p)->next);
+	*p = e->next;
+	if ((*e->fpprev = e->fnext))
+		e->fnext->fpprev = e->fpprev;
+	rtcache_entries--;
+}
+
+/*--- rtcache_family_find: Find the chain of a family's entries, creating it if asked. Called with rtcache_lock held */
+static struct rtcache_family *rtcache_family_find(const char *family, int create)
+{
+	struct rtcache_family *f;
+
+	for (f = rtcache_families; f; f = f->next) {
+		if (!strcasecmp(f->name, family))
+			return f;
+	}
+	if (create && (f = calloc(1, sizeof(*f) + strlen(family) + 1))) {
+		strcpy(f->name, family);
+		f->next = rtcache_families;
+		rtcache_families = f;
+	}
+
+	return f;
+}
+
+/*--- rtcache_flush: Drop cached realtime results of a family, or of all families if NULL */
+static int rtcache_flush(const char *family)
+{
+	struct rtcache_family *f;
+	struct rtcache_entry *e, *dead = NULL;
+	int res = 0;
+
+	cw_mutex_lock(&rtcache_lock);
+	rtcache_gen++;
+	for (f = rtcache_families; f; f = f->next) {
+		if (family && strcasecmp(f->name, family))
+			continue;
+		while ((e = f->entries)) {
+			rtcache_unlink(e);
+			e->next = dead;
+			dead = e;
+			res++;
+		}
+	}
+	cw_mutex_unlock(&rtcache_lock);
+
+	while ((e = dead)) {
+		dead = e->next;
+		rtcache_entry_free(e);
+	}
+
+	return res;
+}
+
+/*--- rtcache_field_is: Check a lookup or update field against a column, ignoring any operator after it */
+static int rtcache_field_is(const char *field, int len, const char *column)
+{
+	const char *sp;
+
+	if ((sp = memchr(field, ' ', len)))
+		len = sp - field;
+	return !strncasecmp(field, column, len) && (column[len] == '\0' || column[len] == ' ');
+}
+
+/*--- rtcache_vars_have: Check whether a cached row has column set to value */
+static int rtcache_vars_have(const struct cw_variable *var, const char *column, const char *value)
+{
+	for (; var; var = var->next) {
+		if (!strcasecmp(var->name, column))
+			return !strcmp(var->value, value);
+	}
+
+	return 0;
+}
+
+/*--- rtcache_stale: Check whether an update of the row keyed keyfield = lookup, setting the
+ * fields in ap, may have changed what a cached lookup returns */
+static int rtcache_stale(const struct rtcache_entry *e, const char *keyfield, const char *lookup, va_list ap)
+{
+	const char *key = e->key + e->famlen;
+	const char *end = e->key + e->keylen;
+	const char *field, *value, *next, *set;
+	struct cw_category *cat;
+	va_list aq;
+	int stale = 0;
+
+	/* It holds the row */
+	if (e->var && rtcache_vars_have(e->var, keyfield, lookup))
+		return 1;
+	if (e->cfg) {
+		for (cat = e->cfg->root; cat; cat = cat->next) {
+			if (rtcache_vars_have(cat->root, keyfield, lookup))
+				return 1;
+		}
+	}
+
+	/* It looked up by the key of the row, or by a field the update set */
+	while (!stale && key < end && *key == '\001') {
+		field = key + 1;
+		if (!(value = memchr(field, '\001', end - field)))
+			break;
+		value++;
+		if (!(next = memchr(value, '\001', end - value)))
+			next = end;
+		if (rtcache_field_is(field, value - 1 - field, keyfield)
+			&& next - value == strlen(lookup) && !strncmp(value, lookup, next - value))
+			stale = 1;
+		va_copy(aq, ap);
+		while (!stale && (set = va_arg(aq, const char *))) {
+			va_arg(aq, const char *);
+			stale = rtcache_field_is(field, value - 1 - field, set);
+		}
+		va_end(aq);
+		key = next;
+	}
+
+	return stale;
+}
+
+/*--- rtcache_update: Drop the cached results of a family that an update may have changed */
+static int rtcache_update(const char *family, const char *keyfield, const char *lookup, va_list ap)
+{
+	struct rtcache_family *f;
+	struct rtcache_entry *e, *next, *dead = NULL;
+	int res = 0;
+
+	cw_mutex_lock(&rtcache_lock);
+	/* lookups already asking the backend may have read the old row */
+	rtcache_gen++;
+	if ((f = rtcache_family_find(family, 0))) {
+		for (e = f->entries; e; e = next) {
+			next = e->fnext;
+			if (!rtcache_stale(e, keyfield, lookup, ap))
+				continue;
+			rtcache_unlink(e);
+			e->next = dead;
+			dead = e;
+			res++;
+		}
+	}
+	cw_mutex_unlock(&rtcache_lock);
+
+	while ((e = dead)) {
+		dead = e->next;
+		rtcache_entry_free(e);
+	}
+
+	return res;
+}
+
+static void clear_rtcache_ttls(void)
+{
+	struct rtcache_ttl *ttl;
+
+	cw_mutex_lock(&rtcache_lock);
+	while ((ttl = rtcache_ttls)) {
+		rtcache_ttls = ttl->next;
+		free(ttl);
+	}
+	rtcache_default_ttl = rtcache_default_negttl = 0;
+	cw_mutex_unlock(&rtcache_lock);
+
+	rtcache_flush(NULL);
+}
+
+/*--- append_rtcache_ttl: Parse a "family => ttl[,negative ttl]" line of the [cache] section */
+static void append_rtcache_ttl(const char *family, const char *value)
+{
+	struct rtcache_ttl *ttl;
+	int pos, neg;
+
+	if (sscanf(value, "%d", &pos) != 1 || pos < 0) {
+		cw_log(LOG_WARNING, "Invalid realtime cache time '%s' for '%s'\n", value, family);
+		return;
+	}
+	neg = pos;
+	if ((value = strchr(value, ',')) && (sscanf(value + 1, "%d", &neg) != 1 || neg < 0)) {
+		cw_log(LOG_WARNING, "Invalid realtime negative cache time '%s' for '%s'\n", value + 1, family);
+		neg = pos;
+	}
+
+	if (!strcasecmp(family, "default")) {
+		cw_mutex_lock(&rtcache_lock);
+		rtcache_default_ttl = pos;
+		rtcache_default_negttl = neg;
+		cw_mutex_unlock(&rtcache_lock);
+		return;
+	}
+
+	if (!(ttl = malloc(sizeof(*ttl) + strlen(family) + 1)))
+		return;
+	strcpy(ttl->family, family);
+	ttl->ttl = pos;
+	ttl->negttl = neg;
+
+	if (option_verbose > 1)
+		cw_verbose(VERBOSE_PREFIX_2 "Caching realtime %s for %ds (misses %ds)\n", family, pos, neg);
+
+	cw_mutex_lock(&rtcache_lock);
+	ttl->next = rtcache_ttls;
+	rtcache_ttls = ttl;
+	cw_mutex_unlock(&rtcache_lock);
+}
+
 void read_config_maps(void) 
 {
 	struct cw_config *config, *configtmp;
@@ -800,6 +1069,7 @@ void read_config_maps(void)
 	char *driver, *table, *database, *stringp;
 
 	clear_config_maps();
+	clear_rtcache_ttls();
 
 	configtmp = cw_config_new();
 	configtmp->max_include_level = 1;
@@ -843,6 +1113,9 @@ void read_config_maps(void)
 		} else 
 			append_mapping(v->name, driver, database, table);
 	}
+
+	for (v = cw_variable_browse(config, "cache"); v; v = v->next)
+		append_rtcache_ttl(v->name, v->value);
 		
 	cw_config_destroy(config);
 }
@@ -981,18 +1254,212 @@ struct cw_config *cw_config_load(const char *filename)
 	return result;
 }
 
+/*--- rtcache_key: Build the cache key of a realtime lookup. Returns its length, or -1 if it does not fit */
+static int rtcache_key(char *buf, int len, const char *family, va_list ap)
+{
+	const char *field;
+	int pos, n;
+
+	pos = snprintf(buf, len, "%s", family);
+	while (pos < len && (field = va_arg(ap, const char *))) {
+		n = snprintf(buf + pos, len - pos, "\001%s\001%s", field, va_arg(ap, const char *));
+		if (n < 0)
+			return -1;
+		pos += n;
+	}
+
+	return (pos < len) ? pos : -1;
+}
+
+static struct cw_config *config_clone(const struct cw_config *old)
+{
+	struct cw_config *new;
+	struct cw_category *cat, *newcat;
+	struct cw_variable *var, *newvar;
+
+	if (!(new = cw_config_new()))
+		return NULL;
+
+	for (cat = old->root; cat; cat = cat->next) {
+		if (!(newcat = cw_category_new(cat->name)))
+			break;
+		newcat->ignored = cat->ignored;
+		cw_category_append(new, newcat);
+		for (var = cat->root; var; var = var->next) {
+			if (!(newvar = variable_clone(var)))
+				break;
+			cw_variable_append(newcat, newvar);
+		}
+		if (var)
+			break;
+	}
+	if (cat) {
+		cw_config_destroy(new);
+		return NULL;
+	}
+
+	return new;
+}
+
+static struct cw_variable *variables_clone(const struct cw_variable *old)
+{
+	struct cw_variable *new = NULL, **p = &new;
+
+	for (; old; old = old->next) {
+		if (!(*p = variable_clone(old))) {
+			cw_variables_destroy(new);
+			return NULL;
+		}
+		p = &(*p)->next;
+	}
+
+	return new;
+}
+
+/*--- rtcache_get: Look a realtime lookup up in the cache.
+ * Returns 1 and a copy of the result on a hit, 0 on a miss along with the
+ * generation to hand to rtcache_put() */
+static int rtcache_get(const char *key, int keylen, int multi, struct cw_variable **var, struct cw_config **cfg, unsigned int *gen)
+{
+	struct rtcache_entry *e, **p;
+	unsigned int hash = cw_hash_string(key);
+	time_t now = time(NULL);
+	int hit = 0;
+
+	cw_mutex_lock(&rtcache_lock);
+	*gen = rtcache_gen;
+	for (p = &rtcache[hash % RTCACHE_BUCKETS]; (e = *p); p = &e->next) {
+		if (e->hash == hash && e->multi == multi && e->keylen == keylen && !memcmp(e->key, key, keylen))
+			break;
+	}
+	if (e && e->expires <= now) {
+		rtcache_unlink(e);
+		cw_mutex_unlock(&rtcache_lock);
+		rtcache_entry_free(e);
+		cw_mutex_lock(&rtcache_lock);
+		e = NULL;
+	}
+	if (e) {
+		/* A copy that fails to allocate is treated as a miss */
+		if (multi)
+			hit = !e->cfg || (*cfg = config_clone(e->cfg)) != NULL;
+		else
+			hit = !e->var || (*var = variables_clone(e->var)) != NULL;
+	}
+	if (hit)
+		rtcache_hits++;
+	else
+		rtcache_misses++;
+	cw_mutex_unlock(&rtcache_lock);
+
+	return hit;
+}
+
+/*--- rtcache_put: Remember the result of a realtime lookup, unless the cache was flushed since rtcache_get() */
+static void rtcache_put(const char *family, const char *key, int keylen, int multi, const struct cw_variable *var, const struct cw_config *cfg, unsigned int gen)
+{
+	struct rtcache_entry *e, *cur, **p, *dead = NULL;
+	struct rtcache_family *f;
+	struct rtcache_ttl *t;
+	int ttl, i;
+	time_t now;
+
+	cw_mutex_lock(&rtcache_lock);
+	for (t = rtcache_ttls; t; t = t->next) {
+		if (!strcasecmp(t->family, family))
+			break;
+	}
+	if (var || cfg)
+		ttl = t ? t->ttl : rtcache_default_ttl;
+	else
+		ttl = t ? t->negttl : rtcache_default_negttl;
+	cw_mutex_unlock(&rtcache_lock);
+
+	if (ttl <= 0)
+		return;
+
+	if (!(e = calloc(1, sizeof(*e) + keylen + 1)))
+		return;
+	memcpy(e->key, key, keylen + 1);
+	e->keylen = keylen;
+	e->famlen = strlen(family);
+	e->hash = cw_hash_string(key);
+	e->multi = multi;
+	if ((var && !(e->var = variables_clone(var))) || (cfg && !(e->cfg = config_clone(cfg)))) {
+		rtcache_entry_free(e);
+		return;
+	}
+
+	now = time(NULL);
+	e->expires = now + ttl;
+
+	cw_mutex_lock(&rtcache_lock);
+	if (gen != rtcache_gen) {
+		/* flushed while we were asking the backend, the result may be stale */
+		cw_mutex_unlock(&rtcache_lock);
+		rtcache_entry_free(e);
+		return;
+	}
+	if (!(f = rtcache_family_find(family, 1))) {
+		cw_mutex_unlock(&rtcache_lock);
+		rtcache_entry_free(e);
+		return;
+	}
+	if (rtcache_entries >= RTCACHE_MAX) {
+		for (i = 0; i < RTCACHE_BUCKETS; i++) {
+			for (p = &rtcache[i]; (cur = *p); ) {
+				if (cur->expires <= now) {
+					rtcache_unlink(cur);
+					cur->next = dead;
+					dead = cur;
+				} else
+					p = &cur->next;
+			}
+		}
+	}
+	if (rtcache_entries >= RTCACHE_MAX) {
+		e->next = dead;
+		dead = e;
+	} else {
+		e->next = rtcache[e->hash % RTCACHE_BUCKETS];
+		rtcache[e->hash % RTCACHE_BUCKETS] = e;
+		if ((e->fnext = f->entries))
+			e->fnext->fpprev = &e->fnext;
+		e->fpprev = &f->entries;
+		f->entries = e;
+		rtcache_entries++;
+	}
+	cw_mutex_unlock(&rtcache_lock);
+
+	while ((cur = dead)) {
+		dead = cur->next;
+		rtcache_entry_free(cur);
+	}
+}
+
 struct cw_variable *cw_load_realtime(const char *family, ...)
 {
 	struct cw_config_engine *eng;
 	char db[256]="";
 	char table[256]="";
+	char key[RTCACHE_KEYLEN];
 	struct cw_variable *res=NULL;
-	va_list ap;
+	unsigned int gen;
+	int keylen;
+	va_list ap, aq;
 
 	va_start(ap, family);
 	eng = find_engine(family, db, sizeof(db), table, sizeof(table));
-	if (eng && eng->realtime_func) 
-		res = eng->realtime_func(db, table, ap);
+	if (eng && eng->realtime_func) {
+		va_copy(aq, ap);
+		keylen = rtcache_key(key, sizeof(key), family, aq);
+		va_end(aq);
+		if (keylen < 0 || !rtcache_get(key, keylen, 0, &res, NULL, &gen)) {
+			res = eng->realtime_func(db, table, ap);
+			if (keylen >= 0)
+				rtcache_put(family, key, keylen, 0, res, NULL, gen);
+		}
+	}
 	va_end(ap);
 
 	return res;
@@ -1015,13 +1482,24 @@ struct cw_config *cw_load_realtime_multientry(const char *family, ...)
 	struct cw_config_engine *eng;
 	char db[256]="";
 	char table[256]="";
+	char key[RTCACHE_KEYLEN];
 	struct cw_config *res=NULL;
-	va_list ap;
+	unsigned int gen;
+	int keylen;
+	va_list ap, aq;
 
 	va_start(ap, family);
 	eng = find_engine(family, db, sizeof(db), table, sizeof(table));
-	if (eng && eng->realtime_multi_func) 
-		res = eng->realtime_multi_func(db, table, ap);
+	if (eng && eng->realtime_multi_func) {
+		va_copy(aq, ap);
+		keylen = rtcache_key(key, sizeof(key), family, aq);
+		va_end(aq);
+		if (keylen < 0 || !rtcache_get(key, keylen, 1, NULL, &res, &gen)) {
+			res = eng->realtime_multi_func(db, table, ap);
+			if (keylen >= 0)
+				rtcache_put(family, key, keylen, 1, NULL, res, gen);
+		}
+	}
 	va_end(ap);
 
 	return res;
@@ -1033,17 +1511,30 @@ int cw_update_realtime(const char *family, const char *keyfield, const char *loo
 	int res = -1;
 	char db[256]="";
 	char table[256]="";
-	va_list ap;
+	va_list ap, aq;
 
 	va_start(ap, lookup);
 	eng = find_engine(family, db, sizeof(db), table, sizeof(table));
-	if (eng && eng->update_func) 
-		res = eng->update_func(db, table, keyfield, lookup, ap);
+	if (eng && eng->update_func) {
+		va_copy(aq, ap);
+		res = eng->update_func(db, table, keyfield, lookup, aq);
+		va_end(aq);
+	}
+
+	/* invalidate even on failure, the backend may have been partly updated */
+	if (eng)
+		rtcache_update(family, keyfield, lookup, ap);
 	va_end(ap);
 
 	return res;
 }
 
+/*--- cw_flush_realtime: Drop cached realtime results */
+int cw_flush_realtime(const char *family)
+{
+	return rtcache_flush(family);
+}
+
 static int config_command(int fd, int argc, char **argv) 
 {
 	struct cw_config_engine *eng;
@@ -1067,6 +1558,64 @@ static int config_command(int fd, int argc, char **argv)
 	return 0;
 }
 
+static int realtime_cache_show(int fd, int argc, char **argv)
+{
+	struct rtcache_ttl *ttl;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+
+	cw_mutex_lock(&rtcache_lock);
+	cw_cli(fd, "Cached lookups: %d (max %d)\n", rtcache_entries, RTCACHE_MAX);
+	cw_cli(fd, "Hits: %lu  Misses: %lu\n", rtcache_hits, rtcache_misses);
+	cw_cli(fd, "%-20s %8s %8s\n", "Family", "TTL", "Miss TTL");
+	cw_cli(fd, "%-20s %8d %8d\n", "(default)", rtcache_default_ttl, rtcache_default_negttl);
+	for (ttl = rtcache_ttls; ttl; ttl = ttl->next)
+		cw_cli(fd, "%-20s %8d %8d\n", ttl->family, ttl->ttl, ttl->negttl);
+	cw_mutex_unlock(&rtcache_lock);
+
+	return RESULT_SUCCESS;
+}
+
+static int realtime_cache_flush(int fd, int argc, char **argv)
+{
+	int n;
+
+	if (argc < 3 || argc > 4)
+		return RESULT_SHOWUSAGE;
+
+	n = rtcache_flush(argc == 4 ? argv[3] : NULL);
+	cw_cli(fd, "Flushed %d cached realtime lookup%s\n", n, (n == 1) ? "" : "s");
+
+	return RESULT_SUCCESS;
+}
+
+static char mandescr_realtime_cache_flush[] =
+"Description: Drop cached realtime lookups.\n"
+"Variables:\n"
+"	Family: Realtime family to flush, all families if omitted\n";
+
+static int action_realtime_cache_flush(struct mansession *s, struct message *m)
+{
+	char *family = astman_get_header(m, "Family");
+	char buf[80];
+	int n;
+
+	n = rtcache_flush(cw_strlen_zero(family) ? NULL : family);
+	snprintf(buf, sizeof(buf), "Flushed %d cached realtime lookups", n);
+	astman_send_ack(s, m, buf);
+
+	return 0;
+}
+
+static char show_realtime_cache_help[] =
+	"Usage: show realtime cache\n"
+	"	Shows realtime cache settings and statistics.\n";
+
+static char realtime_cache_flush_help[] =
+	"Usage: realtime cache flush [family]\n"
+	"	Drops cached realtime lookups of the given family, or of all families.\n";
+
 static char show_config_help[] =
 	"Usage: show config mappings\n"
 	"	Shows the filenames to config engines.\n";
@@ -1075,7 +1624,17 @@ static struct cw_cli_entry config_command_struct = {
 	{ "show", "config", "mappings", NULL }, config_command, "Show Config mappings (file names to config engines)", show_config_help, NULL
 };
 
+static struct cw_cli_entry realtime_cache_cli[] = {
+	{ { "show", "realtime", "cache", NULL }, realtime_cache_show,
+	  "Show realtime cache statistics", show_realtime_cache_help, NULL },
+	{ { "realtime", "cache", "flush", NULL }, realtime_cache_flush,
+	  "Flush cached realtime lookups", realtime_cache_flush_help, NULL },
+};
+
 int register_config_cli() 
 {
+	cw_cli_register_multiple(realtime_cache_cli, sizeof(realtime_cache_cli) / sizeof(realtime_cache_cli[0]));
+	cw_manager_register2("RealtimeCacheFlush", EVENT_FLAG_SYSTEM, action_realtime_cache_flush,
+		"Flush cached realtime lookups", mandescr_realtime_cache_flush);
 	return cw_cli_register(&config_command_struct);
 }
@@ -43,6 +43,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/devicestate.h"
 #include "callweaver/pbx.h"
 #include "callweaver/options.h"
+#include "callweaver/callweaver_hash.h"
 
 static const char *devstatestring[] = {
 	/* 0 CW_DEVICE_UNKNOWN */	"Unknown",	/* Valid, but unknown state */
@@ -54,24 +55,74 @@ static const char *devstatestring[] = {
 	/* 6 CW_DEVICE_RINGING */	"Ringing"	/* Ring, ring, ring */
 };
 
+/*
+ * State changes are handled by a small pool of worker threads. Each device
+ * that has ever changed state has an entry in a hash table holding the last
+ * state seen for it. A change notification only queues the device entry, so
+ * a burst of notifications for the same device collapses into a single query
+ * of cw_device_state(). Subscribers are only told about devices whose state
+ * actually changed, through a per-subscriber event queue which at most one
+ * worker drains at a time, without any engine lock held during the callback.
+ *
+ * A subscriber that falls behind only needs the latest state of each device,
+ * so once its queue grows past twice what it held after the last cleanup the
+ * superseded events are dropped. Device entries nobody has heard about for
+ * DEVSTATE_IDLE seconds, and that no queued event refers to, are freed by
+ * the workers in a periodic sweep.
+ */
+#define DEVSTATE_WORKERS	4
+#define DEVSTATE_BUCKETS	1024
+#define DEVSTATE_QUEUE_MIN	64	/* events queued before superseded ones are dropped */
+#define DEVSTATE_IDLE		600	/* s without a change before a device entry is freed */
+#define DEVSTATE_SWEEP		60	/* s between sweeps for idle device entries */
+
+#define DEV_QUEUED	(1 << 0)	/* on the pending device queue */
+#define DEV_BUSY	(1 << 1)	/* being queried by a worker */
+#define DEV_AGAIN	(1 << 2)	/* changed again while being queried */
+
+struct devstate_dev {
+	struct devstate_dev *next;	/* hash chain */
+	struct devstate_dev *run;	/* pending device queue */
+	unsigned int hash;
+	int state;			/* last state seen, -1 if never queried */
+	unsigned int seq;		/* bumped on every state change */
+	int flags;
+	int refs;			/* queued events referring to this entry */
+	time_t changed;			/* last change notification */
+	char name[1];
+};
+
+struct devstate_event {
+	struct devstate_event *next;
+	struct devstate_dev *dev;
+	unsigned int seq;
+	int state;
+};
+
 /* cw_devstate_cb: A device state watcher (callback) */
 struct devstate_cb {
 	void *data;
 	cw_devstate_cb_type callback;
-	CW_LIST_ENTRY(devstate_cb) list;
-};
-
-static CW_LIST_HEAD_STATIC(devstate_cbs, devstate_cb);
-
-struct state_change {
-	CW_LIST_ENTRY(state_change) list;
-	char device[1];
+	struct devstate_cb *next;	/* subscriber list */
+	struct devstate_cb *run;	/* subscriber run queue */
+	struct devstate_event *head;	/* undelivered events */
+	struct devstate_event **tail;
+	int count;			/* events queued */
+	int limit;			/* count at which superseded events are dropped */
+	int queued;
+	int busy;
 };
 
-static CW_LIST_HEAD_STATIC(state_changes, state_change);
+CW_MUTEX_DEFINE_STATIC(devstate_lock);
+static cw_cond_t devstate_work;		/* signalled when work is queued */
+static cw_cond_t devstate_idle;		/* signalled when a subscriber goes idle */
 
-static pthread_t change_thread = CW_PTHREADT_NULL;
-static cw_cond_t change_pending;
+static struct devstate_dev *devstate_devs[DEVSTATE_BUCKETS];
+static struct devstate_dev *dev_head, *dev_tail;
+static struct devstate_cb *devstate_cbs;
+static struct devstate_cb *cb_head, *cb_tail;
+static int devstate_workers;
+static time_t devstate_swept;
 
 /*--- devstate2str: Find devicestate as text message for output */
 const char *devstate2str(int devstate) 
@@ -138,6 +189,60 @@ int cw_device_state(const char *device)
 	}
 }
 
+/*--- devstate_dev_get: Find or create the engine entry for a device. Called with devstate_lock held */
+static struct devstate_dev *devstate_dev_get(const char *device, int create)
+{
+	struct devstate_dev *dev;
+	unsigned int hash;
+	size_t len;
+
+	hash = cw_hash_string(device);
+	for (dev = devstate_devs[hash % DEVSTATE_BUCKETS]; dev; dev = dev->next) {
+		if (dev->hash == hash && !strcmp(dev->name, device))
+			return dev;
+	}
+	if (!create)
+		return NULL;
+
+	len = strlen(device);
+	dev = calloc(1, sizeof(*dev) + len);
+	if (!dev)
+		return NULL;
+	memcpy(dev->name, device, len + 1);
+	dev->hash = hash;
+	dev->state = -1;
+	dev->next = devstate_devs[hash % DEVSTATE_BUCKETS];
+	devstate_devs[hash % DEVSTATE_BUCKETS] = dev;
+
+	return dev;
+}
+
+/*--- devstate_dev_queue: Put a device on the pending queue. Called with devstate_lock held */
+static void devstate_dev_queue(struct devstate_dev *dev)
+{
+	dev->flags |= DEV_QUEUED;
+	dev->run = NULL;
+	if (dev_tail)
+		dev_tail->run = dev;
+	else
+		dev_head = dev;
+	dev_tail = dev;
+	cw_cond_signal(&devstate_work);
+}
+
+/*--- devstate_cb_queue: Schedule a subscriber for delivery. Called with devstate_lock held */
+static void devstate_cb_queue(struct devstate_cb *devcb)
+{
+	devcb->queued = 1;
+	devcb->run = NULL;
+	if (cb_tail)
+		cb_tail->run = devcb;
+	else
+		cb_head = devcb;
+	cb_tail = devcb;
+	cw_cond_signal(&devstate_work);
+}
+
 /*--- cw_devstate_add: Add device state watcher */
 int cw_devstate_add(cw_devstate_cb_type callback, void *data)
 {
@@ -152,10 +257,13 @@ int cw_devstate_add(cw_devstate_cb_type callback, void *data)
 
 	devcb->data = data;
 	devcb->callback = callback;
+	devcb->tail = &devcb->head;
+	devcb->limit = DEVSTATE_QUEUE_MIN;
 
-	CW_LIST_LOCK(&devstate_cbs);
-	CW_LIST_INSERT_HEAD(&devstate_cbs, devcb, list);
-	CW_LIST_UNLOCK(&devstate_cbs);
+	cw_mutex_lock(&devstate_lock);
+	devcb->next = devstate_cbs;
+	devstate_cbs = devcb;
+	cw_mutex_unlock(&devstate_lock);
 
 	return 0;
 }
@@ -163,64 +271,245 @@ int cw_devstate_add(cw_devstate_cb_type callback, void *data)
 /*--- cw_devstate_del: Remove device state watcher */
 void cw_devstate_del(cw_devstate_cb_type callback, void *data)
 {
-	struct devstate_cb *devcb;
+	struct devstate_cb *devcb, **p;
+	struct devstate_event *ev, *next;
 
-	CW_LIST_LOCK(&devstate_cbs);
-	CW_LIST_TRAVERSE_SAFE_BEGIN(&devstate_cbs, devcb, list) {
-		if ((devcb->callback == callback) && (devcb->data == data)) {
-			CW_LIST_REMOVE_CURRENT(&devstate_cbs, list);
-			free(devcb);
+	cw_mutex_lock(&devstate_lock);
+	for (p = &devstate_cbs; (devcb = *p); p = &devcb->next) {
+		if ((devcb->callback == callback) && (devcb->data == data))
 			break;
+	}
+	if (!devcb) {
+		cw_mutex_unlock(&devstate_lock);
+		return;
+	}
+	*p = devcb->next;
+
+	/* The callback must not be running once we return */
+	while (devcb->busy)
+		cw_cond_wait(&devstate_idle, &devstate_lock);
+
+	if (devcb->queued) {
+		struct devstate_cb *prev = NULL, *cur;
+
+		for (cur = cb_head; cur != devcb; prev = cur, cur = cur->run);
+		if (prev)
+			prev->run = devcb->run;
+		else
+			cb_head = devcb->run;
+		if (cb_tail == devcb)
+			cb_tail = prev;
+		devcb->queued = 0;
+	}
+
+	for (ev = devcb->head; ev; ev = ev->next)
+		ev->dev->refs--;
+	ev = devcb->head;
+	cw_mutex_unlock(&devstate_lock);
+
+	for (; ev; ev = next) {
+		next = ev->next;
+		free(ev);
+	}
+	free(devcb);
+}
+
+/*--- devstate_cb_compact: Drop the queued events of a subscriber that later ones supersede. Called with devstate_lock held */
+static void devstate_cb_compact(struct devstate_cb *devcb)
+{
+	struct devstate_event *ev, **p;
+
+	devcb->count = 0;
+	for (p = &devcb->head; (ev = *p); ) {
+		if (ev->seq != ev->dev->seq) {
+			*p = ev->next;
+			ev->dev->refs--;
+			free(ev);
+		} else {
+			devcb->count++;
+			p = &ev->next;
 		}
 	}
-	CW_LIST_TRAVERSE_SAFE_END;
-	CW_LIST_UNLOCK(&devstate_cbs);
+	devcb->tail = p;
+	devcb->limit = (devcb->count*2 > DEVSTATE_QUEUE_MIN) ? devcb->count*2 : DEVSTATE_QUEUE_MIN;
 }
 
-/*--- do_state_change: Notify callback watchers of change, and notify PBX core for hint updates */
-static inline void do_state_change(const char *device)
+/*--- devstate_sweep: Free device entries idle for DEVSTATE_IDLE seconds. Called with devstate_lock held */
+static void devstate_sweep(time_t now)
+{
+	struct devstate_dev *dev, **p;
+	int i;
+
+	devstate_swept = now;
+	for (i = 0; i < DEVSTATE_BUCKETS; i++) {
+		for (p = &devstate_devs[i]; (dev = *p); ) {
+			if (!dev->flags && !dev->refs && now - dev->changed >= DEVSTATE_IDLE) {
+				*p = dev->next;
+				free(dev);
+			} else {
+				p = &dev->next;
+			}
+		}
+	}
+}
+
+/*--- devstate_dev_run: Query a device and queue events for the subscribers if its state changed */
+static void devstate_dev_run(struct devstate_dev *dev)
 {
-	int state;
 	struct devstate_cb *devcb;
+	struct devstate_event *ev;
+	int state;
+	int changed;
 
-	state = cw_device_state(device);
+	state = cw_device_state(dev->name);
 	if (option_debug > 2)
-		cw_log(LOG_DEBUG, "Changing state for %s - state %d (%s)\n", device, state, devstate2str(state));
+		cw_log(LOG_DEBUG, "Changing state for %s - state %d (%s)\n", dev->name, state, devstate2str(state));
+
+	cw_mutex_lock(&devstate_lock);
+	changed = (state != dev->state);
+	if (changed) {
+		dev->state = state;
+		dev->seq++;
+		for (devcb = devstate_cbs; devcb; devcb = devcb->next) {
+			if (!(ev = malloc(sizeof(*ev)))) {
+				cw_log(LOG_WARNING, "Out of memory, dropping state change of %s\n", dev->name);
+				continue;
+			}
+			ev->next = NULL;
+			ev->dev = dev;
+			ev->seq = dev->seq;
+			ev->state = state;
+			dev->refs++;
+			*devcb->tail = ev;
+			devcb->tail = &ev->next;
+			if (++devcb->count > devcb->limit)
+				devstate_cb_compact(devcb);
+			if (!devcb->queued && !devcb->busy)
+				devstate_cb_queue(devcb);
+		}
+	}
+	cw_mutex_unlock(&devstate_lock);
+
+	if (changed)
+		cw_hint_state_changed(dev->name);
+
+	cw_mutex_lock(&devstate_lock);
+	dev->flags &= ~DEV_BUSY;
+	if ((dev->flags & DEV_AGAIN)) {
+		dev->flags &= ~DEV_AGAIN;
+		devstate_dev_queue(dev);
+	}
+	cw_mutex_unlock(&devstate_lock);
+}
+
+/*--- devstate_cb_run: Deliver the pending events of a subscriber */
+static void devstate_cb_run(struct devstate_cb *devcb)
+{
+	struct devstate_event *ev, *next, *deliver, **dp, *stale;
+
+	/* Take the queued events, dropping those superseded by a later
+	 * event for the same device further down the queue */
+	cw_mutex_lock(&devstate_lock);
+	deliver = NULL;
+	dp = &deliver;
+	stale = NULL;
+	for (ev = devcb->head; ev; ev = next) {
+		next = ev->next;
+		if (ev->seq == ev->dev->seq) {
+			*dp = ev;
+			dp = &ev->next;
+		} else {
+			ev->dev->refs--;
+			ev->next = stale;
+			stale = ev;
+		}
+	}
+	*dp = NULL;
+	devcb->head = NULL;
+	devcb->tail = &devcb->head;
+	devcb->count = 0;
+	cw_mutex_unlock(&devstate_lock);
+
+	for (ev = stale; ev; ev = next) {
+		next = ev->next;
+		free(ev);
+	}
+	/* The entries stay referenced, so cannot be swept, until we are done */
+	for (ev = deliver; ev; ev = ev->next)
+		devcb->callback(ev->dev->name, ev->state, devcb->data);
+
+	cw_mutex_lock(&devstate_lock);
+	for (ev = deliver; ev; ev = next) {
+		next = ev->next;
+		ev->dev->refs--;
+		free(ev);
+	}
+	devcb->busy = 0;
+	if (devcb->head)
+		devstate_cb_queue(devcb);
+	cw_cond_broadcast(&devstate_idle);
+	cw_mutex_unlock(&devstate_lock);
+}
 
-	CW_LIST_LOCK(&devstate_cbs);
-	CW_LIST_TRAVERSE(&devstate_cbs, devcb, list)
-		devcb->callback(device, state, devcb->data);
-	CW_LIST_UNLOCK(&devstate_cbs);
+/*--- devstate_run_one: Do one unit of queued work. Called with devstate_lock held, returns with it held.
+ * Returns 0 if there was nothing to do */
+static int devstate_run_one(void)
+{
+	struct devstate_dev *dev;
+	struct devstate_cb *devcb;
 
-	cw_hint_state_changed(device);
+	if ((devcb = cb_head)) {
+		if (!(cb_head = devcb->run))
+			cb_tail = NULL;
+		devcb->queued = 0;
+		devcb->busy = 1;
+		cw_mutex_unlock(&devstate_lock);
+		devstate_cb_run(devcb);
+		cw_mutex_lock(&devstate_lock);
+		return 1;
+	}
+	if ((dev = dev_head)) {
+		if (!(dev_head = dev->run))
+			dev_tail = NULL;
+		dev->flags = (dev->flags & ~DEV_QUEUED) | DEV_BUSY;
+		cw_mutex_unlock(&devstate_lock);
+		devstate_dev_run(dev);
+		cw_mutex_lock(&devstate_lock);
+		return 1;
+	}
+	return 0;
 }
 
 static int __cw_device_state_changed_literal(char *buf)
 {
 	char *device, *tmp;
-	struct state_change *change = NULL;
+	struct devstate_dev *dev;
 
 	device = buf;
 	tmp = strrchr(device, '-');
 	if (tmp)
 		*tmp = '\0';
-	if (change_thread != CW_PTHREADT_NULL)
-		change = calloc(1, sizeof(*change) + strlen(device));
-
-	if (!change) {
-		/* we could not allocate a change struct, or */
-		/* there is no background thread, so process the change now */
-		do_state_change(device);
-	} else {
-		/* queue the change */
-		strcpy(change->device, device);
-		CW_LIST_LOCK(&state_changes);
-		CW_LIST_INSERT_TAIL(&state_changes, change, list);
-		if (CW_LIST_FIRST(&state_changes) == change)
-			/* the list was empty, signal the thread */
-			cw_cond_signal(&change_pending);
-		CW_LIST_UNLOCK(&state_changes);
+
+	cw_mutex_lock(&devstate_lock);
+	dev = devstate_dev_get(device, 1);
+	if (!dev) {
+		cw_mutex_unlock(&devstate_lock);
+		cw_log(LOG_WARNING, "Out of memory, dropping state change of %s\n", device);
+		return 1;
 	}
+	dev->changed = time(NULL);
+	if ((dev->flags & DEV_BUSY))
+		dev->flags |= DEV_AGAIN;
+	else if (!(dev->flags & DEV_QUEUED))
+		devstate_dev_queue(dev);
+
+	if (!devstate_workers) {
+		/* there are no background threads, so process the change now */
+		while (devstate_run_one());
+		if (dev->changed - devstate_swept >= DEVSTATE_SWEEP)
+			devstate_sweep(dev->changed);
+	}
+	cw_mutex_unlock(&devstate_lock);
 
 	return 1;
 }
@@ -244,40 +533,61 @@ int cw_device_state_changed(const char *fmt, ...)
 	return __cw_device_state_changed_literal(buf);
 }
 
-/*--- do_devstate_changes: Go through the dev state change queue and update changes in the dev state thread */
+/*--- cw_device_state_cached: Last state the engine saw for a device, -1 if none */
+int cw_device_state_cached(const char *device)
+{
+	struct devstate_dev *dev;
+	int res = -1;
+
+	cw_mutex_lock(&devstate_lock);
+	if ((dev = devstate_dev_get(device, 0)))
+		res = dev->state;
+	cw_mutex_unlock(&devstate_lock);
+
+	return res;
+}
+
+/*--- do_devstate_changes: Worker thread draining the device and subscriber queues */
 static void *do_devstate_changes(void *data)
 {
-	struct state_change *cur=NULL;
-
-	CW_LIST_LOCK(&state_changes);
-	for(;;) {
-		/* the list lock will _always_ be held at this point in the loop */
-		cur = CW_LIST_REMOVE_HEAD(&state_changes, list);
-		if (cur) {
-			/* we got an entry, so unlock the list while we process it */
-			CW_LIST_UNLOCK(&state_changes);
-			do_state_change(cur->device);
-			free(cur);
-			CW_LIST_LOCK(&state_changes);
-		} else {
-			/* there was no entry, so atomically unlock the list and wait for
-			   the condition to be signalled (returns with the lock held) */
-			cw_cond_wait(&change_pending, &state_changes.lock);
-		}
+	struct timespec ts;
+	time_t now;
+
+	cw_mutex_lock(&devstate_lock);
+	for (;;) {
+		/* devstate_lock will _always_ be held at this point in the loop */
+		if (devstate_run_one())
+			continue;
+		now = time(NULL);
+		if (now - devstate_swept >= DEVSTATE_SWEEP)
+			devstate_sweep(now);
+		ts.tv_sec = devstate_swept + DEVSTATE_SWEEP;
+		ts.tv_nsec = 0;
+		cw_cond_timedwait(&devstate_work, &devstate_lock, &ts);
 	}
 
 	return NULL;
 }
 
-/*--- cw_device_state_engine_init: Initialize the device state engine in separate thread */
+/*--- cw_device_state_engine_init: Initialize the device state engine worker threads */
 int cw_device_state_engine_init(void)
 {
 	pthread_attr_t attr;
+	pthread_t thread;
+	int i;
 
-	cw_cond_init(&change_pending, NULL);
+	cw_cond_init(&devstate_work, NULL);
+	cw_cond_init(&devstate_idle, NULL);
 	pthread_attr_init(&attr);
 	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-	if (cw_pthread_create(&change_thread, &attr, do_devstate_changes, NULL) < 0) {
+	for (i = 0; i < DEVSTATE_WORKERS; i++) {
+		if (cw_pthread_create(&thread, &attr, do_devstate_changes, NULL) < 0)
+			break;
+		cw_mutex_lock(&devstate_lock);
+		devstate_workers++;
+		cw_mutex_unlock(&devstate_lock);
+	}
+	if (!devstate_workers) {
 		cw_log(LOG_ERROR, "Unable to start device state change thread.\n");
 		return -1;
 	}
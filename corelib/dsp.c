@@ -46,6 +46,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/dsp.h"
 #include "callweaver/ulaw.h"
 #include "callweaver/alaw.h"
+#include "callweaver/pcm.h"
 
 /* Number of goertzels for progress detect */
 #define GSAMP_SIZE_NA       183     /* North America - 350, 440, 480, 620, 950, 1400, 1800 Hz */
@@ -502,7 +503,6 @@ int cw_dsp_silence(struct cw_dsp *dsp, struct cw_frame *f, int *totalsilence)
     int16_t *amp;
     uint8_t *data;
     int len = 0;
-    int x = 0;
 
     if (f->frametype != CW_FRAME_VOICE)
     {
@@ -519,14 +519,12 @@ int cw_dsp_silence(struct cw_dsp *dsp, struct cw_frame *f, int *totalsilence)
     case CW_FORMAT_ULAW:
         amp = alloca(f->datalen*sizeof(int16_t));
         len = f->datalen;
-        for (x = 0;  x < len;  x++) 
-            amp[x] = CW_MULAW(data[x]);
+        cw_ulaw_to_slin(amp, data, len);
         break;
     case CW_FORMAT_ALAW:
         amp = alloca(f->datalen*sizeof(int16_t));
         len = f->datalen;
-        for (x = 0;  x < len;  x++) 
-            amp[x] = CW_ALAW(data[x]);
+        cw_alaw_to_slin(amp, data, len);
         break;
     default:
         cw_log(LOG_WARNING, "Silence detection is not supported on codec %s. Use RFC2833\n", cw_getformatname(f->subclass));
@@ -543,12 +541,10 @@ do \
         switch(inf->subclass) \
         { \
         case CW_FORMAT_ULAW: \
-            for (x = 0;  x < len;  x++) \
-                odata[x] = CW_LIN2MU(amp[x]); \
+            cw_slin_to_ulaw(odata, amp, len); \
             break; \
         case CW_FORMAT_ALAW: \
-            for (x = 0;  x < len;  x++) \
-                odata[x] = CW_LIN2A(amp[x]); \
+            cw_slin_to_alaw(odata, amp, len); \
             break; \
         } \
     } \
@@ -559,7 +555,6 @@ struct cw_frame *cw_dsp_process(struct cw_channel *chan, struct cw_dsp *dsp, str
 {
     int silence;
     int res;
-    int x;
     int16_t *amp;
     uint8_t *odata;
     int len;
@@ -582,13 +577,11 @@ struct cw_frame *cw_dsp_process(struct cw_channel *chan, struct cw_dsp *dsp, str
         break;
     case CW_FORMAT_ULAW:
         amp = alloca(af->datalen*sizeof(int16_t));
-        for (x = 0;  x < len;  x++) 
-            amp[x] = CW_MULAW(odata[x]);
+        cw_ulaw_to_slin(amp, odata, len);
         break;
     case CW_FORMAT_ALAW:
         amp = alloca(af->datalen*sizeof(int16_t));
-        for (x = 0;  x < len;  x++) 
-            amp[x] = CW_ALAW(odata[x]);
+        cw_alaw_to_slin(amp, odata, len);
         break;
     default:
         cw_log(LOG_WARNING, "Tone detection is not supported on codec %s. Use RFC2833\n", cw_getformatname(af->subclass));
@@ -35,6 +35,11 @@
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#define FILE_USE_INOTIFY
+#endif
 
 #include "callweaver.h"
 
@@ -52,6 +57,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/lock.h"
 #include "callweaver/app.h"
 #include "callweaver/pbx.h"
+#include "callweaver/callweaver_hash.h"
 
 struct cw_format {
 	/* Name of format */
@@ -99,6 +105,8 @@ struct cw_filestream {
 	int lastwriteformat;
 	int lasttimeout;
 	struct cw_channel *owner;
+	/* Shared contents the stream reads from, if the prompt was cached */
+	struct prompt_map *map;
 };
 
 CW_MUTEX_DEFINE_STATIC(formatlock);
@@ -341,6 +349,744 @@ static int exts_compare(const char *exts, const char *type)
 	return 0;
 }
 
+/*
+ * Prompt index and cache.
+ *
+ * Looking up a prompt used to stat() one candidate path per extension of
+ * every registered format, times the language fallbacks.  On Linux the
+ * files under the sounds directory are indexed at startup and the index
+ * is kept current with inotify, so those lookups never leave memory.
+ * Names outside the sounds directory, and in directories that could not
+ * be watched or are reached through a symlink, are still checked with
+ * stat().
+ *
+ * Prompts that are opened often are read into memory once and shared.
+ * Each playback reads its own fmemopen() stream over the copy, so the
+ * format modules work unchanged without any file I/O.  The copy lives in
+ * anonymous memory rather than a mapping of the file, so a prompt being
+ * rewritten underneath a playback can't fault the reader.
+ *
+ * promptlock is never held over disk I/O.  Copies are read with the lock
+ * dropped, a rescan builds a new table that replaces the old one in a
+ * single pointer swap, and a new directory is scanned into a table of
+ * its own that is then merged in.
+ */
+#define PROMPT_BUCKETS			4096
+#define PROMPT_HOT_OPENS		2		/* Opens before a prompt is mapped */
+#define PROMPT_CACHE_MAX_FILE	(1024*1024)
+#define PROMPT_CACHE_MAX		(64*1024*1024)
+
+struct prompt_map {
+	int refs;
+	size_t len;
+	void *data;
+};
+
+struct prompt_entry {
+	struct prompt_entry *next;
+	unsigned int hash;
+	unsigned int opens;
+	int loading;				/* A copy is being read, cleared if the file changes */
+	struct prompt_map *map;
+	char name[1];				/* Relative to the sounds directory, with extension */
+};
+
+#ifdef FILE_USE_INOTIFY
+/* Every directory the index has seen.  Those that could not be watched,
+   or are another path to one already watched, have a wd of -1 and are
+   only on the dirs chain. */
+struct prompt_watch {
+	struct prompt_watch *next;		/* By descriptor */
+	struct prompt_watch *dnext;		/* By directory */
+	int wd;
+	unsigned int hash;			/* Of dir */
+	char dir[1];				/* Relative to the sounds directory, "" for the top */
+};
+
+/* A name inotify reported created, to look at without promptlock held */
+struct prompt_pending {
+	struct prompt_pending *next;
+	char name[1];
+};
+#endif
+
+struct prompt_table {
+	struct prompt_entry *index[PROMPT_BUCKETS];
+#ifdef FILE_USE_INOTIFY
+	struct prompt_watch *watches[PROMPT_BUCKETS];
+	struct prompt_watch *dirs[PROMPT_BUCKETS];
+#endif
+	int entries;
+};
+
+CW_MUTEX_DEFINE_STATIC(promptlock);
+static struct prompt_table *prompts = NULL;
+static int prompt_index_ready = 0;
+static int prompt_maps = 0;
+static size_t prompt_cache_bytes = 0;
+static int prompt_transcoded = 0;
+static int prompt_transcode_failed = 0;
+
+#ifdef FILE_USE_INOTIFY
+static int prompt_inotify = -1;
+static pthread_t prompt_thread = CW_PTHREADT_NULL;
+#endif
+
+/* Must be called with promptlock held */
+static void prompt_map_release(struct prompt_map *map)
+{
+	if (map  &&  --map->refs == 0) {
+		munmap(map->data, map->len);
+		prompt_cache_bytes -= map->len;
+		prompt_maps--;
+		free(map);
+	}
+}
+
+/* Must be called with promptlock held, unless t is not yet shared */
+static struct prompt_entry *prompt_find(struct prompt_table *t, const char *name, unsigned int hash)
+{
+	struct prompt_entry *e;
+
+	for (e = t->index[hash % PROMPT_BUCKETS];  e;  e = e->next) {
+		if (e->hash == hash  &&  !strcmp(e->name, name))
+			return e;
+	}
+	return NULL;
+}
+
+/* Must be called with promptlock held, unless t is not yet shared.  Adds
+   a prompt, or drops the cached contents of one that already exists since
+   they may be stale. */
+static void prompt_add(struct prompt_table *t, const char *name)
+{
+	struct prompt_entry *e;
+	unsigned int hash = cw_hash_string(name);
+
+	if ((e = prompt_find(t, name, hash))) {
+		prompt_map_release(e->map);
+		e->map = NULL;
+		e->loading = 0;
+		return;
+	}
+	if ((e = malloc(sizeof(*e) + strlen(name))) == NULL)
+		return;
+	strcpy(e->name, name);
+	e->hash = hash;
+	e->opens = 0;
+	e->loading = 0;
+	e->map = NULL;
+	e->next = t->index[hash % PROMPT_BUCKETS];
+	t->index[hash % PROMPT_BUCKETS] = e;
+	t->entries++;
+}
+
+/* Must be called with promptlock held.  Removes name, or with prefix set
+   everything below the directory name. */
+static void prompt_del(struct prompt_table *t, const char *name, int prefix)
+{
+	struct prompt_entry *e;
+	struct prompt_entry *prev;
+	struct prompt_entry *next;
+	size_t len = strlen(name);
+	int x;
+
+	for (x = 0;  x < PROMPT_BUCKETS;  x++) {
+		if (!prefix)
+			x = cw_hash_string(name) % PROMPT_BUCKETS;
+		for (prev = NULL, e = t->index[x];  e;  e = next) {
+			next = e->next;
+			if (prefix  ?  (strncmp(e->name, name, len) || e->name[len] != '/')  :  strcmp(e->name, name)) {
+				prev = e;
+				continue;
+			}
+			if (prev)
+				prev->next = next;
+			else
+				t->index[x] = next;
+			prompt_map_release(e->map);
+			free(e);
+			t->entries--;
+		}
+		if (!prefix)
+			break;
+	}
+}
+
+/* Returns the part of fn relative to the sounds directory, or NULL if it
+   lies outside it */
+static const char *prompt_relative(const char *fn)
+{
+	size_t len = strlen(cw_config_CW_SOUNDS_DIR);
+
+	if (strncmp(fn, cw_config_CW_SOUNDS_DIR, len)  ||  fn[len] != '/')
+		return NULL;
+	return fn + len + 1;
+}
+
+#ifdef FILE_USE_INOTIFY
+/* Must be called with promptlock held, unless t is not yet shared */
+static struct prompt_watch *prompt_dir_find(struct prompt_table *t, const char *dir, unsigned int hash)
+{
+	struct prompt_watch *w;
+
+	for (w = t->dirs[hash % PROMPT_BUCKETS];  w;  w = w->dnext) {
+		if (w->hash == hash  &&  !strcmp(w->dir, dir))
+			return w;
+	}
+	return NULL;
+}
+
+/* Must be called with promptlock held.  Returns 0 if the index has name,
+   -1 if it knows name does not exist, or 1 if only stat() can tell. */
+static int prompt_known(struct prompt_table *t, const char *name)
+{
+	char dir[PATH_MAX];
+	struct prompt_watch *w;
+	char *p;
+	int own = 1;
+
+	/* The index only holds plain paths */
+	if (name[0] == '.'  ||  strstr(name, "/.")  ||  strstr(name, "//"))
+		return 1;
+	cw_copy_string(dir, name, sizeof(dir));
+	for (;;) {
+		if ((p = strrchr(dir, '/')))
+			*p = '\0';
+		else
+			dir[0] = '\0';
+		if ((w = prompt_dir_find(t, dir, cw_hash_string(dir)))) {
+			if (w->wd < 0)
+				return 1;
+			if (own)
+				return prompt_find(t, name, cw_hash_string(name))  ?  0  :  -1;
+			/* A subdirectory of a watched one would have been indexed */
+			return -1;
+		}
+		if (dir[0] == '\0')
+			return 1;
+		own = 0;
+	}
+}
+#endif
+
+/* stat() replacement for cw_filehelper().  Returns 0 if fn exists, -1 if not. */
+static int prompt_stat(const char *fn)
+{
+	struct stat st;
+#ifdef FILE_USE_INOTIFY
+	const char *name;
+	int res;
+
+	if (prompt_index_ready  &&  (name = prompt_relative(fn))) {
+		cw_mutex_lock(&promptlock);
+		res = prompt_known(prompts, name);
+		cw_mutex_unlock(&promptlock);
+		if (res <= 0)
+			return res;
+	}
+#endif
+	return stat(fn, &st);
+}
+
+/* Brings the index entry for fn in line with the disk, for changes we make
+   ourselves and can't wait for inotify to report */
+static void prompt_update(const char *fn)
+{
+	struct stat st;
+	const char *name;
+
+	if (!prompt_index_ready  ||  !(name = prompt_relative(fn)))
+		return;
+	cw_mutex_lock(&promptlock);
+	if (!stat(fn, &st)  &&  S_ISREG(st.st_mode))
+		prompt_add(prompts, name);
+	else
+		prompt_del(prompts, name, 0);
+	cw_mutex_unlock(&promptlock);
+}
+
+/* fopen(fn, "r") replacement for playback.  Hot prompts are served from the
+   shared mapping, in which case *mapp holds a reference to release once the
+   stream is closed. */
+static FILE *prompt_fopen(const char *fn, struct prompt_map **mapp)
+{
+	struct prompt_entry *e;
+	struct prompt_map *map = NULL;
+	struct prompt_map *copy = NULL;
+	struct stat st;
+	const char *name;
+	unsigned int hash;
+	void *data;
+	FILE *f;
+	int load = 0;
+	int fd;
+
+	*mapp = NULL;
+	if (!prompt_index_ready  ||  !(name = prompt_relative(fn)))
+		return fopen(fn, "r");
+	hash = cw_hash_string(name);
+
+	cw_mutex_lock(&promptlock);
+	if ((e = prompt_find(prompts, name, hash))) {
+		e->opens++;
+		if ((map = e->map))
+			map->refs++;
+		else if (e->opens >= PROMPT_HOT_OPENS  &&  !e->loading)
+			load = e->loading = 1;
+	}
+	cw_mutex_unlock(&promptlock);
+
+	if (load) {
+		/* Read the copy unlocked.  It is only used if nothing changed the
+		   file, or replaced the index, in the meantime. */
+		if ((fd = open(fn, O_RDONLY)) > -1) {
+			if (!fstat(fd, &st)
+				&&  st.st_size > 0
+				&&  st.st_size <= PROMPT_CACHE_MAX_FILE
+				&&  prompt_cache_bytes + st.st_size <= PROMPT_CACHE_MAX
+				&&  (data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED) {
+				if (read(fd, data, st.st_size) == st.st_size  &&  !mprotect(data, st.st_size, PROT_READ)
+					&&  (copy = malloc(sizeof(*copy)))) {
+					copy->refs = 1;
+					copy->len = st.st_size;
+					copy->data = data;
+				} else {
+					munmap(data, st.st_size);
+				}
+			}
+			close(fd);
+		}
+
+		cw_mutex_lock(&promptlock);
+		if ((e = prompt_find(prompts, name, hash))  &&  e->loading) {
+			e->loading = 0;
+			if (copy  &&  prompt_cache_bytes + copy->len <= PROMPT_CACHE_MAX) {
+				e->map = copy;
+				prompt_cache_bytes += copy->len;
+				prompt_maps++;
+				map = copy;
+				map->refs++;
+				copy = NULL;
+			}
+		}
+		cw_mutex_unlock(&promptlock);
+		if (copy) {
+			munmap(copy->data, copy->len);
+			free(copy);
+		}
+	}
+
+	if (!map)
+		return fopen(fn, "r");
+	if ((f = fmemopen(map->data, map->len, "r")) == NULL) {
+		cw_mutex_lock(&promptlock);
+		prompt_map_release(map);
+		cw_mutex_unlock(&promptlock);
+		return fopen(fn, "r");
+	}
+	*mapp = map;
+	return f;
+}
+
+static void prompt_close(struct prompt_map *map)
+{
+	if (map) {
+		cw_mutex_lock(&promptlock);
+		prompt_map_release(map);
+		cw_mutex_unlock(&promptlock);
+	}
+}
+
+#ifdef FILE_USE_INOTIFY
+/* Must be called with promptlock held, unless t is not yet shared */
+static void prompt_dir_unlink(struct prompt_table *t, struct prompt_watch *w)
+{
+	struct prompt_watch **wp;
+
+	for (wp = &t->dirs[w->hash % PROMPT_BUCKETS];  *wp;  wp = &(*wp)->dnext) {
+		if (*wp == w) {
+			*wp = w->dnext;
+			break;
+		}
+	}
+}
+
+/* Must be called with promptlock held, unless t is not yet shared */
+static struct prompt_watch *prompt_watch_find(struct prompt_table *t, int wd, int unlink)
+{
+	struct prompt_watch *w;
+	struct prompt_watch *prev = NULL;
+
+	for (w = t->watches[wd % PROMPT_BUCKETS];  w;  prev = w, w = w->next) {
+		if (w->wd != wd)
+			continue;
+		if (unlink) {
+			if (prev)
+				prev->next = w->next;
+			else
+				t->watches[wd % PROMPT_BUCKETS] = w->next;
+			prompt_dir_unlink(t, w);
+		}
+		return w;
+	}
+	return NULL;
+}
+
+/* Must be called with promptlock held, unless t is not yet shared.
+   Records dir, watching it if that can be done.  Returns the watch
+   descriptor, or -1 if the directory is not watched. */
+static int prompt_watch_add(struct prompt_table *t, const char *dir)
+{
+	struct prompt_watch *w;
+	char path[PATH_MAX];
+	unsigned int hash = cw_hash_string(dir);
+	int wd;
+
+	if ((w = prompt_dir_find(t, dir, hash))) {
+		if (w->wd >= 0)
+			return w->wd;
+		/* It may have been replaced by something that can be watched */
+		prompt_dir_unlink(t, w);
+		free(w);
+	}
+	if (*dir)
+		snprintf(path, sizeof(path), "%s/%s", cw_config_CW_SOUNDS_DIR, dir);
+	else
+		cw_copy_string(path, cw_config_CW_SOUNDS_DIR, sizeof(path));
+	wd = inotify_add_watch(prompt_inotify, path,
+		IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_ONLYDIR);
+	if (wd < 0)
+		cw_log(LOG_WARNING, "Unable to watch %s, checking it with stat(): %s\n", path, strerror(errno));
+	else if (prompt_watch_find(t, wd, 0))
+		wd = -1;	/* Another path to a directory already watched */
+	if ((w = malloc(sizeof(*w) + strlen(dir))) == NULL)
+		return -1;
+	w->wd = wd;
+	w->hash = hash;
+	strcpy(w->dir, dir);
+	w->dnext = t->dirs[hash % PROMPT_BUCKETS];
+	t->dirs[hash % PROMPT_BUCKETS] = w;
+	if (wd >= 0) {
+		w->next = t->watches[wd % PROMPT_BUCKETS];
+		t->watches[wd % PROMPT_BUCKETS] = w;
+	}
+	return wd;
+}
+
+/* Must be called with promptlock held, unless t is not yet shared.
+   Records a directory that is left to stat(). */
+static void prompt_dir_link(struct prompt_table *t, const char *dir)
+{
+	struct prompt_watch *w;
+	unsigned int hash = cw_hash_string(dir);
+
+	if (prompt_dir_find(t, dir, hash)  ||  (w = malloc(sizeof(*w) + strlen(dir))) == NULL)
+		return;
+	w->wd = -1;
+	w->hash = hash;
+	strcpy(w->dir, dir);
+	w->dnext = t->dirs[hash % PROMPT_BUCKETS];
+	t->dirs[hash % PROMPT_BUCKETS] = w;
+}
+
+/* Must be called on a table that is not yet shared, as it reads the disk.
+   Indexes and watches dir and everything below it.  Symlinked directories
+   and other paths to a directory already watched are not descended into,
+   which keeps a link back up the tree from looping, and are left to
+   stat(). */
+static void prompt_scan(struct prompt_table *t, const char *dir)
+{
+	char path[PATH_MAX];
+	char name[PATH_MAX];
+	struct dirent *de;
+	struct stat st;
+	DIR *d;
+
+	if (prompt_watch_add(t, dir) < 0  &&  *dir)
+		return;
+	if (*dir)
+		snprintf(path, sizeof(path), "%s/%s", cw_config_CW_SOUNDS_DIR, dir);
+	else
+		cw_copy_string(path, cw_config_CW_SOUNDS_DIR, sizeof(path));
+	if ((d = opendir(path)) == NULL)
+		return;
+	while ((de = readdir(d))) {
+		if (de->d_name[0] == '.')
+			continue;
+		if (*dir)
+			snprintf(name, sizeof(name), "%s/%s", dir, de->d_name);
+		else
+			cw_copy_string(name, de->d_name, sizeof(name));
+		snprintf(path, sizeof(path), "%s/%s", cw_config_CW_SOUNDS_DIR, name);
+		if (lstat(path, &st))
+			continue;
+		if (S_ISLNK(st.st_mode)) {
+			if (stat(path, &st))
+				continue;
+			if (S_ISDIR(st.st_mode)) {
+				prompt_dir_link(t, name);
+				continue;
+			}
+		}
+		if (S_ISDIR(st.st_mode))
+			prompt_scan(t, name);
+		else if (S_ISREG(st.st_mode))
+			prompt_add(t, name);
+	}
+	closedir(d);
+}
+
+/* Must be called with promptlock held.  Forgets the unwatched directory
+   name, or with prefix set those below it as well.  Watched ones go when
+   inotify drops their watch. */
+static void prompt_dir_del(struct prompt_table *t, const char *name, int prefix)
+{
+	struct prompt_watch *w;
+	struct prompt_watch *next;
+	struct prompt_watch **wp;
+	size_t len = strlen(name);
+	int x;
+
+	for (x = 0;  x < PROMPT_BUCKETS;  x++) {
+		if (!prefix)
+			x = cw_hash_string(name) % PROMPT_BUCKETS;
+		for (wp = &t->dirs[x];  (w = *wp);  w = next) {
+			next = w->dnext;
+			if (w->wd >= 0  ||  (strcmp(w->dir, name)
+				&&  (!prefix  ||  strncmp(w->dir, name, len)  ||  w->dir[len] != '/'))) {
+				wp = &w->dnext;
+				continue;
+			}
+			*wp = next;
+			free(w);
+		}
+		if (!prefix)
+			break;
+	}
+}
+
+/* Must be called with promptlock held.  Moves what a scan of a new
+   directory found into the shared table, and frees the scan's table. */
+static void prompt_merge(struct prompt_table *t)
+{
+	struct prompt_entry *e;
+	struct prompt_watch *w;
+	struct prompt_watch *old;
+	int x;
+
+	for (x = 0;  x < PROMPT_BUCKETS;  x++) {
+		while ((e = t->index[x])) {
+			t->index[x] = e->next;
+			prompt_add(prompts, e->name);
+			free(e);
+		}
+		while ((w = t->dirs[x])) {
+			t->dirs[x] = w->dnext;
+			if ((old = prompt_dir_find(prompts, w->dir, w->hash))) {
+				if (old->wd >= 0)
+					prompt_watch_find(prompts, old->wd, 1);
+				else
+					prompt_dir_unlink(prompts, old);
+				free(old);
+			}
+			if (w->wd >= 0) {
+				/* A directory moved within the tree keeps its watch */
+				if ((old = prompt_watch_find(prompts, w->wd, 1)))
+					free(old);
+				w->next = prompts->watches[w->wd % PROMPT_BUCKETS];
+				prompts->watches[w->wd % PROMPT_BUCKETS] = w;
+			}
+			w->dnext = prompts->dirs[w->hash % PROMPT_BUCKETS];
+			prompts->dirs[w->hash % PROMPT_BUCKETS] = w;
+		}
+	}
+	free(t);
+}
+
+/* Must be called without promptlock held.  Brings in a directory, or a
+   symlink to one, that appeared at name. */
+static void prompt_scan_new(const char *name)
+{
+	struct prompt_table *t;
+	struct stat st;
+	char path[PATH_MAX];
+	int link;
+
+	snprintf(path, sizeof(path), "%s/%s", cw_config_CW_SOUNDS_DIR, name);
+	if (lstat(path, &st))
+		return;
+	if ((link = S_ISLNK(st.st_mode))  &&  stat(path, &st))
+		return;
+	if (!S_ISDIR(st.st_mode)  ||  (t = calloc(1, sizeof(*t))) == NULL)
+		return;
+	if (link)
+		prompt_dir_link(t, name);
+	else
+		prompt_scan(t, name);
+	cw_mutex_lock(&promptlock);
+	prompt_merge(t);
+	cw_mutex_unlock(&promptlock);
+}
+
+/* Must be called without promptlock held.  Scans the sounds directory into
+   a new table and swaps it in. */
+static void prompt_rebuild(void)
+{
+	struct prompt_table *t;
+	struct prompt_table *old;
+	struct prompt_entry *e;
+	struct prompt_watch *w;
+	int x;
+
+	if ((t = calloc(1, sizeof(*t))) == NULL)
+		return;
+	prompt_scan(t, "");
+
+	cw_mutex_lock(&promptlock);
+	old = prompts;
+	prompts = t;
+	if (old) {
+		/* Only the cached copies are shared with playbacks */
+		for (x = 0;  x < PROMPT_BUCKETS;  x++) {
+			for (e = old->index[x];  e;  e = e->next) {
+				prompt_map_release(e->map);
+				e->map = NULL;
+			}
+		}
+	}
+	cw_mutex_unlock(&promptlock);
+
+	if (old == NULL)
+		return;
+	for (x = 0;  x < PROMPT_BUCKETS;  x++) {
+		while ((w = old->dirs[x])) {
+			old->dirs[x] = w->dnext;
+			/* Watching the same directory again reuses its descriptor */
+			if (w->wd >= 0  &&  !prompt_watch_find(t, w->wd, 0))
+				inotify_rm_watch(prompt_inotify, w->wd);
+			free(w);
+		}
+		while ((e = old->index[x])) {
+			old->index[x] = e->next;
+			free(e);
+		}
+	}
+	free(old);
+}
+
+static void *prompt_watcher(void *data)
+{
+	char buf[8192] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	char name[PATH_MAX];
+	struct inotify_event *ev;
+	struct prompt_watch *w;
+	struct prompt_pending *found;
+	struct prompt_pending *prev;
+	struct prompt_pending *f;
+	ssize_t len;
+	char *p;
+	int rescan;
+
+	prompt_rebuild();
+	if (prompts == NULL) {
+		cw_log(LOG_WARNING, "Unable to index sound files, falling back to stat()\n");
+		return NULL;
+	}
+	prompt_index_ready = 1;
+	if (option_verbose > 1)
+		cw_verbose(VERBOSE_PREFIX_2 "Indexed %d sound files\n", prompts->entries);
+
+	for (;;) {
+		pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+		len = read(prompt_inotify, buf, sizeof(buf));
+		pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			cw_log(LOG_WARNING, "Sound file watch failed, falling back to stat(): %s\n", strerror(errno));
+			prompt_index_ready = 0;
+			break;
+		}
+		rescan = 0;
+		found = NULL;
+		cw_mutex_lock(&promptlock);
+		for (p = buf;  p < buf + len;  p += sizeof(*ev) + ev->len) {
+			ev = (struct inotify_event *) p;
+			if ((ev->mask & IN_Q_OVERFLOW)) {
+				cw_log(LOG_NOTICE, "Sound file watch overflowed, rescanning\n");
+				rescan = 1;
+				break;
+			}
+			if ((ev->mask & (IN_DELETE_SELF | IN_IGNORED))) {
+				if ((w = prompt_watch_find(prompts, ev->wd, 1)))
+					free(w);
+				continue;
+			}
+			if (!ev->len  ||  !(w = prompt_watch_find(prompts, ev->wd, 0)))
+				continue;
+			if (w->dir[0])
+				snprintf(name, sizeof(name), "%s/%s", w->dir, ev->name);
+			else
+				cw_copy_string(name, ev->name, sizeof(name));
+			if ((ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+				/* New directories, and symlinks that may lead to one,
+				   are looked at once the lock is dropped */
+				if ((f = malloc(sizeof(*f) + strlen(name)))) {
+					strcpy(f->name, name);
+					f->next = found;
+					found = f;
+				}
+			}
+			if ((ev->mask & IN_ISDIR)) {
+				if ((ev->mask & (IN_DELETE | IN_MOVED_FROM))) {
+					prompt_del(prompts, name, 1);
+					prompt_dir_del(prompts, name, 1);
+				}
+			} else if ((ev->mask & (IN_CREATE | IN_MOVED_TO | IN_CLOSE_WRITE))) {
+				prompt_add(prompts, name);
+			} else if ((ev->mask & (IN_DELETE | IN_MOVED_FROM))) {
+				prompt_del(prompts, name, 0);
+				prompt_dir_del(prompts, name, 0);
+			}
+		}
+		cw_mutex_unlock(&promptlock);
+		/* Oldest first, so that a later event for the same name wins */
+		for (prev = NULL;  (f = found);  prev = f) {
+			found = f->next;
+			f->next = prev;
+		}
+		for (found = prev;  (f = found);  free(f)) {
+			found = f->next;
+			if (!rescan)
+				prompt_scan_new(f->name);
+		}
+		if (rescan)
+			prompt_rebuild();
+	}
+	return NULL;
+}
+#endif
+
+static int show_prompt_cache(int fd, int argc, char *argv[])
+{
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+	cw_mutex_lock(&promptlock);
+	cw_cli(fd, "Sound file index: %s\n", prompt_index_ready  ?  "active"  :  "inactive");
+	cw_cli(fd, "Indexed files: %d\n", prompts  ?  prompts->entries  :  0);
+	cw_cli(fd, "Cached files: %d (%lu of %lu bytes)\n", prompt_maps,
+		(unsigned long) prompt_cache_bytes, (unsigned long) PROMPT_CACHE_MAX);
+	cw_mutex_unlock(&promptlock);
+	cw_cli(fd, "Transcoded prompts: %s, %d made since startup\n",
+		(option_transcode_prompts == CW_TRANSCODE_PROMPTS_PERSIST)  ?  "next to originals"
+			:  (option_transcode_prompts  ?  transcoded_prompt_dir  :  "disabled"),
+		prompt_transcoded);
+	if (prompt_transcode_failed)
+		cw_cli(fd, "Failed transcodes: %d, retried when the original changes\n", prompt_transcode_failed);
+	return RESULT_SUCCESS;
+}
+
 #define ACTION_EXISTS 1
 #define ACTION_DELETE 2
 #define ACTION_RENAME 3
@@ -349,9 +1095,9 @@ static int exts_compare(const char *exts, const char *type)
 
 static int cw_filehelper(const char *filename, const char *filename2, const char *fmt, int action)
 {
-	struct stat st;
 	struct cw_format *f;
 	struct cw_filestream *s;
+	struct prompt_map *map;
 	int res=0, ret = 0;
 	char *ext=NULL, *exts, *fn, *nfn;
 	FILE *bfile;
@@ -387,7 +1133,7 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
 				fn = build_filename(filename, ext);
 				if (fn)
                 {
-					res = stat(fn, &st);
+					res = prompt_stat(fn);
 					if (!res)
                     {
 						switch(action)
@@ -399,6 +1145,7 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
 							res = unlink(fn);
 							if (res)
 								cw_log(LOG_WARNING, "unlink(%s) failed: %s\n", fn, strerror(errno));
+							prompt_update(fn);
 							break;
 						case ACTION_RENAME:
 							nfn = build_filename(filename2, ext);
@@ -407,6 +1154,8 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
 								res = rename(fn, nfn);
 								if (res)
 									cw_log(LOG_WARNING, "rename(%s,%s) failed: %s\n", fn, nfn, strerror(errno));
+								prompt_update(fn);
+								prompt_update(nfn);
 								free(nfn);
 							}
                             else
@@ -420,6 +1169,7 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
 								res = copy(fn, nfn);
 								if (res)
 									cw_log(LOG_WARNING, "copy(%s,%s) failed: %s\n", fn, nfn, strerror(errno));
+								prompt_update(nfn);
 								free(nfn);
 							}
                             else
@@ -430,7 +1180,7 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
 						case ACTION_OPEN:
 							if ((ret < 0) && ((chan->writeformat & f->format) ||
 										((f->format >= CW_FORMAT_MAX_AUDIO) && fmt))) {
-								bfile = fopen(fn, "r");
+								bfile = prompt_fopen(fn, &map);
 								if (bfile)
                                 {
 									ret = 1;
@@ -441,6 +1191,7 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
 										s->fmt = f;
 										s->trans = NULL;
 										s->filename = NULL;
+										s->map = map;
 										if (s->fmt->format < CW_FORMAT_MAX_AUDIO)
 											chan->stream = s;
 										else
@@ -449,6 +1200,7 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
                                     else
                                     {
 										fclose(bfile);
+										prompt_close(map);
 										cw_log(LOG_WARNING, "Unable to open file on %s\n", fn);
 										ret = -1;
 									}
@@ -482,6 +1234,352 @@ static int cw_filehelper(const char *filename, const char *filename2, const char
 	return res;
 }
 
+/*
+ * Transcoded prompts.
+ *
+ * A prompt that only exists in formats the channel doesn't speak is run
+ * through a translator on every playback.  With transcode_prompts set, the
+ * first such playback queues a job that writes the prompt in the channel's
+ * codec, either under transcoded_prompt_dir or, with "persist", next to the
+ * original where the normal lookup finds it.  Later playbacks open that copy
+ * and need no translation at all.
+ *
+ * What was found for each prompt and codec is remembered for a while, so
+ * playbacks don't stat the copy and every original each time.  A copy
+ * older than its original is made again, and one that failed is only
+ * tried again once the original changes.
+ */
+#define VARIANT_RECHECK		30		/* s before the disk is looked at again */
+
+#define VARIANT_NONE		0		/* No usable copy */
+#define VARIANT_READY		1		/* Copy is at least as new as the originals */
+#define VARIANT_QUEUED		2		/* Being made */
+#define VARIANT_FAILED		3		/* Could not be made from this original */
+#define VARIANT_NOPATH		4		/* No translator to make it with */
+
+struct prompt_variant {
+	struct prompt_variant *next;
+	unsigned int hash;
+	int format;
+	int state;
+	time_t checked;				/* When the disk was last looked at */
+	time_t src_mtime;			/* Newest original at that time */
+	char name[1];
+};
+
+CW_MUTEX_DEFINE_STATIC(variantlock);
+static struct prompt_variant *prompt_variants[PROMPT_BUCKETS];
+
+struct prompt_job {
+	struct prompt_job *next;
+	int format;
+	char name[1];
+};
+
+CW_MUTEX_DEFINE_STATIC(prompt_job_lock);
+static cw_cond_t prompt_job_cond;
+static struct prompt_job *prompt_jobs = NULL;
+static pthread_t prompt_job_thread = CW_PTHREADT_NULL;
+
+/* First extension of the format module that handles format, or NULL */
+static const char *format_ext(int format, char *buf, size_t len)
+{
+	struct cw_format *f;
+	char *c;
+
+	cw_mutex_lock(&formatlock);
+	for (f = formats;  f;  f = f->next) {
+		if (f->format == format)
+			break;
+	}
+	if (f) {
+		cw_copy_string(buf, f->exts, len);
+		if ((c = strpbrk(buf, "|,")))
+			*c = '\0';
+	}
+	cw_mutex_unlock(&formatlock);
+	return f  ?  buf  :  NULL;
+}
+
+/* Where the copy of name in another codec lives, without extension */
+static void variant_name(const char *name, char *buf, size_t len)
+{
+	if (option_transcode_prompts == CW_TRANSCODE_PROMPTS_PERSIST)
+		cw_copy_string(buf, name, len);
+	else if (name[0] == '/')
+		snprintf(buf, len, "%s%s", transcoded_prompt_dir, name);
+	else
+		snprintf(buf, len, "%s/%s", transcoded_prompt_dir, name);
+}
+
+/* Must be called with variantlock held.  Finds, or with create set adds,
+   the entry for name in format */
+static struct prompt_variant *variant_find(const char *name, int format, int create)
+{
+	struct prompt_variant *v;
+	unsigned int hash = cw_hash_string(name);
+
+	for (v = prompt_variants[hash % PROMPT_BUCKETS];  v;  v = v->next) {
+		if (v->hash == hash  &&  v->format == format  &&  !strcmp(v->name, name))
+			return v;
+	}
+	if (!create  ||  (v = malloc(sizeof(*v) + strlen(name))) == NULL)
+		return NULL;
+	strcpy(v->name, name);
+	v->hash = hash;
+	v->format = format;
+	v->state = VARIANT_NONE;
+	v->checked = 0;
+	v->src_mtime = 0;
+	v->next = prompt_variants[hash % PROMPT_BUCKETS];
+	prompt_variants[hash % PROMPT_BUCKETS] = v;
+	return v;
+}
+
+/* Newest modification time of name in any of fmts, or 0 */
+static time_t variant_src_mtime(const char *name, int fmts)
+{
+	struct stat st;
+	char ext[32];
+	time_t newest = 0;
+	char *fn;
+	int x;
+
+	for (x = 1;  x < CW_FORMAT_MAX_AUDIO;  x <<= 1) {
+		if (!(fmts & x)  ||  !format_ext(x, ext, sizeof(ext))  ||  !(fn = build_filename(name, ext)))
+			continue;
+		if (!stat(fn, &st)  &&  st.st_mtime > newest)
+			newest = st.st_mtime;
+		free(fn);
+	}
+	return newest;
+}
+
+static int make_dirs(char *path)
+{
+	char *c;
+
+	for (c = strchr(path + 1, '/');  c;  c = strchr(c + 1, '/')) {
+		*c = '\0';
+		if (mkdir(path, 0755) && errno != EEXIST) {
+			*c = '/';
+			return -1;
+		}
+		*c = '/';
+	}
+	return 0;
+}
+
+/* Returns 0 once the copy is in place */
+static int prompt_transcode(struct prompt_job *job)
+{
+	struct cw_filestream *in;
+	struct cw_filestream *out;
+	struct cw_frame *fr;
+	char dst[PATH_MAX];
+	char tmp[PATH_MAX];
+	char srcext[32];
+	char dstext[32];
+	char *fn;
+	int srcformat;
+	int fmts;
+	int res = 0;
+
+	/* A stale persisted copy must not be made from itself */
+	if ((fmts = cw_filehelper(job->name, NULL, NULL, ACTION_EXISTS)) < 1
+		||  !(fmts &= (CW_FORMAT_MAX_AUDIO - 1) & ~job->format))
+		return -1;
+	if (fmts & CW_FORMAT_SLINEAR)
+		srcformat = CW_FORMAT_SLINEAR;
+	else
+		srcformat = cw_best_codec(fmts);
+	if (!format_ext(srcformat, srcext, sizeof(srcext))  ||  !format_ext(job->format, dstext, sizeof(dstext)))
+		return -1;
+
+	variant_name(job->name, dst, sizeof(dst));
+	snprintf(tmp, sizeof(tmp), "%s-transcoding", dst);
+	if (tmp[0] == '/'  &&  make_dirs(tmp)) {
+		cw_log(LOG_WARNING, "Unable to create directory for %s: %s\n", tmp, strerror(errno));
+		return -1;
+	}
+	if (!(in = cw_readfile(job->name, srcext, NULL, O_RDONLY, 0, 0)))
+		return -1;
+	if (!(out = cw_writefile(tmp, dstext, NULL, 0, 0, 0644))) {
+		cw_closestream(in);
+		return -1;
+	}
+	while ((fr = cw_readframe(in))) {
+		if ((res = cw_writestream(out, fr)))
+			break;
+	}
+	cw_closestream(out);
+	cw_closestream(in);
+
+	if (res) {
+		cw_filedelete(tmp, dstext);
+		cw_log(LOG_WARNING, "Unable to transcode %s to %s\n", job->name, cw_getformatname(job->format));
+		return -1;
+	}
+	cw_filerename(tmp, dst, dstext);
+	prompt_transcoded++;
+	if (option_debug && (fn = build_filename(dst, dstext))) {
+		cw_log(LOG_DEBUG, "Transcoded %s.%s to %s\n", job->name, srcext, fn);
+		free(fn);
+	}
+	return 0;
+}
+
+static void *prompt_job_runner(void *data)
+{
+	struct prompt_variant *v;
+	struct prompt_job *job;
+	int res;
+
+	for (;;) {
+		cw_mutex_lock(&prompt_job_lock);
+		while (!prompt_jobs)
+			cw_cond_wait(&prompt_job_cond, &prompt_job_lock);
+		job = prompt_jobs;
+		cw_mutex_unlock(&prompt_job_lock);
+
+		res = prompt_transcode(job);
+
+		cw_mutex_lock(&variantlock);
+		if ((v = variant_find(job->name, job->format, 0))) {
+			v->state = res  ?  VARIANT_FAILED  :  VARIANT_READY;
+			v->checked = time(NULL);
+			if (res)
+				prompt_transcode_failed++;
+		}
+		cw_mutex_unlock(&variantlock);
+
+		/* The job stays queued while it runs so it isn't queued twice */
+		cw_mutex_lock(&prompt_job_lock);
+		prompt_jobs = job->next;
+		cw_mutex_unlock(&prompt_job_lock);
+		free(job);
+	}
+	return NULL;
+}
+
+static void prompt_job_add(const char *name, int format)
+{
+	struct prompt_job *job;
+	struct prompt_job **p;
+
+	cw_mutex_lock(&prompt_job_lock);
+	for (p = &prompt_jobs;  *p;  p = &(*p)->next) {
+		if ((*p)->format == format  &&  !strcmp((*p)->name, name))
+			break;
+	}
+	if (!*p  &&  (job = malloc(sizeof(*job) + strlen(name)))) {
+		job->next = NULL;
+		job->format = format;
+		strcpy(job->name, name);
+		*p = job;
+		if (prompt_job_thread == CW_PTHREADT_NULL  &&  cw_pthread_create(&prompt_job_thread, NULL, prompt_job_runner, NULL)) {
+			cw_log(LOG_WARNING, "Unable to start prompt transcoding thread\n");
+			prompt_job_thread = CW_PTHREADT_NULL;
+		}
+		cw_cond_signal(&prompt_job_cond);
+	}
+	cw_mutex_unlock(&prompt_job_lock);
+}
+
+/* Given the formats name exists in, returns the formats to play it from.
+   If a transcoded copy in the channel's codec is available, name is
+   changed to point at it. */
+static int prompt_variant(struct cw_channel *chan, char *name, size_t len, int fmts)
+{
+	struct prompt_variant *v;
+	struct cw_trans_pvt *trans;
+	struct stat vst;
+	char variant[PATH_MAX];
+	char ext[32];
+	time_t src_mtime;
+	time_t now;
+	char *fn;
+	int persist;
+	int srcs;
+	int target;
+	int state;
+	int old;
+
+	if (!option_transcode_prompts)
+		return fmts;
+	persist = (option_transcode_prompts == CW_TRANSCODE_PROMPTS_PERSIST);
+	target = cw_best_codec(chan->nativeformats & (CW_FORMAT_MAX_AUDIO - 1));
+	/* The originals a copy would be made from */
+	srcs = fmts & (CW_FORMAT_MAX_AUDIO - 1) & ~target;
+	if (!target  ||  !srcs)
+		return fmts;
+	/* A file in the channel's codec is an original, unless we persist
+	   copies next to the originals */
+	if ((fmts & target)  &&  !persist)
+		return fmts;
+	if (!format_ext(target, ext, sizeof(ext)))
+		return fmts;
+	variant_name(name, variant, sizeof(variant));
+
+	now = time(NULL);
+	cw_mutex_lock(&variantlock);
+	v = variant_find(name, target, 0);
+	if (v  &&  now - v->checked < VARIANT_RECHECK) {
+		state = v->state;
+		cw_mutex_unlock(&variantlock);
+		goto done;
+	}
+	old = v  ?  v->state  :  VARIANT_NONE;
+	cw_mutex_unlock(&variantlock);
+
+	/* Look at the disk without the lock, then record what was found */
+	src_mtime = variant_src_mtime(name, srcs);
+	state = VARIANT_NONE;
+	if ((!persist  ||  (fmts & target))  &&  (fn = build_filename(variant, ext))) {
+		if (!stat(fn, &vst)  &&  vst.st_mtime >= src_mtime)
+			state = VARIANT_READY;
+		free(fn);
+	}
+	cw_mutex_lock(&variantlock);
+	if ((v = variant_find(name, target, 1))) {
+		if (state == VARIANT_NONE  &&  old == VARIANT_FAILED  &&  v->src_mtime == src_mtime)
+			state = VARIANT_FAILED;
+		if (v->state != VARIANT_QUEUED) {
+			v->state = state;
+			v->src_mtime = src_mtime;
+			v->checked = now;
+		}
+		state = v->state;
+	}
+	cw_mutex_unlock(&variantlock);
+
+	if (state == VARIANT_NONE) {
+		/* Only queue work we will be able to do */
+		if ((trans = cw_translator_build_path(target, 8000, cw_best_codec(srcs), 8000))) {
+			cw_translator_free_path(trans);
+			state = VARIANT_QUEUED;
+		} else {
+			state = VARIANT_NOPATH;
+		}
+		cw_mutex_lock(&variantlock);
+		if ((v = variant_find(name, target, 0))  &&  v->state == VARIANT_NONE)
+			v->state = state;
+		cw_mutex_unlock(&variantlock);
+		if (state == VARIANT_QUEUED)
+			prompt_job_add(name, target);
+	}
+
+done:
+	if (state == VARIANT_READY) {
+		if (persist)
+			return fmts;
+		cw_copy_string(name, variant, len);
+		return target;
+	}
+	/* Don't play a persisted copy older than its original */
+	return persist  ?  (fmts & ~target)  :  fmts;
+}
+
 struct cw_filestream *cw_openstream(struct cw_channel *chan, const char *filename, const char *preflang)
 {
 	return cw_openstream_full(chan, filename, preflang, 0);
@@ -542,6 +1640,8 @@ struct cw_filestream *cw_openstream_full(struct cw_channel *chan, const char *fi
 		cw_log(LOG_WARNING, "File %s does not exist in any format\n", filename);
 		return NULL;
 	}
+	/* Play a copy already in the channel's codec if there is one */
+	fmts = prompt_variant(chan, filename2, sizeof(filename2), fmts);
 	chan->oldwriteformat = chan->writeformat;
 	/* Set the channel to a format we can work with */
 	res = cw_set_write_format(chan, fmts);
@@ -708,6 +1808,7 @@ int cw_stream_rewind(struct cw_filestream *fs, long ms)
 
 int cw_closestream(struct cw_filestream *f)
 {
+	struct prompt_map *map = f->map;
 	char *cmd = NULL;
 	size_t size = 0;
 	/* Stop a running stream if there is one */
@@ -736,6 +1837,7 @@ int cw_closestream(struct cw_filestream *f)
 			memset(cmd,0,size);
 			snprintf(cmd,size,"/bin/mv -f %s %s",f->filename,f->realfilename);
 			cw_safe_system(cmd);
+			prompt_update(f->realfilename);
 	}
 
 	if (f->filename) {
@@ -747,6 +1849,7 @@ int cw_closestream(struct cw_filestream *f)
 		f->realfilename = NULL;
 	}
 	f->fmt->close(f);
+	prompt_close(map);
 	return 0;
 }
 
@@ -876,6 +1979,7 @@ struct cw_filestream *cw_readfile(const char *filename, const char *type, const
 			fs->mode = mode;
 			fs->filename = strdup(filename);
 			fs->vfs = NULL;
+			fs->map = NULL;
 		} else if (errno != EEXIST)
 			cw_log(LOG_WARNING, "Unable to open file %s: %s\n", fn, strerror(errno));
 		free(fn);
@@ -923,6 +2027,8 @@ struct cw_filestream *cw_writefile(const char *filename, const char *type, const
 
 		fn = build_filename(filename, type);
 		fd = open(fn, flags | myflags, mode);
+		if (fd > -1)
+			prompt_update(fn);
 		if (fd > -1) {
 			/* fdopen() the resulting file stream */
 			bfile = fdopen(fd, ((flags | myflags) & O_RDWR) ? "w+" : "w");
@@ -979,6 +2085,7 @@ struct cw_filestream *cw_writefile(const char *filename, const char *type, const
 					fs->filename = strdup(filename);
 				}
 				fs->vfs = NULL;
+				fs->map = NULL;
 			} else {
 				cw_log(LOG_WARNING, "Unable to rewrite %s\n", fn);
 				close(fd);
@@ -1301,8 +2408,28 @@ struct cw_cli_entry show_file =
 	"       displays currently registered file formats (if any)\n"
 };
 
+struct cw_cli_entry show_prompts =
+{
+	{ "show", "prompt", "cache" },
+	show_prompt_cache,
+	"Displays the sound file index and cache",
+	"Usage: show prompt cache\n"
+	"       displays how many sound files are indexed and held in memory\n"
+};
+
 int cw_file_init(void)
 {
+	cw_cond_init(&prompt_job_cond, NULL);
 	cw_cli_register(&show_file);
+	cw_cli_register(&show_prompts);
+#ifdef FILE_USE_INOTIFY
+	if ((prompt_inotify = inotify_init()) < 0) {
+		cw_log(LOG_WARNING, "Unable to watch sound files, prompt index disabled: %s\n", strerror(errno));
+	} else if (cw_pthread_create(&prompt_thread, NULL, prompt_watcher, NULL)) {
+		cw_log(LOG_WARNING, "Unable to start sound file watcher, prompt index disabled\n");
+		close(prompt_inotify);
+		prompt_inotify = -1;
+	}
+#endif
 	return 0;
 }
@@ -45,6 +45,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/cli.h"
 #include "callweaver/term.h"
 #include "callweaver/utils.h"
+#include "callweaver/pcm.h"
 
 #ifdef TRACE_FRAMES
 static int headers = 0;
@@ -1555,8 +1556,6 @@ int cw_codec_get_len(int format, int samples)
 
 int cw_frame_adjust_volume(struct cw_frame *f, int adjustment)
 {
-    int count;
-    int16_t *fdata = f->data;
     int16_t adjust_value;
 
     if ((f->frametype != CW_FRAME_VOICE)  ||  (f->subclass != CW_FORMAT_SLINEAR))
@@ -1570,18 +1569,13 @@ int cw_frame_adjust_volume(struct cw_frame *f, int adjustment)
     else
         adjust_value = (1 << 11)/(-adjustment);
     
-    for (count = 0;  count < f->samples;  count++)
-        fdata[count] = saturate(((int32_t) fdata[count]*(int32_t) adjust_value) >> 11);
+    cw_slin_gain((int16_t *) f->data, f->samples, adjust_value);
 
     return 0;
 }
 
 int cw_frame_slinear_sum(struct cw_frame *f1, struct cw_frame *f2)
 {
-    int count;
-    int16_t *data1;
-    int16_t *data2;
-
     if ((f1->frametype != CW_FRAME_VOICE)  ||  (f1->subclass != CW_FORMAT_SLINEAR))
         return -1;
 
@@ -1591,7 +1585,6 @@ int cw_frame_slinear_sum(struct cw_frame *f1, struct cw_frame *f2)
     if (f1->samples != f2->samples)
         return -1;
 
-    for (data1 = (int16_t *) f1->data, data2 = (int16_t *) f2->data, count = 0;  count < f1->samples;  count++)
-        data1[count] = saturate((int) data1[count] + (int) data2[count]);
+    cw_slin_mix((int16_t *) f1->data, (const int16_t *) f2->data, f1->samples);
     return 0;
 }
@@ -30,6 +30,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 
 #include "callweaver.h"
 
@@ -41,6 +44,8 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/term.h"
 #include "callweaver/options.h"
 #include "callweaver/utils.h"
+#include "callweaver/lock.h"
+#include "callweaver/cli.h"
 
 #include "callweaver/generic_jb.h"
 #include "jitterbuf_scx.h"
@@ -52,6 +57,19 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #define JB_USE (1 << 0)
 #define JB_TIMEBASE_INITIALIZED (1 << 1)
 #define JB_CREATED (1 << 2)
+#define JB_TIMED (1 << 3)
+
+/* Playout timer state (tflags) */
+#define JB_T_QUEUED (1 << 0)
+#define JB_T_FIRING (1 << 1)
+#define JB_T_DYING (1 << 2)
+
+/* Playout timer threads. Jitterbuffers are spread over them */
+#define JB_TIMER_THREADS 4
+/* Playout timer wheel size, one slot per ms. Must be a power of 2 */
+#define JB_TIMER_SLOTS 256
+/* Jitterbuffers with nothing due sooner than this (ms) wait for a frame instead */
+#define JB_TIMER_MAX_AHEAD 60000
 
 
 /* Hooks for the abstract jb implementation */
@@ -202,9 +220,45 @@ if(jb->logfile) \
 
 /* Internal utility functions */
 static void jb_choose_impl(struct cw_channel *chan);
-static void jb_get_and_deliver(struct cw_channel *chan);
+static int jb_deliver(struct cw_jb *jb);
 static int create_jb(struct cw_channel *chan, struct cw_frame *first_frame, int codec);
 static long get_now(struct cw_jb *jb, struct timeval *tv);
+static int jb_can_own(struct cw_frame *f);
+static struct jb_timer *timer_attach(void);
+static void timer_detach(struct jb_timer *t);
+static void timer_queue(struct cw_jb *jb);
+static void timer_unqueue(struct jb_timer *t, struct cw_jb *jb);
+
+
+/* A playout timer thread. Frames are put in by the bridge thread, under the
+   jitterbuffer lock, and played out by the timer thread. The jitterbuffer
+   lock is taken before the timer lock, and neither is held while a frame
+   is written to the channel. */
+struct jb_timer
+{
+	/* Guards the wheel and the tflags of the jitterbuffers on this thread */
+	cw_mutex_t lock;
+	/* Wakes the thread up when something is due before it would wake */
+	cw_cond_t cond;
+	struct cw_jb *wheel[JB_TIMER_SLOTS];
+	/* Next tick to be served */
+	unsigned long cursor;
+	/* Tick the thread sleeps until, while sleeping is set */
+	unsigned long wake;
+	int sleeping;
+	/* Jitterbuffers queued on the wheel */
+	int count;
+	/* Jitterbuffers given to this thread, guarded by timer_start_lock */
+	int jbs;
+	int failed;
+	pthread_t thread;
+};
+
+static struct jb_timer timers[JB_TIMER_THREADS];
+static struct timeval timer_epoch;
+static int timer_ready;
+/* Guards starting the timer threads and spreading jitterbuffers over them */
+CW_MUTEX_DEFINE_STATIC(timer_start_lock);
 
 
 /* Interface ast jb functions impl */
@@ -327,6 +381,16 @@ int cw_jb_get_when_to_wakeup(struct cw_channel *c0, struct cw_channel *c1, int t
 	
 	gettimeofday(&tv_now, NULL);
 	
+	/* The playout timer takes care of timed jitterbuffers */
+	if(c0_use_jb && c0_jb_is_created && cw_test_flag(jb0, JB_TIMED))
+	{
+		c0_use_jb = 0;
+	}
+	if(c1_use_jb && c1_jb_is_created && cw_test_flag(jb1, JB_TIMED))
+	{
+		c1_use_jb = 0;
+	}
+	
 	wait0 = (c0_use_jb && c0_jb_is_created) ? jb0->next - get_now(jb0, &tv_now) : time_left;
 	wait1 = (c1_use_jb && c1_jb_is_created) ? jb1->next - get_now(jb1, &tv_now) : time_left;
 	
@@ -354,6 +418,7 @@ int cw_jb_put(struct cw_channel *chan, struct cw_frame *f, int codec)
 	void *jbobj = jb->jbobj;
 	struct cw_frame *frr;
 	long now = 0;
+	int owned;
 	
 	if(!cw_test_flag(jb, JB_USE))
 	{
@@ -365,7 +430,9 @@ int cw_jb_put(struct cw_channel *chan, struct cw_frame *f, int codec)
 		if(f->frametype == CW_FRAME_DTMF && cw_test_flag(jb, JB_CREATED))
 		{
 			jb_framelog("JB_PUT {now=%ld}: Received DTMF frame. Force resynching jb...\n", now);
+			cw_mutex_lock(&jb->lock);
 			jbimpl->force_resync(jbobj);
+			cw_mutex_unlock(&jb->lock);
 		}
 		
 		return -1;
@@ -378,10 +445,12 @@ int cw_jb_put(struct cw_channel *chan, struct cw_frame *f, int codec)
 		return -1;
 	}
 	
-	/* Get us our own copy of the frame.
+	/* Queue the frame itself if freeing it later releases everything
+	 * it points to. Otherwise get us our own copy of the frame.
 	 * We dup it since frisolate makes it hard to 
 	 * manage memory */
-	frr = cw_frdup(f);
+	owned = jb_can_own(f);
+	frr = owned ? f : cw_frdup(f);
 	if(frr == NULL)
 	{
 		cw_log(LOG_ERROR, "Failed to isolate frame for the jitterbuffer on channel '%s'\n", chan->name);
@@ -392,33 +461,54 @@ int cw_jb_put(struct cw_channel *chan, struct cw_frame *f, int codec)
 	{
 		if(create_jb(chan, frr, codec))
 		{
-			cw_fr_free(frr);
+			if(!owned)
+			{
+				cw_fr_free(frr);
+			}
 			/* Disable the jitterbuffer */
 			cw_clear_flag(jb, JB_USE);
 			return -1;
 		}
 
 		cw_set_flag(jb, JB_CREATED);
-		return 0;
+		
+		/* Hand the playout over to a timer thread if we can. If not, the
+		   bridge delivers the frames as they become due. */
+		if((jb->timer = timer_attach()) != NULL)
+		{
+			cw_set_flag(jb, JB_TIMED);
+			cw_mutex_lock(&jb->lock);
+			timer_queue(jb);
+			cw_mutex_unlock(&jb->lock);
+		}
+		return owned ? CW_JB_PUT_OWNED : 0;
 	}
 	else
 	{
+		cw_mutex_lock(&jb->lock);
 		now = get_now(jb, NULL);
 		if(jbimpl->put(jbobj, frr, now, codec) != JB_IMPL_OK)
 		{
 			jb_framelog("JB_PUT {now=%ld}: Dropped frame with ts=%ld and len=%ld\n", now, frr->ts, frr->len);
+			cw_mutex_unlock(&jb->lock);
 			cw_fr_free(frr);
 			/*return -1;*/
 			/* TODO: Check this fix - should return 0 here, because the dropped frame shouldn't 
 			   be delivered at all */
-			return 0;
+			return owned ? CW_JB_PUT_OWNED : 0;
 		}
 		
 		jb->next = jbimpl->next(jbobj);
 
 		jb_framelog("JB_PUT {now=%ld}: Queued frame with ts=%ld and len=%ld\n", now, frr->ts, frr->len);
 		
-		return 0;
+		if(cw_test_flag(jb, JB_TIMED))
+		{
+			timer_queue(jb);
+		}
+		cw_mutex_unlock(&jb->lock);
+		
+		return owned ? CW_JB_PUT_OWNED : 0;
 	}
 }
 
@@ -432,26 +522,51 @@ void cw_jb_get_and_deliver(struct cw_channel *c0, struct cw_channel *c1)
 	int c1_use_jb = cw_test_flag(jb1, JB_USE);
 	int c1_jb_is_created = cw_test_flag(jb1, JB_CREATED);
 	
-	if(c0_use_jb && c0_jb_is_created)
+	if(c0_use_jb && c0_jb_is_created && !cw_test_flag(jb0, JB_TIMED))
 	{
-		jb_get_and_deliver(c0);
+		cw_mutex_lock(&jb0->lock);
+		jb_deliver(jb0);
+		cw_mutex_unlock(&jb0->lock);
 	}
 	
-	if(c1_use_jb && c1_jb_is_created)
+	if(c1_use_jb && c1_jb_is_created && !cw_test_flag(jb1, JB_TIMED))
 	{
-		jb_get_and_deliver(c1);
+		cw_mutex_lock(&jb1->lock);
+		jb_deliver(jb1);
+		cw_mutex_unlock(&jb1->lock);
 	}
 }
 
 
-static void jb_get_and_deliver(struct cw_channel *chan)
+/* Write a frame out to the channel. Called with the jb lock held, which is
+   dropped meanwhile. Returns -1 if the jb is being destroyed */
+static int jb_write(struct cw_jb *jb, struct cw_frame *f)
+{
+	struct jb_timer *t = jb->timer;
+	int dying = 0;
+
+	cw_mutex_unlock(&jb->lock);
+	cw_write(jb->owner, f);
+	cw_mutex_lock(&jb->lock);
+	if(t != NULL)
+	{
+		cw_mutex_lock(&t->lock);
+		dying = jb->tflags & JB_T_DYING;
+		cw_mutex_unlock(&t->lock);
+	}
+	return dying ? -1 : 0;
+}
+
+
+/* Deliver the frames due by now. Called with the jb lock held.
+   Returns -1 if the jb is being destroyed */
+static int jb_deliver(struct cw_jb *jb)
 {
-	struct cw_jb *jb = &chan->jb;
 	struct cw_jb_impl *jbimpl = jb->impl;
 	void *jbobj = jb->jbobj;
 	struct cw_frame *f, finterp;
 	long now;
-	int interpolation_len, res;
+	int interpolation_len, res, dying;
 	
 	now = get_now(jb, NULL);
 	jb->next = jbimpl->next(jbobj);
@@ -466,19 +581,20 @@ static void jb_get_and_deliver(struct cw_channel *chan)
 	if(now < jb->next)
 	{
 		jb_framelog("\tJB_GET {now=%ld}: now < next=%ld\n", now, jb->next);
-		return;
+		return 0;
 	}
 	
 	while(now >= jb->next)
 	{
 		interpolation_len = cw_codec_interp_len(jb->last_format);
 		res = jbimpl->get(jbobj, &f, now, interpolation_len);
+		dying = 0;
 		
 		switch(res)
 		{
 		case JB_IMPL_OK:
 			/* deliver the frame */
-			cw_write(chan, f);
+			dying = jb_write(jb, f);
 		case JB_IMPL_DROP:
 			jb_framelog("\tJB_GET {now=%ld, next=%ld}: %s frame"
 				    "with ts=%ld and len=%ld\n",
@@ -495,7 +611,7 @@ static void jb_get_and_deliver(struct cw_channel *chan)
 			f->delivery = cw_tvadd(jb->timebase, cw_samp2tv(jb->next, 1000));
 			f->offset=CW_FRIENDLY_OFFSET;
 			/* deliver the interpolated frame */
-			cw_write(chan, f);
+			dying = jb_write(jb, f);
 			jb_framelog("\tJB_GET {now=%ld}: Interpolated frame with len=%d\n", now, interpolation_len);
 			break;
 		case JB_IMPL_NOFRAME:
@@ -505,15 +621,33 @@ static void jb_get_and_deliver(struct cw_channel *chan)
 				jbimpl->name, now, jb->next, jbimpl->next(jbobj));
 #endif
 			jb_framelog("\tJB_GET {now=%ld}: No frame for now!?\n", now);
-			return;
+			return 0;
 		default:
 			cw_log(LOG_ERROR, "This should never happen!\n");
 			CRASH;
 			break;
 		}
 		
+		if(dying)
+		{
+			return -1;
+		}
+		
 		jb->next = jbimpl->next(jbobj);
 	}
+	return 0;
+}
+
+
+/* A frame can be queued as it is if it is a single malloc'ed block, like
+   cw_frdup() makes. Some implementations drop frames with a plain free(). */
+static int jb_can_own(struct cw_frame *f)
+{
+	if(f->mallocd != CW_MALLOCD_HDR)
+	{
+		return 0;
+	}
+	return f->data == NULL || (uint8_t *) f->data == f->local_data;
 }
 
 
@@ -546,6 +680,13 @@ static int create_jb(struct cw_channel *chan, struct cw_frame *frr, int codec)
 		return -1;
 	}
 	
+	cw_mutex_init(&jb->lock);
+	cw_cond_init(&jb->idle, NULL);
+	jb->owner = chan;
+	jb->timer = NULL;
+	jb->tnext = jb->tprev = NULL;
+	jb->tflags = 0;
+	
 	now = get_now(jb, NULL);
 	res = jbimpl->put_first(jbobj, frr, now, codec);
 	
@@ -626,6 +767,7 @@ void cw_jb_destroy(struct cw_channel *chan)
 	struct cw_jb_impl *jbimpl;
 	void *jbobj;
 	struct cw_frame *f;
+	struct jb_timer *t;
 
 	if (chan) {
 		jb = &chan->jb;	
@@ -636,6 +778,29 @@ void cw_jb_destroy(struct cw_channel *chan)
 		return;
 	}
 
+	/* Take it off its playout timer, and wait for the timer thread to be
+	   done with it */
+	if(cw_test_flag(jb, JB_CREATED) && (t = jb->timer) != NULL)
+	{
+		cw_mutex_lock(&jb->lock);
+		cw_mutex_lock(&t->lock);
+		jb->tflags |= JB_T_DYING;
+		if(jb->tflags & JB_T_QUEUED)
+		{
+			timer_unqueue(t, jb);
+		}
+		while(jb->tflags & JB_T_FIRING)
+		{
+			cw_mutex_unlock(&t->lock);
+			cw_cond_wait(&jb->idle, &jb->lock);
+			cw_mutex_lock(&t->lock);
+		}
+		cw_mutex_unlock(&t->lock);
+		cw_mutex_unlock(&jb->lock);
+		timer_detach(t);
+		jb->timer = NULL;
+	}
+	
 	if(jb->logfile != NULL)
 	{
 		fclose(jb->logfile);
@@ -654,9 +819,13 @@ void cw_jb_destroy(struct cw_channel *chan)
 		jb->jbobj = NULL;
 		
 		cw_clear_flag(jb, JB_CREATED);
+		cw_clear_flag(jb, JB_TIMED);
+		cw_cond_destroy(&jb->idle);
+		cw_mutex_destroy(&jb->lock);
 		
 		jb_verbose("%s jitterbuffer destroyed on channel %s", jbimpl->name, chan->name);
 	}
+	jb->tflags = 0;
 }
 
 
@@ -802,7 +971,9 @@ void cw_jb_get_info(struct cw_channel *chan, cw_jb_info *info)
 		jb = &chan->jb;	
 		jbimpl = jb->impl;
 		jbobj = jb->jbobj;
+		cw_mutex_lock(&jb->lock);
 	        jbimpl->info(jbobj, info);
+		cw_mutex_unlock(&jb->lock);
 	} else 
 		cw_log(LOG_ERROR, "Channel/jitterbuffer data is broken!\n");
 
@@ -822,6 +993,643 @@ int cw_jb_is_active(struct cw_channel *chan)
 }
 
 
+/* Playout timer */
+
+static unsigned long timer_now(struct timeval *tv)
+{
+	return (unsigned long) (tv->tv_sec - timer_epoch.tv_sec) * 1000UL
+		+ (unsigned long) ((tv->tv_usec - timer_epoch.tv_usec) / 1000);
+}
+
+
+static void timer_tick_time(unsigned long tick, struct timespec *ts)
+{
+	long usec;
+
+	usec = timer_epoch.tv_usec + (long) (tick % 1000) * 1000;
+	ts->tv_sec = timer_epoch.tv_sec + tick / 1000 + usec / 1000000;
+	ts->tv_nsec = (usec % 1000000) * 1000;
+}
+
+
+/* Called with the timer lock held */
+static void timer_unqueue(struct jb_timer *t, struct cw_jb *jb)
+{
+	if(jb->tprev)
+	{
+		jb->tprev->tnext = jb->tnext;
+	}
+	else
+	{
+		t->wheel[jb->tdue & (JB_TIMER_SLOTS - 1)] = jb->tnext;
+	}
+	if(jb->tnext)
+	{
+		jb->tnext->tprev = jb->tprev;
+	}
+	jb->tnext = jb->tprev = NULL;
+	jb->tflags &= ~JB_T_QUEUED;
+	t->count--;
+}
+
+
+/* (Re)queue a jitterbuffer on the wheel for its next delivery.
+   Called with the jb lock and the timer lock held */
+static void timer_requeue(struct jb_timer *t, struct cw_jb *jb)
+{
+	struct cw_jb **slot;
+	struct timeval tv;
+	long ahead;
+
+	if(jb->tflags & JB_T_QUEUED)
+	{
+		timer_unqueue(t, jb);
+	}
+	/* A firing jitterbuffer is queued again by the timer thread */
+	if(jb->tflags & (JB_T_FIRING | JB_T_DYING))
+	{
+		return;
+	}
+	
+	tv = cw_tvnow();
+	ahead = jb->next - get_now(jb, &tv);
+	if(ahead > JB_TIMER_MAX_AHEAD)
+	{
+		/* Nothing to play out until more frames come in */
+		return;
+	}
+	if(t->count == 0)
+	{
+		/* The thread has been idle, so the cursor is stale */
+		t->cursor = timer_now(&tv);
+	}
+	jb->tdue = timer_now(&tv) + ((ahead > 0) ? ahead : 0);
+	/* Never behind the tick being served, so it can't fire twice in one tick */
+	if((long) (jb->tdue - t->cursor) < 0)
+	{
+		jb->tdue = t->cursor;
+	}
+	
+	slot = &t->wheel[jb->tdue & (JB_TIMER_SLOTS - 1)];
+	jb->tprev = NULL;
+	if((jb->tnext = *slot) != NULL)
+	{
+		jb->tnext->tprev = jb;
+	}
+	*slot = jb;
+	jb->tflags |= JB_T_QUEUED;
+	t->count++;
+	if(t->sleeping && (long) (jb->tdue - t->wake) < 0)
+	{
+		t->sleeping = 0;
+		cw_cond_signal(&t->cond);
+	}
+}
+
+
+/* Called with the jb lock held */
+static void timer_queue(struct cw_jb *jb)
+{
+	struct jb_timer *t = jb->timer;
+
+	cw_mutex_lock(&t->lock);
+	timer_requeue(t, jb);
+	cw_mutex_unlock(&t->lock);
+}
+
+
+/* Play out a jitterbuffer the timer thread took off the wheel, and queue it
+   again for its next frame. Called with no locks held */
+static void timer_fire(struct jb_timer *t, struct cw_jb *jb)
+{
+	int dying, res;
+
+	cw_mutex_lock(&jb->lock);
+	cw_mutex_lock(&t->lock);
+	dying = jb->tflags & JB_T_DYING;
+	cw_mutex_unlock(&t->lock);
+	
+	/* Frames wait in the jitterbuffer while the channel is out of a bridge,
+	   like they did when the bridge loop delivered them. The next frame
+	   put in queues it again. */
+	res = -1;
+	if(!dying && jb->owner->_bridge != NULL)
+	{
+		res = jb_deliver(jb);
+	}
+	
+	cw_mutex_lock(&t->lock);
+	jb->tflags &= ~JB_T_FIRING;
+	dying = jb->tflags & JB_T_DYING;
+	if(!dying && res == 0)
+	{
+		timer_requeue(t, jb);
+	}
+	cw_mutex_unlock(&t->lock);
+	if(dying)
+	{
+		cw_cond_broadcast(&jb->idle);
+	}
+	cw_mutex_unlock(&jb->lock);
+}
+
+
+static void *timer_run(void *data)
+{
+	struct jb_timer *t = data;
+	struct cw_jb *jb, *next, *due;
+	struct timeval tv;
+	struct timespec ts;
+	unsigned long now;
+	unsigned long tick;
+	int i;
+
+	cw_mutex_lock(&t->lock);
+	for(;;)
+	{
+		if(t->count == 0)
+		{
+			t->sleeping = 1;
+			t->wake = t->cursor + ULONG_MAX / 2;
+			cw_cond_wait(&t->cond, &t->lock);
+			t->sleeping = 0;
+			continue;
+		}
+		
+		tv = cw_tvnow();
+		now = timer_now(&tv);
+		/* If we fell behind by more than a turn, a single turn serves everything */
+		if((long) (now - t->cursor) >= JB_TIMER_SLOTS)
+		{
+			t->cursor = now - JB_TIMER_SLOTS + 1;
+		}
+		
+		/* Take everything due off the wheel */
+		due = NULL;
+		while((long) (now - t->cursor) >= 0)
+		{
+			tick = t->cursor++;
+			for(jb = t->wheel[tick & (JB_TIMER_SLOTS - 1)]; jb != NULL; jb = next)
+			{
+				next = jb->tnext;
+				if((long) (jb->tdue - tick) > 0)
+				{
+					/* Due on a later turn */
+					continue;
+				}
+				timer_unqueue(t, jb);
+				jb->tflags |= JB_T_FIRING;
+				jb->tnext = due;
+				due = jb;
+			}
+		}
+		
+		if(due != NULL)
+		{
+			/* Frames can be put in and other jitterbuffers queued while
+			   these are played out */
+			cw_mutex_unlock(&t->lock);
+			while((jb = due) != NULL)
+			{
+				due = jb->tnext;
+				jb->tnext = NULL;
+				timer_fire(t, jb);
+			}
+			cw_mutex_lock(&t->lock);
+			continue;
+		}
+		
+		/* Sleep until the first slot with something in it. Entries due on
+		   a later turn cost a spurious wakeup at most once a turn */
+		for(i = 0; i < JB_TIMER_SLOTS - 1 && t->wheel[(t->cursor + i) & (JB_TIMER_SLOTS - 1)] == NULL; i++)
+			;
+		t->wake = t->cursor + i;
+		t->sleeping = 1;
+		timer_tick_time(t->wake, &ts);
+		cw_cond_timedwait(&t->cond, &t->lock, &ts);
+		t->sleeping = 0;
+	}
+	cw_mutex_unlock(&t->lock);
+	return NULL;
+}
+
+
+/* Give a new jitterbuffer to the least loaded playout timer thread,
+   starting it if need be. Returns NULL if no thread can be had */
+static struct jb_timer *timer_attach(void)
+{
+	struct jb_timer *t, *best;
+	pthread_attr_t attr;
+	int i;
+
+	best = NULL;
+	cw_mutex_lock(&timer_start_lock);
+	for(i = 0; timer_ready && i < JB_TIMER_THREADS; i++)
+	{
+		t = &timers[i];
+		if(!t->failed && (best == NULL || t->jbs < best->jbs))
+		{
+			best = t;
+		}
+	}
+	if(best != NULL && best->thread == CW_PTHREADT_NULL)
+	{
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if(cw_pthread_create(&best->thread, &attr, timer_run, best))
+		{
+			cw_log(LOG_WARNING, "Unable to start a jitterbuffer playout timer, bridges will deliver frames\n");
+			best->thread = CW_PTHREADT_NULL;
+			/* Don't try again for every call */
+			best->failed = 1;
+			best = NULL;
+		}
+		pthread_attr_destroy(&attr);
+	}
+	if(best != NULL)
+	{
+		best->jbs++;
+	}
+	cw_mutex_unlock(&timer_start_lock);
+	return best;
+}
+
+
+static void timer_detach(struct jb_timer *t)
+{
+	cw_mutex_lock(&timer_start_lock);
+	t->jbs--;
+	cw_mutex_unlock(&timer_start_lock);
+}
+
+
+/* Trace replay */
+
+/* Length of the synthetic trace, in ms */
+#define JB_REPLAY_SYNTH_MS 60000
+#define JB_REPLAY_MAX_STREAMS 1000
+
+struct replay_pkt
+{
+	long arrival;	/* when it reached us, in ms */
+	long ts;	/* its timestamp, in ms */
+	long len;	/* audio in it, in ms */
+};
+
+struct replay_stats
+{
+	long in;
+	long delivered;
+	long interpolated;
+};
+
+static int replay_by_arrival(const void *a, const void *b)
+{
+	const struct replay_pkt *pa = a;
+	const struct replay_pkt *pb = b;
+
+	if(pa->arrival != pb->arrival)
+	{
+		return (pa->arrival < pb->arrival) ? -1 : 1;
+	}
+	return (pa->ts < pb->ts) ? -1 : (pa->ts > pb->ts);
+}
+
+static int replay_by_ts(const void *a, const void *b)
+{
+	const struct replay_pkt *pa = a;
+	const struct replay_pkt *pb = b;
+
+	return (pa->ts < pb->ts) ? -1 : (pa->ts > pb->ts);
+}
+
+/* Read "<arrival ms> <timestamp ms> <length ms>" lines. '#' starts a comment */
+static struct replay_pkt *replay_load(const char *path, int *count)
+{
+	struct replay_pkt *pkts, *tmp;
+	char buf[256];
+	FILE *fp;
+	int size, n;
+
+	if((fp = fopen(path, "r")) == NULL)
+	{
+		return NULL;
+	}
+	pkts = NULL;
+	size = n = 0;
+	while(fgets(buf, sizeof(buf), fp))
+	{
+		if(n == size)
+		{
+			size = size ? size * 2 : 1024;
+			if((tmp = realloc(pkts, size * sizeof(*pkts))) == NULL)
+			{
+				free(pkts);
+				fclose(fp);
+				return NULL;
+			}
+			pkts = tmp;
+		}
+		if(buf[0] == '#')
+		{
+			continue;
+		}
+		if(sscanf(buf, "%ld %ld %ld", &pkts[n].arrival, &pkts[n].ts, &pkts[n].len) == 3
+			&& pkts[n].len >= 2 && pkts[n].ts >= 0)
+		{
+			n++;
+		}
+	}
+	fclose(fp);
+	*count = n;
+	return pkts;
+}
+
+/* 20ms frames with up to 40ms of jitter, a 100ms delay spike every 10s
+   and 2% loss. Always the same, so runs can be compared. */
+static struct replay_pkt *replay_synthetic(int *count)
+{
+	struct replay_pkt *pkts;
+	unsigned int seed;
+	long ts;
+	int n;
+
+	if((pkts = malloc((JB_REPLAY_SYNTH_MS / 20) * sizeof(*pkts))) == NULL)
+	{
+		return NULL;
+	}
+	seed = 1;
+	n = 0;
+	for(ts = 0; ts < JB_REPLAY_SYNTH_MS; ts += 20)
+	{
+		seed = seed * 1103515245 + 12345;
+		if(((seed >> 16) & 0x7FFF) % 1000 < 20)
+		{
+			continue;
+		}
+		seed = seed * 1103515245 + 12345;
+		pkts[n].ts = ts;
+		pkts[n].len = 20;
+		pkts[n].arrival = ts + 20 + ((seed >> 16) & 0x7FFF) % 40;
+		if(ts % 10000 < 100)
+		{
+			pkts[n].arrival += 100;
+		}
+		n++;
+	}
+	*count = n;
+	return pkts;
+}
+
+/* Packets missing from the trace, going by the timestamps */
+static long replay_lost(struct replay_pkt *pkts, int count)
+{
+	struct replay_pkt *byts;
+	long lost, gap;
+	int i;
+
+	if((byts = malloc(count * sizeof(*byts))) == NULL)
+	{
+		return -1;
+	}
+	memcpy(byts, pkts, count * sizeof(*byts));
+	qsort(byts, count, sizeof(*byts), replay_by_ts);
+	lost = 0;
+	for(i = 1; i < count; i++)
+	{
+		gap = byts[i].ts - byts[i - 1].ts - byts[i - 1].len;
+		if(gap > 0)
+		{
+			lost += gap / byts[i - 1].len;
+		}
+	}
+	free(byts);
+	return lost;
+}
+
+/* A frame for a trace packet, allocated the way cw_jb_put() queues them */
+static struct cw_frame *replay_frame(struct replay_pkt *pkt)
+{
+	struct cw_frame *f;
+
+	if((f = malloc(sizeof(*f))) == NULL)
+	{
+		return NULL;
+	}
+	cw_fr_init_ex(f, CW_FRAME_VOICE, CW_FORMAT_ULAW, "JB replay");
+	f->mallocd = CW_MALLOCD_HDR;
+	f->samples = pkt->len * 8;
+	f->has_timing_info = 1;
+	f->ts = pkt->ts;
+	f->len = pkt->len;
+	return f;
+}
+
+/* Play a trace through one jitterbuffer on a virtual clock */
+static int replay_stream(struct cw_jb_impl *impl, struct cw_jb_conf *conf,
+	struct replay_pkt *pkts, int count, struct replay_stats *st)
+{
+	struct cw_frame *f;
+	void *jbobj;
+	long now, next, t, end;
+	int interpolation_len, i, res;
+
+	if((f = replay_frame(&pkts[0])) == NULL)
+	{
+		return -1;
+	}
+	if((jbobj = impl->create(conf, conf->resync_threshold)) == NULL)
+	{
+		cw_fr_free(f);
+		return -1;
+	}
+	interpolation_len = cw_codec_interp_len(CW_FORMAT_ULAW);
+	end = pkts[count - 1].arrival + ((conf->max_size > 0) ? conf->max_size : 1000);
+	
+	now = pkts[0].arrival;
+	if(impl->put_first(jbobj, f, now, CW_FORMAT_ULAW) != JB_IMPL_OK)
+	{
+		cw_fr_free(f);
+	}
+	st->in++;
+	i = 1;
+	while(now <= end)
+	{
+		/* Everything that has arrived by now goes in first */
+		for( ; i < count && pkts[i].arrival <= now; i++)
+		{
+			if((f = replay_frame(&pkts[i])) == NULL)
+			{
+				continue;
+			}
+			if(impl->put(jbobj, f, now, CW_FORMAT_ULAW) != JB_IMPL_OK)
+			{
+				cw_fr_free(f);
+			}
+			st->in++;
+		}
+		
+		next = impl->next(jbobj);
+		if(next <= now)
+		{
+			res = impl->get(jbobj, &f, now, interpolation_len);
+			if(res == JB_IMPL_OK)
+			{
+				cw_fr_free(f);
+				st->delivered++;
+				continue;
+			}
+			if(res == JB_IMPL_DROP)
+			{
+				cw_fr_free(f);
+				continue;
+			}
+			if(res == JB_IMPL_INTERP)
+			{
+				st->interpolated++;
+				continue;
+			}
+		}
+		
+		/* On to whatever happens next */
+		t = (i < count) ? pkts[i].arrival : end + 1;
+		if(next > now && next < t)
+		{
+			t = next;
+		}
+		now = t;
+	}
+	
+	while(impl->remove(jbobj, &f) == JB_IMPL_OK)
+	{
+		cw_fr_free(f);
+	}
+	impl->destroy(jbobj);
+	return 0;
+}
+
+static long replay_cpu_us(void)
+{
+	struct rusage ru;
+
+#ifdef RUSAGE_THREAD
+	getrusage(RUSAGE_THREAD, &ru);
+#else
+	getrusage(RUSAGE_SELF, &ru);
+#endif
+	return (ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000L
+		+ ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static int jb_replay(int fd, int argc, char *argv[])
+{
+	struct cw_jb_conf conf;
+	struct replay_stats st;
+	struct replay_pkt *pkts;
+	long lost, cpu;
+	int count, streams, i, j, res;
+
+	if(argc < 3 || argc > 4)
+	{
+		return RESULT_SHOWUSAGE;
+	}
+	streams = (argc > 3) ? atoi(argv[3]) : 1;
+	if(streams < 1 || streams > JB_REPLAY_MAX_STREAMS)
+	{
+		cw_cli(fd, "Number of streams must be between 1 and %d\n", JB_REPLAY_MAX_STREAMS);
+		return RESULT_SHOWUSAGE;
+	}
+	
+	count = 0;
+	if(strcasecmp(argv[2], "synthetic") == 0)
+	{
+		pkts = replay_synthetic(&count);
+	}
+	else
+	{
+		pkts = replay_load(argv[2], &count);
+	}
+	if(pkts == NULL || count == 0)
+	{
+		cw_cli(fd, "Unable to read a packet trace from '%s'\n", argv[2]);
+		free(pkts);
+		return RESULT_FAILURE;
+	}
+	qsort(pkts, count, sizeof(*pkts), replay_by_arrival);
+	lost = replay_lost(pkts, count);
+	
+	cw_jb_default_config(&conf);
+	conf.flags |= CW_GENERIC_JB_ENABLED;
+	conf.max_size = 200;
+	conf.resync_threshold = 1000;
+	
+	cw_cli(fd, "%d packets, %ld missing from the trace, %d stream(s) per jitterbuffer\n", count, lost, streams);
+	cw_cli(fd, "%-10s %8s %10s %8s %8s %13s %13s\n",
+		"Impl", "In", "Delivered", "Late", "Lost", "Interpolated", "CPU us/stream");
+	for(i = 0; i < sizeof(avail_impl) / sizeof(avail_impl[0]); i++)
+	{
+		memset(&st, 0, sizeof(st));
+		res = 0;
+		cpu = replay_cpu_us();
+		for(j = 0; j < streams && res == 0; j++)
+		{
+			res = replay_stream(&avail_impl[i], &conf, pkts, count, &st);
+		}
+		cpu = replay_cpu_us() - cpu;
+		if(res)
+		{
+			cw_cli(fd, "%-10s failed to create a jitterbuffer\n", avail_impl[i].name);
+			continue;
+		}
+		/* Whatever came in and was not played out was too late for it */
+		cw_cli(fd, "%-10s %8ld %10ld %8ld %8ld %13ld %13ld\n", avail_impl[i].name,
+			st.in / streams, st.delivered / streams, (st.in - st.delivered) / streams, lost,
+			st.interpolated / streams, cpu / streams);
+	}
+	
+	free(pkts);
+	return RESULT_SUCCESS;
+}
+
+static char jb_replay_usage[] =
+"Usage: jitterbuffer replay <trace file>|synthetic [<streams>]\n"
+"       Plays a packet trace through each jitterbuffer implementation on a\n"
+"virtual clock, and reports how many frames were delivered, came too late\n"
+"to be played out, were lost and were interpolated, and the CPU time used\n"
+"per stream. Each trace line holds the arrival time, timestamp and length\n"
+"of a packet, in ms. 'synthetic' uses a built in minute long trace with\n"
+"jitter, delay spikes and loss.\n";
+
+static struct cw_cli_entry jb_replay_cli =
+{
+	{ "jitterbuffer", "replay", NULL },
+	jb_replay,
+	"Replay a packet trace through the jitterbuffers",
+	jb_replay_usage
+};
+
+
+void cw_jb_init(void)
+{
+	int i;
+
+	cw_mutex_lock(&timer_start_lock);
+	if(!timer_ready)
+	{
+		timer_epoch = cw_tvnow();
+		for(i = 0; i < JB_TIMER_THREADS; i++)
+		{
+			cw_mutex_init(&timers[i].lock);
+			cw_cond_init(&timers[i].cond, NULL);
+			timers[i].thread = CW_PTHREADT_NULL;
+		}
+		timer_ready = 1;
+	}
+	cw_mutex_unlock(&timer_start_lock);
+	cw_cli_register(&jb_replay_cli);
+}
+
+
 /* Implementation functions */
 
 /* scx */
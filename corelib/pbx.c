@@ -154,6 +154,7 @@ struct cw_exten
     struct cw_exten *peer;    /* Next higher priority with our extension */
     const char *registrar;        /* Registrar */
     struct cw_exten *next;    /* Extension with a greater ID */
+    struct pbx_tmpl *tmpl;        /* Precompiled data, NULL if it has nothing to substitute */
     char stuff[0];
 };
 
@@ -199,6 +200,8 @@ struct cw_context
     struct cw_ignorepat *ignorepats;    /* Patterns for which to continue playing dialtone */
     const char *registrar;        /* Registrar */
     struct cw_sw *alts;        /* Alternative switches */
+    struct cw_exten *pending;    /* Bulk loaded extensions not yet linked in */
+    int npending;                /* Number of extensions on the pending list */
     char name[0];                /* Name of the context */
 };
 
@@ -236,12 +239,45 @@ struct cw_state_cb
 };
         
 /* Hints are pointers from an extension in the dialplan to one or more devices (tech/name) */
+/* Device states as far as a hint's aggregate state cares */
+#define HINT_DEV_NOT_INUSE      0
+#define HINT_DEV_INUSE          1
+#define HINT_DEV_RINGING        2
+#define HINT_DEV_BUSY           3
+#define HINT_DEV_UNAVAILABLE    4
+#define HINT_DEV_OTHER          5
+#define HINT_DEV_STATES         6
+
+struct cw_hint;
+
+/* hint_device: a device named in one or more hints, with its last known state */
+struct hint_device
+{
+    struct hint_device *next;     /* Hash chain */
+    unsigned int hash;
+    int state;                    /* Last cw_device_state() seen */
+    struct hint_link *links;      /* Hints watching this device */
+    char name[0];
+};
+
+/* hint_link: one device of one hint */
+struct hint_link
+{
+    struct cw_hint *hint;
+    struct hint_device *dev;
+    struct hint_link *next;       /* Next link on the same device */
+    struct hint_link **prevp;
+};
+
 struct cw_hint
 {
     struct cw_exten *exten;    /* Extension */
     int laststate;                /* Last known state */
     struct cw_state_cb *callbacks;    /* Callback list for this extension */
     struct cw_hint *next;        /* Pointer to next hint in list */
+    int ndevs;                    /* Devices named in the hint */
+    struct hint_link *links;      /* One per device */
+    int counts[HINT_DEV_STATES];  /* How many of the devices are in each state */
 };
 
 int cw_pbx_outgoing_cdr_failed(void);
@@ -281,6 +317,18 @@ static int pbx_builtin_importvar(struct cw_channel *, int, char **);
 
 CW_MUTEX_DEFINE_STATIC(globalslock);
 static struct varshead globals;
+static struct cw_var_index globalsindex;
+
+/* Lookups read a published copy of the globals rather than take globalslock.
+   Changes under the lock mark the copy stale and the next lookup publishes
+   a new one.  A replaced copy is kept until a later replacement finds no
+   lookup in progress, so values handed out by pbx_builtin_getvar_helper()
+   stay readable for a while, much as they did until the variable next
+   changed. */
+static struct cw_var_shared * volatile globalsread;
+static volatile int globalsstale = 1;
+static volatile int globalsreaders;
+static struct cw_var_shared *globalsretired;
 
 static int autofallthrough = 0;
 
@@ -616,6 +664,141 @@ static struct pbx_builtin {
 
 static struct cw_context *contexts = NULL;
 CW_MUTEX_DEFINE_STATIC(conlock);         /* Lock for the cw_context list */
+
+/*
+ * Dialplan versions.  A reload builds its contexts off to the side and
+ * swaps them onto the contexts list in one step, which starts a new
+ * version.  The contexts it replaced are hung off the version they were
+ * last seen in and are only freed once that version, and every version
+ * before it, is no longer pinned by a lookup still using what it found.
+ * The freeing is done by the reload itself or by the reaper thread, never
+ * by the call whose lookup let go of the last pin.
+ */
+struct dialplan_version
+{
+    int refs;                       /* Pinning lookups, plus one while current */
+    unsigned int id;
+    struct cw_context *retired;     /* Contexts replaced when this version was superseded */
+    struct dialplan_version *next;
+};
+
+static struct dialplan_version dialplan_initial = { 1, 0, NULL, NULL };
+static struct dialplan_version *dialplan_current = &dialplan_initial;   /* Protected by conlock */
+static struct dialplan_version *dialplan_old = NULL;    /* Superseded versions, oldest first */
+static struct dialplan_version **dialplan_old_tail = &dialplan_old;
+CW_MUTEX_DEFINE_STATIC(dialplan_old_lock);
+static cw_cond_t dialplan_reap_cond;    /* Signalled when a superseded version is let go of */
+static pthread_t dialplan_reaper = CW_PTHREADT_NULL;
+
+static void context_free(struct cw_context *tmp);
+
+/*! \brief Pin the current dialplan version.  Must be called with conlock held. */
+static struct dialplan_version *dialplan_pin(void)
+{
+    struct dialplan_version *ver = dialplan_current;
+
+    cw_atomic_fetchadd_int(&ver->refs, 1);
+    return ver;
+}
+
+/*! \brief Free the contexts of superseded versions nothing can see any more */
+static void dialplan_reclaim(void)
+{
+    struct dialplan_version *ver;
+    struct cw_context *dead = NULL, *con;
+
+    cw_mutex_lock(&dialplan_old_lock);
+    while ((ver = dialplan_old)  &&  ver->refs == 0)
+    {
+        if ((dialplan_old = ver->next) == NULL)
+            dialplan_old_tail = &dialplan_old;
+        while ((con = ver->retired))
+        {
+            ver->retired = con->next;
+            con->next = dead;
+            dead = con;
+        }
+        if (option_debug)
+            cw_log(LOG_DEBUG, "Reclaimed dialplan version %u\n", ver->id);
+        if (ver != &dialplan_initial)
+            free(ver);
+    }
+    cw_mutex_unlock(&dialplan_old_lock);
+
+    while ((con = dead))
+    {
+        dead = con->next;
+        context_free(con);
+    }
+}
+
+/*! \brief Free retired contexts as the versions holding them are let go of */
+static void *dialplan_reap(void *data)
+{
+    for (;;)
+    {
+        cw_mutex_lock(&dialplan_old_lock);
+        while (dialplan_old == NULL  ||  dialplan_old->refs != 0)
+            cw_cond_wait(&dialplan_reap_cond, &dialplan_old_lock);
+        cw_mutex_unlock(&dialplan_old_lock);
+        dialplan_reclaim();
+    }
+    return NULL;
+}
+
+/*! \brief Drop a pin.  Only a superseded version can lose its last pin, and
+ *  then the reaper is woken to free what it held. */
+static void dialplan_unpin(struct dialplan_version *ver)
+{
+    if (cw_atomic_dec_and_test(&ver->refs))
+    {
+        if (dialplan_reaper == CW_PTHREADT_NULL)
+        {
+            dialplan_reclaim();
+            return;
+        }
+        cw_mutex_lock(&dialplan_old_lock);
+        cw_cond_signal(&dialplan_reap_cond);
+        cw_mutex_unlock(&dialplan_old_lock);
+    }
+}
+
+/*! \brief Start a new dialplan version, retiring the given contexts with the
+ *  current one.  Must be called with conlock held; the caller unpins the
+ *  version returned once it has dropped conlock. */
+static struct dialplan_version *dialplan_retire(struct cw_context *retired)
+{
+    struct dialplan_version *old = dialplan_current;
+    struct dialplan_version *ver;
+    pthread_attr_t attr;
+
+    if ((ver = calloc(1, sizeof(*ver))) == NULL)
+        return NULL;
+    ver->refs = 1;
+    ver->id = old->id + 1;
+    old->retired = retired;
+    cw_mutex_lock(&dialplan_old_lock);
+    if (dialplan_reaper == CW_PTHREADT_NULL)
+    {
+        cw_cond_init(&dialplan_reap_cond, NULL);
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (cw_pthread_create(&dialplan_reaper, &attr, dialplan_reap, NULL))
+        {
+            /* Calls free what they let go of, as they did before */
+            cw_log(LOG_WARNING, "Unable to start the dialplan reaper thread\n");
+            dialplan_reaper = CW_PTHREADT_NULL;
+            cw_cond_destroy(&dialplan_reap_cond);
+        }
+        pthread_attr_destroy(&attr);
+    }
+    *dialplan_old_tail = old;
+    dialplan_old_tail = &old->next;
+    cw_mutex_unlock(&dialplan_old_lock);
+    cw_memory_barrier();
+    dialplan_current = ver;
+    return old;
+}
 static struct cw_app *apps_head = NULL;
 CW_MUTEX_DEFINE_STATIC(apps_lock);         /* Lock for the application list */
 
@@ -1128,7 +1311,83 @@ static struct cw_exten *pbx_find_extension(struct cw_channel *chan, struct cw_co
 //
 // NOTE: There may be further unsafeguarded cases not yet documented here!
 
+static void retrieve_variable(struct cw_channel *c, const char *var, unsigned int hash, char **ret, char *workspace, int workspacelen, struct varshead *headp);
+
+/*! \brief Publish a fresh copy of the globals for lookups.  globalslock must be held. */
+static void globals_publish(void)
+{
+    struct cw_var_shared *sh, *old;
+    struct cw_var_t *var;
+
+    if ((sh = cw_var_shared_new()) == NULL)
+        return;
+    CW_LIST_TRAVERSE(&globals, var, entries)
+    {
+        if (cw_var_shared_append(sh, cw_var_full_name(var), cw_var_value(var)))
+        {
+            /* Lookups carry on with the copy they have */
+            cw_var_shared_unref(sh);
+            return;
+        }
+    }
+
+    old = globalsread;
+    globalsread = sh;
+    globalsstale = 0;
+    cw_memory_barrier();
+    if (globalsreaders == 0)
+    {
+        /* Nobody can still be looking at anything replaced before now */
+        while ((sh = globalsretired))
+        {
+            globalsretired = sh->next;
+            cw_var_shared_unref(sh);
+        }
+    }
+    if (old)
+    {
+        old->next = globalsretired;
+        globalsretired = old;
+    }
+}
+
+/*! \brief Start a lookup in the globals.  Must be paired with globals_read_end(). */
+static struct cw_var_shared *globals_read_begin(void)
+{
+    if (globalsstale)
+    {
+        cw_mutex_lock(&globalslock);
+        if (globalsstale)
+            globals_publish();
+        cw_mutex_unlock(&globalslock);
+    }
+    cw_atomic_fetchadd_int(&globalsreaders, 1);
+    return globalsread;
+}
+
+static void globals_read_end(void)
+{
+    cw_atomic_fetchadd_int(&globalsreaders, -1);
+}
+
+/*! \brief Look a global up, returning its value or NULL.  Must be called
+    between globals_read_begin() and globals_read_end(). */
+static char *globals_find(struct cw_var_shared *sh, const char *name)
+{
+    struct cw_var_t *var;
+
+    if (sh  &&  (var = cw_var_index_find(&sh->idx, &sh->head, name)))
+        return cw_var_value(var);
+    return NULL;
+}
+
 void pbx_retrieve_variable(struct cw_channel *c, const char *var, char **ret, char *workspace, int workspacelen, struct varshead *headp)
+{
+    retrieve_variable(c, var, cw_hash_var_name(var), ret, workspace, workspacelen, headp);
+}
+
+/*! \brief pbx_retrieve_variable() with the name already hashed */
+static void retrieve_variable(struct cw_channel *c, const char *var, unsigned int hash, char **ret, char *workspace, int workspacelen, struct varshead *headp)
 {
     char *first, *second;
     char tmpvar[80];
@@ -1137,7 +1396,6 @@ void pbx_retrieve_variable(struct cw_channel *c, const char *var, char **ret, ch
     int offset, offset2;
     struct cw_var_t *variables;
     int no_match_yet = 0; // start optimistic
-    unsigned int hash = cw_hash_var_name(var);
 
     // warnings for (potentially) unsafe pre-conditions
     // TODO: these cases really ought to be safeguarded against
@@ -1384,22 +1642,15 @@ void pbx_retrieve_variable(struct cw_channel *c, const char *var, char **ret, ch
                 // search user defined channel variables (scenario #2)
                 // ---------------------------------------------------
                 
-                CW_LIST_TRAVERSE(&c->varshead, variables, entries) {
-#if 0
-                    cw_log(LOG_WARNING, "Comparing variable '%s' with '%s' in channel '%s'\n",
-                             var, cw_var_name(variables), c->name);
-#endif
-                    if (strcasecmp(cw_var_name(variables),var) == 0)
+                if ((variables = cw_channel_var_find(c, var)))
+                {
+                    *ret = cw_var_value(variables);
+                    if (*ret)
                     {
-                        *ret = cw_var_value(variables);
-                        if (*ret)
-                        {
-                            cw_copy_string(workspace, *ret, workspacelen);
-                            *ret = workspace;
-                        }
-                        no_match_yet = 0; // remember that we found a match
-                        break;
+                        cw_copy_string(workspace, *ret, workspacelen);
+                        *ret = workspace;
                     }
+                    no_match_yet = 0; // remember that we found a match
                 }
             }            
             else /* not a channel variable, neither built-in nor user-defined */
@@ -1484,24 +1735,14 @@ void pbx_retrieve_variable(struct cw_channel *c, const char *var, char **ret, ch
                 
                 if /* globals variable list exists, not NULL */ (&globals)
                 {
-                    cw_mutex_lock(&globalslock);
-                    CW_LIST_TRAVERSE(&globals, variables, entries)
+                    struct cw_var_shared *sh = globals_read_begin();
+
+                    if ((*ret = globals_find(sh, var)))
                     {
-#if 0
-                        cw_log(LOG_WARNING,"Comparing variable '%s' with '%s' in globals\n",
-                                 var, cw_var_name(variables));
-#endif
-                        if (hash == cw_var_hash(variables))
-                        {
-                            *ret = cw_var_value(variables);
-                            if (*ret)
-                            {
-                                cw_copy_string(workspace, *ret, workspacelen);
-                                *ret = workspace;
-                            }
-                        }
+                        cw_copy_string(workspace, *ret, workspacelen);
+                        *ret = workspace;
                     }
-                    cw_mutex_unlock(&globalslock);
+                    globals_read_end();
                 }
             }
         }
@@ -2021,16 +2262,216 @@ void pbx_substitute_variables_varshead(struct varshead *headp, const char *cp1,
     pbx_substitute_variables_helper_full(NULL, headp, cp1, cp2, count);
 }
 
+/*
+ * Precompiled extension data.  The data of each extension is split once,
+ * when it is added, into literal text, plain variable references with
+ * their names already hashed, and $[...] expressions with nothing to
+ * substitute inside them.  Anything more involved (functions, slicing,
+ * nesting) is kept as its original text and handed to the full
+ * substitution code when the priority runs.
+ */
+#define TMPL_LITERAL    0
+#define TMPL_VAR        1
+#define TMPL_EXPR       2
+#define TMPL_DYNAMIC    3
+
+struct pbx_tmpl_seg
+{
+    int type;
+    int len;
+    unsigned int hash;          /* TMPL_VAR: hashed variable name */
+    char *text;
+};
+
+struct pbx_tmpl
+{
+    int nsegs;
+    struct pbx_tmpl_seg seg[0];
+};
+
+/*! \brief Find the end of the ${...} or $[...] starting at p, exactly as
+ *  pbx_substitute_variables_helper_full() does.  Returns the length of the
+ *  whole reference, and whether it is well formed and needs no nested
+ *  substitution. */
+static int tmpl_scan(const char *p, int *simple)
+{
+    const char *vare = p + 2;
+    int brackets = 1;
+    int needsub = 0;
+
+    if (p[1] == '{')
+    {
+        while (brackets  &&  *vare)
+        {
+            if ((vare[0] == '$')  &&  (vare[1] == '{'))
+                needsub++;
+            else if (vare[0] == '{')
+                brackets++;
+            else if (vare[0] == '}')
+                brackets--;
+            else if ((vare[0] == '$')  &&  (vare[1] == '['))
+                needsub++;
+            vare++;
+        }
+    }
+    else
+    {
+        while (brackets  &&  *vare)
+        {
+            if ((vare[0] == '$')  &&  (vare[1] == '['))
+            {
+                needsub++;
+                brackets++;
+                vare++;
+            }
+            else if (vare[0] == '[')
+            {
+                brackets++;
+            }
+            else if (vare[0] == ']')
+            {
+                brackets--;
+            }
+            else if ((vare[0] == '$')  &&  (vare[1] == '{'))
+            {
+                needsub++;
+                vare++;
+            }
+            vare++;
+        }
+    }
+    *simple = (!brackets  &&  !needsub);
+    return vare - p;
+}
+
+static int tmpl_split(const char *data, struct pbx_tmpl_seg *seg, char *text)
+{
+    const char *p = data;
+    const char *lit = data;
+    int n = 0;
+    int len, simple;
+
+#define TMPL_ADD(t, src, l) do { \
+        if (seg) { \
+            seg[n].type = (t); \
+            seg[n].len = (l); \
+            seg[n].text = text; \
+            memcpy(text, (src), (l)); \
+            text[l] = '\0'; \
+            text += (l) + 1; \
+        } \
+        n++; \
+    } while (0)
+
+    while ((p = strchr(p, '$')))
+    {
+        if (p[1] != '{'  &&  p[1] != '[')
+        {
+            p++;
+            continue;
+        }
+        if (p > lit)
+            TMPL_ADD(TMPL_LITERAL, lit, p - lit);
+        len = tmpl_scan(p, &simple);
+        if (!simple)
+        {
+            TMPL_ADD(TMPL_DYNAMIC, p, len);
+        }
+        else if (p[1] == '[')
+        {
+            TMPL_ADD(TMPL_EXPR, p + 2, len - 3);
+        }
+        else if (memchr(p + 2, ')', len - 3)  ||  memchr(p + 2, ':', len - 3))
+        {
+            TMPL_ADD(TMPL_DYNAMIC, p, len);
+        }
+        else
+        {
+            TMPL_ADD(TMPL_VAR, p + 2, len - 3);
+            if (seg)
+                seg[n - 1].hash = cw_hash_var_name(seg[n - 1].text);
+        }
+        p += len;
+        lit = p;
+    }
+    if (*lit)
+        TMPL_ADD(TMPL_LITERAL, lit, strlen(lit));
+#undef TMPL_ADD
+    return n;
+}
+
+/*! \brief Compile extension data.  Returns NULL when there is nothing to
+ *  substitute, and the data can be used as it is. */
+static struct pbx_tmpl *pbx_tmpl_compile(const char *data)
+{
+    struct pbx_tmpl *t;
+    int n;
+
+    if (data == NULL  ||  (!strstr(data, "${")  &&  !strstr(data, "$[")))
+        return NULL;
+    n = tmpl_split(data, NULL, NULL);
+    /* Each segment's text plus its terminator fits in the data's own length plus one per segment */
+    if ((t = malloc(sizeof(*t) + n*sizeof(t->seg[0]) + strlen(data) + n + 1)) == NULL)
+        return NULL;
+    t->nsegs = tmpl_split(data, t->seg, (char *) &t->seg[n]);
+    return t;
+}
+
+static void pbx_tmpl_eval(struct cw_channel *c, struct pbx_tmpl *t, char *cp2, int count)
+{
+    struct pbx_tmpl_seg *seg;
+    char *workspace = NULL;
+    char *cp4;
+    int i, length;
+
+    /* Save the last byte for a terminating '\0' */
+    count--;
+    for (i = 0, seg = t->seg;  i < t->nsegs  &&  count > 0;  i++, seg++)
+    {
+        switch (seg->type)
+        {
+        case TMPL_LITERAL:
+            length = (seg->len > count)  ?  count  :  seg->len;
+            memcpy(cp2, seg->text, length);
+            break;
+        case TMPL_VAR:
+            if (!workspace)
+                workspace = alloca(VAR_BUF_SIZE);
+            workspace[0] = '\0';
+            retrieve_variable(c, seg->text, seg->hash, &cp4, workspace, VAR_BUF_SIZE, (c)  ?  &c->varshead  :  NULL);
+            length = 0;
+            if (cp4)
+            {
+                length = strlen(cp4);
+                if (length > count)
+                    length = count;
+                memcpy(cp2, cp4, length);
+            }
+            break;
+        case TMPL_EXPR:
+            length = cw_expr(seg->text, cp2, count);
+            break;
+        default:
+            pbx_substitute_variables_helper_full(c, (c)  ?  &c->varshead  :  NULL, seg->text, cp2, count + 1);
+            length = strlen(cp2);
+            break;
+        }
+        count -= length;
+        cp2 += length;
+    }
+    *cp2 = '\0';
+}
+
 static void pbx_substitute_variables(char *passdata, int datalen, struct cw_channel *c, struct cw_exten *e)
 {
     /* No variables or expressions in e->data, so why scan it? */
-    if (!strchr(e->data, '$') && !strstr(e->data,"${") && !strstr(e->data,"$[") && !strstr(e->data,"$(")) {
-        cw_copy_string(passdata, e->data, datalen);
+    if (e->tmpl == NULL)
+    {
+        cw_copy_string(passdata, (e->data)  ?  (char *) e->data  :  "", datalen);
         return;
     }
-    
-    pbx_substitute_variables_helper(c, e->data, passdata, datalen);
-}                                                        
+    pbx_tmpl_eval(c, e->tmpl, passdata, datalen);
+}
 
 static int pbx_extension_helper(struct cw_channel *c, struct cw_context *con, const char *context, const char *exten, int priority, const char *label, const char *callerid, int action) 
 {
@@ -2047,6 +2488,7 @@ static int pbx_extension_helper(struct cw_channel *c, struct cw_context *con, co
     char tmp[80];
     char tmp2[80];
     char tmp3[EXT_DATA_SIZE];
+    struct dialplan_version *ver;
 
     if (cw_mutex_lock(&conlock))
     {
@@ -2076,6 +2518,9 @@ static int pbx_extension_helper(struct cw_channel *c, struct cw_context *con, co
             return -1;
         case HELPER_EXEC:
             app = pbx_findapp(e->app);
+            /* e stays valid after conlock is dropped as long as its
+               dialplan version is pinned */
+            ver = dialplan_pin();
             cw_mutex_unlock(&conlock);
             if (app)
             {
@@ -2085,6 +2530,7 @@ static int pbx_extension_helper(struct cw_channel *c, struct cw_context *con, co
                     cw_copy_string(c->exten, exten, sizeof(c->exten));
                 c->priority = priority;
                 pbx_substitute_variables(passdata, sizeof(passdata), c, e);
+                dialplan_unpin(ver);
                 if (option_verbose > 2)
                         cw_verbose( VERBOSE_PREFIX_3 "Executing [%s@%s:%d] %s(\"%s\", \"%s\")\n", 
                                 exten, context, priority,
@@ -2104,6 +2550,7 @@ static int pbx_extension_helper(struct cw_channel *c, struct cw_context *con, co
                 return res;
             }
             cw_log(LOG_WARNING, "No application '%s' for extension (%s, %s, %d)\n", e->app, context, exten, priority);
+            dialplan_unpin(ver);
             return -1;
         default:
             cw_log(LOG_WARNING, "Huh (%d)?\n", action);
@@ -2127,6 +2574,8 @@ static int pbx_extension_helper(struct cw_channel *c, struct cw_context *con, co
             cw_mutex_unlock(&conlock);
             return -1;
         case HELPER_EXEC:
+            /* data and foundcontext point into the context */
+            ver = dialplan_pin();
             cw_mutex_unlock(&conlock);
             if (sw->exec)
             {
@@ -2137,6 +2586,7 @@ static int pbx_extension_helper(struct cw_channel *c, struct cw_context *con, co
                 cw_log(LOG_WARNING, "No execution engine for switch %s\n", sw->name);
                 res = -1;
             }
+            dialplan_unpin(ver);
             return res;
         default:
             cw_log(LOG_WARNING, "Huh (%d)?\n", action);
@@ -2300,45 +2750,201 @@ int cw_extension_state(struct cw_channel *c, char *context, char *exten)
     return cw_extension_state2(e);            /* Check all devices in the hint */
 }
 
+/*
+ * Reverse index from device name to the hints naming it.  Each device's
+ * state is queried once per change and cached; every hint keeps a count
+ * of its devices per state, so its aggregate state follows from the
+ * counts without asking any device again.  All of it is under hintlock.
+ */
+#define HINT_DEV_BUCKETS    4096
+
+static struct hint_device *hint_devices[HINT_DEV_BUCKETS];
+
+static int hint_dev_state(int devstate)
+{
+    switch (devstate)
+    {
+    case CW_DEVICE_NOT_INUSE:
+        return HINT_DEV_NOT_INUSE;
+    case CW_DEVICE_INUSE:
+        return HINT_DEV_INUSE;
+    case CW_DEVICE_RINGING:
+        return HINT_DEV_RINGING;
+    case CW_DEVICE_BUSY:
+        return HINT_DEV_BUSY;
+    case CW_DEVICE_UNAVAILABLE:
+    case CW_DEVICE_INVALID:
+        return HINT_DEV_UNAVAILABLE;
+    }
+    return HINT_DEV_OTHER;
+}
+
+/*! \brief The extension state of a hint, by the same rules as
+ *  cw_extension_state2() but from the hint's device counts */
+static int hint_aggregate(struct cw_hint *hint)
+{
+    int *n = hint->counts;
+    int inuse = n[HINT_DEV_INUSE];
+    int ring = n[HINT_DEV_RINGING];
+
+    if (!inuse && ring)
+        return CW_EXTENSION_RINGING;
+    if (inuse && ring)
+        return (CW_EXTENSION_INUSE | CW_EXTENSION_RINGING);
+    if (inuse)
+        return CW_EXTENSION_INUSE;
+    if (n[HINT_DEV_NOT_INUSE] == hint->ndevs)
+        return CW_EXTENSION_NOT_INUSE;
+    if (n[HINT_DEV_NOT_INUSE] + n[HINT_DEV_UNAVAILABLE] + n[HINT_DEV_OTHER] == 0)
+        return CW_EXTENSION_BUSY;
+    if (n[HINT_DEV_UNAVAILABLE] == hint->ndevs)
+        return CW_EXTENSION_UNAVAILABLE;
+    if (n[HINT_DEV_BUSY])
+        return CW_EXTENSION_INUSE;
+    return CW_EXTENSION_NOT_INUSE;
+}
+
+static struct hint_device *hint_device_find(const char *name, unsigned int hash)
+{
+    struct hint_device *dev;
+
+    for (dev = hint_devices[hash % HINT_DEV_BUCKETS];  dev;  dev = dev->next)
+    {
+        if (dev->hash == hash  &&  !strcmp(dev->name, name))
+            return dev;
+    }
+    return NULL;
+}
+
+/*! \brief Index the devices of a hint's application string */
+static void hint_link_devices(struct cw_hint *hint)
+{
+    char buf[CW_MAX_EXTENSION];
+    char *parse, *cur;
+    struct hint_device *dev;
+    struct hint_link *link;
+    unsigned int hash;
+    int n;
+
+    cw_copy_string(buf, cw_get_extension_app(hint->exten), sizeof(buf));
+    for (n = 1, parse = buf;  *parse;  parse++)
+    {
+        if (*parse == '&')
+            n++;
+    }
+    memset(hint->counts, 0, sizeof(hint->counts));
+    hint->ndevs = 0;
+    if ((hint->links = calloc(n, sizeof(*hint->links))) == NULL)
+    {
+        cw_log(LOG_ERROR, "Out of memory\n");
+        return;
+    }
+    parse = buf;
+    while ((cur = strsep(&parse, "&")))
+    {
+        hash = cw_hash_string(cur);
+        if ((dev = hint_device_find(cur, hash)) == NULL)
+        {
+            if ((dev = malloc(sizeof(*dev) + strlen(cur) + 1)) == NULL)
+            {
+                cw_log(LOG_ERROR, "Out of memory\n");
+                continue;
+            }
+            dev->hash = hash;
+            strcpy(dev->name, cur);
+            dev->state = cw_device_state(cur);
+            dev->links = NULL;
+            dev->next = hint_devices[hash % HINT_DEV_BUCKETS];
+            hint_devices[hash % HINT_DEV_BUCKETS] = dev;
+        }
+        link = &hint->links[hint->ndevs++];
+        link->hint = hint;
+        link->dev = dev;
+        link->next = dev->links;
+        if (link->next)
+            link->next->prevp = &link->next;
+        link->prevp = &dev->links;
+        dev->links = link;
+        hint->counts[hint_dev_state(dev->state)]++;
+    }
+}
+
+/*! \brief Drop a hint from the index, and any device no hint names any more */
+static void hint_unlink_devices(struct cw_hint *hint)
+{
+    struct hint_device *dev, **devp;
+    struct hint_link *link;
+    int i;
+
+    for (i = 0;  i < hint->ndevs;  i++)
+    {
+        link = &hint->links[i];
+        dev = link->dev;
+        if ((*link->prevp = link->next))
+            link->next->prevp = link->prevp;
+        if (dev->links == NULL)
+        {
+            for (devp = &hint_devices[dev->hash % HINT_DEV_BUCKETS];  *devp != dev;  devp = &(*devp)->next)
+                ;
+            *devp = dev->next;
+            free(dev);
+        }
+    }
+    free(hint->links);
+    hint->links = NULL;
+    hint->ndevs = 0;
+}
+
 void cw_hint_state_changed(const char *device)
 {
     struct cw_hint *hint;
     struct cw_state_cb *cblist;
-    char buf[CW_MAX_EXTENSION];
-    char *parse;
-    char *cur;
+    struct hint_device *dev;
+    struct hint_link *link;
+    int oldstate, newstate;
     int state;
 
     cw_mutex_lock(&hintlock);
 
-    for (hint = hints; hint; hint = hint->next)
+    if ((dev = hint_device_find(device, cw_hash_string(device))) == NULL)
+    {
+        /* No hint names this device */
+        cw_mutex_unlock(&hintlock);
+        return;
+    }
+
+    /* Update the cached device state and the counts of every hint naming it */
+    state = cw_device_state(device);
+    oldstate = hint_dev_state(dev->state);
+    newstate = hint_dev_state(state);
+    dev->state = state;
+    if (oldstate != newstate)
     {
-        cw_copy_string(buf, cw_get_extension_app(hint->exten), sizeof(buf));
-        parse = buf;
-        for (cur = strsep(&parse, "&"); cur; cur = strsep(&parse, "&"))
+        for (link = dev->links;  link;  link = link->next)
         {
-            if (strcmp(cur, device))
-                continue;
+            link->hint->counts[oldstate]--;
+            link->hint->counts[newstate]++;
+        }
+    }
 
-            /* Get device state for this hint */
-            state = cw_extension_state2(hint->exten);
-            
-            if ((state == -1) || (state == hint->laststate))
-                continue;
+    for (link = dev->links;  link;  link = link->next)
+    {
+        hint = link->hint;
+        state = hint_aggregate(hint);
+        if (state == hint->laststate)
+            continue;
 
-            /* Device state changed since last check - notify the watchers */
-            
-            /* For general callbacks */
-            for (cblist = statecbs; cblist; cblist = cblist->next)
-                cblist->callback(hint->exten->parent->name, hint->exten->exten, state, cblist->data);
-            
-            /* For extension callbacks */
-            for (cblist = hint->callbacks; cblist; cblist = cblist->next)
-                cblist->callback(hint->exten->parent->name, hint->exten->exten, state, cblist->data);
-            
-            hint->laststate = state;
-            break;
-        }
+        /* Device state changed since last check - notify the watchers */
+        
+        /* For general callbacks */
+        for (cblist = statecbs; cblist; cblist = cblist->next)
+            cblist->callback(hint->exten->parent->name, hint->exten->exten, state, cblist->data);
+        
+        /* For extension callbacks */
+        for (cblist = hint->callbacks; cblist; cblist = cblist->next)
+            cblist->callback(hint->exten->parent->name, hint->exten->exten, state, cblist->data);
+        
+        hint->laststate = state;
     }
 
     cw_mutex_unlock(&hintlock);
@@ -2536,7 +3142,8 @@ static int cw_add_hint(struct cw_exten *e)
     /* Initialize and insert new item at the top */
     memset(list, 0, sizeof(struct cw_hint));
     list->exten = e;
-    list->laststate = cw_extension_state2(e);
+    hint_link_devices(list);
+    list->laststate = (list->links)  ?  hint_aggregate(list)  :  cw_extension_state2(e);
     list->next = hints;
     hints = list;
 
@@ -2556,7 +3163,10 @@ static int cw_change_hint(struct cw_exten *oe, struct cw_exten *ne)
     {
         if (list->exten == oe)
         {
-                list->exten = ne;
+            list->exten = ne;
+            /* The devices may have changed with the extension */
+            hint_unlink_devices(list);
+            hint_link_devices(list);
             cw_mutex_unlock(&hintlock);    
             return 0;
         }
@@ -2600,6 +3210,7 @@ static int cw_remove_hint(struct cw_exten *e)
                 hints = list->next;
                 else
                 prev->next = list->next;
+                hint_unlink_devices(list);
                 free(list);
         
             cw_mutex_unlock(&hintlock);
@@ -4307,6 +4918,14 @@ static int handle_show_dialplan(int fd, int argc, char *argv[])
 /*
  * CLI entries for upper commands ...
  */
+static int handle_dialplan_benchmark(int fd, int argc, char *argv[]);
+
+static char dialplan_benchmark_help[] =
+"Usage: dialplan benchmark [<extensions>]\n"
+"       Loads a generated dialplan of the given number of extensions, 10000\n"
+"by default, into two scratch contexts, one line at a time and in bulk.\n"
+"Shows how long each took and checks that both give the same order.\n";
+
 static struct cw_cli_entry pbx_cli[] = {
     { { "show", "applications", NULL }, handle_show_applications,
       "Shows registered dialplan applications", show_applications_help, complete_show_applications },
@@ -4326,6 +4945,8 @@ static struct cw_cli_entry pbx_cli[] = {
       "Show global dialplan variables", show_globals_help },
     { { "set", "global", NULL }, handle_set_global,
       "Set global dialplan variable", set_global_help },
+    { { "dialplan", "benchmark", NULL }, handle_dialplan_benchmark,
+      "Time dialplan loading", dialplan_benchmark_help },
 };
 
 
@@ -4403,6 +5024,9 @@ CW_LIST_HEAD(store_hints, store_hint);
 void cw_merge_contexts_and_delete(struct cw_context **extcontexts, const char *registrar)
 {
     struct cw_context *tmp, *lasttmp = NULL;
+    struct cw_context *retired, *newcon, **prev;
+    struct dialplan_version *old;
+    int match;
     struct store_hints store;
     struct store_hint *this;
     struct cw_hint *hint;
@@ -4410,6 +5034,10 @@ void cw_merge_contexts_and_delete(struct cw_context **extcontexts, const char *r
     int length;
     struct cw_state_cb *thiscb, *prevcb;
 
+    /* link anything still queued by a bulk load before taking any locks */
+    for (tmp = *extcontexts;  tmp;  tmp = tmp->next)
+        cw_context_commit_extensions(tmp);
+
     /* preserve all watchers for hints associated with this registrar */
     CW_LIST_HEAD_INIT(&store);
     cw_mutex_lock(&hintlock);
@@ -4435,29 +5063,41 @@ void cw_merge_contexts_and_delete(struct cw_context **extcontexts, const char *r
     }
     cw_mutex_unlock(&hintlock);
 
-    tmp = *extcontexts;
+    /* Unlink the contexts being replaced.  Only the list is touched while
+       conlock is held; freeing them waits until no lookup can still be
+       using them. */
     cw_mutex_lock(&conlock);
-    if (registrar)
+    retired = NULL;
+    for (prev = &contexts;  (tmp = *prev);  )
     {
-        __cw_context_destroy(NULL,registrar);
-        while (tmp)
+        if (registrar)
+            match = !strcasecmp(registrar, tmp->registrar);
+        else
         {
-            lasttmp = tmp;
-            tmp = tmp->next;
+            for (newcon = *extcontexts;  newcon;  newcon = newcon->next)
+            {
+                if (newcon->hash == tmp->hash  &&  !strcasecmp(newcon->registrar, tmp->registrar))
+                    break;
+            }
+            match = (newcon != NULL);
         }
-    }
-    else
-    {
-        while (tmp)
+        if (match)
         {
-            __cw_context_destroy(tmp,tmp->registrar);
-            lasttmp = tmp;
-            tmp = tmp->next;
+            *prev = tmp->next;
+            tmp->next = retired;
+            retired = tmp;
+        }
+        else
+        {
+            prev = &tmp->next;
         }
     }
+    for (tmp = *extcontexts;  tmp;  tmp = tmp->next)
+        lasttmp = tmp;
     if (lasttmp)
     {
         lasttmp->next = contexts;
+        cw_memory_barrier();
         contexts = *extcontexts;
         *extcontexts = NULL;
     }
@@ -4465,7 +5105,23 @@ void cw_merge_contexts_and_delete(struct cw_context **extcontexts, const char *r
     {
         cw_log(LOG_WARNING, "Requested contexts could not be merged\n");
     }
+    old = NULL;
+    if (retired  &&  (old = dialplan_retire(retired)) == NULL)
+    {
+        cw_log(LOG_WARNING, "Out of memory, freeing replaced contexts immediately\n");
+        while ((tmp = retired))
+        {
+            retired = tmp->next;
+            context_free(tmp);
+        }
+    }
     cw_mutex_unlock(&conlock);
+    if (old)
+    {
+        /* Free here what no call is using, and leave the rest to the reaper */
+        dialplan_unpin(old);
+        dialplan_reclaim();
+    }
 
     /* restore the watchers for hints that can be found; notify those that
        cannot be restored
@@ -5487,6 +6143,65 @@ static void null_datad(void *foo)
 {
 }
 
+/*! \brief Allocate and fill in an extension, with all its strings packed
+ *  behind the structure.  Nothing is linked. */
+static struct cw_exten *exten_alloc(struct cw_context *con, const char *extension, int priority,
+                                    const char *label, const char *callerid, const char *application,
+                                    void *data, void (*datad)(void *), const char *registrar)
+{
+    struct cw_exten *tmp;
+    int length;
+    char *p;
+
+    length = sizeof(struct cw_exten);
+    length += strlen(extension) + 1;
+    length += strlen(application) + 1;
+    if (label)
+        length += strlen(label) + 1;
+    if (callerid)
+        length += strlen(callerid) + 1;
+    else
+        length ++;
+
+    if ((tmp = malloc(length)) == NULL)
+        return NULL;
+    memset(tmp, 0, length);
+    tmp->hash = cw_hash_string(extension);
+    p = tmp->stuff;
+    if (label)
+    {
+        tmp->label = p;
+        strcpy(tmp->label, label);
+        p += strlen(label) + 1;
+    }
+    tmp->exten = p;
+    p += ext_strncpy(tmp->exten, extension, strlen(extension) + 1) + 1;
+    tmp->priority = priority;
+    tmp->cidmatch = p;
+    if (callerid)
+    {
+        p += ext_strncpy(tmp->cidmatch, callerid, strlen(callerid) + 1) + 1;
+        tmp->matchcid = 1;
+    }
+    else
+    {
+        tmp->cidmatch[0] = '\0';
+        tmp->matchcid = 0;
+        p++;
+    }
+    tmp->app = p;
+    strcpy(tmp->app, application);
+    tmp->parent = con;
+    tmp->data = data;
+    tmp->datad = datad;
+    tmp->registrar = registrar;
+    tmp->peer = NULL;
+    tmp->next =  NULL;
+    if (priority != PRIORITY_HINT)
+        tmp->tmpl = pbx_tmpl_compile(data);
+    return tmp;
+}
+
 /*
  * EBUSY - can't lock
  * EEXIST - extension with the same priority exist and no replace is set
@@ -5520,59 +6235,11 @@ int cw_add_extension2(struct cw_context *con,
      */
     struct cw_exten *tmp, *e, *el = NULL, *ep = NULL;
     int res;
-    int length;
-    char *p;
-    unsigned int hash = cw_hash_string(extension);
-
-    length = sizeof(struct cw_exten);
-    length += strlen(extension) + 1;
-    length += strlen(application) + 1;
-    if (label)
-        length += strlen(label) + 1;
-    if (callerid)
-        length += strlen(callerid) + 1;
-    else
-        length ++;
 
     /* Be optimistic:  Build the extension structure first */
     if (datad == NULL)
         datad = null_datad;
-    if ((tmp = malloc(length)))
-    {
-        memset(tmp, 0, length);
-        tmp->hash = hash;
-        p = tmp->stuff;
-        if (label)
-        {
-            tmp->label = p;
-            strcpy(tmp->label, label);
-            p += strlen(label) + 1;
-        }
-        tmp->exten = p;
-        p += ext_strncpy(tmp->exten, extension, strlen(extension) + 1) + 1;
-        tmp->priority = priority;
-        tmp->cidmatch = p;
-        if (callerid)
-        {
-            p += ext_strncpy(tmp->cidmatch, callerid, strlen(callerid) + 1) + 1;
-            tmp->matchcid = 1;
-        }
-        else
-        {
-            tmp->cidmatch[0] = '\0';
-            tmp->matchcid = 0;
-            p++;
-        }
-        tmp->app = p;
-        strcpy(tmp->app, application);
-        tmp->parent = con;
-        tmp->data = data;
-        tmp->datad = datad;
-        tmp->registrar = registrar;
-        tmp->peer = NULL;
-        tmp->next =  NULL;
-    }
-    else
+    if ((tmp = exten_alloc(con, extension, priority, label, callerid, application, data, datad, registrar)) == NULL)
     {
         cw_log(LOG_ERROR, "Out of memory\n");
         errno = ENOMEM;
@@ -5580,6 +6247,7 @@ int cw_add_extension2(struct cw_context *con,
     }
     if (cw_mutex_lock(&con->lock))
     {
+        free(tmp->tmpl);
         free(tmp);
         /* And properly destroy the data */
         datad(data);
@@ -5644,6 +6312,7 @@ int cw_add_extension2(struct cw_context *con,
                             cw_change_hint(e,tmp);
                         /* Destroy the old one */
                         e->datad(e->data);
+                        free(e->tmpl);
                         free(e);
                         cw_mutex_unlock(&con->lock);
                         if (tmp->priority == PRIORITY_HINT)
@@ -5657,6 +6326,7 @@ int cw_add_extension2(struct cw_context *con,
                         cw_log(LOG_WARNING, "Unable to register extension '%s', priority %d in '%s' (%#x), already in use\n",
                                  tmp->exten, tmp->priority, con->name, con->hash);
                         tmp->datad(tmp->data);
+                        free(tmp->tmpl);
                         free(tmp);
                         cw_mutex_unlock(&con->lock);
                         errno = EEXIST;
@@ -5750,6 +6420,290 @@ int cw_add_extension2(struct cw_context *con,
     return 0;    
 }
 
+/*! \brief Sort order of the extension lists: plain extensions before
+ *  patterns, then by name, extensions with a CID match before the one
+ *  without, so that they are found first, and then by CID match.
+ *  Priorities are not compared.  This must give the same order as
+ *  cw_add_extension2(). */
+static int exten_name_cmp(const struct cw_exten *a, const struct cw_exten *b)
+{
+    int res;
+
+    if ((a->exten[0] != '_')  &&  (b->exten[0] == '_'))
+        return -1;
+    if ((a->exten[0] == '_')  &&  (b->exten[0] != '_'))
+        return 1;
+    if ((res = strcmp(a->exten, b->exten)))
+        return res;
+    if (a->matchcid != b->matchcid)
+        return (a->matchcid)  ?  -1  :  1;
+    if (a->matchcid)
+        return strcasecmp(a->cidmatch, b->cidmatch);
+    return 0;
+}
+
+/*! \brief As exten_name_cmp(), then by priority */
+static int exten_cmp(const struct cw_exten *a, const struct cw_exten *b)
+{
+    int res;
+
+    if ((res = exten_name_cmp(a, b)))
+        return res;
+    return a->priority - b->priority;
+}
+
+struct bulk_item
+{
+    struct cw_exten *e;
+    int seq;                    /* Load order, so the first definition wins */
+};
+
+static int bulk_item_cmp(const void *a, const void *b)
+{
+    const struct bulk_item *ia = a;
+    const struct bulk_item *ib = b;
+    int res;
+
+    if ((res = exten_cmp(ia->e, ib->e)))
+        return res;
+    return ia->seq - ib->seq;
+}
+
+/*
+ * Queue an extension on a context for cw_context_commit_extensions().
+ * Nothing is searched here, so loading a large dialplan this way costs
+ * one sort per context instead of a list walk per extension.
+ */
+int cw_add_extension_bulk(struct cw_context *con,
+                          const char *extension, int priority, const char *label, const char *callerid,
+                          const char *application, void *data, void (*datad)(void *),
+                          const char *registrar)
+{
+    struct cw_exten *tmp;
+
+    if (datad == NULL)
+        datad = null_datad;
+    if ((tmp = exten_alloc(con, extension, priority, label, callerid, application, data, datad, registrar)) == NULL)
+    {
+        cw_log(LOG_ERROR, "Out of memory\n");
+        datad(data);
+        errno = ENOMEM;
+        return -1;
+    }
+    cw_mutex_lock(&con->lock);
+    tmp->next = con->pending;
+    con->pending = tmp;
+    con->npending++;
+    cw_mutex_unlock(&con->lock);
+    return 0;
+}
+
+/*
+ * Link every extension queued with cw_add_extension_bulk() into the
+ * context.  The pending extensions and the ones already in the context
+ * are sorted together and the next/peer lists rebuilt in a single pass.
+ * Where an extension and priority is defined twice the earlier definition
+ * is kept, just as cw_add_extension2() without replace would.
+ * Returns the number of extensions added or -1 on error.
+ */
+int cw_context_commit_extensions(struct cw_context *con)
+{
+    struct bulk_item *items;
+    struct cw_exten *e, *en, *ep, *last;
+    int n, i, count, added = 0;
+
+    cw_mutex_lock(&con->lock);
+    if (con->pending == NULL)
+    {
+        cw_mutex_unlock(&con->lock);
+        return 0;
+    }
+
+    /* Anything already linked takes part in the sort, ahead of the new ones */
+    count = con->npending;
+    for (e = con->root;  e;  e = e->next)
+    {
+        for (en = e;  en;  en = en->peer)
+            count++;
+    }
+    if ((items = malloc(count*sizeof(*items))) == NULL)
+    {
+        cw_mutex_unlock(&con->lock);
+        cw_log(LOG_ERROR, "Out of memory\n");
+        return -1;
+    }
+    n = 0;
+    for (e = con->root;  e;  e = e->next)
+    {
+        for (en = e;  en;  en = en->peer)
+        {
+            items[n].e = en;
+            items[n].seq = n - count;
+            n++;
+        }
+    }
+    /* The pending list is in reverse order of loading */
+    for (e = con->pending, i = count;  e;  e = e->next)
+    {
+        items[n].e = e;
+        items[n].seq = --i;
+        n++;
+    }
+    con->pending = NULL;
+    con->npending = 0;
+
+    qsort(items, n, sizeof(*items), bulk_item_cmp);
+
+    con->root = NULL;
+    last = ep = NULL;
+    for (i = 0;  i < n;  i++)
+    {
+        e = items[i].e;
+        if (ep  &&  exten_cmp(ep, e) == 0)
+        {
+            cw_log(LOG_WARNING, "Unable to register extension '%s', priority %d in '%s' (%#x), already in use\n",
+                   e->exten, e->priority, con->name, con->hash);
+            e->datad(e->data);
+            free(e->tmpl);
+            free(e);
+            items[i].e = NULL;
+            continue;
+        }
+        e->next = NULL;
+        e->peer = NULL;
+        if (ep  &&  exten_name_cmp(ep, e) == 0)
+        {
+            /* Another priority of the same extension */
+            ep->peer = e;
+        }
+        else
+        {
+            if (last)
+                last->next = e;
+            else
+                con->root = e;
+            last = e;
+        }
+        ep = e;
+    }
+    cw_mutex_unlock(&con->lock);
+
+    for (i = 0;  i < n;  i++)
+    {
+        if (items[i].e  &&  items[i].seq >= 0)
+        {
+            added++;
+            if (items[i].e->priority == PRIORITY_HINT)
+                cw_add_hint(items[i].e);
+        }
+    }
+    free(items);
+    if (option_debug)
+        cw_log(LOG_DEBUG, "Added %d extensions to %s\n", added, con->name);
+    else if (option_verbose > 2)
+        cw_verbose(VERBOSE_PREFIX_3 "Added %d extensions to %s\n", added, con->name);
+    return added;
+}
+
+/*! \brief Compare the extension lists of two contexts.  Returns the first
+ *  extension of a where they differ, or NULL if they are the same. */
+static struct cw_exten *dialplan_benchmark_diff(struct cw_context *a, struct cw_context *b)
+{
+    struct cw_exten *ea, *eb, *pa, *pb;
+
+    for (ea = a->root, eb = b->root;  ea  &&  eb;  ea = ea->next, eb = eb->next)
+    {
+        for (pa = ea, pb = eb;  pa  &&  pb;  pa = pa->peer, pb = pb->peer)
+        {
+            if (exten_cmp(pa, pb))
+                return pa;
+        }
+        if (pa  ||  pb)
+            return ea;
+    }
+    return (ea  ||  eb)  ?  (ea  ?  ea  :  a->root)  :  NULL;
+}
+
+static int handle_dialplan_benchmark(int fd, int argc, char *argv[])
+{
+    static const char registrar[] = "dialplan benchmark";
+    struct cw_context *local = NULL;
+    struct cw_context *one, *bulk;
+    struct cw_exten *e;
+    struct timeval start;
+    long t_one, t_bulk;
+    char exten[32];
+    const char *cid;
+    int lines, n, i, k, p, pass;
+
+    if (argc > 3)
+        return RESULT_SHOWUSAGE;
+    n = (argc > 2)  ?  atoi(argv[2])  :  10000;
+    if (n < 1  ||  n > 1000000)
+    {
+        cw_cli(fd, "The number of extensions must be between 1 and 1000000\n");
+        return RESULT_SHOWUSAGE;
+    }
+    one = cw_context_create(&local, "__dialplan_benchmark_one", registrar);
+    bulk = cw_context_create(&local, "__dialplan_benchmark_bulk", registrar);
+    if (one == NULL  ||  bulk == NULL)
+    {
+        if (one)
+            context_free(one);
+        cw_cli(fd, "Unable to create the scratch contexts\n");
+        return RESULT_FAILURE;
+    }
+
+    /* Three priorities per extension, in no particular order, with every
+       tenth also matched on caller ID and every fifth a pattern */
+    lines = 0;
+    for (pass = 0;  pass < 2;  pass++)
+    {
+        start = cw_tvnow();
+        for (i = 0;  i < n;  i++)
+        {
+            k = (int) (((long long) i*7919) % n);
+            snprintf(exten, sizeof(exten), (k % 5)  ?  "%d"  :  "_%dX.", k);
+            cid = (k % 10 == 1)  ?  "5551234"  :  NULL;
+            for (p = 1;  p <= 3;  p++)
+            {
+                if (pass == 0)
+                    cw_add_extension2(one, 0, exten, p, NULL, cid, "NoOp", NULL, NULL, registrar);
+                else
+                    cw_add_extension_bulk(bulk, exten, p, NULL, cid, "NoOp", NULL, NULL, registrar);
+                if (cid)
+                {
+                    if (pass == 0)
+                        cw_add_extension2(one, 0, exten, p, NULL, NULL, "NoOp", NULL, NULL, registrar);
+                    else
+                        cw_add_extension_bulk(bulk, exten, p, NULL, NULL, "NoOp", NULL, NULL, registrar);
+                }
+                if (pass == 0)
+                    lines += (cid)  ?  2  :  1;
+            }
+        }
+        if (pass == 0)
+        {
+            t_one = cw_tvdiff_ms(cw_tvnow(), start);
+        }
+        else
+        {
+            cw_context_commit_extensions(bulk);
+            t_bulk = cw_tvdiff_ms(cw_tvnow(), start);
+        }
+    }
+
+    cw_cli(fd, "%d lines, one at a time: %ld ms, in bulk: %ld ms\n", lines, t_one, t_bulk);
+    if ((e = dialplan_benchmark_diff(one, bulk)))
+        cw_cli(fd, "Extension orders DIFFER, first at '%s' priority %d\n", e->exten, e->priority);
+    else
+        cw_cli(fd, "Extension orders match\n");
+
+    context_free(one);
+    context_free(bulk);
+    return RESULT_SUCCESS;
+}
+
 struct async_stat
 {
     pthread_t p;
@@ -6253,16 +7207,65 @@ static void destroy_exten(struct cw_exten *e)
 
     if (e->datad)
         e->datad(e->data);
+    free(e->tmpl);
     free(e);
 }
 
+/*! \brief Free a context that is no longer on the contexts list */
+static void context_free(struct cw_context *tmp)
+{
+    struct cw_include *tmpi, *tmpil;
+    struct cw_sw *sw, *swl;
+    struct cw_exten *e, *el, *en;
+    struct cw_ignorepat *ipi, *ipl;
+
+    for (tmpi = tmp->includes;  tmpi;  )
+    {
+        /* Free includes */
+        tmpil = tmpi;
+        tmpi = tmpi->next;
+        free(tmpil);
+    }
+    for (ipi = tmp->ignorepats;  ipi;  )
+    {
+        /* Free ignorepats */
+        ipl = ipi;
+        ipi = ipi->next;
+        free(ipl);
+    }
+    for (sw = tmp->alts;  sw;  )
+    {
+        /* Free switches */
+        swl = sw;
+        sw = sw->next;
+        free(swl);
+        swl = sw;
+    }
+    for (e = tmp->root;  e;  )
+    {
+        for (en = e->peer;  en;  )
+        {
+            el = en;
+            en = en->peer;
+            destroy_exten(el);
+        }
+        el = e;
+        e = e->next;
+        destroy_exten(el);
+    }
+    for (e = tmp->pending;  e;  )
+    {
+        el = e;
+        e = e->next;
+        destroy_exten(el);
+    }
+    cw_mutex_destroy(&tmp->lock);
+    free(tmp);
+}
+
 void __cw_context_destroy(struct cw_context *con, const char *registrar)
 {
     struct cw_context *tmp, *tmpl=NULL;
-    struct cw_include *tmpi, *tmpil= NULL;
-    struct cw_sw *sw, *swl= NULL;
-    struct cw_exten *e, *el, *en;
-    struct cw_ignorepat *ipi, *ipl = NULL;
 
     cw_mutex_lock(&conlock);
     tmp = contexts;
@@ -6286,48 +7289,12 @@ void __cw_context_destroy(struct cw_context *con, const char *registrar)
             /* Okay, now we're safe to let it go -- in a sense, we were
                ready to let it go as soon as we locked it. */
             cw_mutex_unlock(&tmp->lock);
-            for (tmpi = tmp->includes;  tmpi;  )
-            {
-                /* Free includes */
-                tmpil = tmpi;
-                tmpi = tmpi->next;
-                free(tmpil);
-            }
-            for (ipi = tmp->ignorepats;  ipi;  )
-            {
-                /* Free ignorepats */
-                ipl = ipi;
-                ipi = ipi->next;
-                free(ipl);
-            }
-            for (sw = tmp->alts;  sw;  )
-            {
-                /* Free switches */
-                swl = sw;
-                sw = sw->next;
-                free(swl);
-                swl = sw;
-            }
-            for (e = tmp->root;  e;  )
-            {
-                for (en = e->peer;  en;  )
-                {
-                    el = en;
-                    en = en->peer;
-                    destroy_exten(el);
-                }
-                el = e;
-                e = e->next;
-                destroy_exten(el);
-            }
-            cw_mutex_destroy(&tmp->lock);
-            free(tmp);
+            context_free(tmp);
             if (!con)
             {
                 /* Might need to get another one -- restart */
                 tmp = contexts;
                 tmpl = NULL;
-                tmpil = NULL;
                 continue;
             }
             cw_mutex_unlock(&conlock);
@@ -6841,7 +7808,7 @@ int pbx_builtin_serialize_variables(struct cw_channel *chan, char *buf, size_t s
 
     memset(buf, 0, size);
 
-    CW_LIST_TRAVERSE(&chan->varshead, variables, entries)
+    CW_CHANNEL_VARS_TRAVERSE(chan, variables)
     {
         if ((var = cw_var_name(variables))  &&  (val = cw_var_value(variables)))
         {
@@ -6864,43 +7831,17 @@ int pbx_builtin_serialize_variables(struct cw_channel *chan, char *buf, size_t s
 char *pbx_builtin_getvar_helper(struct cw_channel *chan, const char *name) 
 {
     struct cw_var_t *variables;
-    struct varshead *headp;
-    unsigned int hash = cw_hash_var_name(name);
     char *ret = NULL;
 
-    if (chan)
-        headp = &chan->varshead;
-    else
-        headp = &globals;
-
     if (name)
     {
-        if (headp == &globals)
-            cw_mutex_lock(&globalslock);
-        CW_LIST_TRAVERSE(headp,variables,entries)
-        {
-            if (hash == cw_var_hash(variables))
-            {
-                ret = cw_var_value(variables);
-                break;
-            }
-        }
-        if (headp == &globals)
-            cw_mutex_unlock(&globalslock);
-        if (ret == NULL && headp != &globals)
+        if (chan  &&  (variables = cw_channel_var_find(chan, name)))
+            ret = cw_var_value(variables);
+        if (ret == NULL)
         {
             /* Check global variables if we haven't already */
-            headp = &globals;
-            cw_mutex_lock(&globalslock);
-            CW_LIST_TRAVERSE(headp,variables,entries)
-            {
-                if (hash == cw_var_hash(variables))
-                {
-                    ret = cw_var_value(variables);
-                    break;
-                }
-            }
-            cw_mutex_unlock(&globalslock);
+            ret = globals_find(globals_read_begin(), name);
+            globals_read_end();
         }
     }
     return ret;
@@ -6924,11 +7865,19 @@ void pbx_builtin_pushvar_helper(struct cw_channel *chan, const char *name, const
         if ((option_verbose > 1) && (headp == &globals))
             cw_verbose(VERBOSE_PREFIX_2 "Setting global variable '%s' to '%s'\n", name, value);
         newvariable = cw_var_assign(name, value);      
+        if (newvariable == NULL)
+            return;
         if (headp == &globals)
             cw_mutex_lock(&globalslock);
+        else
+            cw_channel_var_changing(chan, name);
         CW_LIST_INSERT_HEAD(headp, newvariable, entries);
+        cw_var_index_add((chan)  ?  &chan->varsindex  :  &globalsindex, newvariable, 1);
         if (headp == &globals)
+        {
+            globalsstale = 1;
             cw_mutex_unlock(&globalslock);
+        }
     }
 }
 
@@ -6937,48 +7886,57 @@ void pbx_builtin_setvar_helper(struct cw_channel *chan, const char *name, const
 {
     struct cw_var_t *newvariable;
     struct varshead *headp;
-    const char *nametail = name;
-    unsigned int hash;
+    struct cw_var_index *idx;
 
     if (name[strlen(name)-1] == ')')
         return cw_func_write(chan, name, value);
 
     headp = (chan) ? &chan->varshead : &globals;
-
-    /* For comparison purposes, we have to strip leading underscores */
-    if (*nametail == '_')
-    {
-        nametail++;
-        if (*nametail == '_') 
-            nametail++;
-    }
-    
-    hash = cw_hash_var_name(nametail);
+    idx = (chan) ? &chan->varsindex : &globalsindex;
 
     if (headp == &globals)
         cw_mutex_lock(&globalslock);
+    else
+        cw_channel_var_changing(chan, name);
 
-    CW_LIST_TRAVERSE (headp, newvariable, entries)
+    /* Leading underscores are ignored when looking for an existing variable */
+    if ((newvariable = cw_var_index_find(idx, headp, name)))
     {
-        if (hash == cw_var_hash(newvariable))
+        if (value  &&  !strcmp(cw_var_full_name(newvariable), name)  &&  strlen(value) <= strlen(newvariable->value))
         {
-            /* there is already such a variable, delete it */
-            CW_LIST_REMOVE(headp, newvariable, entries);
-            cw_var_delete(newvariable);
-            break;
+            /* The new value fits where the old one is */
+            strcpy(newvariable->value, value);
+            if ((option_verbose > 1) && (headp == &globals))
+                cw_verbose(VERBOSE_PREFIX_2 "Setting global variable '%s' to '%s'\n", name, value);
+            if (headp == &globals)
+            {
+                globalsstale = 1;
+                cw_mutex_unlock(&globalslock);
+            }
+            return;
         }
-    } 
+        /* there is already such a variable, delete it */
+        CW_LIST_REMOVE(headp, newvariable, entries);
+        cw_var_index_remove(idx, headp, newvariable);
+        cw_var_delete(newvariable);
+    }
 
     if (value)
     {
         if ((option_verbose > 1) && (headp == &globals))
             cw_verbose(VERBOSE_PREFIX_2 "Setting global variable '%s' to '%s'\n", name, value);
-        newvariable = cw_var_assign(name, value);    
-        CW_LIST_INSERT_HEAD(headp, newvariable, entries);
+        if ((newvariable = cw_var_assign(name, value)))
+        {
+            CW_LIST_INSERT_HEAD(headp, newvariable, entries);
+            cw_var_index_add(idx, newvariable, 1);
+        }
     }
 
     if (headp == &globals)
+    {
+        globalsstale = 1;
         cw_mutex_unlock(&globalslock);
+    }
 }
 
 static int pbx_builtin_setvar_old(struct cw_channel *chan, int argc, char **argv)
@@ -7089,6 +8047,8 @@ void pbx_builtin_clear_globals(void)
         vardata = CW_LIST_REMOVE_HEAD(&globals, entries);
         cw_var_delete(vardata);
     }
+    cw_var_index_free(&globalsindex);
+    globalsstale = 1;
     cw_mutex_unlock(&globalslock);
 }
 
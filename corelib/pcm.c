@@ -0,0 +1,757 @@
+/*
+ * CallWeaver -- An open source telephony toolkit.
+ *
+ * See http://www.callweaver.org for more information about
+ * the CallWeaver project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ *
+ * \brief Block conversion, mixing and gain of audio samples
+ *
+ * The G.711 decoders work from the same tables as the CW_MULAW style
+ * macros, so they are bit exact by construction. The vector encoders
+ * compute what spandsp's linear_to_ulaw() and linear_to_alaw() do, and
+ * are checked against the tables at startup, since those come from
+ * whichever spandsp the build used. Mixing and gain use saturating
+ * vector instructions, which give the same results as the scalar
+ * saturate() loops.
+ */
+#ifdef HAVE_CONFIG_H
+#include "confdefs.h"
+#endif
+
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <spandsp.h>
+
+#include "callweaver.h"
+
+CALLWEAVER_FILE_VERSION("$HeadURL$", "$Revision$")
+
+#include "callweaver/pcm.h"
+#include "callweaver/ulaw.h"
+#include "callweaver/alaw.h"
+#include "callweaver/cli.h"
+#include "callweaver/logger.h"
+#include "callweaver/utils.h"
+
+/* The x86 kernels are built with per-function target attributes, so the
+   rest of the tree can stay at the baseline instruction set */
+#if (defined(__i386__)  ||  defined(__x86_64__))  &&  defined(__GNUC__)  &&  (__GNUC__ > 4  ||  (__GNUC__ == 4  &&  __GNUC_MINOR__ >= 9))
+#define PCM_X86
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON__)  ||  defined(__ARM_NEON)
+#define PCM_NEON
+#include <arm_neon.h>
+#endif
+
+/* The decode tables widened to 32 bits, for gathering */
+static int32_t ulaw_wide[256];
+static int32_t alaw_wide[256];
+
+static const char *decode_impl = "scalar";
+static const char *encode_impl = "scalar";
+static const char *mix_impl = "scalar";
+static const char *gain_impl = "scalar";
+
+/* ************************************************************************** */
+
+static void ulaw_to_slin_scalar(int16_t *dst, const uint8_t *src, int samples)
+{
+    int i;
+
+    for (i = 0;  i < samples;  i++)
+        dst[i] = CW_MULAW(src[i]);
+}
+
+static void slin_to_ulaw_scalar(uint8_t *dst, const int16_t *src, int samples)
+{
+    int i;
+
+    for (i = 0;  i < samples;  i++)
+        dst[i] = CW_LIN2MU(src[i]);
+}
+
+static void alaw_to_slin_scalar(int16_t *dst, const uint8_t *src, int samples)
+{
+    int i;
+
+    for (i = 0;  i < samples;  i++)
+        dst[i] = CW_ALAW(src[i]);
+}
+
+static void slin_to_alaw_scalar(uint8_t *dst, const int16_t *src, int samples)
+{
+    int i;
+
+    for (i = 0;  i < samples;  i++)
+        dst[i] = CW_LIN2A(src[i]);
+}
+
+static void slin_mix_scalar(int16_t *dst, const int16_t *src, int samples)
+{
+    int i;
+
+    for (i = 0;  i < samples;  i++)
+        dst[i] = saturate((int32_t) dst[i] + (int32_t) src[i]);
+}
+
+static void slin_gain_scalar(int16_t *amp, int samples, int16_t gain)
+{
+    int i;
+
+    for (i = 0;  i < samples;  i++)
+        amp[i] = saturate(((int32_t) amp[i]*(int32_t) gain) >> 11);
+}
+
+/* ************************************************************************** */
+
+#if defined(PCM_X86)
+__attribute__((target("sse2")))
+static void slin_mix_sse2(int16_t *dst, const int16_t *src, int samples)
+{
+    __m128i a;
+    __m128i b;
+    int i;
+
+    for (i = 0;  i + 8 <= samples;  i += 8)
+    {
+        a = _mm_loadu_si128((const __m128i *) (dst + i));
+        b = _mm_loadu_si128((const __m128i *) (src + i));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_adds_epi16(a, b));
+    }
+    slin_mix_scalar(dst + i, src + i, samples - i);
+}
+
+__attribute__((target("sse2")))
+static void slin_gain_sse2(int16_t *amp, int samples, int16_t gain)
+{
+    __m128i g;
+    __m128i a;
+    __m128i lo;
+    __m128i hi;
+    int i;
+
+    g = _mm_set1_epi16(gain);
+    for (i = 0;  i + 8 <= samples;  i += 8)
+    {
+        a = _mm_loadu_si128((const __m128i *) (amp + i));
+        /* Rebuild the full 32 bit products, shift, then saturate back down */
+        lo = _mm_mullo_epi16(a, g);
+        hi = _mm_mulhi_epi16(a, g);
+        a = _mm_packs_epi32(_mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 11),
+                            _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 11));
+        _mm_storeu_si128((__m128i *) (amp + i), a);
+    }
+    slin_gain_scalar(amp + i, samples - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void slin_mix_avx2(int16_t *dst, const int16_t *src, int samples)
+{
+    __m256i a;
+    __m256i b;
+    int i;
+
+    for (i = 0;  i + 16 <= samples;  i += 16)
+    {
+        a = _mm256_loadu_si256((const __m256i *) (dst + i));
+        b = _mm256_loadu_si256((const __m256i *) (src + i));
+        _mm256_storeu_si256((__m256i *) (dst + i), _mm256_adds_epi16(a, b));
+    }
+    slin_mix_scalar(dst + i, src + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+static void slin_gain_avx2(int16_t *amp, int samples, int16_t gain)
+{
+    __m256i g;
+    __m256i a;
+    __m256i lo;
+    __m256i hi;
+    int i;
+
+    g = _mm256_set1_epi16(gain);
+    for (i = 0;  i + 16 <= samples;  i += 16)
+    {
+        a = _mm256_loadu_si256((const __m256i *) (amp + i));
+        /* The unpacks and the pack both work within 128 bit lanes, so
+           the samples come back out in order */
+        lo = _mm256_mullo_epi16(a, g);
+        hi = _mm256_mulhi_epi16(a, g);
+        a = _mm256_packs_epi32(_mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), 11),
+                               _mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), 11));
+        _mm256_storeu_si256((__m256i *) (amp + i), a);
+    }
+    slin_gain_scalar(amp + i, samples - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void g711_decode_avx2(const int32_t *table, int16_t *dst, const uint8_t *src, int samples)
+{
+    __m256i v0;
+    __m256i v1;
+    int i;
+
+    for (i = 0;  i + 16 <= samples;  i += 16)
+    {
+        v0 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (src + i)));
+        v1 = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) (src + i + 8)));
+        v0 = _mm256_i32gather_epi32((const int *) table, v0, 4);
+        v1 = _mm256_i32gather_epi32((const int *) table, v1, 4);
+        /* The pack interleaves the lanes, and the permute puts them back */
+        v0 = _mm256_permute4x64_epi64(_mm256_packs_epi32(v0, v1), 0xD8);
+        _mm256_storeu_si256((__m256i *) (dst + i), v0);
+    }
+    for (  ;  i < samples;  i++)
+        dst[i] = (int16_t) table[src[i]];
+}
+
+static void ulaw_to_slin_avx2(int16_t *dst, const uint8_t *src, int samples)
+{
+    g711_decode_avx2(ulaw_wide, dst, src, samples);
+}
+
+static void alaw_to_slin_avx2(int16_t *dst, const uint8_t *src, int samples)
+{
+    g711_decode_avx2(alaw_wide, dst, src, samples);
+}
+
+/* The encode tables hold the code for the top value each entry covers,
+   so encoding x arithmetically means encoding x | 3 for mu-law and
+   x | 7 for A-law. Each helper takes 8 samples and gives 8 codes, one
+   per 16 bit lane. */
+__attribute__((target("sse2")))
+static __m128i ulaw_encode_sse2(__m128i x)
+{
+    __m128i neg;
+    __m128i mag;
+    __m128i big;
+    __m128i seg;
+    __m128i mult;
+    __m128i m;
+    int k;
+
+    x = _mm_or_si128(x, _mm_set1_epi16(3));
+    neg = _mm_srai_epi16(x, 15);
+    /* Biased magnitude, up to 32900, so it is unsigned */
+    mag = _mm_add_epi16(_mm_xor_si128(x, neg), _mm_sub_epi16(_mm_set1_epi16(0x84), neg));
+    /* Anything past segment 7 encodes like the top of it */
+    big = _mm_srai_epi16(mag, 15);
+    mag = _mm_or_si128(_mm_andnot_si128(big, mag), _mm_and_si128(big, _mm_set1_epi16(0x7FFF)));
+    /* Find the segment, and 2^(13 - seg) to shift the mantissa down by
+       seg + 3 with a high multiply */
+    seg = _mm_setzero_si128();
+    mult = _mm_set1_epi16(8192);
+    for (k = 8;  k <= 14;  k++)
+    {
+        m = _mm_cmpgt_epi16(mag, _mm_set1_epi16((1 << k) - 1));
+        seg = _mm_sub_epi16(seg, m);
+        mult = _mm_sub_epi16(mult, _mm_and_si128(m, _mm_srli_epi16(mult, 1)));
+    }
+    m = _mm_and_si128(_mm_mulhi_epu16(mag, mult), _mm_set1_epi16(0x0F));
+    m = _mm_or_si128(_mm_slli_epi16(seg, 4), m);
+    return _mm_xor_si128(m, _mm_xor_si128(_mm_set1_epi16(0xFF), _mm_and_si128(neg, _mm_set1_epi16(0x80))));
+}
+
+__attribute__((target("sse2")))
+static __m128i alaw_encode_sse2(__m128i x)
+{
+    __m128i neg;
+    __m128i mag;
+    __m128i seg;
+    __m128i mult;
+    __m128i m;
+    int k;
+
+    x = _mm_or_si128(x, _mm_set1_epi16(7));
+    neg = _mm_srai_epi16(x, 15);
+    /* -x - 1 for negative samples, which never reaches segment 8 */
+    mag = _mm_xor_si128(x, neg);
+    /* Segments 0 and 1 both shift the mantissa down by 4 */
+    seg = _mm_setzero_si128();
+    mult = _mm_set1_epi16(4096);
+    for (k = 8;  k <= 14;  k++)
+    {
+        m = _mm_cmpgt_epi16(mag, _mm_set1_epi16((1 << k) - 1));
+        seg = _mm_sub_epi16(seg, m);
+        if (k > 8)
+            mult = _mm_sub_epi16(mult, _mm_and_si128(m, _mm_srli_epi16(mult, 1)));
+    }
+    m = _mm_and_si128(_mm_mulhi_epu16(mag, mult), _mm_set1_epi16(0x0F));
+    m = _mm_or_si128(_mm_slli_epi16(seg, 4), m);
+    return _mm_xor_si128(m, _mm_xor_si128(_mm_set1_epi16(0xD5), _mm_and_si128(neg, _mm_set1_epi16(0x80))));
+}
+
+__attribute__((target("sse2")))
+static void slin_to_ulaw_sse2(uint8_t *dst, const int16_t *src, int samples)
+{
+    __m128i a;
+    __m128i b;
+    int i;
+
+    for (i = 0;  i + 16 <= samples;  i += 16)
+    {
+        a = ulaw_encode_sse2(_mm_loadu_si128((const __m128i *) (src + i)));
+        b = ulaw_encode_sse2(_mm_loadu_si128((const __m128i *) (src + i + 8)));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(a, b));
+    }
+    slin_to_ulaw_scalar(dst + i, src + i, samples - i);
+}
+
+__attribute__((target("sse2")))
+static void slin_to_alaw_sse2(uint8_t *dst, const int16_t *src, int samples)
+{
+    __m128i a;
+    __m128i b;
+    int i;
+
+    for (i = 0;  i + 16 <= samples;  i += 16)
+    {
+        a = alaw_encode_sse2(_mm_loadu_si128((const __m128i *) (src + i)));
+        b = alaw_encode_sse2(_mm_loadu_si128((const __m128i *) (src + i + 8)));
+        _mm_storeu_si128((__m128i *) (dst + i), _mm_packus_epi16(a, b));
+    }
+    slin_to_alaw_scalar(dst + i, src + i, samples - i);
+}
+
+/* The AVX2 encoders are the SSE2 ones at twice the width */
+__attribute__((target("avx2")))
+static __m256i ulaw_encode_avx2(__m256i x)
+{
+    __m256i neg;
+    __m256i mag;
+    __m256i big;
+    __m256i seg;
+    __m256i mult;
+    __m256i m;
+    int k;
+
+    x = _mm256_or_si256(x, _mm256_set1_epi16(3));
+    neg = _mm256_srai_epi16(x, 15);
+    mag = _mm256_add_epi16(_mm256_xor_si256(x, neg), _mm256_sub_epi16(_mm256_set1_epi16(0x84), neg));
+    big = _mm256_srai_epi16(mag, 15);
+    mag = _mm256_blendv_epi8(mag, _mm256_set1_epi16(0x7FFF), big);
+    seg = _mm256_setzero_si256();
+    mult = _mm256_set1_epi16(8192);
+    for (k = 8;  k <= 14;  k++)
+    {
+        m = _mm256_cmpgt_epi16(mag, _mm256_set1_epi16((1 << k) - 1));
+        seg = _mm256_sub_epi16(seg, m);
+        mult = _mm256_sub_epi16(mult, _mm256_and_si256(m, _mm256_srli_epi16(mult, 1)));
+    }
+    m = _mm256_and_si256(_mm256_mulhi_epu16(mag, mult), _mm256_set1_epi16(0x0F));
+    m = _mm256_or_si256(_mm256_slli_epi16(seg, 4), m);
+    return _mm256_xor_si256(m, _mm256_xor_si256(_mm256_set1_epi16(0xFF), _mm256_and_si256(neg, _mm256_set1_epi16(0x80))));
+}
+
+__attribute__((target("avx2")))
+static __m256i alaw_encode_avx2(__m256i x)
+{
+    __m256i neg;
+    __m256i mag;
+    __m256i seg;
+    __m256i mult;
+    __m256i m;
+    int k;
+
+    x = _mm256_or_si256(x, _mm256_set1_epi16(7));
+    neg = _mm256_srai_epi16(x, 15);
+    mag = _mm256_xor_si256(x, neg);
+    seg = _mm256_setzero_si256();
+    mult = _mm256_set1_epi16(4096);
+    for (k = 8;  k <= 14;  k++)
+    {
+        m = _mm256_cmpgt_epi16(mag, _mm256_set1_epi16((1 << k) - 1));
+        seg = _mm256_sub_epi16(seg, m);
+        if (k > 8)
+            mult = _mm256_sub_epi16(mult, _mm256_and_si256(m, _mm256_srli_epi16(mult, 1)));
+    }
+    m = _mm256_and_si256(_mm256_mulhi_epu16(mag, mult), _mm256_set1_epi16(0x0F));
+    m = _mm256_or_si256(_mm256_slli_epi16(seg, 4), m);
+    return _mm256_xor_si256(m, _mm256_xor_si256(_mm256_set1_epi16(0xD5), _mm256_and_si256(neg, _mm256_set1_epi16(0x80))));
+}
+
+__attribute__((target("avx2")))
+static void slin_to_ulaw_avx2(uint8_t *dst, const int16_t *src, int samples)
+{
+    __m256i a;
+    __m256i b;
+    int i;
+
+    for (i = 0;  i + 32 <= samples;  i += 32)
+    {
+        a = ulaw_encode_avx2(_mm256_loadu_si256((const __m256i *) (src + i)));
+        b = ulaw_encode_avx2(_mm256_loadu_si256((const __m256i *) (src + i + 16)));
+        /* The pack interleaves the lanes, and the permute puts them back */
+        a = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i *) (dst + i), a);
+    }
+    slin_to_ulaw_sse2(dst + i, src + i, samples - i);
+}
+
+__attribute__((target("avx2")))
+static void slin_to_alaw_avx2(uint8_t *dst, const int16_t *src, int samples)
+{
+    __m256i a;
+    __m256i b;
+    int i;
+
+    for (i = 0;  i + 32 <= samples;  i += 32)
+    {
+        a = alaw_encode_avx2(_mm256_loadu_si256((const __m256i *) (src + i)));
+        b = alaw_encode_avx2(_mm256_loadu_si256((const __m256i *) (src + i + 16)));
+        a = _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8);
+        _mm256_storeu_si256((__m256i *) (dst + i), a);
+    }
+    slin_to_alaw_sse2(dst + i, src + i, samples - i);
+}
+#endif
+
+#if defined(PCM_NEON)
+static void slin_mix_neon(int16_t *dst, const int16_t *src, int samples)
+{
+    int i;
+
+    for (i = 0;  i + 8 <= samples;  i += 8)
+        vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+    slin_mix_scalar(dst + i, src + i, samples - i);
+}
+
+static void slin_gain_neon(int16_t *amp, int samples, int16_t gain)
+{
+    int16x8_t a;
+    int16x4_t g;
+    int32x4_t lo;
+    int32x4_t hi;
+    int i;
+
+    g = vdup_n_s16(gain);
+    for (i = 0;  i + 8 <= samples;  i += 8)
+    {
+        a = vld1q_s16(amp + i);
+        lo = vshrq_n_s32(vmull_s16(vget_low_s16(a), g), 11);
+        hi = vshrq_n_s32(vmull_s16(vget_high_s16(a), g), 11);
+        vst1q_s16(amp + i, vcombine_s16(vqmovn_s32(lo), vqmovn_s32(hi)));
+    }
+    slin_gain_scalar(amp + i, samples - i, gain);
+}
+#endif
+
+/* ************************************************************************** */
+
+void (*cw_ulaw_to_slin)(int16_t *dst, const uint8_t *src, int samples) = ulaw_to_slin_scalar;
+void (*cw_slin_to_ulaw)(uint8_t *dst, const int16_t *src, int samples) = slin_to_ulaw_scalar;
+void (*cw_alaw_to_slin)(int16_t *dst, const uint8_t *src, int samples) = alaw_to_slin_scalar;
+void (*cw_slin_to_alaw)(uint8_t *dst, const int16_t *src, int samples) = slin_to_alaw_scalar;
+void (*cw_slin_mix)(int16_t *dst, const int16_t *src, int samples) = slin_mix_scalar;
+void (*cw_slin_gain)(int16_t *amp, int samples, int16_t gain) = slin_gain_scalar;
+
+/* ************************************************************************** */
+
+#define PCM_DECODE  0x01
+#define PCM_ENCODE  0x02
+#define PCM_MIX     0x04
+#define PCM_GAIN    0x08
+
+/* Check the kernels in use against the scalar ones. Returns a mask of the
+   PCM_xxx classes which failed */
+static int pcm_verify(void)
+{
+    static const int16_t gains[] = {-32768, -2048, -1, 0, 1, 682, 1024, 2048, 4096, 30720, 32767};
+    int16_t *a;
+    int16_t *b;
+    int16_t *c;
+    uint8_t *u;
+    uint8_t *v;
+    int bad;
+    int i;
+    int j;
+
+    a = malloc(3*65536*sizeof(int16_t) + 2*65536);
+    if (a == NULL)
+        return 0;
+    b = a + 65536;
+    c = b + 65536;
+    u = (uint8_t *) (c + 65536);
+    v = u + 65536;
+
+    bad = 0;
+    for (i = 0;  i < 65536;  i++)
+    {
+        u[i] = (uint8_t) i;
+        c[i] = (int16_t) (i - 32768);
+    }
+
+    ulaw_to_slin_scalar(a, u, 65536);
+    cw_ulaw_to_slin(b, u, 65536);
+    if (memcmp(a, b, 65536*sizeof(int16_t)))
+        bad |= PCM_DECODE;
+    alaw_to_slin_scalar(a, u, 65536);
+    cw_alaw_to_slin(b, u, 65536);
+    if (memcmp(a, b, 65536*sizeof(int16_t)))
+        bad |= PCM_DECODE;
+
+    slin_to_ulaw_scalar(u, c, 65536);
+    cw_slin_to_ulaw(v, c, 65536);
+    if (memcmp(u, v, 65536))
+        bad |= PCM_ENCODE;
+    slin_to_alaw_scalar(u, c, 65536);
+    cw_slin_to_alaw(v, c, 65536);
+    if (memcmp(u, v, 65536))
+        bad |= PCM_ENCODE;
+
+    /* Every sample against a spread of others, including the extremes */
+    for (j = 0;  j < 65536;  j += 4099)
+    {
+        for (i = 0;  i < 65536;  i++)
+            a[i] = b[i] = c[(i + j) & 0xFFFF];
+        slin_mix_scalar(a, c, 65536);
+        cw_slin_mix(b, c, 65536);
+        if (memcmp(a, b, 65536*sizeof(int16_t)))
+            bad |= PCM_MIX;
+    }
+    for (j = 0;  j < (int) (sizeof(gains)/sizeof(gains[0]));  j++)
+    {
+        memcpy(a, c, 65536*sizeof(int16_t));
+        memcpy(b, c, 65536*sizeof(int16_t));
+        slin_gain_scalar(a, 65536, gains[j]);
+        cw_slin_gain(b, 65536, gains[j]);
+        if (memcmp(a, b, 65536*sizeof(int16_t)))
+            bad |= PCM_GAIN;
+    }
+    free(a);
+    return bad;
+}
+
+/* ************************************************************************** */
+
+#define BENCH_SAMPLES 160
+
+/* Run a kernel over 20ms blocks for the given time, giving samples per
+   second. The kernel is called through a volatile pointer, so the work
+   can't be hoisted out of the loop */
+#define BENCH(rate, ms, fn, args) \
+do \
+{ \
+    struct timeval start; \
+    long done = 0; \
+    long elapsed; \
+    int n; \
+ \
+    start = cw_tvnow(); \
+    do \
+    { \
+        for (n = 0;  n < 1000;  n++) \
+            (fn) args; \
+        done += 1000L*BENCH_SAMPLES; \
+    } \
+    while ((elapsed = cw_tvdiff_ms(cw_tvnow(), start)) < (ms)); \
+    rate = (double) done*1000.0/(double) elapsed; \
+} \
+while (0)
+
+static int pcm_benchmark(int fd, int argc, char *argv[])
+{
+    void (* volatile decode[2])(int16_t *dst, const uint8_t *src, int samples);
+    void (* volatile encode[2])(uint8_t *dst, const int16_t *src, int samples);
+    void (* volatile mix[2])(int16_t *dst, const int16_t *src, int samples);
+    void (* volatile gain[2])(int16_t *amp, int samples, int16_t gain);
+    int16_t lin[BENCH_SAMPLES];
+    int16_t lin2[BENCH_SAMPLES];
+    uint8_t law[BENCH_SAMPLES];
+    double ref;
+    double cur;
+    int ms;
+    int i;
+
+    if (argc > 3)
+        return RESULT_SHOWUSAGE;
+    ms = (argc > 2)  ?  atoi(argv[2])  :  200;
+    if (ms < 10  ||  ms > 10000)
+    {
+        cw_cli(fd, "Time per kernel must be between 10 and 10000 ms\n");
+        return RESULT_SHOWUSAGE;
+    }
+    for (i = 0;  i < BENCH_SAMPLES;  i++)
+    {
+        lin[i] = (int16_t) ((i*7919) & 0xFFFF);
+        lin2[i] = (int16_t) ((i*104729) & 0xFFFF);
+        law[i] = (uint8_t) (i*13);
+    }
+
+    cw_cli(fd, "%-14s %-8s %14s %14s\n", "Kernel", "Using", "Scalar Msps", "Using Msps");
+
+    decode[0] = ulaw_to_slin_scalar;
+    decode[1] = cw_ulaw_to_slin;
+    BENCH(ref, ms, decode[0], (lin, law, BENCH_SAMPLES));
+    BENCH(cur, ms, decode[1], (lin, law, BENCH_SAMPLES));
+    cw_cli(fd, "%-14s %-8s %14.1f %14.1f\n", "ulaw decode", decode_impl, ref/1.0e6, cur/1.0e6);
+    encode[0] = slin_to_ulaw_scalar;
+    encode[1] = cw_slin_to_ulaw;
+    BENCH(ref, ms, encode[0], (law, lin, BENCH_SAMPLES));
+    BENCH(cur, ms, encode[1], (law, lin, BENCH_SAMPLES));
+    cw_cli(fd, "%-14s %-8s %14.1f %14.1f\n", "ulaw encode", encode_impl, ref/1.0e6, cur/1.0e6);
+
+    decode[0] = alaw_to_slin_scalar;
+    decode[1] = cw_alaw_to_slin;
+    BENCH(ref, ms, decode[0], (lin, law, BENCH_SAMPLES));
+    BENCH(cur, ms, decode[1], (lin, law, BENCH_SAMPLES));
+    cw_cli(fd, "%-14s %-8s %14.1f %14.1f\n", "alaw decode", decode_impl, ref/1.0e6, cur/1.0e6);
+    encode[0] = slin_to_alaw_scalar;
+    encode[1] = cw_slin_to_alaw;
+    BENCH(ref, ms, encode[0], (law, lin, BENCH_SAMPLES));
+    BENCH(cur, ms, encode[1], (law, lin, BENCH_SAMPLES));
+    cw_cli(fd, "%-14s %-8s %14.1f %14.1f\n", "alaw encode", encode_impl, ref/1.0e6, cur/1.0e6);
+
+    mix[0] = slin_mix_scalar;
+    mix[1] = cw_slin_mix;
+    BENCH(ref, ms, mix[0], (lin, lin2, BENCH_SAMPLES));
+    BENCH(cur, ms, mix[1], (lin, lin2, BENCH_SAMPLES));
+    cw_cli(fd, "%-14s %-8s %14.1f %14.1f\n", "mix", mix_impl, ref/1.0e6, cur/1.0e6);
+    gain[0] = slin_gain_scalar;
+    gain[1] = cw_slin_gain;
+    BENCH(ref, ms, gain[0], (lin, BENCH_SAMPLES, 2048));
+    BENCH(cur, ms, gain[1], (lin, BENCH_SAMPLES, 2048));
+    cw_cli(fd, "%-14s %-8s %14.1f %14.1f\n", "gain", gain_impl, ref/1.0e6, cur/1.0e6);
+
+    cw_cli(fd, "Kernels in use %s the reference ones\n", pcm_verify()  ?  "DO NOT MATCH"  :  "match");
+    return RESULT_SUCCESS;
+}
+
+static char pcm_benchmark_usage[] =
+"Usage: pcm benchmark [<ms per kernel>]\n"
+"       Times the G.711, mixing and gain kernels picked for this CPU\n"
+"against the plain C ones, on 20ms blocks, and checks that they give\n"
+"identical results.\n";
+
+static struct cw_cli_entry pcm_cli =
+{
+    { "pcm", "benchmark", NULL },
+    pcm_benchmark,
+    "Measure audio sample kernels",
+    pcm_benchmark_usage
+};
+
+int cw_pcm_use(const char *impl)
+{
+    if (strcmp(impl, "scalar") == 0)
+    {
+        cw_ulaw_to_slin = ulaw_to_slin_scalar;
+        cw_slin_to_ulaw = slin_to_ulaw_scalar;
+        cw_alaw_to_slin = alaw_to_slin_scalar;
+        cw_slin_to_alaw = slin_to_alaw_scalar;
+        cw_slin_mix = slin_mix_scalar;
+        cw_slin_gain = slin_gain_scalar;
+        decode_impl =
+        encode_impl =
+        mix_impl =
+        gain_impl = "scalar";
+        return 0;
+    }
+#if defined(PCM_X86)
+    __builtin_cpu_init();
+    if (strcmp(impl, "sse2") == 0  &&  __builtin_cpu_supports("sse2"))
+    {
+        /* A table lookup beats anything SSE2 can do for decoding */
+        cw_ulaw_to_slin = ulaw_to_slin_scalar;
+        cw_slin_to_ulaw = slin_to_ulaw_sse2;
+        cw_alaw_to_slin = alaw_to_slin_scalar;
+        cw_slin_to_alaw = slin_to_alaw_sse2;
+        cw_slin_mix = slin_mix_sse2;
+        cw_slin_gain = slin_gain_sse2;
+        decode_impl = "scalar";
+        encode_impl =
+        mix_impl =
+        gain_impl = "sse2";
+        return 0;
+    }
+    if (strcmp(impl, "avx2") == 0  &&  __builtin_cpu_supports("avx2"))
+    {
+        cw_ulaw_to_slin = ulaw_to_slin_avx2;
+        cw_slin_to_ulaw = slin_to_ulaw_avx2;
+        cw_alaw_to_slin = alaw_to_slin_avx2;
+        cw_slin_to_alaw = slin_to_alaw_avx2;
+        cw_slin_mix = slin_mix_avx2;
+        cw_slin_gain = slin_gain_avx2;
+        decode_impl =
+        encode_impl =
+        mix_impl =
+        gain_impl = "avx2";
+        return 0;
+    }
+#endif
+#if defined(PCM_NEON)
+    if (strcmp(impl, "neon") == 0)
+    {
+        cw_ulaw_to_slin = ulaw_to_slin_scalar;
+        cw_slin_to_ulaw = slin_to_ulaw_scalar;
+        cw_alaw_to_slin = alaw_to_slin_scalar;
+        cw_slin_to_alaw = slin_to_alaw_scalar;
+        cw_slin_mix = slin_mix_neon;
+        cw_slin_gain = slin_gain_neon;
+        decode_impl =
+        encode_impl = "scalar";
+        mix_impl =
+        gain_impl = "neon";
+        return 0;
+    }
+#endif
+    return -1;
+}
+
+void cw_pcm_init(void)
+{
+    int bad;
+    int i;
+
+    for (i = 0;  i < 256;  i++)
+    {
+        ulaw_wide[i] = __cw_mulaw[i];
+        alaw_wide[i] = __cw_alaw[i];
+    }
+
+    if (cw_pcm_use("avx2")  &&  cw_pcm_use("sse2")  &&  cw_pcm_use("neon"))
+        cw_pcm_use("scalar");
+
+    /* Never run with kernels that disagree with the tables. Only the
+       classes which fail fall back, so an encoder which disagrees with the
+       spandsp the tables came from doesn't cost us the other kernels */
+    if ((bad = pcm_verify()))
+    {
+        cw_log(LOG_WARNING, "Accelerated audio kernels do not match the reference ones (mask 0x%X). Using the scalar kernels for those\n", bad);
+        if ((bad & PCM_DECODE))
+        {
+            cw_ulaw_to_slin = ulaw_to_slin_scalar;
+            cw_alaw_to_slin = alaw_to_slin_scalar;
+            decode_impl = "scalar";
+        }
+        if ((bad & PCM_ENCODE))
+        {
+            cw_slin_to_ulaw = slin_to_ulaw_scalar;
+            cw_slin_to_alaw = slin_to_alaw_scalar;
+            encode_impl = "scalar";
+        }
+        if ((bad & PCM_MIX))
+        {
+            cw_slin_mix = slin_mix_scalar;
+            mix_impl = "scalar";
+        }
+        if ((bad & PCM_GAIN))
+        {
+            cw_slin_gain = slin_gain_scalar;
+            gain_impl = "scalar";
+        }
+    }
+    cw_cli_register(&pcm_cli);
+}
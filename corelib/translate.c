@@ -32,6 +32,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
 #include <spandsp.h>
 
 #include "callweaver.h"
@@ -50,11 +51,19 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 
 #define MAX_RECALC 200 /* max sample recalc */
 
+/* Measured costs are kept here, and are only trusted for the same build
+   on the same CPU */
+#define COST_CACHE_FILE "translator_costs"
+#define COST_CACHE_BUILD PACKAGE_STRING SVN_VERSION " " BUILD_DATE
+
 /* This could all be done more efficiently *IF* we chained packets together
    by default, but it would also complicate virtually every application. */
    
 CW_MUTEX_DEFINE_STATIC(list_lock);
 static struct cw_translator *list = NULL;
+/* Held while translators are run without list_lock, so none of them can be
+   unregistered meanwhile. Taken before list_lock */
+CW_MUTEX_DEFINE_STATIC(run_lock);
 
 struct cw_translator_dir
 {
@@ -74,6 +83,17 @@ struct cw_frame_delivery
 
 static struct cw_translator_dir tr_matrix[MAX_FORMAT][MAX_FORMAT];
 
+struct cost_cache_entry
+{
+    struct cost_cache_entry *next;
+    int cost;
+    char name[80];
+};
+
+CW_MUTEX_DEFINE_STATIC(cost_lock);
+static struct cost_cache_entry *cost_cache = NULL;
+static int cost_cache_loaded = 0;
+
 struct cw_trans_pvt
 {
     struct cw_translator *step;
@@ -83,6 +103,111 @@ struct cw_trans_pvt
     struct timeval nextout;
 };
 
+/* The translators to go through from one format to another, worked out
+   from the matrix once per pair and kept until the matrix changes */
+struct path_plan
+{
+    int steps;
+    struct cw_translator *step[MAX_FORMAT];
+};
+
+static struct path_plan *tr_plans[MAX_FORMAT][MAX_FORMAT];
+
+/* Most idle states kept per translator */
+#define TRANSLATOR_POOL_MAX 32
+
+CW_MUTEX_DEFINE_STATIC(pool_lock);
+
+/* Called with list_lock held */
+static void plans_invalidate(void)
+{
+    int x;
+    int y;
+
+    for (x = 0;  x < MAX_FORMAT;  x++)
+    {
+        for (y = 0;  y < MAX_FORMAT;  y++)
+        {
+            if (tr_plans[x][y])
+            {
+                free(tr_plans[x][y]);
+                tr_plans[x][y] = NULL;
+            }
+        }
+    }
+}
+
+/* Called with list_lock held */
+static struct path_plan *plan_get(int source, int dest)
+{
+    struct path_plan *plan;
+    int x;
+
+    if ((plan = tr_plans[source][dest]))
+        return plan;
+    if ((plan = malloc(sizeof(*plan))) == NULL)
+        return NULL;
+    plan->steps = 0;
+    for (x = source;  x != dest;  x = plan->step[plan->steps++]->dst_format)
+    {
+        if (!tr_matrix[x][dest].step  ||  plan->steps >= MAX_FORMAT)
+        {
+            free(plan);
+            return NULL;
+        }
+        plan->step[plan->steps] = tr_matrix[x][dest].step;
+    }
+    tr_plans[source][dest] = plan;
+    return plan;
+}
+
+static struct cw_trans_pvt *pool_get(struct cw_translator *t)
+{
+    struct cw_trans_pvt *p;
+
+    if (!t->reset)
+        return NULL;
+    cw_mutex_lock(&pool_lock);
+    if ((p = t->pool))
+    {
+        t->pool = p->next;
+        t->pooled--;
+    }
+    cw_mutex_unlock(&pool_lock);
+    return p;
+}
+
+/* Park a finished step for reuse. Returns 0 if it was taken */
+static int pool_put(struct cw_trans_pvt *p)
+{
+    struct cw_translator *t = p->step;
+    int res = -1;
+
+    if (!p->state  ||  !t->reset  ||  t->pooled >= TRANSLATOR_POOL_MAX)
+        return -1;
+    t->reset(p->state);
+    cw_mutex_lock(&pool_lock);
+    if (t->active  &&  t->pooled < TRANSLATOR_POOL_MAX)
+    {
+        p->next = t->pool;
+        t->pool = p;
+        t->pooled++;
+        res = 0;
+    }
+    cw_mutex_unlock(&pool_lock);
+    return res;
+}
+
+int cw_translator_pooled(struct cw_translator *t)
+{
+    int res;
+
+    cw_mutex_lock(&pool_lock);
+    res = t->pooled;
+    cw_mutex_unlock(&pool_lock);
+    return res;
+}
+
 void cw_translator_free_path(struct cw_trans_pvt *p)
 {
     struct cw_trans_pvt *pl;
@@ -93,6 +218,8 @@ void cw_translator_free_path(struct cw_trans_pvt *p)
     {
         pl = pn;
         pn = pn->next;
+        if (pool_put(pl) == 0)
+            continue;
         if (pl->state  &&  pl->step->destroy)
             pl->step->destroy(pl->state);
         free(pl);
@@ -102,110 +229,154 @@ void cw_translator_free_path(struct cw_trans_pvt *p)
 /* Build a set of translators based upon the given source and destination formats */
 struct cw_trans_pvt *cw_translator_build_path(int dest, int dest_rate, int source, int source_rate)
 {
+    struct cw_translator *steps[MAX_FORMAT];
     struct cw_trans_pvt *tmpr = NULL;
-    struct cw_trans_pvt *tmp = NULL;
+    struct cw_trans_pvt **tail = &tmpr;
+    struct cw_trans_pvt *tmp;
+    struct path_plan *plan;
+    int nsteps = 0;
+    int i;
     
     source = bottom_bit(source);
     dest = bottom_bit(dest);
     
-    while (source != dest)
+    /* Take a copy of the plan, so the states can be set up without
+       holding up anyone else */
+    cw_mutex_lock(&list_lock);
+    if ((plan = plan_get(source, dest)))
     {
-        if (!tr_matrix[source][dest].step)
-        {
-            /* We shouldn't have allocated any memory */
-            cw_log(LOG_WARNING,
-                     "No translator path from %s to %s\n", 
-                     cw_getformatname(1 << source),
-                     cw_getformatname(1 << dest));
-            return NULL;
-        }
+        nsteps = plan->steps;
+        memcpy(steps, plan->step, nsteps*sizeof(steps[0]));
+    }
+    cw_mutex_unlock(&list_lock);
+    if (plan == NULL)
+    {
+        /* We shouldn't have allocated any memory */
+        cw_log(LOG_WARNING,
+                 "No translator path from %s to %s\n", 
+                 cw_getformatname(1 << source),
+                 cw_getformatname(1 << dest));
+        return NULL;
+    }
 
-        if (tmp)
-        {
-            tmp->next = malloc(sizeof(*tmp));
-            tmp = tmp->next;
-        }
-        else
-        {
-            tmp = malloc(sizeof(*tmp));
-        }
-        if (tmp == NULL)
+    for (i = 0;  i < nsteps;  i++)
+    {
+        if ((tmp = pool_get(steps[i])) == NULL)
         {
-            cw_log(LOG_WARNING, "Out of memory\n");
-            if (tmpr)
+            if ((tmp = malloc(sizeof(*tmp))) == NULL)
+            {
+                cw_log(LOG_WARNING, "Out of memory\n");
                 cw_translator_free_path(tmpr);    
-            return NULL;
+                return NULL;
+            }
+            tmp->step = steps[i];
+            if ((tmp->state = tmp->step->newpvt()) == NULL)
+            {
+                cw_log(LOG_WARNING, "Failed to build translator step from %d to %d\n", steps[i]->src_format, dest);
+                free(tmp);
+                cw_translator_free_path(tmpr);    
+                return NULL;
+            }
         }
-
-        /* Set the root, if it doesn't exist yet... */
-        if (tmpr == NULL)
-            tmpr = tmp;
-
         tmp->next = NULL;
         tmp->nextin =
         tmp->nextout = cw_tv(0, 0);
-        tmp->step = tr_matrix[source][dest].step;
-        tmp->state = tmp->step->newpvt();
-        
-        if (!tmp->state)
-        {
-            cw_log(LOG_WARNING, "Failed to build translator step from %d to %d\n", source, dest);
-            cw_translator_free_path(tmpr);    
-            return NULL;
-        }
-        
-        /* Keep going if this isn't the final destination */
-        source = tmp->step->dst_format;
+        *tail = tmp;
+        tail = &tmp->next;
     }
     return tmpr;
 }
 
-struct cw_frame *cw_translate(struct cw_trans_pvt *path, struct cw_frame *f, int consume)
+/* What cw_translate needs to remember about an input frame once it has
+   been fed in, and possibly freed */
+struct frame_timing
 {
-    struct cw_trans_pvt *p;
-    struct cw_frame *out;
     struct timeval delivery;
     int has_timing_info;
     long ts;
     long len;
     int seq_no;
-    
-    has_timing_info = f->has_timing_info;
-    ts = f->ts;
-    len = f->len;
-    seq_no = f->seq_no;
+};
 
-    p = path;
-    /* Feed the first frame into the first translator */
-    p->step->framein(p->state, f);
-    if (!cw_tvzero(f->delivery))
+static void path_timing_in(struct cw_trans_pvt *path, struct cw_frame *f, struct frame_timing *tm)
+{
+    tm->delivery = f->delivery;
+    tm->has_timing_info = f->has_timing_info;
+    tm->ts = f->ts;
+    tm->len = f->len;
+    tm->seq_no = f->seq_no;
+
+    if (cw_tvzero(f->delivery))
+        return;
+    if (!cw_tvzero(path->nextin))
     {
-        if (!cw_tvzero(path->nextin))
+        /* Make sure this is in line with what we were expecting */
+        if (!cw_tveq(path->nextin, f->delivery))
         {
-            /* Make sure this is in line with what we were expecting */
-            if (!cw_tveq(path->nextin, f->delivery))
+            /* The time has changed between what we expected and this
+               most recent time on the new packet.  If we have a
+               valid prediction adjust our output time appropriately */
+            if (!cw_tvzero(path->nextout))
             {
-                /* The time has changed between what we expected and this
-                   most recent time on the new packet.  If we have a
-                   valid prediction adjust our output time appropriately */
-                if (!cw_tvzero(path->nextout))
-                {
-                    path->nextout = cw_tvadd(path->nextout,
-                                               cw_tvsub(f->delivery, path->nextin));
-                }
-                path->nextin = f->delivery;
+                path->nextout = cw_tvadd(path->nextout,
+                                           cw_tvsub(f->delivery, path->nextin));
             }
-        }
-        else
-        {
-            /* This is our first pass.  Make sure the timing looks good */
             path->nextin = f->delivery;
-            path->nextout = f->delivery;
         }
-        /* Predict next incoming sample */
-        path->nextin = cw_tvadd(path->nextin, cw_samp2tv(f->samples, 8000));
     }
-    delivery = f->delivery;
+    else
+    {
+        /* This is our first pass.  Make sure the timing looks good */
+        path->nextin = f->delivery;
+        path->nextout = f->delivery;
+    }
+    /* Predict next incoming sample */
+    path->nextin = cw_tvadd(path->nextin, cw_samp2tv(f->samples, 8000));
+}
+
+static void path_timing_out(struct cw_trans_pvt *path, struct cw_frame *out, const struct frame_timing *tm)
+{
+    if (!cw_tvzero(tm->delivery))
+    {
+        /* Regenerate prediction after a discontinuity */
+        if (cw_tvzero(path->nextout))
+            path->nextout = cw_tvnow();
+
+        /* Use next predicted outgoing timestamp */
+        out->delivery = path->nextout;
+        
+        /* Predict next outgoing timestamp from samples in this
+           frame. */
+        path->nextout = cw_tvadd(path->nextout, cw_samp2tv( out->samples, 8000));
+    }
+    else
+    {
+        out->delivery = cw_tv(0, 0);
+    }
+    /* Invalidate prediction if we're entering a silence period */
+    if (out->frametype == CW_FRAME_CNG)
+        path->nextout = cw_tv(0, 0);
+
+    out->has_timing_info = tm->has_timing_info;
+    if (tm->has_timing_info)
+    {
+        out->ts = tm->ts;
+        out->len = tm->len;
+        //out->len = cw_codec_get_samples(out)/8;
+        out->seq_no = tm->seq_no;
+    }
+}
+
+struct cw_frame *cw_translate(struct cw_trans_pvt *path, struct cw_frame *f, int consume)
+{
+    struct cw_trans_pvt *p;
+    struct cw_frame *out;
+    struct frame_timing tm;
+    
+    p = path;
+    /* Feed the first frame into the first translator */
+    p->step->framein(p->state, f);
+    path_timing_in(path, f, &tm);
     if (consume)
         cw_fr_free(f);
     while (p)
@@ -221,45 +392,126 @@ struct cw_frame *cw_translate(struct cw_trans_pvt *path, struct cw_frame *f, int
         }
         else
         {
-            if (!cw_tvzero(delivery))
+            path_timing_out(path, out, &tm);
+            return out;
+        }
+        p = p->next;
+    }
+    cw_log(LOG_WARNING, "I should never get here...\n");
+    return NULL;
+}
+
+/* Feed one frame into each of a set of states of the same translator */
+static void translator_feed(struct cw_translator *t, struct cw_translator_pvt **pvt, struct cw_frame **f, int n)
+{
+    int i;
+
+    if (t->framein_batch)
+    {
+        t->framein_batch(pvt, f, n);
+        return;
+    }
+    for (i = 0;  i < n;  i++)
+        t->framein(pvt[i], f[i]);
+}
+
+static int translate_batch(struct cw_trans_pvt **paths, struct cw_frame **in, struct cw_frame **out, int n, int consume)
+{
+    struct cw_trans_pvt *hop[CW_TRANSLATE_BATCH_MAX];
+    struct cw_frame *cur[CW_TRANSLATE_BATCH_MAX];
+    struct frame_timing tm[CW_TRANSLATE_BATCH_MAX];
+    struct cw_translator_pvt *gpvt[CW_TRANSLATE_BATCH_MAX];
+    struct cw_frame *gf[CW_TRANSLATE_BATCH_MAX];
+    unsigned char done[CW_TRANSLATE_BATCH_MAX];
+    struct cw_translator *t;
+    struct cw_frame *f;
+    int first;
+    int left;
+    int produced;
+    int count;
+    int i;
+    int j;
+
+    for (i = 0;  i < n;  i++)
+    {
+        hop[i] = paths[i];
+        cur[i] = in[i];
+        out[i] = NULL;
+        path_timing_in(paths[i], in[i], &tm[i]);
+    }
+    produced = 0;
+    left = n;
+    /* Work through the paths a hop at a time, so every state of the same
+       translator at the same stage gets fed in one go */
+    for (first = 1;  left > 0;  first = 0)
+    {
+        memset(done, 0, n);
+        for (i = 0;  i < n;  i++)
+        {
+            if (hop[i] == NULL  ||  done[i])
+                continue;
+            t = hop[i]->step;
+            count = 0;
+            for (j = i;  j < n;  j++)
             {
-                /* Regenerate prediction after a discontinuity */
-                if (cw_tvzero(path->nextout))
-                    path->nextout = cw_tvnow();
-
-                /* Use next predicted outgoing timestamp */
-                out->delivery = path->nextout;
-                
-                /* Predict next outgoing timestamp from samples in this
-                   frame. */
-                path->nextout = cw_tvadd(path->nextout, cw_samp2tv( out->samples, 8000));
+                if (hop[j]  &&  !done[j]  &&  hop[j]->step == t)
+                {
+                    gpvt[count] = hop[j]->state;
+                    gf[count++] = cur[j];
+                    done[j] = 1;
+                }
             }
-            else
+            translator_feed(t, gpvt, gf, count);
+        }
+        if (first  &&  consume)
+        {
+            for (i = 0;  i < n;  i++)
+                cw_fr_free(in[i]);
+        }
+        for (i = 0;  i < n;  i++)
+        {
+            if (hop[i] == NULL)
+                continue;
+            if ((f = hop[i]->step->frameout(hop[i]->state)) == NULL)
             {
-                out->delivery = cw_tv(0, 0);
+                hop[i] = NULL;
+                left--;
             }
-            /* Invalidate prediction if we're entering a silence period */
-            if (out->frametype == CW_FRAME_CNG)
-                path->nextout = cw_tv(0, 0);
-
-            out->has_timing_info = has_timing_info;
-            if (has_timing_info)
+            else if (hop[i]->next)
             {
-                out->ts = ts;
-                out->len = len;
-                //out->len = cw_codec_get_samples(out)/8;
-                out->seq_no = seq_no;
+                cur[i] = f;
+                hop[i] = hop[i]->next;
+            }
+            else
+            {
+                path_timing_out(paths[i], f, &tm[i]);
+                out[i] = f;
+                produced++;
+                hop[i] = NULL;
+                left--;
             }
-
-            return out;
         }
-        p = p->next;
     }
-    cw_log(LOG_WARNING, "I should never get here...\n");
-    return NULL;
+    return produced;
+}
+
+int cw_translate_batch(struct cw_trans_pvt **paths, struct cw_frame **in, struct cw_frame **out, int n, int consume)
+{
+    int produced;
+    int chunk;
+    int i;
+
+    produced = 0;
+    for (i = 0;  i < n;  i += chunk)
+    {
+        chunk = (n - i > CW_TRANSLATE_BATCH_MAX)  ?  CW_TRANSLATE_BATCH_MAX  :  n - i;
+        produced += translate_batch(paths + i, in + i, out + i, chunk, consume);
+    }
+    return produced;
 }
 
-static void calc_cost(struct cw_translator *t, int secs)
+/* Time the translator on secs seconds of its sample audio. Returns the cost */
+static int calc_cost(struct cw_translator *t, int secs)
 {
     int sofar;
     struct cw_translator_pvt *pvt;
@@ -275,14 +527,12 @@ static void calc_cost(struct cw_translator *t, int secs)
     if (t->sample == NULL)
     {
         cw_log(LOG_WARNING, "Translator '%s' does not produce sample frames.\n", t->name);
-        t->cost = 99999;
-        return;
+        return 99999;
     }
     if ((pvt = t->newpvt()) == NULL)
     {
         cw_log(LOG_WARNING, "Translator '%s' appears to be broken and will probably fail.\n", t->name);
-        t->cost = 99999;
-        return;
+        return 99999;
     }
     start = cw_tvnow();
     /* Call the encoder until we've processed "secs" seconds of data */
@@ -292,8 +542,7 @@ static void calc_cost(struct cw_translator *t, int secs)
         {
             cw_log(LOG_WARNING, "Translator '%s' failed to produce a sample frame.\n", t->name);
             t->destroy(pvt);
-            t->cost = 99999;
-            return;
+            return 99999;
         }
         t->framein(pvt, f);
         cw_fr_free(f);
@@ -305,12 +554,213 @@ static void calc_cost(struct cw_translator *t, int secs)
     }
     cost = cw_tvdiff_ms(cw_tvnow(), start);
     t->destroy(pvt);
-    t->cost = cost/secs;
-    if (t->cost <= 0)
-        t->cost = 1;
+    cost /= secs;
+    return (cost > 0)  ?  cost  :  1;
+}
+
+static void cpu_model(char *buf, size_t len)
+{
+    FILE *f;
+    char line[256];
+    char *p;
+
+    cw_copy_string(buf, "unknown", len);
+    if ((f = fopen("/proc/cpuinfo", "r")) == NULL)
+        return;
+    while (fgets(line, sizeof(line), f))
+    {
+        if (!strncmp(line, "model name", 10)  &&  (p = strchr(line, ':')))
+        {
+            cw_copy_string(buf, cw_skip_blanks(p + 1), len);
+            cw_trim_blanks(buf);
+            break;
+        }
+    }
+    fclose(f);
+}
+
+/* Called with cost_lock held */
+static struct cost_cache_entry *cost_cache_find(const char *name)
+{
+    struct cost_cache_entry *e;
+
+    for (e = cost_cache;  e;  e = e->next)
+    {
+        if (!strcmp(e->name, name))
+            return e;
+    }
+    return NULL;
+}
+
+/* Called with cost_lock held */
+static void cost_cache_set(const char *name, int cost)
+{
+    struct cost_cache_entry *e;
+
+    if ((e = cost_cache_find(name)) == NULL)
+    {
+        if ((e = malloc(sizeof(*e))) == NULL)
+            return;
+        cw_copy_string(e->name, name, sizeof(e->name));
+        e->next = cost_cache;
+        cost_cache = e;
+    }
+    e->cost = cost;
+}
+
+/* Read the costs saved by an earlier run. Called with cost_lock held */
+static void cost_cache_load(void)
+{
+    char fn[256];
+    char line[256];
+    char cpu[128];
+    char *name;
+    FILE *f;
+    int cost;
+
+    cost_cache_loaded = 1;
+    snprintf(fn, sizeof(fn), "%s/%s", cw_config_CW_VAR_DIR, COST_CACHE_FILE);
+    if ((f = fopen(fn, "r")) == NULL)
+        return;
+    cpu_model(cpu, sizeof(cpu));
+
+    /* The first two lines say which build and CPU the costs were measured with */
+    if (!fgets(line, sizeof(line), f)  ||  strncmp(line, "build ", 6)  ||  strcmp(cw_trim_blanks(line + 6), COST_CACHE_BUILD)
+        ||
+        !fgets(line, sizeof(line), f)  ||  strncmp(line, "cpu ", 4)  ||  strcmp(cw_trim_blanks(line + 4), cpu))
+    {
+        if (option_verbose > 2)
+            cw_verbose(VERBOSE_PREFIX_3 "Ignoring translator costs measured by another build or CPU\n");
+        fclose(f);
+        return;
+    }
+    while (fgets(line, sizeof(line), f))
+    {
+        cost = strtol(line, &name, 10);
+        name = cw_trim_blanks(cw_skip_blanks(name));
+        if (cost > 0  &&  *name)
+            cost_cache_set(name, cost);
+    }
+    fclose(f);
+}
+
+/* Called with cost_lock held */
+static void cost_cache_save(void)
+{
+    char fn[256];
+    char tmp[256];
+    char cpu[128];
+    struct cost_cache_entry *e;
+    FILE *f;
+
+    snprintf(fn, sizeof(fn), "%s/%s", cw_config_CW_VAR_DIR, COST_CACHE_FILE);
+    snprintf(tmp, sizeof(tmp), "%s.tmp", fn);
+    if ((f = fopen(tmp, "w")) == NULL)
+    {
+        cw_log(LOG_WARNING, "Unable to save translator costs to '%s': %s\n", tmp, strerror(errno));
+        return;
+    }
+    cpu_model(cpu, sizeof(cpu));
+    fprintf(f, "build %s\ncpu %s\n", COST_CACHE_BUILD, cpu);
+    for (e = cost_cache;  e;  e = e->next)
+        fprintf(f, "%d %s\n", e->cost, e->name);
+    if (fclose(f)  ||  rename(tmp, fn))
+    {
+        cw_log(LOG_WARNING, "Unable to save translator costs to '%s': %s\n", fn, strerror(errno));
+        unlink(tmp);
+    }
+}
+
+/* Give a translator its cost: the one it declares, the one measured by an
+   earlier run, or failing those a fresh measurement */
+static void translator_cost(struct cw_translator *t)
+{
+    struct cost_cache_entry *e;
+
+    if (t->cost > 0)
+        return;
+
+    cw_mutex_lock(&cost_lock);
+    if (!cost_cache_loaded)
+        cost_cache_load();
+    if ((e = cost_cache_find(t->name)))
+    {
+        t->cost = e->cost;
+    }
+    else
+    {
+        t->cost = calc_cost(t, 1);
+        cost_cache_set(t->name, t->cost);
+        cost_cache_save();
+    }
+    cw_mutex_unlock(&cost_lock);
+}
+
+/* Add a translator to the matrix, relaxing only the paths that can run
+   through it rather than recomputing every path. Called with list_lock held */
+static void matrix_add(struct cw_translator *t)
+{
+    int src = t->src_format;
+    int dst = t->dst_format;
+    int changed = 0;
+    int cost;
+    int x;
+    int z;
+
+    for (x = 0;  x < MAX_FORMAT;  x++)
+    {
+        /* Only formats that can already reach our source */
+        if (x != src  &&  !tr_matrix[x][src].step)
+            continue;
+        for (z = 0;  z < MAX_FORMAT;  z++)
+        {
+            /* ...going to formats our destination can reach */
+            if (x == z  ||  (z != dst  &&  !tr_matrix[dst][z].step))
+                continue;
+            cost = ((x == src)  ?  0  :  tr_matrix[x][src].cost)
+                 + t->cost
+                 + ((z == dst)  ?  0  :  tr_matrix[dst][z].cost);
+            if (!tr_matrix[x][z].step  ||  cost < tr_matrix[x][z].cost)
+            {
+                tr_matrix[x][z].step = (x == src)  ?  t  :  tr_matrix[x][src].step;
+                tr_matrix[x][z].cost = cost;
+                changed = 1;
+                if (option_debug)
+                    cw_log(LOG_DEBUG, "Discovered %d cost path from %s to %s, via %s\n", cost, cw_getformatname(1 << x), cw_getformatname(1 << z), t->name);
+            }
+        }
+    }
+    if (changed)
+        plans_invalidate();
+}
+
+/* Does any path in the matrix go through this translator? Called with list_lock held */
+static int matrix_uses(struct cw_translator *t)
+{
+    struct cw_translator *step;
+    int hops;
+    int x;
+    int z;
+
+    for (x = 0;  x < MAX_FORMAT;  x++)
+    {
+        for (z = 0;  z < MAX_FORMAT;  z++)
+        {
+            for (step = tr_matrix[x][z].step, hops = 0;  step  &&  hops < MAX_FORMAT;  hops++)
+            {
+                if (step == t)
+                    return 1;
+                if (step->dst_format == z)
+                    break;
+                step = tr_matrix[step->dst_format][z].step;
+            }
+        }
+    }
+    return 0;
 }
 
-static void rebuild_matrix(int samples)
+/* Called with list_lock held */
+static void rebuild_matrix(void)
 {
     struct cw_translator *t;
     int changed;
@@ -322,12 +772,10 @@ static void rebuild_matrix(int samples)
         cw_log(LOG_DEBUG, "Reseting translation matrix\n");
     /* Use the list of translators to build a translation matrix */
     bzero(tr_matrix, sizeof(tr_matrix));
+    plans_invalidate();
     t = list;
     while (t)
     {
-        if (samples)
-            calc_cost(t,samples);
-      
         if (!tr_matrix[t->src_format][t->dst_format].step
             ||
             tr_matrix[t->src_format][t->dst_format].cost > t->cost)
@@ -377,6 +825,55 @@ static void rebuild_matrix(int samples)
     while (changed);
 }
 
+/* Time every translator again and rebuild the matrix from the new costs.
+   The timing is done without list_lock, so paths can still be built
+   meanwhile */
+static void recalc_costs(int secs)
+{
+    struct cw_translator **ts;
+    struct cw_translator *t;
+    int *costs;
+    int n;
+    int i;
+
+    cw_mutex_lock(&run_lock);
+    cw_mutex_lock(&list_lock);
+    for (n = 0, t = list;  t;  t = t->next)
+        n++;
+    ts = NULL;
+    costs = NULL;
+    if (n > 0  &&  ((ts = malloc(n*sizeof(*ts))) == NULL  ||  (costs = malloc(n*sizeof(*costs))) == NULL))
+    {
+        cw_mutex_unlock(&list_lock);
+        cw_mutex_unlock(&run_lock);
+        cw_log(LOG_WARNING, "Out of memory\n");
+        free(ts);
+        free(costs);
+        return;
+    }
+    for (i = 0, t = list;  t;  t = t->next)
+        ts[i++] = t;
+    cw_mutex_unlock(&list_lock);
+
+    for (i = 0;  i < n;  i++)
+        costs[i] = calc_cost(ts[i], secs);
+
+    cw_mutex_lock(&cost_lock);
+    for (i = 0;  i < n;  i++)
+        cost_cache_set(ts[i]->name, costs[i]);
+    cost_cache_save();
+    cw_mutex_unlock(&cost_lock);
+
+    cw_mutex_lock(&list_lock);
+    for (i = 0;  i < n;  i++)
+        ts[i]->cost = costs[i];
+    rebuild_matrix();
+    cw_mutex_unlock(&list_lock);
+    cw_mutex_unlock(&run_lock);
+    free(ts);
+    free(costs);
+}
+
 static int show_translation(int fd, int argc, char *argv[])
 {
 #define SHOW_TRANS 11
@@ -404,7 +901,7 @@ static int show_translation(int fd, int argc, char *argv[])
             z = MAX_RECALC;
         }
         cw_cli(fd,"         Recalculating Codec Translation (number of sample seconds: %d)\n\n", z);
-        rebuild_matrix(z);
+        recalc_costs(z);
     }
 
     cw_cli(fd, "         Translation times between formats (in milliseconds)\n");
@@ -432,6 +929,129 @@ static int show_translation(int fd, int argc, char *argv[])
     return RESULT_SUCCESS;
 }
 
+/* Most states "translator benchmark" runs side by side */
+#define MAX_BENCH_STATES 256
+
+/* Push sample frames through a set of states of one translator for a while,
+   one at a time or in batches. Returns the rate in frames per second, or -1
+   if it can't be measured */
+static int translator_bench(struct cw_translator *t, int states, int secs, int batch)
+{
+    struct cw_translator_pvt *pvt[MAX_BENCH_STATES];
+    struct cw_frame *f[MAX_BENCH_STATES];
+    struct cw_frame *out;
+    struct timeval start;
+    long frames;
+    long ms;
+    int made;
+    int res;
+    int i;
+
+    if (t->sample == NULL)
+        return -1;
+    res = -1;
+    for (made = 0;  made < states;  made++)
+    {
+        if ((pvt[made] = t->newpvt()) == NULL)
+            goto done;
+        if ((f[made] = t->sample()) == NULL)
+        {
+            t->destroy(pvt[made]);
+            goto done;
+        }
+    }
+    frames = 0;
+    start = cw_tvnow();
+    do
+    {
+        if (batch)
+        {
+            translator_feed(t, pvt, f, states);
+        }
+        else
+        {
+            for (i = 0;  i < states;  i++)
+                t->framein(pvt[i], f[i]);
+        }
+        for (i = 0;  i < states;  i++)
+        {
+            while ((out = t->frameout(pvt[i])))
+                cw_fr_free(out);
+        }
+        frames += states;
+    }
+    while ((ms = cw_tvdiff_ms(cw_tvnow(), start)) < secs*1000);
+    res = (int) ((frames*1000)/((ms > 0)  ?  ms  :  1));
+done:
+    for (i = 0;  i < made;  i++)
+    {
+        cw_fr_free(f[i]);
+        t->destroy(pvt[i]);
+    }
+    return res;
+}
+
+static int translator_benchmark(int fd, int argc, char *argv[])
+{
+    struct cw_translator **ts;
+    struct cw_translator *t;
+    int states;
+    int secs;
+    int single;
+    int batched;
+    int n;
+    int i;
+
+    if (argc > 4)
+        return RESULT_SHOWUSAGE;
+    states = (argc > 2)  ?  atoi(argv[2])  :  32;
+    secs = (argc > 3)  ?  atoi(argv[3])  :  1;
+    if (states < 1  ||  states > MAX_BENCH_STATES)
+    {
+        cw_cli(fd, "Number of states must be between 1 and %d\n", MAX_BENCH_STATES);
+        return RESULT_SHOWUSAGE;
+    }
+    if (secs < 1  ||  secs > MAX_RECALC)
+    {
+        cw_cli(fd, "Seconds must be between 1 and %d\n", MAX_RECALC);
+        return RESULT_SHOWUSAGE;
+    }
+
+    /* Only run_lock is held while the translators run, so paths can still
+       be built meanwhile */
+    cw_mutex_lock(&run_lock);
+    cw_mutex_lock(&list_lock);
+    for (n = 0, t = list;  t;  t = t->next)
+        n++;
+    ts = NULL;
+    if (n > 0  &&  (ts = malloc(n*sizeof(*ts))) == NULL)
+    {
+        cw_mutex_unlock(&list_lock);
+        cw_mutex_unlock(&run_lock);
+        cw_cli(fd, "Out of memory\n");
+        return RESULT_SUCCESS;
+    }
+    for (i = 0, t = list;  t;  t = t->next)
+        ts[i++] = t;
+    cw_mutex_unlock(&list_lock);
+
+    cw_cli(fd, "%-20s %12s %12s\n", "Translator", "Frames/sec", "Batched/sec");
+    for (i = 0;  i < n;  i++)
+    {
+        single = translator_bench(ts[i], states, secs, 0);
+        batched = (ts[i]->framein_batch)  ?  translator_bench(ts[i], states, secs, 1)  :  -1;
+        if (single < 0)
+            cw_cli(fd, "%-20s %12s %12s\n", ts[i]->name, "-", "-");
+        else if (batched < 0)
+            cw_cli(fd, "%-20s %12d %12s\n", ts[i]->name, single, "-");
+        else
+            cw_cli(fd, "%-20s %12d %12d\n", ts[i]->name, single, batched);
+    }
+    cw_mutex_unlock(&run_lock);
+    free(ts);
+    return RESULT_SUCCESS;
+}
+
 int cw_translator_best_choice(int *dst, int *srcs)
 {
     /* Calculate our best source format, given costs, and a desired destination */
@@ -509,7 +1129,8 @@ static char show_trans_usage[] =
 "       Displays known codec translators and the cost associated\n"
 "with each conversion.  if the argument 'recalc' is supplied along\n"
 "with optional number of seconds to test a new test will be performed\n"
-"as the chart is being displayed.\n";
+"as the chart is being displayed, and the new costs are saved for use\n"
+"at the next start.\n";
 
 static struct cw_cli_entry show_trans =
 {
@@ -519,6 +1140,21 @@ static struct cw_cli_entry show_trans =
     show_trans_usage
 };
 
+static char bench_trans_usage[] =
+"Usage: translator benchmark [<states> [<seconds>]]\n"
+"       Feeds sample frames through each registered translator, using\n"
+"the given number of independent states (default 32), and reports the\n"
+"frames translated per second one at a time and, for translators with\n"
+"a batch entry point, in batches.\n";
+
+static struct cw_cli_entry bench_trans =
+{
+    { "translator", "benchmark", NULL },
+    translator_benchmark,
+    "Measure translator throughput",
+    bench_trans_usage
+};
+
 int cw_register_translator(struct cw_translator *t)
 {
     char tmp[120]; /* Assume 120 character wide screen */
@@ -535,18 +1171,24 @@ int cw_register_translator(struct cw_translator *t)
         cw_log(LOG_WARNING, "Destination format %s is larger than MAX_FORMAT\n", cw_getformatname(1 << t->dst_format));
         return -1;
     }
-    calc_cost(t, 1);
+    translator_cost(t);
+    cw_mutex_lock(&pool_lock);
+    t->pool = NULL;
+    t->pooled = 0;
+    t->active = 1;
+    cw_mutex_unlock(&pool_lock);
     if (option_verbose > 1)
         cw_verbose(VERBOSE_PREFIX_2 "Registered translator '%s' from format %s to %s, cost %d\n", cw_term_color(tmp, t->name, COLOR_MAGENTA, COLOR_BLACK, sizeof(tmp)), cw_getformatname(1 << t->src_format), cw_getformatname(1 << t->dst_format), t->cost);
     cw_mutex_lock(&list_lock);
     if (!added_cli)
     {
         cw_cli_register(&show_trans);
+        cw_cli_register(&bench_trans);
         added_cli++;
     }
     t->next = list;
     list = t;
-    rebuild_matrix(0);
+    matrix_add(t);
     cw_mutex_unlock(&list_lock);
     return 0;
 }
@@ -556,7 +1198,10 @@ int cw_unregister_translator(struct cw_translator *t)
     char tmp[120]; /* Assume 120 character wide screen */
     struct cw_translator *u;
     struct cw_translator *ul = NULL;
+    struct cw_trans_pvt *p;
+    struct cw_trans_pvt *pn;
     
+    cw_mutex_lock(&run_lock);
     cw_mutex_lock(&list_lock);
     u = list;
     while (u)
@@ -574,8 +1219,28 @@ int cw_unregister_translator(struct cw_translator *t)
         ul = u;
         u = u->next;
     }
-    rebuild_matrix(0);
+    /* Only start over if a path actually went through it */
+    if (u  &&  matrix_uses(t))
+        rebuild_matrix();
     cw_mutex_unlock(&list_lock);
+    cw_mutex_unlock(&run_lock);
+    if (u)
+    {
+        /* Nothing can pick up a state from here on, so the pool can go */
+        cw_mutex_lock(&pool_lock);
+        t->active = 0;
+        pn = t->pool;
+        t->pool = NULL;
+        t->pooled = 0;
+        cw_mutex_unlock(&pool_lock);
+        while ((p = pn))
+        {
+            pn = p->next;
+            if (t->destroy)
+                t->destroy(p->state);
+            free(p);
+        }
+    }
     return (u  ?  0  :  -1);
 }
 
@@ -142,12 +142,10 @@ static void group_function_write(struct cw_channel *chan, int argc, char **argv,
 static char *group_list_function_read(struct cw_channel *chan, int argc, char **argv, char *buf, size_t len)
 {
 	struct cw_var_t *current;
-	struct varshead *headp;
 	char tmp1[1024] = "";
 	char tmp2[1024] = "";
 
-	headp=&chan->varshead;
-	CW_LIST_TRAVERSE(headp,current,entries) {
+	CW_CHANNEL_VARS_TRAVERSE(chan, current) {
 		if (!strncmp(cw_var_name(current), GROUP_CATEGORY_PREFIX "_", strlen(GROUP_CATEGORY_PREFIX) + 1)) {
 			if (!cw_strlen_zero(tmp1)) {
 				cw_copy_string(tmp2, tmp1, sizeof(tmp2));
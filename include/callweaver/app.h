@@ -137,9 +137,39 @@ int cw_app_has_voicemail(const char *mailbox, const char *folder);
 /*! Determine number of new/old messages in a mailbox */
 int cw_app_messagecount(const char *mailbox, int *newmsgs, int *oldmsgs);
 
+typedef int (*cw_mwi_cb_type)(const char *mailbox, int newmsgs, int oldmsgs, void *data);
+
+/*! \brief Registers a message waiting change callback
+ * The callback is called with "mailbox@context" whenever the voicemail
+ * module sees the new/old message counts of a mailbox change.
+ * Returns -1 on failure, 0 on success
+ */
+int cw_mwi_add(cw_mwi_cb_type callback, void *data);
+void cw_mwi_del(cw_mwi_cb_type callback, void *data);
+
+/*! \brief Tells CallWeaver the message counts of a mailbox changed
+ * \param mailbox "mailbox@context"
+ * Calls every registered message waiting callback
+ */
+void cw_mwi_changed(const char *mailbox, int newmsgs, int oldmsgs);
+
 /*! Safely spawn an external program while closingn file descriptors */
 extern int cw_safe_system(const char *s);
 
+#define CW_SPAWN_MAX_FDS	8
+
+/*! \brief Start an external program without forking the whole process
+ * \param path program to execute
+ * \param argv NULL terminated argument vector
+ * \param fds descriptor fds[n] becomes descriptor n of the child, -1 leaves it closed
+ * \param nfds number of entries in fds, at most CW_SPAWN_MAX_FDS
+ * \param dir working directory for the child, or NULL
+ * All other descriptors are closed, signals are reset and the child runs at
+ * normal priority. The caller must reap the child.
+ * Returns the pid of the child, or -1 on failure
+ */
+extern pid_t cw_spawn(const char *path, char *const argv[], const int *fds, int nfds, const char *dir);
+
 /*! Send DTMF to chan (optionally entertain peer)   */
 int cw_dtmf_stream(struct cw_channel *chan, struct cw_channel *peer, char *digits, int between);
 
@@ -32,6 +32,8 @@ extern "C" {
 #endif
 
 int cw_expr(char *expr, char *buf, int length);
+int cw_expr_uncached(char *expr, char *buf, int length);
+void cw_expr_cache_stats(unsigned int *hits, unsigned int *misses);
 
 #if defined(__cplusplus) || defined(c_plusplus)
 }
@@ -103,6 +103,11 @@ extern int cw_cdr_copy_vars(struct cw_cdr *to_cdr, struct cw_cdr *from_cdr);
 
 typedef int (*cw_cdrbe)(struct cw_cdr *cdr);
 
+/*! Batch CDR handler.  Stores count records in one go.  Returns 0 if the
+ * records were stored, or -1 if none were, in which case each record is
+ * handed to the backend's per record handler instead. */
+typedef int (*cw_cdrbe_batch)(struct cw_cdr **cdrs, int count);
+
 /*! \brief Allocate a CDR record 
  * Returns a malloc'd cw_cdr structure, returns NULL on error (malloc failure)
  */
@@ -146,6 +151,16 @@ extern int cw_cdr_setcid(struct cw_cdr *cdr, struct cw_channel *chan);
  */
 extern int cw_cdr_register(char *name, char *desc, cw_cdrbe be);
 
+/*! Register a CDR handling engine that can also store records in batches */
+/*!
+ * \param name name associated with the particular CDR handler
+ * \param desc description of the CDR handler
+ * \param be function pointer to a CDR handler
+ * \param be_batch function pointer to a batch CDR handler, used in batch mode
+ * Returns -1 on error, 0 on success.
+ */
+extern int cw_cdr_register_batch(char *name, char *desc, cw_cdrbe be, cw_cdrbe_batch be_batch);
+
 /*! Unregister a CDR handling engine */
 /*!
  * \param name name of CDR handler to unregister
@@ -207,7 +222,7 @@ extern void cw_cdr_end(struct cw_cdr *cdr);
  */
 extern void cw_cdr_detach(struct cw_cdr *cdr);
 
-/*! Spawns (possibly) a new thread to submit a batch of CDRs to the backend engines */
+/*! Hands a batch of CDRs to the CDR posting thread */
 /*!
  * \param shutdown Whether or not we are shutting down
  * Blocks the callweaver shutdown procedures until the CDR data is submitted.
@@ -175,9 +175,31 @@ struct cw_channel_tech {
 #define CHANSPY_RUNNING 1
 #define CHANSPY_DONE 2
 
+/*! Samples held per spy direction (must be a power of two) */
+#define CW_SPY_RING_SAMPLES	4096
+#define CW_SPY_RING_MASK	(CW_SPY_RING_SAMPLES - 1)
+
+/*! \brief Single producer/single consumer ring of signed linear audio.
+    The spied channel is the only writer and the spy the only reader.
+    The writer never blocks or allocates; if the reader falls behind the
+    oldest audio is overwritten. */
+struct cw_spy_ring {
+	int16_t buf[CW_SPY_RING_SAMPLES];
+	/*! Total samples written. Only the producer stores to this. */
+	volatile unsigned int head;
+	/*! Total samples consumed. Only the consumer touches this. */
+	unsigned int tail;
+	/*! Samples the consumer lost to overwrite */
+	unsigned int overruns;
+};
+
 struct cw_channel_spy {
-	struct cw_frame *queue[2];
-	cw_mutex_t lock;
+	/*! [0] is audio read from the channel, [1] is audio written to it */
+	struct cw_spy_ring ring[2];
+	/*! Decoders for voice formats that are not G.711 or signed linear.
+	    Only touched by the producer, under the spied channel's lock. */
+	struct cw_trans_pvt *trans[2];
+	int format[2];
 	char status;
 	struct cw_channel_spy *next;
 };
@@ -328,6 +350,13 @@ struct cw_channel {
 	
 	/* A linked list for variables */
 	struct varshead varshead;
+	/* Hash index over varshead */
+	struct cw_var_index varsindex;
+	/* Variables inherited from the parent, shared with its other children.
+	   They follow varshead, and changing one copies them into it first. */
+	struct cw_var_shared *varsinherited;
+	/* What this channel's children inherit, kept until it changes */
+	struct cw_var_shared *varsexport;
 
 	cw_group_t callgroup;
 	cw_group_t pickupgroup;
@@ -1021,6 +1050,37 @@ int cw_do_masquerade(struct cw_channel *chan);
 */
 struct cw_channel *cw_bridged_channel(struct cw_channel *chan);
 
+/*! \brief Initialise a spy before attaching it to a channel's spiers list */
+void cw_channel_spy_init(struct cw_channel_spy *spy);
+
+/*! \brief Release the decoders of a spy which is no longer attached */
+void cw_channel_spy_destroy(struct cw_channel_spy *spy);
+
+/*! \brief Copy a voice frame into one direction of a spy.
+	Called by the spied channel with its lock held.
+	\param spy The spy
+	\param f Voice frame
+	\param pos 0 for the read direction, 1 for the write direction
+*/
+void cw_channel_spy_feed(struct cw_channel_spy *spy, struct cw_frame *f, int pos);
+
+/*! \brief Copy a voice frame into one direction of every spy on a list.
+	Called by the spied channel with its lock held. Spies that have to
+	decode the frame have it translated on all their paths in one batch.
+	\param spiers First spy on the list
+	\param f Voice frame
+	\param pos 0 for the read direction, 1 for the write direction
+*/
+void cw_channel_spy_feed_list(struct cw_channel_spy *spiers, struct cw_frame *f, int pos);
+
+/*! \brief Number of samples waiting in one direction of a spy */
+int cw_channel_spy_avail(struct cw_channel_spy *spy, int pos);
+
+/*! \brief Take up to samples of signed linear audio from one direction of a spy.
+	\return the number of samples copied into buf
+*/
+int cw_channel_spy_read(struct cw_channel_spy *spy, int pos, int16_t *buf, int samples);
+
 /*!
   \brief Inherits channel variable from parent to child channel
   \param parent Parent channel
@@ -1032,8 +1092,33 @@ struct cw_channel *cw_bridged_channel(struct cw_channel *chan);
   child channel with the prefix removed.
   Variables whose names begin with '__' are copied into the child
   channel with their names unchanged.
+  The copies are made once per parent and shared by all its children
+  until one of them changes an inherited variable.
 */
-void cw_channel_inherit_variables(const struct cw_channel *parent, struct cw_channel *child);
+void cw_channel_inherit_variables(struct cw_channel *parent, struct cw_channel *child);
+
+/*! \brief Look a channel variable up by name, own variables first, then inherited ones */
+struct cw_var_t *cw_channel_var_find(struct cw_channel *chan, const char *name);
+
+/*! \brief The first of a channel's variables in list order */
+struct cw_var_t *cw_channel_var_first(struct cw_channel *chan);
+
+/*! \brief The channel variable after var in list order */
+struct cw_var_t *cw_channel_var_next(struct cw_channel *chan, struct cw_var_t *var);
+
+/*! \brief Walk all of a channel's variables, own ones and then inherited ones,
+    in the order a lookup sees them.  The list must not change during the walk. */
+#define CW_CHANNEL_VARS_TRAVERSE(chan, var) \
+	for ((var) = cw_channel_var_first(chan); (var); (var) = cw_channel_var_next((chan), (var)))
+
+/*! \brief Copy a channel's inherited variables into its own list so that
+    they can be changed or removed */
+void cw_channel_vars_own(struct cw_channel *chan);
+
+/*! \brief Note that a channel variable is about to be changed, added or removed.
+    Inherited variables of that name are copied into the channel first, and
+    what the channel passes on is worked out again if the name is inheritable. */
+void cw_channel_var_changing(struct cw_channel *chan, const char *name);
 
 /*!
   \brief adds a list of channel variables to a channel
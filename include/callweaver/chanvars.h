@@ -30,11 +30,29 @@ struct cw_var_t {
 	// added 'hash' to accommodate hash based system to recognise identifiers
 	unsigned int hash;
 	char *value;
+	int shared;			/* Belongs to a cw_var_shared block */
 	char name[0];
 };
 
 CW_LIST_HEAD_NOLOCK(varshead, cw_var_t);
 
+/*! Hash index over a variable list, by name without leading underscores
+    and regardless of case, as ${} lookups always have been.  Code that adds variables to or removes them from an indexed list
+    must keep the index in step using the functions below. */
+struct cw_var_slot {
+	unsigned int hash;
+	unsigned int count;		/* Variables of this name in the list */
+	struct cw_var_t *var;		/* The first of them */
+};
+
+struct cw_var_index {
+	unsigned int size;		/* Number of slots, a power of 2, or 0 */
+	unsigned int used;		/* Slots holding a name */
+	unsigned int tombs;		/* Slots emptied by removals */
+	int invalid;			/* Out of memory, searches fall back to the list */
+	struct cw_var_slot *slots;
+};
+
 struct cw_var_t *cw_var_assign(const char *name, const char *value);
 void cw_var_delete(struct cw_var_t *var);
 char *cw_var_name(struct cw_var_t *var);
@@ -42,4 +60,28 @@ char *cw_var_full_name(struct cw_var_t *var);
 char *cw_var_value(struct cw_var_t *var);
 #define cw_var_hash(v) (v ? v->hash : 0)
 
+struct cw_var_t *cw_var_index_find(struct cw_var_index *idx, struct varshead *head, const char *name);
+void cw_var_index_add(struct cw_var_index *idx, struct cw_var_t *var, int first);
+void cw_var_index_remove(struct cw_var_index *idx, struct varshead *head, struct cw_var_t *var);
+void cw_var_index_rebuild(struct cw_var_index *idx, struct varshead *head);
+void cw_var_index_free(struct cw_var_index *idx);
+
+/*! A reference counted, read only list of variables with its index.  It
+    carries the variables a channel passes on to the channels it spawns,
+    which share it until one of them changes an inherited variable, and
+    the published copy of the globals.  Nothing may change it once it has
+    been handed out. */
+struct cw_var_shared {
+	int refs;
+	int hard;			/* Every variable in it is a "__" one */
+	struct cw_var_shared *next;	/* For the holder's use */
+	struct varshead head;
+	struct cw_var_index idx;
+};
+
+struct cw_var_shared *cw_var_shared_new(void);
+int cw_var_shared_append(struct cw_var_shared *sh, const char *name, const char *value);
+struct cw_var_shared *cw_var_shared_ref(struct cw_var_shared *sh);
+void cw_var_shared_unref(struct cw_var_shared *sh);
+
 #endif /* _CALLWEAVER_CHANVARS_H */
@@ -153,6 +153,15 @@ struct cw_config *cw_load_realtime_multientry(const char *family, ...);
  */
 int cw_update_realtime(const char *family, const char *keyfield, const char *lookup, ...);
 
+/*! \brief Flush cached realtime lookups
+ * \param family which family/config to flush, NULL for all of them
+ * Lookups are cached for the time set in the [cache] section of
+ * extconfig.conf. Use this after changing realtime storage behind
+ * CallWeaver's back.
+ * Returns the number of cached lookups dropped.
+ */
+int cw_flush_realtime(const char *family);
+
 /*! \brief Check if realtime engine is configured for family 
  * returns 1 if family is configured in realtime and engine exists
  * \param family which family/config to be checked
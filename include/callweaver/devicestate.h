@@ -68,6 +68,13 @@ int cw_parse_device_state(const char *device);
  */
 int cw_device_state(const char *device);
 
+/*! \brief Last state the device state engine saw for a device
+ * \param device devicename like a dialstring, without the channel suffix
+ * Does not query the channel driver.
+ * Returns an CW_DEVICE_??? state, -1 if no change was ever seen for the device
+ */
+int cw_device_state_cached(const char *device);
+
 /*! \brief Tells CallWeaver the State for Device is changed
  * \param fmt devicename like a dialstring with format parameters
  * CallWeaver polls the new extensionstates and calls the registered
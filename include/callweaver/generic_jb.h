@@ -29,12 +29,15 @@
 #include <stdio.h>
 #include <sys/time.h>
 
+#include "callweaver/lock.h"
+
 #if defined(__cplusplus) || defined(c_plusplus)
 extern "C" {
 #endif
 
 struct cw_channel;
 struct cw_frame;
+struct jb_timer;
 
 
 /* Configuration flags */
@@ -103,6 +106,20 @@ struct cw_jb
     FILE *logfile;
     /*! \brief Jitterbuffer internal state flags. */
     unsigned int flags;
+    /*! \brief Guards the implementation object and next. */
+    cw_mutex_t lock;
+    /*! \brief Signalled when the playout timer lets go of a dying jitterbuffer. */
+    cw_cond_t idle;
+    /*! \brief Channel the queued frames are played out to. */
+    struct cw_channel *owner;
+    /*! \brief Playout timer thread the jitterbuffer is on, if any. */
+    struct jb_timer *timer;
+    /*! \brief Playout timer slot links. */
+    struct cw_jb *tnext, *tprev;
+    /*! \brief Playout timer tick the jitterbuffer is due at. */
+    unsigned long tdue;
+    /*! \brief Playout timer state, guarded by the timer lock. */
+    unsigned int tflags;
 };
 
 typedef struct cw_jb_info
@@ -148,6 +165,16 @@ typedef struct jb_frame
 } jb_frame;
 
 
+/*!
+ * \brief Sets up the jitterbuffer playout timers and CLI commands.
+ *
+ * Called once at startup. Jitterbuffers are spread over a few playout timer
+ * threads, which play their frames out, so the bridge does not have to wake
+ * up for every frame due.
+ */
+void cw_jb_init(void);
+
+
 /*!
  * \brief Checks the need of a jb use in a generic bridge.
  * \param c0 first bridged channel.
@@ -170,7 +197,8 @@ void cw_jb_do_usecheck(struct cw_channel *c0, struct cw_channel *c1);
  *
  * Called from cw_generic_bridge() to determine the maximum time to wait for
  * activity in cw_waitfor_n() call. If neihter of the channels is using jb,
- * this function returns the time limit passed.
+ * or their jitterbuffers are played out by the playout timer, this function
+ * returns the time limit passed.
  *
  * \return maximum time to wait.
  */
@@ -194,11 +222,18 @@ int cw_jb_get_when_to_wakeup(struct cw_channel *c0, struct cw_channel *c1, int t
  * Frames, not successfuly queued, should be delivered immediately.
  * Dropped by the jb implementation frames are considered successfuly enqueued as
  * far as they should not be delivered at all.
+ * A frame that is a single malloc'ed block, as cw_frdup() makes, is queued as
+ * it is rather than copied. The jitterbuffer then owns it, and the caller must neither
+ * free it nor look at it again.
  *
- * \return zero if the frame was queued, -1 if not.
+ * \return zero if a copy of the frame was queued, CW_JB_PUT_OWNED if the
+ * jitterbuffer took the frame itself, -1 if not queued.
  */
 int cw_jb_put(struct cw_channel *chan, struct cw_frame *f, int codec);
 
+/*! cw_jb_put() took the frame itself */
+#define CW_JB_PUT_OWNED 1
+
 
 /*!
  * \brief Deliver the queued frames that should be delivered now for both channels.
@@ -207,8 +242,8 @@ int cw_jb_put(struct cw_channel *chan, struct cw_frame *f, int codec);
  *
  * Called from cw_generic_bridge() to deliver any frames, that should be delivered
  * for the moment of invocation. Does nothing if neihter of the channels is using jb
- * or has any frames currently queued in. The function delivers frames usig cw_write()
- * each of the channels.
+ * or has any frames currently queued in, or if the playout timer delivers them.
+ * The function delivers frames usig cw_write() each of the channels.
  */
 void cw_jb_get_and_deliver(struct cw_channel *c0, struct cw_channel *c1);
 
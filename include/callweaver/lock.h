@@ -692,6 +692,27 @@ static inline int cw_cond_timedwait(cw_cond_t *cond, cw_mutex_t *t, const struct
 
 #define CW_MUTEX_INITIALIZER __use_CW_MUTEX_DEFINE_STATIC_rather_than_CW_MUTEX_INITIALIZER__
 
+/*! \brief Atomically add v to *p and return the previous value of *p. */
+static inline int cw_atomic_fetchadd_int(volatile int *p, int v)
+{
+	return __sync_fetch_and_add(p, v);
+}
+
+/*! \brief Atomically decrement *p and return non-zero if it reached zero. */
+static inline int cw_atomic_dec_and_test(volatile int *p)
+{
+	return __sync_sub_and_fetch(p, 1) == 0;
+}
+
+/*! \brief Atomically set *p to v if it still holds old. Returns non-zero if it did. */
+static inline int cw_atomic_cmpxchg_int(volatile int *p, int old, int v)
+{
+	return __sync_bool_compare_and_swap(p, old, v);
+}
+
+/*! \brief Full memory barrier for lock-free producer/consumer hand-offs. */
+#define cw_memory_barrier()	__sync_synchronize()
+
 #define gethostbyname __gethostbyname__is__not__reentrant__use__cw_gethostbyname__instead__
 #ifndef __linux__
 #define pthread_create __use_cw_pthread_create_instead__
@@ -31,6 +31,8 @@ typedef struct ogi_state {
 	int fd;		/* FD for general output */
 	int audio;	/* FD for audio output */
 	int ctrl;	/* FD for input control */
+	int keepalive;	/* Control connection belongs to the FastOGI pool */
+	int reusable;	/* Server ended the session with END SESSION */
 } OGI;
 
 typedef struct ogi_command {
@@ -32,6 +32,10 @@ extern "C" {
 #define CW_CACHE_DIR_LEN 512
 #define CW_FILENAME_MAX	80
 
+/* Values of option_transcode_prompts */
+#define CW_TRANSCODE_PROMPTS_CACHE	1	/* Under transcoded_prompt_dir */
+#define CW_TRANSCODE_PROMPTS_PERSIST	2	/* Next to the original prompt */
+
 extern int option_verbose;
 extern int option_debug;
 extern int option_nofork;
@@ -45,6 +49,7 @@ extern int option_exec_includes;
 extern int option_cache_record_files;
 extern int option_timestamp;
 extern int option_transcode_slin;
+extern int option_transcode_prompts;
 extern int option_maxcalls;
 extern double option_maxload;
 extern int option_dontwarn;
@@ -54,6 +59,7 @@ extern time_t cw_startuptime;
 extern time_t cw_lastreloadtime;
 extern int cw_mainpid;
 extern char record_cache_dir[CW_CACHE_DIR_LEN];
+extern char transcoded_prompt_dir[CW_CACHE_DIR_LEN];
 extern char debug_filename[CW_FILENAME_MAX];
 
 #define VERBOSE_PREFIX_1 " "
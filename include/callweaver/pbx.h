@@ -275,6 +275,27 @@ int cw_add_extension2(struct cw_context *con,
 					  const char *application, void *data, void (*datad)(void *),
 					  const char *registrar);
 
+/*! Queue an extension for bulk loading into a context */
+/*!
+ * Takes the same arguments as cw_add_extension2() without replace.  The extension
+ * is only linked into the context, and any duplicate reported, by
+ * cw_context_commit_extensions(), which cw_merge_contexts_and_delete() calls for
+ * every context it merges.  Use this when loading a whole dialplan.
+ * Returns 0 on success, -1 on failure
+ */
+int cw_add_extension_bulk(struct cw_context *con,
+					  const char *extension, int priority, const char *label, const char *callerid,
+					  const char *application, void *data, void (*datad)(void *),
+					  const char *registrar);
+
+/*! Link the extensions queued by cw_add_extension_bulk() into a context */
+/*!
+ * \param con context to commit
+ * Sorts the queued extensions once together with those already in the context.
+ * Returns the number of extensions added, or -1 on failure
+ */
+int cw_context_commit_extensions(struct cw_context *con);
+
 /*! Add an application.  The function 'execute' should return non-zero if the line needs to be hung up.  */
 /*!
   \param app Short name of the application
@@ -0,0 +1,64 @@
+/*
+ * CallWeaver -- An open source telephony toolkit.
+ *
+ * See http://www.callweaver.org for more information about
+ * the CallWeaver project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*! \file
+ * \brief Block conversion, mixing and gain of audio samples
+ *
+ * These run on every voice frame, so the best implementation the CPU
+ * supports is picked at startup. Every implementation gives exactly the
+ * same results as the CW_MULAW/CW_LIN2MU style table macros and the
+ * scalar saturating loops they replace.
+ */
+
+#ifndef _CALLWEAVER_PCM_H
+#define _CALLWEAVER_PCM_H
+
+#include <inttypes.h>
+
+#if defined(__cplusplus) || defined(c_plusplus)
+extern "C" {
+#endif
+
+/*! Pick the kernels for this CPU. Run after cw_ulaw_init and cw_alaw_init */
+extern void cw_pcm_init(void);
+
+/*! Force one set of kernels, "scalar", "sse2", "avx2" or "neon", without
+ *  checking them. Kernel classes an implementation lacks use the scalar
+ *  ones. Returns -1 if it is not built in or the CPU can't run it. Meant
+ *  for tests, and only valid after cw_pcm_init */
+extern int cw_pcm_use(const char *impl);
+
+/*! Decode mu-law samples to signed linear */
+extern void (*cw_ulaw_to_slin)(int16_t *dst, const uint8_t *src, int samples);
+
+/*! Encode signed linear samples to mu-law */
+extern void (*cw_slin_to_ulaw)(uint8_t *dst, const int16_t *src, int samples);
+
+/*! Decode A-law samples to signed linear */
+extern void (*cw_alaw_to_slin)(int16_t *dst, const uint8_t *src, int samples);
+
+/*! Encode signed linear samples to A-law */
+extern void (*cw_slin_to_alaw)(uint8_t *dst, const int16_t *src, int samples);
+
+/*! Add src into dst, saturating each sum to 16 bits */
+extern void (*cw_slin_mix)(int16_t *dst, const int16_t *src, int samples);
+
+/*! Scale samples in place by gain/2048, saturating to 16 bits */
+extern void (*cw_slin_gain)(int16_t *amp, int samples, int16_t gain);
+
+#if defined(__cplusplus) || defined(c_plusplus)
+}
+#endif
+
+#endif /* _CALLWEAVER_PCM_H */
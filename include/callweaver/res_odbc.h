@@ -25,35 +25,56 @@
 #ifndef _CALLWEAVER_RES_ODBC_H
 #define _CALLWEAVER_RES_ODBC_H
 
+#include <time.h>
+#include <pthread.h>
 #include <sql.h>
 #include <sqlext.h>
 #include <sqltypes.h>
 
 typedef struct odbc_obj odbc_obj;
+typedef struct odbc_pool odbc_pool;
 
 typedef enum { ODBC_SUCCESS=0,ODBC_FAIL=-1} odbc_status;
 
+struct odbc_prepared;
+
+/* One connection of a DSN's pool. Only the user it is handed out to touches it. */
 struct odbc_obj {
-	char *name;
-	char *dsn;
-	char *username;
-	char *password;
-	SQLHENV  env;                   /* ODBC Environment */
+	odbc_pool *pool;                /* DSN it belongs to */
 	SQLHDBC  con;                   /* ODBC Connection Handle */
-	SQLHSTMT stmt;                  /* ODBC Statement Handle */
-	cw_mutex_t lock;
+	struct odbc_prepared *prepared; /* Statements prepared on this connection */
+	time_t last_used;               /* When it was last handed back */
+	int used;
+	pthread_t owner;                /* Thread it is handed out to, while used */
+	int depth;                      /* Further requests the owner made for it */
 	int up;
-
+	odbc_obj *next;
 };
 
 /* functions */
-odbc_obj *new_odbc_obj(char *name,char *dsn,char *username, char *password);
+
+/*! Get a connection to a DSN for the caller's own use, connecting or
+ * checking it as needed. Waits a while if they are all busy. A thread
+ * already holding a connection to the DSN gets that one again, so nested
+ * lookups (an #include read from the database, say) never wait on themselves.
+ * \param check run a health check on the connection first
+ * \return NULL if the DSN is unknown, or no working connection was got.
+ * Hand it back with odbc_release_obj() */
+odbc_obj *odbc_request_obj(const char *name, int check);
+
+/*! Hand a connection back to its pool, closing the cursors of the
+ * statements odbc_prepare() gave out on it */
+void odbc_release_obj(odbc_obj *obj);
+
+/*! Get a statement prepared with the given SQL on the connection. Statements
+ * are cached by SQL text, so the caller must not free it, and it stays
+ * valid until the connection is released. Asking for the same SQL again
+ * before then gets a second statement, leaving the first one's cursor alone.
+ * \return the SQLPrepare() result */
+int odbc_prepare(odbc_obj *obj, const char *sql, SQLHSTMT *stmt);
+
 odbc_status odbc_obj_connect(odbc_obj *obj);
 odbc_status odbc_obj_disconnect(odbc_obj *obj);
-void destroy_odbc_obj(odbc_obj **obj);
-int register_odbc_obj(char *name,odbc_obj *obj);
-odbc_obj *fetch_odbc_obj(const char *name, int check);
-int odbc_dump_fd(int fd,odbc_obj *obj);
 int odbc_sanity_check(odbc_obj *obj);
 int odbc_smart_execute(odbc_obj *obj, SQLHSTMT stmt);
 int odbc_smart_direct_execute(odbc_obj *obj, SQLHSTMT stmt, char *sql);
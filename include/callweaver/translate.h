@@ -25,6 +25,9 @@
 
 #define MAX_FORMAT 32
 
+/*! Most frames cw_translate_batch hands to a translator at once */
+#define CW_TRANSLATE_BATCH_MAX 64
+
 #if defined(__cplusplus) || defined(c_plusplus)
 extern "C" {
 #endif
@@ -34,6 +37,8 @@ extern "C" {
 /* Declared by individual translators */
 struct cw_translator_pvt;
 
+struct cw_trans_pvt;
+
 /*! data structure associated with a translator */
 struct cw_translator {
 	/*! Name of translator */
@@ -57,14 +62,23 @@ struct cw_translator {
 	/* For performance measurements */
 	/*! Generate an example frame */
 	struct cw_frame *(*sample)(void);
-	/*! Cost in milliseconds for encoding/decoding 1 second of sound */
+	/*! Return a state to the condition newpvt left it in. Optional; only
+	    translators providing it have their states pooled for reuse */
+	void (*reset)(struct cw_translator_pvt *pvt);
+	/*! Feed one frame into each of n states at once. Optional; framein
+	    is called for each state when it is missing */
+	int (*framein_batch)(struct cw_translator_pvt **pvt, struct cw_frame **in, int n);
+	/*! Cost in milliseconds for encoding/decoding 1 second of sound.
+	    Leave at 0 to have it measured once and cached */
 	int cost;
 	/*! For linking, not to be modified by the translator */
 	struct cw_translator *next;
+	/*! Idle states kept for reuse, not to be modified by the translator */
+	struct cw_trans_pvt *pool;
+	int pooled;
+	int active;
 };
 
-struct cw_trans_pvt;
-
 /*! Register a translator */
 /*! 
  * \param t populated cw_translator structure
@@ -81,6 +95,15 @@ extern int cw_register_translator(struct cw_translator *t);
  */
 extern int cw_unregister_translator(struct cw_translator *t);
 
+/*! Count the idle states pooled for a translator */
+/*!
+ * \param t translator to look at
+ * Pooled states are owned by the core, not by a channel, so modules
+ * should leave them out of their use counts
+ * Returns the number of pooled states
+ */
+extern int cw_translator_pooled(struct cw_translator *t);
+
 /*! Chooses the best translation path */
 /*! 
  * Given a list of sources, and a designed destination format, which should
@@ -116,6 +139,20 @@ extern void cw_translator_free_path(struct cw_trans_pvt *tr);
  */
 extern struct cw_frame *cw_translate(struct cw_trans_pvt *tr, struct cw_frame *f, int consume);
 
+/*! translates a frame on each of a set of paths */
+/*!
+ * \param paths translator paths to use, each at most once
+ * \param in one frame for each path
+ * \param out where to put the frame produced on each path, or NULL
+ * \param n number of paths
+ * \param consume Whether or not to free the original frames
+ * Does the same as calling cw_translate for each path in turn, but feeds
+ * each stage of every path using the same translator in one go, so code
+ * fanning audio out to many legs can translate all of them per tick cheaply.
+ * Returns the number of frames produced
+ */
+extern int cw_translate_batch(struct cw_trans_pvt **paths, struct cw_frame **in, struct cw_frame **out, int n, int consume);
+
 #if defined(__cplusplus) || defined(c_plusplus)
 }
 #endif
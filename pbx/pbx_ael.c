@@ -3201,7 +3201,7 @@ void add_extensions(struct ael_extension *exten, struct cw_context *context)
 		struct ael_priority *last = 0;
 		
 		if (exten->hints) {
-			if (cw_add_extension2(context, 0 /*no replace*/, exten->name, PRIORITY_HINT, NULL, exten->cidmatch, 
+			if (cw_add_extension_bulk(context, exten->name, PRIORITY_HINT, NULL, exten->cidmatch, 
 								  exten->hints, NULL, FREE, registrar)) {
 				cw_log(LOG_WARNING, "Unable to add step at priority 'hint' of extension '%s'\n",
 						exten->name);
@@ -3283,7 +3283,7 @@ void add_extensions(struct ael_extension *exten, struct cw_context *context)
 				label = 0;
 			
 			
-			if (cw_add_extension2(context, 0 /*no replace*/, exten->name, pr->priority_num, (label?label:NULL), exten->cidmatch, 
+			if (cw_add_extension_bulk(context, exten->name, pr->priority_num, (label?label:NULL), exten->cidmatch, 
 								  app, strdup(appargs), FREE, registrar)) {
 				cw_log(LOG_WARNING, "Unable to add step at priority '%d' of extension '%s'\n", pr->priority_num, 
 						exten->name);
@@ -43,6 +43,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/logger.h"
 #include "callweaver/cli.h"
 #include "callweaver/phone_no_utils.h"
+#include "callweaver/callweaver_hash.h"
 
 #ifdef __CW_DEBUG_MALLOC
 static void FREE(void *ptr)
@@ -1606,6 +1607,167 @@ int unload_module(void)
 	return 0;
 }
 
+/*
+ * Priority labels seen while loading a context.  Extensions are only
+ * queued while loading, and linked in with one commit per context, so a
+ * label used as a priority is looked up here rather than in the context.
+ * Lines whose label isn't here (one from an included context, say) are
+ * put aside, along with any "n" and "s" lines following on from them,
+ * and added once the context has been committed.
+ */
+#define LABEL_BUCKETS 256
+
+struct load_label {
+	struct load_label *next;
+	unsigned int hash;
+	int priority;
+	char key[1];
+};
+
+struct load_pending {
+	struct load_pending *next;
+	char *ext;
+	char *cidmatch;
+	char *ref;		/* Label used as the priority, or NULL for "n" or "s" */
+	int delta;		/* 1 for "n", 0 for "s" */
+	int plus;
+	int start;		/* First of a run of put aside lines */
+	int lastpri;		/* Priority before the run began */
+	char *label;
+	char *appl;
+	char *data;
+	int lineno;
+	char buf[1];
+};
+
+static void load_label_key(char *buf, size_t len, const char *ext, const char *cidmatch, const char *label)
+{
+	snprintf(buf, len, "%s\n%s\n%s", ext, cidmatch ? cidmatch : "", label);
+}
+
+static int load_label_find(struct load_label **labels, const char *ext, const char *cidmatch, const char *label)
+{
+	struct load_label *l;
+	char key[512];
+	unsigned int hash;
+
+	load_label_key(key, sizeof(key), ext, cidmatch, label);
+	hash = cw_hash_string(key);
+	for (l = labels[hash % LABEL_BUCKETS]; l; l = l->next) {
+		if (l->hash == hash && !strcmp(l->key, key))
+			return l->priority;
+	}
+	return 0;
+}
+
+/* The first definition wins, as it does for the extensions themselves */
+static void load_label_add(struct load_label **labels, const char *ext, const char *cidmatch, const char *label, int priority)
+{
+	struct load_label *l;
+	char key[512];
+
+	if (load_label_find(labels, ext, cidmatch, label))
+		return;
+	load_label_key(key, sizeof(key), ext, cidmatch, label);
+	if (!(l = malloc(sizeof(*l) + strlen(key))))
+		return;
+	strcpy(l->key, key);
+	l->hash = cw_hash_string(key);
+	l->priority = priority;
+	l->next = labels[l->hash % LABEL_BUCKETS];
+	labels[l->hash % LABEL_BUCKETS] = l;
+}
+
+static void load_label_clear(struct load_label **labels)
+{
+	struct load_label *l;
+	int x;
+
+	for (x = 0; x < LABEL_BUCKETS; x++) {
+		while ((l = labels[x])) {
+			labels[x] = l->next;
+			free(l);
+		}
+	}
+}
+
+static char *load_pending_copy(char **pos, const char *str)
+{
+	char *res;
+
+	if (!str)
+		return NULL;
+	res = strcpy(*pos, str);
+	*pos += strlen(str) + 1;
+	return res;
+}
+
+static struct load_pending *load_pending_new(const char *ext, const char *cidmatch, const char *ref,
+	const char *label, const char *appl, const char *data)
+{
+	struct load_pending *p;
+	size_t len;
+	char *pos;
+
+	len = strlen(ext) + strlen(appl) + strlen(data) + 3;
+	if (cidmatch)
+		len += strlen(cidmatch) + 1;
+	if (ref)
+		len += strlen(ref) + 1;
+	if (label)
+		len += strlen(label) + 1;
+	if (!(p = malloc(sizeof(*p) + len)))
+		return NULL;
+	memset(p, 0, sizeof(*p));
+	pos = p->buf;
+	p->ext = load_pending_copy(&pos, ext);
+	p->cidmatch = load_pending_copy(&pos, cidmatch);
+	p->ref = load_pending_copy(&pos, ref);
+	p->label = load_pending_copy(&pos, label);
+	p->appl = load_pending_copy(&pos, appl);
+	p->data = load_pending_copy(&pos, data);
+	return p;
+}
+
+/* Adds the lines put aside while loading con, now that it is committed.
+   Returns the priority of the last one, for a following "n" */
+static int load_pending_add(struct cw_context *con, struct load_label **labels, struct load_pending *pending, int lastpri)
+{
+	struct load_pending *p;
+	int ipri;
+
+	cw_context_commit_extensions(con);
+	while ((p = pending)) {
+		pending = p->next;
+		if (p->start)
+			lastpri = p->lastpri;
+		ipri = -2;
+		if (p->ref) {
+			if ((ipri = load_label_find(labels, p->ext, p->cidmatch, p->ref)) < 1
+				&& (ipri = cw_findlabel_extension2(NULL, con, p->ext, p->ref, p->cidmatch)) < 1) {
+				cw_log(LOG_WARNING, "Invalid priority/label '%s' at line %d\n", p->ref, p->lineno);
+				ipri = 0;
+			}
+		} else if (lastpri > -2) {
+			ipri = lastpri + p->delta;
+		} else {
+			cw_log(LOG_WARNING, "Can't use '%s' priority on the first entry!\n", p->delta ? "next" : "same");
+		}
+		if (ipri) {
+			ipri += p->plus;
+			lastpri = ipri;
+			if (!option_dontwarn && !strcmp(p->ext, "_."))
+				cw_log(LOG_WARNING, "The use of '_.' for an extension is strongly discouraged and can have unexpected behavior.  Please use '_X.' instead at line %d\n", p->lineno);
+			if (cw_add_extension_bulk(con, p->ext, ipri, p->label, p->cidmatch, p->appl, strdup(p->data), FREE, registrar))
+				cw_log(LOG_WARNING, "Unable to register extension at line %d\n", p->lineno);
+			else if (p->label)
+				load_label_add(labels, p->ext, p->cidmatch, p->label, ipri);
+		}
+		free(p);
+	}
+	return lastpri;
+}
+
 static int pbx_load_module(void)
 {
 	char realvalue[4096];
@@ -1616,6 +1778,12 @@ static int pbx_load_module(void)
 	char *end;
 	char *label;
 	int lastpri = -2;
+	struct load_label *labels[LABEL_BUCKETS];
+	struct load_pending *pending, **pending_tail, *p;
+	int chained;
+	int pendpri;
+
+	memset(labels, 0, sizeof(labels));
 
 	cfg = cw_config_load(config);
 	if (cfg) {
@@ -1645,11 +1813,17 @@ static int pbx_load_module(void)
 				continue;
 			}
 			if ((con=cw_context_create(&local_contexts,cxt, registrar))) {
+				pending = NULL;
+				pending_tail = &pending;
+				chained = 0;
 				v = cw_variable_browse(cfg, cxt);
 				while(v) {
 					if (!strcasecmp(v->name, "exten")) {
 						char *stringp=NULL;
 						int ipri = -2;
+						int defer = 0;
+						int relative = 0;
+						int delta = 0;
 						char realext[256]="";
 						char *plus, *firstp, *firstc;
 						tc = strdup(v->value);
@@ -1686,21 +1860,24 @@ static int pbx_load_module(void)
 							if (!strcmp(pri,"hint"))
 								ipri=PRIORITY_HINT;
 							else if (!strcmp(pri, "next") || !strcmp(pri, "n")) {
-								if (lastpri > -2)
+								if (chained)
+									defer = relative = delta = 1;
+								else if (lastpri > -2)
 									ipri = lastpri + 1;
 								else
 									cw_log(LOG_WARNING, "Can't use 'next' priority on the first entry!\n");
 							} else if (!strcmp(pri, "same") || !strcmp(pri, "s")) {
-								if (lastpri > -2)
+								if (chained)
+									defer = relative = 1;
+								else if (lastpri > -2)
 									ipri = lastpri;
 								else
 									cw_log(LOG_WARNING, "Can't use 'same' priority on the first entry!\n");
 							} else  {
 								if (sscanf(pri, "%d", &ipri) != 1) {
-									if ((ipri = cw_findlabel_extension2(NULL, con, realext, pri, cidmatch)) < 1) {
-										cw_log(LOG_WARNING, "Invalid priority/label '%s' at line %d\n", pri, v->lineno);
-										ipri = 0;
-									}
+									/* Not defined earlier in this context, so wait for it to be committed */
+									if ((ipri = load_label_find(labels, realext, cidmatch, pri)) < 1)
+										defer = 1;
 								}
 							}
 							appl = stringp;
@@ -1732,7 +1909,19 @@ static int pbx_load_module(void)
 							if (!data)
 								data="";
 							while(*appl && (*appl < 33)) appl++;
-							if (ipri) {
+							if (defer) {
+								if ((p = load_pending_new(realext, cidmatch, relative ? NULL : pri, label, appl, data))) {
+									p->delta = delta;
+									p->plus = plus ? atoi(plus) : 0;
+									p->start = !chained;
+									p->lastpri = lastpri;
+									p->lineno = v->lineno;
+									*pending_tail = p;
+									pending_tail = &p->next;
+								}
+								chained = 1;
+							} else if (ipri) {
+								chained = 0;
 								if (plus)
 									ipri += atoi(plus);
 								lastpri = ipri;
@@ -1740,8 +1929,10 @@ static int pbx_load_module(void)
 									if (!strcmp(realext, "_."))
 										cw_log(LOG_WARNING, "The use of '_.' for an extension is strongly discouraged and can have unexpected behavior.  Please use '_X.' instead at line %d\n", v->lineno);
 								}
-								if (cw_add_extension2(con, 0, realext, ipri, label, cidmatch, appl, strdup(data), FREE, registrar)) {
+								if (cw_add_extension_bulk(con, realext, ipri, label, cidmatch, appl, strdup(data), FREE, registrar)) {
 									cw_log(LOG_WARNING, "Unable to register extension at line %d\n", v->lineno);
+								} else if (label) {
+									load_label_add(labels, realext, cidmatch, label, ipri);
 								}
 							}
 							free(tc);
@@ -1772,6 +1963,13 @@ static int pbx_load_module(void)
 					}
 					v = v->next;
 				}
+				if (pending) {
+					/* Only the last line put aside can set what "n" follows on from */
+					pendpri = load_pending_add(con, labels, pending, lastpri);
+					if (chained)
+						lastpri = pendpri;
+				}
+				load_label_clear(labels);
 			}
 			cxt = cw_category_browse(cfg, cxt);
 		}
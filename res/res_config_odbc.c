@@ -52,9 +52,8 @@ STANDARD_LOCAL_USER;
 
 LOCAL_USER_DECL;
 
-static struct cw_variable *realtime_odbc(const char *database, const char *table, va_list ap)
+static struct cw_variable *realtime_odbc_query(odbc_obj *obj, const char *table, va_list ap)
 {
-	odbc_obj *obj;
 	SQLHSTMT stmt;
 	char sql[1024];
 	char coltitle[256];
@@ -78,24 +77,9 @@ static struct cw_variable *realtime_odbc(const char *database, const char *table
 	va_copy(aq, ap);
 	
 	
-	if (!table)
-		return NULL;
-
-	obj = fetch_odbc_obj(database, 0);
-	if (!obj)
-		return NULL;
-
-	res = SQLAllocHandle (SQL_HANDLE_STMT, obj->con, &stmt);
-	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
-		cw_log(LOG_WARNING, "SQL Alloc Handle failed!\n");
-		return NULL;
-	}
-
 	newparam = va_arg(aq, const char *);
-	if (!newparam)  {
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
+	if (!newparam)
 		return NULL;
-	}
 	newval = va_arg(aq, const char *);
 	if (!strchr(newparam, ' ')) op = " ="; else op = "";
 	snprintf(sql, sizeof(sql), "SELECT * FROM %s WHERE %s%s ?", table, newparam, op);
@@ -105,10 +89,9 @@ static struct cw_variable *realtime_odbc(const char *database, const char *table
 		newval = va_arg(aq, const char *);
 	}
 	va_end(aq);
-	res = SQLPrepare(stmt, (unsigned char *) sql, SQL_NTS);
+	res = odbc_prepare(obj, sql, &stmt);
 	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 		cw_log(LOG_WARNING, "SQL Prepare failed![%s]\n", sql);
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 		return NULL;
 	}
 	
@@ -124,25 +107,21 @@ static struct cw_variable *realtime_odbc(const char *database, const char *table
 
 	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 		cw_log(LOG_WARNING, "SQL Execute error!\n[%s]\n\n", sql);
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 		return NULL;
 	}
 
 	res = SQLNumResultCols(stmt, &colcount);
 	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 		cw_log(LOG_WARNING, "SQL Column Count error!\n[%s]\n\n", sql);
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 		return NULL;
 	}
 
 	res = SQLFetch(stmt);
 	if (res == SQL_NO_DATA) {
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 		return NULL;
 	}
 	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 		cw_log(LOG_WARNING, "SQL Fetch error!\n[%s]\n\n", sql);
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 		return NULL;
 	}
 	for (x=0;x<colcount;x++) {
@@ -183,14 +162,28 @@ static struct cw_variable *realtime_odbc(const char *database, const char *table
 		}
 	}
 
-
-	SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 	return var;
 }
 
-static struct cw_config *realtime_multi_odbc(const char *database, const char *table, va_list ap)
+static struct cw_variable *realtime_odbc(const char *database, const char *table, va_list ap)
 {
 	odbc_obj *obj;
+	struct cw_variable *var;
+
+	if (!table)
+		return NULL;
+
+	obj = odbc_request_obj(database, 0);
+	if (!obj)
+		return NULL;
+
+	var = realtime_odbc_query(obj, table, ap);
+	odbc_release_obj(obj);
+	return var;
+}
+
+static struct cw_config *realtime_multi_odbc_query(odbc_obj *obj, const char *table, va_list ap)
+{
 	SQLHSTMT stmt;
 	char sql[1024];
 	char coltitle[256];
@@ -218,25 +211,11 @@ static struct cw_config *realtime_multi_odbc(const char *database, const char *t
 	va_copy(aq, ap);
 	
 	
-	if (!table)
-		return NULL;
 	memset(&ra, 0, sizeof(ra));
 
-	obj = fetch_odbc_obj(database, 0);
-	if (!obj)
-		return NULL;
-
-	res = SQLAllocHandle (SQL_HANDLE_STMT, obj->con, &stmt);
-	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
-		cw_log(LOG_WARNING, "SQL Alloc Handle failed!\n");
-		return NULL;
-	}
-
 	newparam = va_arg(aq, const char *);
-	if (!newparam)  {
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
+	if (!newparam)
 		return NULL;
-	}
 	initfield = cw_strdupa(newparam);
 	if ((op = strchr(initfield, ' '))) 
 		*op = '\0';
@@ -251,10 +230,9 @@ static struct cw_config *realtime_multi_odbc(const char *database, const char *t
 	if (initfield)
 		snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " ORDER BY %s", initfield);
 	va_end(aq);
-	res = SQLPrepare(stmt, (unsigned char *) sql, SQL_NTS);
+	res = odbc_prepare(obj, sql, &stmt);
 	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 		cw_log(LOG_WARNING, "SQL Prepare failed![%s]\n", sql);
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 		return NULL;
 	}
 	
@@ -270,21 +248,18 @@ static struct cw_config *realtime_multi_odbc(const char *database, const char *t
 
 	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 		cw_log(LOG_WARNING, "SQL Execute error!\n[%s]\n\n", sql);
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 		return NULL;
 	}
 
 	res = SQLNumResultCols(stmt, &colcount);
 	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 		cw_log(LOG_WARNING, "SQL Column Count error!\n[%s]\n\n", sql);
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 		return NULL;
 	}
 
 	cfg = cw_config_new();
 	if (!cfg) {
 		cw_log(LOG_WARNING, "Out of memory!\n");
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 		return NULL;
 	}
 
@@ -334,13 +309,28 @@ static struct cw_config *realtime_multi_odbc(const char *database, const char *t
 		cw_category_append(cfg, cat);
 	}
 
-	SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 	return cfg;
 }
 
-static int update_odbc(const char *database, const char *table, const char *keyfield, const char *lookup, va_list ap)
+static struct cw_config *realtime_multi_odbc(const char *database, const char *table, va_list ap)
 {
 	odbc_obj *obj;
+	struct cw_config *cfg;
+
+	if (!table)
+		return NULL;
+
+	obj = odbc_request_obj(database, 0);
+	if (!obj)
+		return NULL;
+
+	cfg = realtime_multi_odbc_query(obj, table, ap);
+	odbc_release_obj(obj);
+	return cfg;
+}
+
+static int update_odbc_query(odbc_obj *obj, const char *table, const char *keyfield, const char *lookup, va_list ap)
+{
 	SQLHSTMT stmt;
 	char sql[256];
 	SQLLEN rowcount=0;
@@ -351,24 +341,9 @@ static int update_odbc(const char *database, const char *table, const char *keyf
 	
 	va_copy(aq, ap);
 	
-	if (!table)
-		return -1;
-
-	obj = fetch_odbc_obj (database, 0);
-	if (!obj)
-		return -1;
-
-	res = SQLAllocHandle (SQL_HANDLE_STMT, obj->con, &stmt);
-	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
-		cw_log(LOG_WARNING, "SQL Alloc Handle failed!\n");
-		return -1;
-	}
-
 	newparam = va_arg(aq, const char *);
-	if (!newparam)  {
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
+	if (!newparam)
 		return -1;
-	}
 	newval = va_arg(aq, const char *);
 	snprintf(sql, sizeof(sql), "UPDATE %s SET %s=?", table, newparam);
 	while((newparam = va_arg(aq, const char *))) {
@@ -378,10 +353,9 @@ static int update_odbc(const char *database, const char *table, const char *keyf
 	va_end(aq);
 	snprintf(sql + strlen(sql), sizeof(sql) - strlen(sql), " WHERE %s=?", keyfield);
 	
-	res = SQLPrepare(stmt, (unsigned char *) sql, SQL_NTS);
+	res = odbc_prepare(obj, sql, &stmt);
 	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 		cw_log(LOG_WARNING, "SQL Prepare failed![%s]\n", sql);
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 		return -1;
 	}
 	
@@ -399,12 +373,10 @@ static int update_odbc(const char *database, const char *table, const char *keyf
 
 	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 		cw_log(LOG_WARNING, "SQL Execute error!\n[%s]\n\n", sql);
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 		return -1;
 	}
 
 	res = SQLRowCount(stmt, &rowcount);
-	SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 
 	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 		cw_log(LOG_WARNING, "SQL Row Count error!\n[%s]\n\n", sql);
@@ -417,12 +389,28 @@ static int update_odbc(const char *database, const char *table, const char *keyf
 	return -1;
 }
 
-static struct cw_config *config_odbc(const char *database, const char *table, const char *file, struct cw_config *cfg)
+static int update_odbc(const char *database, const char *table, const char *keyfield, const char *lookup, va_list ap)
+{
+	odbc_obj *obj;
+	int res;
+
+	if (!table)
+		return -1;
+
+	obj = odbc_request_obj(database, 0);
+	if (!obj)
+		return -1;
+
+	res = update_odbc_query(obj, table, keyfield, lookup, ap);
+	odbc_release_obj(obj);
+	return res;
+}
+
+static struct cw_config *config_odbc_query(odbc_obj *obj, const char *table, const char *file, struct cw_config *cfg)
 {
 	struct cw_variable *new_v;
 	struct cw_category *cur_cat;
 	int res = 0;
-	odbc_obj *obj;
 	SQLINTEGER err=0, commented=0, cat_metric=0, var_metric=0, last_cat_metric=0;
 	SQLBIGINT id;
 	char sql[255] = "", filename[128], category[128], var_name[128], var_val[512];
@@ -430,13 +418,6 @@ static struct cw_config *config_odbc(const char *database, const char *table, co
 	SQLHSTMT stmt;
 	char last[128] = "";
 
-	if (!file || !strcmp (file, "res_config_odbc.conf"))
-		return NULL;		/* cant configure myself with myself ! */
-
-	obj = fetch_odbc_obj(database, 0);
-	if (!obj)
-		return NULL;
-
 	res = SQLAllocHandle (SQL_HANDLE_STMT, obj->con, &stmt);
 
 	SQLBindCol (stmt, 1, SQL_C_ULONG, &id, sizeof (id), &err);
@@ -500,6 +481,24 @@ static struct cw_config *config_odbc(const char *database, const char *table, co
 	return cfg;
 }
 
+static struct cw_config *config_odbc(const char *database, const char *table, const char *file, struct cw_config *cfg)
+{
+	odbc_obj *obj;
+	struct cw_config *res;
+
+	if (!file || !strcmp (file, "res_config_odbc.conf"))
+		return NULL;		/* cant configure myself with myself ! */
+
+	/* An #include in the config comes back here, and gets this connection again */
+	obj = odbc_request_obj(database, 0);
+	if (!obj)
+		return NULL;
+
+	res = config_odbc_query(obj, table, file, cfg);
+	odbc_release_obj(obj);
+	return res;
+}
+
 static struct cw_config_engine odbc_engine = {
 	.name = "odbc",
 	.load_func = config_odbc,
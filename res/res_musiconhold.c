@@ -59,6 +59,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/config.h"
 #include "callweaver/utils.h"
 #include "callweaver/cli.h"
+#include "callweaver/app.h"
 
 #define MAX_MOHFILES 512
 #define MAX_MOHFILE_LEN 128
@@ -323,6 +324,7 @@ static struct cw_generator moh_file_stream =
 static int spawn_custom_command(struct mohclass *class)
 {
 	int fds[2];
+	int cfds[3];
 	int files = 0;
 	char fns[MAX_MOHFILES][MAX_MOHFILE_LEN];
 	char *argv[MAX_MOHFILES + 50];
@@ -384,31 +386,18 @@ static int spawn_custom_command(struct mohclass *class)
 			printf("arg%d: %s\n", x, argv[x]);
 	}
 #endif	
-	class->pid = fork();
+	/* Stdout goes to pipe */
+	cfds[0] = STDIN_FILENO;
+	cfds[1] = fds[1];
+	cfds[2] = STDERR_FILENO;
+	class->pid = cw_spawn(argv[0], argv, cfds, 3, (strcasecmp(class->dir, "nodir")  ?  class->dir  :  NULL));
+	close(fds[1]);
 	if (class->pid < 0) {
+		class->pid = 0;
 		close(fds[0]);
-		close(fds[1]);
-		cw_log(LOG_WARNING, "Fork failed: %s\n", strerror(errno));
+		cw_log(LOG_WARNING, "Unable to start '%s'\n", argv[0]);
 		return -1;
 	}
-	if (!class->pid) {
-		/* Child */
-		int x;
-		close(fds[0]);
-		/* Stdout goes to pipe */
-		dup2(fds[1], STDOUT_FILENO);
-		/* Close unused file descriptors */
-		for (x = 3; x < 8192; x++)
-			close(x);
-		chdir(class->dir);
-		execv(argv[0], argv);
-		cw_log(LOG_WARNING, "Exec failed: %s\n", strerror(errno));
-		close(fds[1]);
-		exit(1);
-	} else {
-		/* Parent */
-		close(fds[1]);
-	}
 	return fds[0];
 }
 
@@ -34,6 +34,8 @@
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <sys/time.h>
 
 #include "callweaver.h"
 
@@ -48,49 +50,92 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/module.h"
 #include "callweaver/cli.h"
 #include "callweaver/lock.h"
+#include "callweaver/utils.h"
 #include "callweaver/res_odbc.h"
 #define MAX_ODBC_HANDLES 25
 
+/* Pool defaults, overridden per DSN in res_odbc.conf */
+#define ODBC_POOL_SIZE 4		/* connections */
+#define ODBC_POOL_WAIT 2000		/* ms to wait for a free connection */
+#define ODBC_IDLE_CHECK 60		/* s idle before a connection is checked */
+#define ODBC_MAX_BACKOFF 60		/* s between reconnect attempts, at most */
+#define ODBC_STMT_CACHE 16		/* prepared statements per connection */
+
+struct odbc_prepared
+{
+	char *sql;
+	SQLHSTMT stmt;
+	int used;			/* given out since the connection was requested */
+	struct odbc_prepared *next;
+};
+
+struct odbc_pool
+{
+	char *name;
+	char *dsn;
+	char *username;
+	char *password;
+	SQLHENV env;			/* ODBC Environment */
+	cw_mutex_t lock;
+	cw_cond_t freed;		/* signalled when a connection is handed back */
+	odbc_obj *objs;
+	int count;			/* connections made so far */
+	int size;			/* most connections to make */
+	int wait;
+	int idle_check;
+	int max_backoff;
+	int cache_size;
+	int backoff;			/* s to wait after the last failed connect */
+	time_t retry;			/* no connecting before this */
+	long requests;
+	long waited;
+	long timeouts;
+};
+
 struct odbc_list
 {
 	char name[80];
-	odbc_obj *obj;
+	odbc_pool *pool;
 	int used;
 };
 
 static struct odbc_list ODBC_REGISTRY[MAX_ODBC_HANDLES];
 
 
+static odbc_pool *new_odbc_pool(char *name, char *dsn, char *username, char *password);
+static void destroy_odbc_pool(odbc_pool *pool);
+static int register_odbc_pool(char *name, odbc_pool *pool);
+
 static void odbc_destroy(void)
 {
 	int x = 0;
 
 	for (x = 0; x < MAX_ODBC_HANDLES; x++) {
-		if (ODBC_REGISTRY[x].obj) {
-			destroy_odbc_obj(&ODBC_REGISTRY[x].obj);
-			ODBC_REGISTRY[x].obj = NULL;
+		if (ODBC_REGISTRY[x].pool) {
+			destroy_odbc_pool(ODBC_REGISTRY[x].pool);
+			ODBC_REGISTRY[x].pool = NULL;
 		}
 	}
 }
 
-static odbc_obj *odbc_read(struct odbc_list *registry, const char *name)
+static odbc_pool *odbc_read(struct odbc_list *registry, const char *name)
 {
 	int x = 0;
 	for (x = 0; x < MAX_ODBC_HANDLES; x++) {
 		if (registry[x].used && !strcmp(registry[x].name, name)) {
-			return registry[x].obj;
+			return registry[x].pool;
 		}
 	}
 	return NULL;
 }
 
-static int odbc_write(struct odbc_list *registry, char *name, odbc_obj *obj)
+static int odbc_write(struct odbc_list *registry, char *name, odbc_pool *pool)
 {
 	int x = 0;
 	for (x = 0; x < MAX_ODBC_HANDLES; x++) {
 		if (!registry[x].used) {
 			cw_copy_string(registry[x].name, name, sizeof(registry[x].name));
-			registry[x].obj = obj;
+			registry[x].pool = pool;
 			registry[x].used = 1;
 			return 1;
 		}
@@ -109,18 +154,30 @@ static void odbc_init(void)
 static char *tdesc = "ODBC Resource";
 /* internal stuff */
 
+/* Connection errors are SQLSTATE class 08. Anything else leaves the connection be. */
+static void odbc_check_error(odbc_obj *obj, SQLHSTMT stmt)
+{
+	SQLCHAR state[6];
+	SQLCHAR msg[200];
+	SQLINTEGER err;
+	SQLSMALLINT mlen;
+
+	if (SQLGetDiagRec(SQL_HANDLE_STMT, stmt, 1, state, &err, msg, sizeof(msg), &mlen) != SQL_SUCCESS)
+		return;
+	if (!strncmp((char *) state, "08", 2)) {
+		cw_log(LOG_WARNING, "res_odbc: Connection to %s lost (%s: %s), it will be reconnected\n",
+			obj->pool->name, state, msg);
+		obj->up = 0;
+	}
+}
+
 int odbc_smart_execute(odbc_obj *obj, SQLHSTMT stmt) 
 {
 	int res = 0;
 	res = SQLExecute(stmt);
 	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO) && (res != SQL_NO_DATA)) {
-		cw_log(LOG_WARNING, "SQL Execute error! Attempting a reconnect...\n");
-		cw_mutex_lock(&obj->lock);
-		obj->up = 0;
-		cw_mutex_unlock(&obj->lock);
-		odbc_obj_disconnect(obj);
-		odbc_obj_connect(obj);
-		res = SQLExecute(stmt);
+		cw_log(LOG_WARNING, "SQL Execute error!\n");
+		odbc_check_error(obj, stmt);
 	}
 	
 	return res;
@@ -133,13 +190,8 @@ int odbc_smart_direct_execute(odbc_obj *obj, SQLHSTMT stmt, char *sql)
 
 	res = SQLExecDirect (stmt, (unsigned char *) sql, SQL_NTS);
 	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
-		cw_log(LOG_WARNING, "SQL Execute error! Attempting a reconnect...\n");
-		cw_mutex_lock(&obj->lock);
-		obj->up = 0;
-		cw_mutex_unlock(&obj->lock);
-		odbc_obj_disconnect(obj);
-		odbc_obj_connect(obj);
-		res = SQLExecDirect (stmt, (unsigned char *) sql, SQL_NTS);
+		cw_log(LOG_WARNING, "SQL Execute error!\n");
+		odbc_check_error(obj, stmt);
 	}
 	
 	return res;
@@ -151,7 +203,6 @@ int odbc_sanity_check(odbc_obj *obj)
 	SQLHSTMT stmt;
 	int res = 0;
 
-	cw_mutex_lock(&obj->lock);
 	if(obj->up) { /* so you say... let's make sure */
 		res = SQLAllocHandle (SQL_HANDLE_STMT, obj->con, &stmt);
 		if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
@@ -166,19 +217,215 @@ int odbc_sanity_check(odbc_obj *obj)
 					obj->up = 0; /* Liar!*/
 				}
 			}
+			SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 		}
-		SQLFreeHandle (SQL_HANDLE_STMT, stmt);
 	}
-	cw_mutex_unlock(&obj->lock);
 
 	if(!obj->up) { /* Try to reconnect! */
 		cw_log(LOG_WARNING, "Connection is down attempting to reconnect...\n");
-		odbc_obj_disconnect(obj);
 		odbc_obj_connect(obj);
 	}
 	return obj->up;
 }
 
+static int odbc_prepared_free(odbc_obj *obj)
+{
+	struct odbc_prepared *p;
+	int n = 0;
+
+	while ((p = obj->prepared)) {
+		obj->prepared = p->next;
+		SQLFreeHandle(SQL_HANDLE_STMT, p->stmt);
+		free(p->sql);
+		free(p);
+		n++;
+	}
+	return n;
+}
+
+int odbc_prepare(odbc_obj *obj, const char *sql, SQLHSTMT *stmt)
+{
+	struct odbc_prepared *p, *prev, *evict, *evict_prev;
+	int n;
+	int res;
+
+	/* Most recently used first. One given out earlier in this borrow may
+	   still be in use, so that SQL gets another statement of its own */
+	for (prev = NULL, p = obj->prepared; p; prev = p, p = p->next) {
+		if (!p->used && !strcmp(p->sql, sql)) {
+			if (prev) {
+				prev->next = p->next;
+				p->next = obj->prepared;
+				obj->prepared = p;
+			}
+			p->used = 1;
+			*stmt = p->stmt;
+			return SQL_SUCCESS;
+		}
+	}
+
+	if ((p = malloc(sizeof(*p))) == NULL || (p->sql = strdup(sql)) == NULL) {
+		cw_log(LOG_WARNING, "Out of memory\n");
+		free(p);
+		return SQL_ERROR;
+	}
+	res = SQLAllocHandle(SQL_HANDLE_STMT, obj->con, &p->stmt);
+	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
+		free(p->sql);
+		free(p);
+		return res;
+	}
+	res = SQLPrepare(p->stmt, (unsigned char *) sql, SQL_NTS);
+	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
+		odbc_check_error(obj, p->stmt);
+		SQLFreeHandle(SQL_HANDLE_STMT, p->stmt);
+		free(p->sql);
+		free(p);
+		return res;
+	}
+	p->used = 1;
+	p->next = obj->prepared;
+	obj->prepared = p;
+	*stmt = p->stmt;
+
+	/* Drop the least recently used statement that is not given out */
+	evict = evict_prev = NULL;
+	for (n = 0, prev = NULL, p = obj->prepared; p; prev = p, p = p->next) {
+		n++;
+		if (!p->used) {
+			evict = p;
+			evict_prev = prev;
+		}
+	}
+	if (n > obj->pool->cache_size && evict) {
+		if (evict_prev)
+			evict_prev->next = evict->next;
+		else
+			obj->prepared = evict->next;
+		SQLFreeHandle(SQL_HANDLE_STMT, evict->stmt);
+		free(evict->sql);
+		free(evict);
+	}
+	return res;
+}
+
+static odbc_obj *odbc_pool_take(odbc_pool *pool)
+{
+	odbc_obj *obj;
+	struct timeval tv;
+	struct timespec ts;
+
+	tv = cw_tvadd(cw_tvnow(), cw_samp2tv(pool->wait, 1000));
+	ts.tv_sec = tv.tv_sec;
+	ts.tv_nsec = tv.tv_usec * 1000;
+
+	cw_mutex_lock(&pool->lock);
+	pool->requests++;
+	/* Already ours further up the stack, so share it */
+	for (obj = pool->objs; obj; obj = obj->next) {
+		if (obj->used && pthread_equal(obj->owner, pthread_self())) {
+			obj->depth++;
+			cw_mutex_unlock(&pool->lock);
+			return obj;
+		}
+	}
+	for (;;) {
+		/* A free connection that is up, else any free one, else a new one */
+		for (obj = pool->objs; obj; obj = obj->next) {
+			if (!obj->used && obj->up)
+				break;
+		}
+		if (!obj) {
+			for (obj = pool->objs; obj; obj = obj->next) {
+				if (!obj->used)
+					break;
+			}
+		}
+		if (!obj && pool->count < pool->size && (obj = malloc(sizeof(*obj)))) {
+			memset(obj, 0, sizeof(*obj));
+			obj->pool = pool;
+			obj->con = SQL_NULL_HANDLE;
+			obj->next = pool->objs;
+			pool->objs = obj;
+			pool->count++;
+		}
+		if (obj)
+			break;
+		if (cw_tvdiff_ms(tv, cw_tvnow()) <= 0) {
+			pool->timeouts++;
+			cw_mutex_unlock(&pool->lock);
+			cw_log(LOG_WARNING, "res_odbc: All %d connections to %s are busy\n", pool->size, pool->name);
+			return NULL;
+		}
+		pool->waited++;
+		cw_cond_timedwait(&pool->freed, &pool->lock, &ts);
+	}
+	obj->used = 1;
+	obj->owner = pthread_self();
+	obj->depth = 0;
+	cw_mutex_unlock(&pool->lock);
+	return obj;
+}
+
+odbc_obj *odbc_request_obj(const char *name, int check)
+{
+	odbc_pool *pool;
+	odbc_obj *obj;
+
+	if (!(pool = odbc_read(ODBC_REGISTRY, name)))
+		return NULL;
+	if (!(obj = odbc_pool_take(pool)))
+		return NULL;
+
+	/* Connecting and checking are done on our own connection, so other
+	   users of the DSN don't wait for them. A shared one is left to the
+	   outer request */
+	if (!obj->depth) {
+		if (!obj->up)
+			odbc_obj_connect(obj);
+		else if (check || (pool->idle_check && time(NULL) - obj->last_used >= pool->idle_check))
+			odbc_sanity_check(obj);
+	}
+
+	if (!obj->up) {
+		odbc_release_obj(obj);
+		return NULL;
+	}
+	return obj;
+}
+
+void odbc_release_obj(odbc_obj *obj)
+{
+	odbc_pool *pool = obj->pool;
+	struct odbc_prepared *p;
+
+	/* Only the owner touches depth, and the outermost release hands it back */
+	if (obj->depth) {
+		obj->depth--;
+		return;
+	}
+	if (obj->up) {
+		/* Ready the statements for the next user */
+		for (p = obj->prepared; p; p = p->next) {
+			if (p->used) {
+				SQLFreeStmt(p->stmt, SQL_CLOSE);
+				SQLFreeStmt(p->stmt, SQL_UNBIND);
+				SQLFreeStmt(p->stmt, SQL_RESET_PARAMS);
+				p->used = 0;
+			}
+		}
+	} else if (obj->con != SQL_NULL_HANDLE) {
+		/* Lost, so drop what is left and let the next user reconnect */
+		odbc_obj_disconnect(obj);
+	}
+
+	cw_mutex_lock(&pool->lock);
+	obj->used = 0;
+	obj->last_used = time(NULL);
+	cw_cond_signal(&pool->freed);
+	cw_mutex_unlock(&pool->lock);
+}
+
 static int load_odbc_config(void)
 {
 	static char *cfg = "res_odbc.conf";
@@ -187,8 +434,10 @@ static int load_odbc_config(void)
 	char *cat, *dsn, *username, *password;
 	int enabled;
 	int connect = 0;
+	int size, wait, idle_check, max_backoff, cache_size;
 	char *env_var;
 
+	odbc_pool *pool;
 	odbc_obj *obj;
 
 	config = cw_config_load(cfg);
@@ -211,6 +460,11 @@ static int load_odbc_config(void)
 			dsn = username = password = NULL;
 			enabled = 1;
 			connect = 0;
+			size = ODBC_POOL_SIZE;
+			wait = ODBC_POOL_WAIT;
+			idle_check = ODBC_IDLE_CHECK;
+			max_backoff = ODBC_MAX_BACKOFF;
+			cache_size = ODBC_STMT_CACHE;
 			for (v = cw_variable_browse(config, cat); v; v = v->next) {
 				if (!strcmp(v->name, "enabled"))
 					enabled = cw_true(v->value);
@@ -222,15 +476,30 @@ static int load_odbc_config(void)
 					username = v->value;
 				if (!strcmp(v->name, "password"))
 					password = v->value;
+				if (!strcmp(v->name, "pool-size") && (size = atoi(v->value)) < 1)
+					size = 1;
+				if (!strcmp(v->name, "pool-wait") && (wait = atoi(v->value)) < 0)
+					wait = 0;
+				if (!strcmp(v->name, "idle-check") && (idle_check = atoi(v->value)) < 0)
+					idle_check = 0;
+				if (!strcmp(v->name, "max-backoff") && (max_backoff = atoi(v->value)) < 1)
+					max_backoff = 1;
+				if (!strcmp(v->name, "statement-cache") && (cache_size = atoi(v->value)) < 1)
+					cache_size = 1;
 			}
 
 			if (enabled && dsn) {
-				obj = new_odbc_obj(cat, dsn, username, password);
-				if (obj) {
-					register_odbc_obj(cat, obj);
-					cw_log(LOG_NOTICE, "registered database handle '%s' dsn->[%s]\n", cat, obj->dsn);
-					if (connect) {
-						odbc_obj_connect(obj);
+				pool = new_odbc_pool(cat, dsn, username, password);
+				if (pool) {
+					pool->size = size;
+					pool->wait = wait;
+					pool->idle_check = idle_check;
+					pool->max_backoff = max_backoff;
+					pool->cache_size = cache_size;
+					register_odbc_pool(cat, pool);
+					cw_log(LOG_NOTICE, "registered database handle '%s' dsn->[%s], %d connection(s)\n", cat, pool->dsn, pool->size);
+					if (connect && (obj = odbc_request_obj(cat, 0))) {
+						odbc_release_obj(obj);
 					}
 				} else {
 					cw_log(LOG_WARNING, "Addition of obj %s failed.\n", cat);
@@ -243,11 +512,50 @@ static int load_odbc_config(void)
 	return 0;
 }
 
-int odbc_dump_fd(int fd, odbc_obj *obj)
+static int odbc_dump_fd(int fd, odbc_pool *pool)
 {
-	/* make sure the connection is up before we lie to our master.*/
-	odbc_sanity_check(obj);
-	cw_cli(fd, "Name: %s\nDSN: %s\nConnected: %s\n\n", obj->name, obj->dsn, obj->up ? "yes" : "no");
+	odbc_obj *obj;
+	time_t start;
+	int up, busy, wait;
+
+	/* make sure the idle connections are up before we lie to our master.*/
+	start = time(NULL);
+	for (;;) {
+		cw_mutex_lock(&pool->lock);
+		for (obj = pool->objs; obj; obj = obj->next) {
+			if (!obj->used && obj->up && obj->last_used < start)
+				break;
+		}
+		if (obj) {
+			obj->used = 1;
+			obj->owner = pthread_self();
+			obj->depth = 0;
+		}
+		cw_mutex_unlock(&pool->lock);
+		if (!obj)
+			break;
+		/* Handing it back marks it as checked */
+		odbc_sanity_check(obj);
+		odbc_release_obj(obj);
+	}
+
+	cw_mutex_lock(&pool->lock);
+	up = busy = 0;
+	for (obj = pool->objs; obj; obj = obj->next) {
+		if (obj->up)
+			up++;
+		if (obj->used)
+			busy++;
+	}
+	wait = (pool->retry > time(NULL)) ? (int) (pool->retry - time(NULL)) : 0;
+	cw_cli(fd, "Name: %s\nDSN: %s\nConnected: %s\nConnections: %d up, %d in use, %d at most\n"
+		"Requests: %ld, %ld waited, %ld timed out\n",
+		pool->name, pool->dsn, up ? "yes" : "no", up, busy, pool->size,
+		pool->requests, pool->waited, pool->timeouts);
+	if (wait)
+		cw_cli(fd, "Reconnecting in: %d s\n", wait);
+	cw_cli(fd, "\n");
+	cw_mutex_unlock(&pool->lock);
 	return 0;
 }
 
@@ -265,7 +573,7 @@ static int odbc_disconnect_usage(int fd)
 
 static int odbc_show_command(int fd, int argc, char **argv)
 {
-	odbc_obj *obj;
+	odbc_pool *pool;
 	int x = 0;
 	
 	if (!strcmp(argv[1], "show")) {
@@ -273,13 +581,13 @@ static int odbc_show_command(int fd, int argc, char **argv)
 			for (x = 0; x < MAX_ODBC_HANDLES; x++) {
 				if (!ODBC_REGISTRY[x].used)
 					break;
-				if (ODBC_REGISTRY[x].obj)
-					odbc_dump_fd(fd, ODBC_REGISTRY[x].obj);
+				if (ODBC_REGISTRY[x].pool)
+					odbc_dump_fd(fd, ODBC_REGISTRY[x].pool);
 			}
 		} else {
-			obj = odbc_read(ODBC_REGISTRY, argv[2]);
-			if (obj)
-				odbc_dump_fd(fd, obj);
+			pool = odbc_read(ODBC_REGISTRY, argv[2]);
+			if (pool)
+				odbc_dump_fd(fd, pool);
 		}
 	}
 	return 0;
@@ -287,14 +595,21 @@ static int odbc_show_command(int fd, int argc, char **argv)
 
 static int odbc_disconnect_command(int fd, int argc, char **argv)
 {
+	odbc_pool *pool;
 	odbc_obj *obj;
 	if (!strcmp(argv[1], "disconnect")) {
 		if (!argv[2])
 			return odbc_disconnect_usage(fd);
 
-		obj = odbc_read(ODBC_REGISTRY, argv[2]);
-		if (obj) {
-			odbc_obj_disconnect(obj);
+		pool = odbc_read(ODBC_REGISTRY, argv[2]);
+		if (pool) {
+			/* Connections in use are left to their users */
+			cw_mutex_lock(&pool->lock);
+			for (obj = pool->objs; obj; obj = obj->next) {
+				if (!obj->used && obj->con != SQL_NULL_HANDLE)
+					odbc_obj_disconnect(obj);
+			}
+			cw_mutex_unlock(&pool->lock);
 		}
 	} 
 	return 0;
@@ -302,6 +617,7 @@ static int odbc_disconnect_command(int fd, int argc, char **argv)
 
 static int odbc_connect_command(int fd, int argc, char **argv)
 {
+	odbc_pool *pool;
 	odbc_obj *obj;
 	if (!argv[1])
 		return odbc_connect_usage(fd);
@@ -310,9 +626,15 @@ static int odbc_connect_command(int fd, int argc, char **argv)
 		if (!argv[2])
 			return odbc_connect_usage(fd);
 
-		obj = odbc_read(ODBC_REGISTRY, argv[2]);
-		if (obj) {
-			odbc_obj_connect(obj);
+		pool = odbc_read(ODBC_REGISTRY, argv[2]);
+		if (pool) {
+			cw_mutex_lock(&pool->lock);
+			pool->retry = 0;
+			cw_mutex_unlock(&pool->lock);
+			if ((obj = odbc_request_obj(argv[2], 1)))
+				odbc_release_obj(obj);
+			else
+				cw_cli(fd, "Unable to connect to %s\n", argv[2]);
 		}
 	}
 	return 0;
@@ -321,11 +643,11 @@ static int odbc_connect_command(int fd, int argc, char **argv)
 
 static char connect_usage[] =
 "Usage: odbc connect <DSN>\n"
-"       Connect to ODBC DSN\n";
+"       Connect to ODBC DSN, without waiting out any reconnect backoff\n";
 
 static char disconnect_usage[] =
-"Usage: odbc connect <DSN>\n"
-"       Disconnect from ODBC DSN\n";
+"Usage: odbc disconnect <DSN>\n"
+"       Disconnect the idle connections to ODBC DSN\n";
 
 static char show_usage[] =
 "Usage: odbc show {DSN}\n"
@@ -344,168 +666,180 @@ static struct cw_cli_entry odbc_show_struct =
 
 /* api calls */
 
-int register_odbc_obj(char *name, odbc_obj *obj)
+static int register_odbc_pool(char *name, odbc_pool *pool)
 {
-	if (obj != NULL)
-		return odbc_write(ODBC_REGISTRY, name, obj);
+	if (pool != NULL)
+		return odbc_write(ODBC_REGISTRY, name, pool);
 	return 0;
 }
 
-odbc_obj *fetch_odbc_obj(const char *name, int check)
+static odbc_pool *new_odbc_pool(char *name, char *dsn, char *username, char *password)
 {
-	odbc_obj *obj = NULL;
-	if((obj = (odbc_obj *) odbc_read(ODBC_REGISTRY, name))) {
-		if(check)
-			odbc_sanity_check(obj);
-	}
-	return obj;
-}
-
-odbc_obj *new_odbc_obj(char *name, char *dsn, char *username, char *password)
-{
-	static odbc_obj *new;
+	odbc_pool *new;
 
-	new = malloc(sizeof(odbc_obj));
+	new = malloc(sizeof(odbc_pool));
 	if (!new)
 		return NULL;
-	memset(new, 0, sizeof(odbc_obj));
+	memset(new, 0, sizeof(odbc_pool));
 	new->env = SQL_NULL_HANDLE;
 
-	new->name = malloc(strlen(name) + 1);
-	if (new->name == NULL)
+	if (!(new->name = strdup(name))
+		|| !(new->dsn = strdup(dsn))
+		|| (username && !(new->username = strdup(username)))
+		|| (password && !(new->password = strdup(password)))) {
+		free(new->name);
+		free(new->dsn);
+		free(new->username);
+		free(new);
 		return NULL;
-
-	new->dsn = malloc(strlen(dsn) + 1);
-	if (new->dsn == NULL)
-		return NULL;
-
-	if (username) {
-		new->username = malloc(strlen(username) + 1);
-		if (new->username == NULL)
-			return NULL;
-		strcpy(new->username, username);
 	}
 
-	if (password) {
-		new->password = malloc(strlen(password) + 1);
-		if (new->password == NULL)
-			return NULL;
-		strcpy(new->password, password);
-	}
-
-	strcpy(new->name, name);
-	strcpy(new->dsn, dsn);
-	new->up = 0;
+	new->size = ODBC_POOL_SIZE;
+	new->wait = ODBC_POOL_WAIT;
+	new->idle_check = ODBC_IDLE_CHECK;
+	new->max_backoff = ODBC_MAX_BACKOFF;
+	new->cache_size = ODBC_STMT_CACHE;
 	cw_mutex_init(&new->lock);
+	cw_cond_init(&new->freed, NULL);
 	return new;
 }
 
-void destroy_odbc_obj(odbc_obj **obj)
+/* Nothing may be using the pool any more */
+static void destroy_odbc_pool(odbc_pool *pool)
 {
-	odbc_obj_disconnect(*obj);
-
-	cw_mutex_lock(&(*obj)->lock);
-	SQLFreeHandle(SQL_HANDLE_STMT, (*obj)->stmt);
-	SQLFreeHandle(SQL_HANDLE_DBC, (*obj)->con);
-	SQLFreeHandle(SQL_HANDLE_ENV, (*obj)->env);
+	odbc_obj *obj;
 
-	free((*obj)->name);
-	free((*obj)->dsn);
-	if ((*obj)->username)
-		free((*obj)->username);
-	if ((*obj)->password)
-		free((*obj)->password);
-	cw_mutex_unlock(&(*obj)->lock);
-	cw_mutex_destroy(&(*obj)->lock);
-	free(*obj);
+	while ((obj = pool->objs)) {
+		pool->objs = obj->next;
+		if (obj->con != SQL_NULL_HANDLE)
+			odbc_obj_disconnect(obj);
+		free(obj);
+	}
+	if (pool->env != SQL_NULL_HANDLE)
+		SQLFreeHandle(SQL_HANDLE_ENV, pool->env);
+
+	free(pool->name);
+	free(pool->dsn);
+	if (pool->username)
+		free(pool->username);
+	if (pool->password)
+		free(pool->password);
+	cw_cond_destroy(&pool->freed);
+	cw_mutex_destroy(&pool->lock);
+	free(pool);
 }
 
 odbc_status odbc_obj_disconnect(odbc_obj *obj)
 {
 	int res;
-	cw_mutex_lock(&obj->lock);
 
+	odbc_prepared_free(obj);
 	res = SQLDisconnect(obj->con);
 
 
 	if (res == ODBC_SUCCESS) {
-		cw_log(LOG_WARNING, "res_odbc: disconnected %d from %s [%s]\n", res, obj->name, obj->dsn);
+		cw_log(LOG_WARNING, "res_odbc: disconnected %d from %s [%s]\n", res, obj->pool->name, obj->pool->dsn);
 	} else {
 		cw_log(LOG_WARNING, "res_odbc: %s [%s] already disconnected\n",
-		obj->name, obj->dsn);
+		obj->pool->name, obj->pool->dsn);
 	}
+	SQLFreeHandle(SQL_HANDLE_DBC, obj->con);
+	obj->con = SQL_NULL_HANDLE;
 	obj->up = 0;
-	cw_mutex_unlock(&obj->lock);
 	return ODBC_SUCCESS;
 }
 
 odbc_status odbc_obj_connect(odbc_obj *obj)
 {
+	odbc_pool *pool = obj->pool;
 	int res;
 	SQLINTEGER err;
 	short int mlen;
 	char msg[200], stat[10];
 
-	cw_mutex_lock(&obj->lock);
+	cw_mutex_lock(&pool->lock);
 
-	if (obj->env == SQL_NULL_HANDLE) {
-		res = SQLAllocHandle(SQL_HANDLE_ENV, SQL_NULL_HANDLE, &obj->env);
+	if (pool->retry > time(NULL)) {
+		/* Backing off after a failure. Fail now rather than hold
+		   the caller up on another login timeout. */
+		cw_mutex_unlock(&pool->lock);
+		return ODBC_FAIL;
+	}
+
+	if (pool->env == SQL_NULL_HANDLE) {
+		res = SQLAllocHandle(SQL_HANDLE_ENV, SQL_NULL_HANDLE, &pool->env);
 
 		if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 			if (option_verbose > 3)
 				cw_log(LOG_WARNING, "res_odbc: Error AllocHandle\n");
-			cw_mutex_unlock(&obj->lock);
+			pool->env = SQL_NULL_HANDLE;
+			cw_mutex_unlock(&pool->lock);
 			return ODBC_FAIL;
 		}
 
-		res = SQLSetEnvAttr(obj->env, SQL_ATTR_ODBC_VERSION, (void *) SQL_OV_ODBC3, 0);
+		res = SQLSetEnvAttr(pool->env, SQL_ATTR_ODBC_VERSION, (void *) SQL_OV_ODBC3, 0);
 
 		if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 			if (option_verbose > 3)
 				cw_log(LOG_WARNING, "res_odbc: Error SetEnv\n");
-			SQLFreeHandle(SQL_HANDLE_ENV, obj->env);
-			cw_mutex_unlock(&obj->lock);
+			SQLFreeHandle(SQL_HANDLE_ENV, pool->env);
+			pool->env = SQL_NULL_HANDLE;
+			cw_mutex_unlock(&pool->lock);
 			return ODBC_FAIL;
 		}
+	}
+	cw_mutex_unlock(&pool->lock);
 
-		res = SQLAllocHandle(SQL_HANDLE_DBC, obj->env, &obj->con);
+	if(obj->up) {
+		odbc_obj_disconnect(obj);
+		cw_log(LOG_NOTICE,"Re-connecting %s\n", pool->name);
+	} else if (obj->con != SQL_NULL_HANDLE) {
+		/* Lost; drop what is left of it */
+		odbc_obj_disconnect(obj);
+	}
 
-		if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
+	res = SQLAllocHandle(SQL_HANDLE_DBC, pool->env, &obj->con);
 
-			if (option_verbose > 3)
-				cw_log(LOG_WARNING, "res_odbc: Error AllocHDB %d\n", res);
-			SQLFreeHandle(SQL_HANDLE_ENV, obj->env);
+	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 
-			cw_mutex_unlock(&obj->lock);
-			return ODBC_FAIL;
-		}
-		SQLSetConnectAttr(obj->con, SQL_LOGIN_TIMEOUT, (SQLPOINTER *) 10, 0);
-	}
-	if(obj->up) {
-		odbc_obj_disconnect(obj);
-		cw_log(LOG_NOTICE,"Re-connecting %s\n", obj->name);
+		if (option_verbose > 3)
+			cw_log(LOG_WARNING, "res_odbc: Error AllocHDB %d\n", res);
+		obj->con = SQL_NULL_HANDLE;
+		return ODBC_FAIL;
 	}
+	SQLSetConnectAttr(obj->con, SQL_LOGIN_TIMEOUT, (SQLPOINTER *) 10, 0);
 
-	cw_log(LOG_NOTICE, "Connecting %s\n", obj->name);
+	cw_log(LOG_NOTICE, "Connecting %s\n", pool->name);
 
 	res = SQLConnect(obj->con,
-		   (SQLCHAR *) obj->dsn, SQL_NTS,
-		   (SQLCHAR *) obj->username, SQL_NTS,
-		   (SQLCHAR *) obj->password, SQL_NTS);
+		   (SQLCHAR *) pool->dsn, SQL_NTS,
+		   (SQLCHAR *) pool->username, SQL_NTS,
+		   (SQLCHAR *) pool->password, SQL_NTS);
 
 	if ((res != SQL_SUCCESS) && (res != SQL_SUCCESS_WITH_INFO)) {
 		SQLGetDiagRec(SQL_HANDLE_DBC, obj->con, 1, (unsigned char *) stat, &err, (unsigned char *) msg, 100, &mlen);
-		SQLFreeHandle(SQL_HANDLE_ENV, obj->env);
-		cw_mutex_unlock(&obj->lock);
-		cw_log(LOG_WARNING, "res_odbc: Error SQLConnect=%d errno=%d %s\n", res, (int)err, msg);
+		SQLFreeHandle(SQL_HANDLE_DBC, obj->con);
+		obj->con = SQL_NULL_HANDLE;
+
+		/* Back off, doubling each time, before anyone tries again */
+		cw_mutex_lock(&pool->lock);
+		pool->backoff = pool->backoff ? pool->backoff * 2 : 1;
+		if (pool->backoff > pool->max_backoff)
+			pool->backoff = pool->max_backoff;
+		pool->retry = time(NULL) + pool->backoff;
+		cw_mutex_unlock(&pool->lock);
+		cw_log(LOG_WARNING, "res_odbc: Error SQLConnect=%d errno=%d %s, retrying in %d s\n", res, (int)err, msg, pool->backoff);
 		return ODBC_FAIL;
 	} else {
 
-		cw_log(LOG_NOTICE, "res_odbc: Connected to %s [%s]\n", obj->name, obj->dsn);
+		cw_log(LOG_NOTICE, "res_odbc: Connected to %s [%s]\n", pool->name, pool->dsn);
 		obj->up = 1;
 	}
 
-	cw_mutex_unlock(&obj->lock);
+	cw_mutex_lock(&pool->lock);
+	pool->backoff = 0;
+	pool->retry = 0;
+	cw_mutex_unlock(&pool->lock);
 	return ODBC_SUCCESS;
 }
 
@@ -66,6 +66,7 @@ CALLWEAVER_FILE_VERSION("$HeadURL: https://svn.callweaver.org/callweaver/branche
 #include "callweaver/lock.h"
 #include "callweaver/strings.h"
 #include "callweaver/ogi.h"
+#include "callweaver/config.h"
 
 #define MAX_ARGS 128
 #define MAX_COMMANDS 128
@@ -135,42 +136,183 @@ static void ogi_debug_cli(int fd, char *fmt, ...)
 	}
 }
 
-/* launch_netscript: The fastogi handler.
-	FastOGI defaults to port 4573 */
-static int launch_netscript(char *ogiurl, char *argv[], int *fds, int *efd, int *opid)
-{
-	int s;
-	int flags;
-	struct pollfd pfds[1];
-	char *host;
-	char *c; int port = OGI_PORT;
-	char *script="";
+/*
+ * FastOGI connection pool.
+ *
+ * An ogi:// URL may name several servers, e.g. ogi://a:4573,b/script.
+ * Each server is a backend with a cached address and a stack of idle
+ * connections. When keep-alive is enabled we tell the server with an
+ * "ogi_network_keepalive: yes" header that it may end the session by
+ * sending "END SESSION" instead of closing the socket. Connections whose
+ * session ended that way are put back in the pool for the next call.
+ */
+#define OGI_POOL_MAX_IDLE		64
+#define OGI_POOL_MAX_BACKENDS	16
+#define OGI_POOL_MAX_BACKOFF	60
+
+#define OGI_BALANCE_ROUNDROBIN		0
+#define OGI_BALANCE_LEASTOUTSTANDING	1
+
+struct ogi_backend {
+	struct ogi_backend *next;
+	char host[MAXHOSTNAMELEN];
+	int port;
 	struct sockaddr_in sin;
-	struct hostent *hp;
-	struct cw_hostent ahp;
+	time_t resolved;		/* When sin was looked up, 0 if never */
+	time_t down_until;		/* Don't connect before this after failures */
+	int failures;			/* Consecutive connect failures */
+	int outstanding;		/* Sessions currently running */
+	int nidle;
+	int idle[OGI_POOL_MAX_IDLE];
+	time_t idle_since[OGI_POOL_MAX_IDLE];
+	unsigned long connects;
+	unsigned long reuses;
+	unsigned long errors;
+};
 
-	host = cw_strdupa(ogiurl + 6);	/* Remove ogi:// */
+struct ogi_pool {
+	struct ogi_pool *next;
+	int nbackends;
+	struct ogi_backend *backends[OGI_POOL_MAX_BACKENDS];
+	unsigned int rr;
+	unsigned long sessions;
+	char hostlist[1];
+};
 
-	/* Strip off any script name */
-	if ((c = strchr(host, '/'))) {
-		*c = '\0';
-		c++;
-		script = c;
-	}
+struct ogi_conn {
+	struct ogi_backend *backend;
+	int fd;
+};
+
+CW_MUTEX_DEFINE_STATIC(poollock);
+static struct ogi_backend *backends = NULL;
+static struct ogi_pool *pools = NULL;
+
+static int pool_keepalive = 1;
+static int pool_balance = OGI_BALANCE_ROUNDROBIN;
+static int pool_maxidle = 8;
+static int pool_idletimeout = 60;
+static int pool_dnscache = 300;
+static int pool_connecttimeout = MAX_OGI_CONNECT;
+
+/* Must be called with poollock held */
+static struct ogi_backend *ogi_backend_get(const char *hostport)
+{
+	struct ogi_backend *b;
+	char host[MAXHOSTNAMELEN];
+	char *c;
+	int port = OGI_PORT;
+
+	cw_copy_string(host, hostport, sizeof(host));
 	if ((c = strchr(host, ':'))) {
-		*c = '\0';
-		c++;
+		*c++ = '\0';
 		port = atoi(c);
 	}
-	if (efd) {
-		cw_log(LOG_WARNING, "OGI URI's don't support Enhanced OGI yet\n");
-		return -1;
+	for (b = backends;  b;  b = b->next) {
+		if (b->port == port && !strcasecmp(b->host, host))
+			return b;
+	}
+	if ((b = calloc(1, sizeof(*b))) == NULL)
+		return NULL;
+	cw_copy_string(b->host, host, sizeof(b->host));
+	b->port = port;
+	b->next = backends;
+	backends = b;
+	return b;
+}
+
+/* Must be called with poollock held */
+static struct ogi_pool *ogi_pool_get(const char *hostlist)
+{
+	struct ogi_pool *p;
+	struct ogi_backend *b;
+	char *tmp;
+	char *cur;
+
+	for (p = pools;  p;  p = p->next) {
+		if (!strcasecmp(p->hostlist, hostlist))
+			return p;
 	}
-	hp = cw_gethostbyname(host, &ahp);
-	if (!hp) {
-		cw_log(LOG_WARNING, "Unable to locate host '%s'\n", host);
-		return -1;
+	if ((p = calloc(1, sizeof(*p) + strlen(hostlist))) == NULL)
+		return NULL;
+	strcpy(p->hostlist, hostlist);
+	tmp = cw_strdupa(hostlist);
+	while ((cur = strsep(&tmp, ","))  &&  p->nbackends < OGI_POOL_MAX_BACKENDS) {
+		if (cw_strlen_zero(cur))
+			continue;
+		if ((b = ogi_backend_get(cur)))
+			p->backends[p->nbackends++] = b;
+	}
+	if (p->nbackends == 0) {
+		free(p);
+		return NULL;
+	}
+	p->next = pools;
+	pools = p;
+	return p;
+}
+
+/* Must be called with poollock held.  Returns an idle connection that still
+   looks healthy, or -1. Stale and dead connections are closed on the way. */
+static int ogi_backend_idle(struct ogi_backend *b, time_t now)
+{
+	struct pollfd pfd;
+	int fd;
+
+	while (b->nidle > 0) {
+		b->nidle--;
+		fd = b->idle[b->nidle];
+		if (now - b->idle_since[b->nidle] > pool_idletimeout) {
+			close(fd);
+			continue;
+		}
+		/* An idle connection must have nothing to say. Readable means the
+		   server closed it or is out of step with us. */
+		pfd.fd = fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) != 0) {
+			close(fd);
+			continue;
+		}
+		return fd;
 	}
+	return -1;
+}
+
+static int ogi_backend_connect(struct ogi_backend *b)
+{
+	struct sockaddr_in sin;
+	struct pollfd pfds[1];
+	struct hostent *hp;
+	struct cw_hostent ahp;
+	char host[MAXHOSTNAMELEN];
+	time_t now;
+	int flags;
+	int s;
+
+	time(&now);
+	cw_mutex_lock(&poollock);
+	if (b->resolved  &&  now - b->resolved < pool_dnscache) {
+		sin = b->sin;
+		cw_mutex_unlock(&poollock);
+	} else {
+		cw_copy_string(host, b->host, sizeof(host));
+		cw_mutex_unlock(&poollock);
+		if ((hp = cw_gethostbyname(host, &ahp)) == NULL) {
+			cw_log(LOG_WARNING, "Unable to locate host '%s'\n", host);
+			return -1;
+		}
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(b->port);
+		memcpy(&sin.sin_addr, hp->h_addr, sizeof(sin.sin_addr));
+		cw_mutex_lock(&poollock);
+		b->sin = sin;
+		b->resolved = now;
+		cw_mutex_unlock(&poollock);
+	}
+
 	s = socket(AF_INET, SOCK_STREAM, 0);
 	if (s < 0) {
 		cw_log(LOG_WARNING, "Unable to create socket: %s\n", strerror(errno));
@@ -187,10 +329,6 @@ static int launch_netscript(char *ogiurl, char *argv[], int *fds, int *efd, int
 		close(s);
 		return -1;
 	}
-	memset(&sin, 0, sizeof(sin));
-	sin.sin_family = AF_INET;
-	sin.sin_port = htons(port);
-	memcpy(&sin.sin_addr, hp->h_addr, sizeof(sin.sin_addr));
 	if (connect(s, (struct sockaddr *)&sin, sizeof(sin)) && (errno != EINPROGRESS)) {
 		cw_log(LOG_WARNING, "Connect failed with unexpected error: %s\n", strerror(errno));
 		close(s);
@@ -198,42 +336,190 @@ static int launch_netscript(char *ogiurl, char *argv[], int *fds, int *efd, int
 	}
 	pfds[0].fd = s;
 	pfds[0].events = POLLOUT;
-	if (poll(pfds, 1, MAX_OGI_CONNECT) != 1) {
-		cw_log(LOG_WARNING, "Connect to '%s' failed!\n", ogiurl);
+	if (poll(pfds, 1, pool_connecttimeout) != 1) {
+		cw_log(LOG_WARNING, "Connect to '%s:%d' failed!\n", b->host, b->port);
 		close(s);
 		return -1;
 	}
-	if (write(s, "ogi_network: yes\n", strlen("ogi_network: yes\n")) < 0) {
+	return s;
+}
+
+/* Must be called with poollock held */
+static struct ogi_backend *ogi_pool_pick(struct ogi_pool *p, int *tried, time_t now)
+{
+	struct ogi_backend *b;
+	struct ogi_backend *best = NULL;
+	int x;
+	int i;
+
+	for (x = 0;  x < p->nbackends;  x++) {
+		i = (p->rr + x) % p->nbackends;
+		b = p->backends[i];
+		if (tried[i]  ||  b->down_until > now)
+			continue;
+		if (pool_balance == OGI_BALANCE_ROUNDROBIN) {
+			p->rr = i + 1;
+			tried[i] = 1;
+			return b;
+		}
+		if (best == NULL  ||  b->outstanding < best->outstanding)
+			best = b;
+	}
+	if (best) {
+		for (i = 0;  p->backends[i] != best;  i++)
+			;
+		tried[i] = 1;
+		p->rr = i + 1;
+	}
+	return best;
+}
+
+/* Get a connection to one of the servers listed in hostlist */
+static int ogi_pool_acquire(const char *hostlist, struct ogi_conn *conn)
+{
+	struct ogi_pool *p;
+	struct ogi_backend *b;
+	int tried[OGI_POOL_MAX_BACKENDS];
+	int backoff;
+	time_t now;
+	int fd;
+
+	memset(tried, 0, sizeof(tried));
+	cw_mutex_lock(&poollock);
+	if ((p = ogi_pool_get(hostlist)) == NULL) {
+		cw_mutex_unlock(&poollock);
+		return -1;
+	}
+	for (;;) {
+		time(&now);
+		if ((b = ogi_pool_pick(p, tried, now)) == NULL)
+			break;
+		if ((fd = ogi_backend_idle(b, now)) > -1) {
+			b->reuses++;
+		} else {
+			cw_mutex_unlock(&poollock);
+			fd = ogi_backend_connect(b);
+			cw_mutex_lock(&poollock);
+			if (fd < 0) {
+				/* Back off exponentially so a dead server costs no connect timeouts */
+				b->errors++;
+				b->failures++;
+				backoff = (b->failures < 6)  ?  (1 << b->failures)  :  OGI_POOL_MAX_BACKOFF;
+				if (backoff > OGI_POOL_MAX_BACKOFF)
+					backoff = OGI_POOL_MAX_BACKOFF;
+				b->down_until = now + backoff;
+				continue;
+			}
+			b->connects++;
+		}
+		b->failures = 0;
+		b->down_until = 0;
+		b->outstanding++;
+		p->sessions++;
+		cw_mutex_unlock(&poollock);
+		conn->backend = b;
+		conn->fd = fd;
+		return 0;
+	}
+	cw_mutex_unlock(&poollock);
+	cw_log(LOG_WARNING, "No FastOGI server available in '%s'\n", hostlist);
+	return -1;
+}
+
+/* Hand a connection back. Only connections whose session the server ended
+   cleanly are kept for reuse. */
+static void ogi_pool_release(struct ogi_conn *conn, int reusable)
+{
+	struct ogi_backend *b = conn->backend;
+
+	cw_mutex_lock(&poollock);
+	b->outstanding--;
+	if (reusable  &&  pool_keepalive  &&  b->nidle < pool_maxidle  &&  b->nidle < OGI_POOL_MAX_IDLE) {
+		b->idle[b->nidle] = conn->fd;
+		time(&b->idle_since[b->nidle]);
+		b->nidle++;
+		conn->fd = -1;
+	}
+	cw_mutex_unlock(&poollock);
+	if (conn->fd > -1)
+		close(conn->fd);
+	conn->fd = -1;
+	conn->backend = NULL;
+}
+
+static void ogi_pool_destroy(void)
+{
+	struct ogi_backend *b;
+	struct ogi_pool *p;
+
+	cw_mutex_lock(&poollock);
+	while ((p = pools)) {
+		pools = p->next;
+		free(p);
+	}
+	while ((b = backends)) {
+		backends = b->next;
+		while (b->nidle > 0)
+			close(b->idle[--b->nidle]);
+		free(b);
+	}
+	cw_mutex_unlock(&poollock);
+}
+
+/* launch_netscript: The fastogi handler.
+	FastOGI defaults to port 4573 */
+static int launch_netscript(char *ogiurl, char *argv[], int *fds, int *efd, int *opid, struct ogi_conn *conn)
+{
+	char *host;
+	char *c;
+	char *script="";
+
+	host = cw_strdupa(ogiurl + 6);	/* Remove ogi:// */
+
+	/* Strip off any script name */
+	if ((c = strchr(host, '/'))) {
+		*c = '\0';
+		c++;
+		script = c;
+	}
+	if (efd) {
+		cw_log(LOG_WARNING, "OGI URI's don't support Enhanced OGI yet\n");
+		return -1;
+	}
+	if (ogi_pool_acquire(host, conn))
+		return -1;
+	if (write(conn->fd, "ogi_network: yes\n", strlen("ogi_network: yes\n")) < 0) {
 		cw_log(LOG_WARNING, "Connect to '%s' failed: %s\n", ogiurl, strerror(errno));
-		close(s);
+		ogi_pool_release(conn, 0);
 		return -1;
 	}
+	if (pool_keepalive)
+		fdprintf(conn->fd, "ogi_network_keepalive: yes\n");
 
 	/* If we have a script parameter, relay it to the fastogi server */
 	if (!cw_strlen_zero(script))
-		fdprintf(s, "ogi_network_script: %s\n", script);
+		fdprintf(conn->fd, "ogi_network_script: %s\n", script);
 
 	if (option_debug > 3)
 		cw_log(LOG_DEBUG, "Wow, connected!\n");
-	fds[0] = s;
-	fds[1] = s;
+	fds[0] = conn->fd;
+	fds[1] = conn->fd;
 	*opid = -1;
 	return 0;
 }
 
-static int launch_script(char *script, char *argv[], int *fds, int *efd, int *opid)
+static int launch_script(char *script, char *argv[], int *fds, int *efd, int *opid, struct ogi_conn *conn)
 {
 	char tmp[256];
 	int pid;
 	int toast[2];
 	int fromast[2];
 	int audio[2];
-	int x;
+	int cfds[4];
 	int res;
-	sigset_t signal_set;
 	
 	if (!strncasecmp(script, "ogi://", 6))
-		return launch_netscript(script, argv, fds, efd, opid);
+		return launch_netscript(script, argv, fds, efd, opid, conn);
 	
 	if (script[0] != '/') {
 		snprintf(tmp, sizeof(tmp), "%s/%s", (char *)cw_config_CW_OGI_DIR, script);
@@ -277,39 +563,23 @@ static int launch_script(char *script, char *argv[], int *fds, int *efd, int *op
 			return -1;
 		}
 	}
-	pid = fork();
+	/* Redirect stdin and out, provide enhanced audio channel if desired */
+	cfds[0] = fromast[0];
+	cfds[1] = toast[1];
+	cfds[2] = STDERR_FILENO;
+	cfds[3] = efd  ?  audio[0]  :  -1;
+	pid = cw_spawn(script, argv, cfds, 4, NULL);
 	if (pid < 0) {
-		cw_log(LOG_WARNING, "Failed to fork(): %s\n", strerror(errno));
-		return -1;
-	}
-	if (!pid) {
-		/* Don't run OGI scripts with realtime priority -- it causes audio stutter */
-		cw_set_priority(0);
-
-		/* Redirect stdin and out, provide enhanced audio channel if desired */
-		dup2(fromast[0], STDIN_FILENO);
-		dup2(toast[1], STDOUT_FILENO);
+		cw_log(LOG_WARNING, "Failed to launch OGI script %s\n", script);
+		close(fromast[0]);
+		close(fromast[1]);
+		close(toast[0]);
+		close(toast[1]);
 		if (efd) {
-			dup2(audio[0], STDERR_FILENO + 1);
-		} else {
-			close(STDERR_FILENO + 1);
-		}
-		
-		/* unblock important signal handlers */
-		if (sigfillset(&signal_set) || pthread_sigmask(SIG_UNBLOCK, &signal_set, NULL)) {
-			cw_log(LOG_WARNING, "unable to unblock signals for OGI script: %s\n", strerror(errno));
-			exit(1);
+			close(audio[0]);
+			close(audio[1]);
 		}
-
-		/* Close everything but stdin/out/error */
-		for (x=STDERR_FILENO + 2;x<1024;x++) 
-			close(x);
-
-		/* Execute script */
-		execv(script, argv);
-		/* Can't use cw_log since FD's are closed */
-		fprintf(stderr, "Failed to execute '%s': %s\n", script, strerror(errno));
-		exit(1);
+		return -1;
 	}
 	if (option_verbose > 2) 
 		cw_verbose(VERBOSE_PREFIX_3 "Launched OGI Script %s\n", script);
@@ -1856,11 +2126,13 @@ static int run_ogi(struct cw_channel *chan, char *request, OGI *ogi, int pid, in
 	  channel or file descriptor in case select is interrupted by a system call (EINTR) */
 	int retry = RETRY;
 
-	if (!(readf = fdopen(ogi->ctrl, "r"))) {
+	/* A pooled connection must survive the fclose() below */
+	if (!(readf = fdopen(ogi->keepalive  ?  dup(ogi->ctrl)  :  ogi->ctrl, "r"))) {
 		cw_log(LOG_WARNING, "Unable to fdopen file descriptor\n");
 		if (pid > -1)
 			kill(pid, SIGHUP);
-		close(ogi->ctrl);
+		if (!ogi->keepalive)
+			close(ogi->ctrl);
 		return -1;
 	}
 	setlinebuf(readf);
@@ -1901,6 +2173,14 @@ static int run_ogi(struct cw_channel *chan, char *request, OGI *ogi, int pid, in
 				buf[strlen(buf) - 1] = 0;
 			if (ogidebug)
 				cw_verbose("OGI Rx << %s\n", buf);
+			if (ogi->keepalive  &&  !strcasecmp(buf, "END SESSION")) {
+				/* The server is done with this call but keeps the connection */
+				fdprintf(ogi->fd, "200 result=0\n");
+				ogi->reusable = 1;
+				if (option_verbose > 2) 
+					cw_verbose(VERBOSE_PREFIX_3 "OGI Script %s ended session, returning %d\n", request, returnstatus);
+				break;
+			}
 			returnstatus |= ogi_handle_command(chan, ogi, buf);
 			/* If the handle_command returns -1, we need to stop */
 			if ((returnstatus < 0) || (returnstatus == CW_PBX_KEEPALIVE)) {
@@ -2002,6 +2282,78 @@ static int handle_dumpogihtml(int fd, int argc, char *argv[]) {
 	return RESULT_SUCCESS;
 }
 
+static void ogi_load_config(void)
+{
+	struct cw_config *cfg;
+	char *v;
+
+	cw_mutex_lock(&poollock);
+	pool_keepalive = 1;
+	pool_balance = OGI_BALANCE_ROUNDROBIN;
+	pool_maxidle = 8;
+	pool_idletimeout = 60;
+	pool_dnscache = 300;
+	pool_connecttimeout = MAX_OGI_CONNECT;
+	if ((cfg = cw_config_load("ogi.conf"))) {
+		if ((v = cw_variable_retrieve(cfg, "general", "keepalive")))
+			pool_keepalive = cw_true(v);
+		if ((v = cw_variable_retrieve(cfg, "general", "balance"))) {
+			if (!strcasecmp(v, "leastoutstanding"))
+				pool_balance = OGI_BALANCE_LEASTOUTSTANDING;
+			else if (!strcasecmp(v, "roundrobin"))
+				pool_balance = OGI_BALANCE_ROUNDROBIN;
+			else
+				cw_log(LOG_WARNING, "Unknown balance '%s' in ogi.conf, using roundrobin\n", v);
+		}
+		if ((v = cw_variable_retrieve(cfg, "general", "maxidle"))) {
+			pool_maxidle = atoi(v);
+			if (pool_maxidle < 0)
+				pool_maxidle = 0;
+			if (pool_maxidle > OGI_POOL_MAX_IDLE)
+				pool_maxidle = OGI_POOL_MAX_IDLE;
+		}
+		if ((v = cw_variable_retrieve(cfg, "general", "idletimeout")))
+			pool_idletimeout = atoi(v);
+		if ((v = cw_variable_retrieve(cfg, "general", "dnscache")))
+			pool_dnscache = atoi(v);
+		if ((v = cw_variable_retrieve(cfg, "general", "connecttimeout"))) {
+			pool_connecttimeout = atoi(v);
+			if (pool_connecttimeout <= 0)
+				pool_connecttimeout = MAX_OGI_CONNECT;
+		}
+		cw_config_destroy(cfg);
+	}
+	cw_mutex_unlock(&poollock);
+}
+
+static int handle_showogipool(int fd, int argc, char *argv[])
+{
+	struct ogi_backend *b;
+	struct ogi_pool *p;
+	time_t now;
+
+	if (argc != 3)
+		return RESULT_SHOWUSAGE;
+	time(&now);
+	cw_mutex_lock(&poollock);
+	cw_cli(fd, "Keep-alive: %s  Balance: %s  Max idle: %d  Idle timeout: %ds\n",
+		pool_keepalive  ?  "yes"  :  "no",
+		(pool_balance == OGI_BALANCE_LEASTOUTSTANDING)  ?  "leastoutstanding"  :  "roundrobin",
+		pool_maxidle, pool_idletimeout);
+	cw_cli(fd, "%-30s %6s %5s %9s %9s %7s %s\n", "Server", "Active", "Idle", "Connects", "Reuses", "Errors", "State");
+	for (b = backends;  b;  b = b->next) {
+		char name[MAXHOSTNAMELEN + 8];
+
+		snprintf(name, sizeof(name), "%s:%d", b->host, b->port);
+		cw_cli(fd, "%-30s %6d %5d %9lu %9lu %7lu %s\n", name, b->outstanding, b->nidle,
+			b->connects, b->reuses, b->errors, (b->down_until > now)  ?  "DOWN"  :  "OK");
+	}
+	for (p = pools;  p;  p = p->next)
+		cw_cli(fd, "Pool %s: %lu sessions\n", p->hostlist, p->sessions);
+	cw_mutex_unlock(&poollock);
+	return RESULT_SUCCESS;
+}
+
 static int ogi_exec_full(struct cw_channel *chan, int argc, char **argv, int enhanced, int dead)
 {
 	int res=0;
@@ -2010,6 +2362,7 @@ static int ogi_exec_full(struct cw_channel *chan, int argc, char **argv, int enh
 	int efd = -1;
 	int pid;
 	OGI ogi;
+	struct ogi_conn conn;
 
 	if (argc < 1 || !argv[0][0]) {
 		cw_log(LOG_ERROR, "Syntax: OGI(command[, arg1, arg2, ..., argn])\n");
@@ -2026,13 +2379,19 @@ static int ogi_exec_full(struct cw_channel *chan, int argc, char **argv, int enh
 		}
 	}
 #endif
-	res = launch_script(argv[0], argv, fds, enhanced ? &efd : NULL, &pid);
+	conn.backend = NULL;
+	conn.fd = -1;
+	res = launch_script(argv[0], argv, fds, enhanced ? &efd : NULL, &pid, &conn);
 	if (!res) {
 		ogi.fd = fds[1];
 		ogi.ctrl = fds[0];
 		ogi.audio = efd;
+		ogi.keepalive = (conn.backend != NULL);
+		ogi.reusable = 0;
 		res = run_ogi(chan, argv[0], &ogi, pid, dead);
-		if (fds[1] != fds[0])
+		if (conn.backend)
+			ogi_pool_release(&conn, ogi.reusable);
+		else if (fds[1] != fds[0])
 			close(fds[1]);
 		if (efd > -1)
 			close(efd);
@@ -2089,6 +2448,13 @@ static char dumpogihtml_help[] =
 static struct cw_cli_entry showogi = 
 { { "show", "ogi", NULL }, handle_showogi, "Show OGI commands or specific help", showogi_help };
 
+static char showogipool_help[] =
+"Usage: show ogi pool\n"
+"       Lists FastOGI servers with their active and idle connections.\n";
+
+static struct cw_cli_entry showogipool = 
+{ { "show", "ogi", "pool", NULL }, handle_showogipool, "Show FastOGI connection pool", showogipool_help };
+
 static struct cw_cli_entry dumpogihtml = 
 { { "dump", "ogihtml", NULL }, handle_dumpogihtml, "Dumps a list of ogi command in html format", dumpogihtml_help };
 
@@ -2097,18 +2463,28 @@ int unload_module(void)
 	int res = 0;
 	STANDARD_HANGUP_LOCALUSERS;
 	cw_cli_unregister(&showogi);
+	cw_cli_unregister(&showogipool);
 	cw_cli_unregister(&dumpogihtml);
 	cw_cli_unregister(&cli_debug);
 	cw_cli_unregister(&cli_no_debug);
 	res |= cw_unregister_application(eapp_app);
 	res |= cw_unregister_application(deadapp_app);
 	res |= cw_unregister_application(app_app);
+	ogi_pool_destroy();
 	return res;
 }
 
+int reload(void)
+{
+	ogi_load_config();
+	return 0;
+}
+
 int load_module(void)
 {
+	ogi_load_config();
 	cw_cli_register(&showogi);
+	cw_cli_register(&showogipool);
 	cw_cli_register(&dumpogihtml);
 	cw_cli_register(&cli_debug);
 	cw_cli_register(&cli_no_debug);
@@ -22,6 +22,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <sys/time.h>
 #include "callweaver/callweaver_expr.h"
 
 static unsigned int global_lineno = 1;
@@ -30,6 +31,10 @@ static unsigned int global_expr_max_size = 0;
 static unsigned int global_expr_tot_size = 0;
 static unsigned int global_warn_count = 0;
 static unsigned int global_OK_count = 0;
+static unsigned int global_mismatch_count = 0;
+static unsigned int global_bench_iterations = 0;
+static double global_parse_usec = 0.0;
+static double global_cached_usec = 0.0;
 
 struct varz
 {
@@ -165,6 +170,55 @@ unsigned int check_expr(char* buffer, char* error_report)
 	return warn_found;
 }
 
+/* The cached evaluator must give exactly what the parser gives, both
+   when it misses and when it hits */
+void check_conformance(char *expr, char *result, int result_len)
+{
+	char s[4096];
+	int i, len;
+
+	for (i = 0; i < 2; i++) {
+		if (i == 0)
+			len = cw_expr_uncached(expr, s, sizeof(s));
+		else
+			len = cw_expr(expr, s, sizeof(s));
+		if (len != result_len || strcmp(s, result)) {
+			if (printf("MISMATCH at line %u: $[ %s ] gave '%s' (%d) from the %s, '%s' (%d) from the cache\n",
+				   global_lineno, expr, s, len, i ? "cache" : "parser", result, result_len) < 0)
+			{
+				exit(errno);
+			}
+			global_mismatch_count++;
+		}
+	}
+}
+
+static double elapsed_usec(struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec)*1000000.0 + (now.tv_usec - start->tv_usec);
+}
+
+/* Time repeated evaluation of one expression with and without the cache */
+void bench_expr(char *expr)
+{
+	char s[4096];
+	struct timeval start;
+	unsigned int i;
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < global_bench_iterations; i++)
+		cw_expr_uncached(expr, s, sizeof(s));
+	global_parse_usec += elapsed_usec(&start);
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < global_bench_iterations; i++)
+		cw_expr(expr, s, sizeof(s));
+	global_cached_usec += elapsed_usec(&start);
+}
+
 int check_eval(char *buffer, char *error_report)
 {
 	char *cp, *ep;
@@ -229,6 +283,9 @@ int check_eval(char *buffer, char *error_report)
 
 	/* now, run the test */
 	result = cw_expr(evalbuf, s, sizeof(s));
+	check_conformance(evalbuf, s, result);
+	if (global_bench_iterations)
+		bench_expr(evalbuf);
 	if (result) {
 		sprintf(error_report, "line %u, evaluation of $[ %s ] result: %s\n", global_lineno, evalbuf, s);
 		return 1;
@@ -256,8 +313,6 @@ void parse_file(const char *fname)
 		}
 		exit(20);
 	}
-	if (!l) {
-
 	if (!(l = fopen("expr2_log", "w"))) {
 		if (fprintf(stderr, "Couldn't open 'expr2_log' file for writing... please fix and re-run!\n") < 0)
 		{
@@ -383,6 +438,25 @@ void parse_file(const char *fname)
 		exit(errno);
 	}
 
+	if (printf("  Cache mismatches:   %u\n", global_mismatch_count) < 0)
+	{
+		exit(errno);
+	}
+
+	if (global_bench_iterations && global_expr_count) {
+		unsigned int hits, misses;
+
+		cw_expr_cache_stats(&hits, &misses);
+		if (printf("Benchmark (%u evaluations per expression):\n  Parser:   %.3f usec/eval\n  Cached:   %.3f usec/eval\n  Cache hits/misses:  %u/%u\n",
+			   global_bench_iterations,
+			   global_parse_usec/((double) global_bench_iterations*global_expr_count),
+			   global_cached_usec/((double) global_bench_iterations*global_expr_count),
+			   hits, misses) < 0)
+		{
+			exit(errno);
+		}
+	}
+
 	if (fclose(f))
 	{
 		exit(errno);
@@ -399,9 +473,15 @@ void parse_file(const char *fname)
 int main(int argc, char **argv)
 {
 	int argc1;
+	int first = 1;
 	char *eq;
 	
-	if (argc < 2) {
+	/* -b N: also time N evaluations of each expression, parsed and cached */
+	if (argc > 2 && !strcmp(argv[1], "-b")) {
+		global_bench_iterations = atoi(argv[2]);
+		first = 3;
+	}
+	if (argc < first + 1) {
 		if (printf("Hey-- give me a path to an extensions.conf file!\n") < 0)
 		{
 			return errno;
@@ -410,7 +490,7 @@ int main(int argc, char **argv)
 		return 19;
 	}
 	global_varlist = 0;
-	for (argc1=2;argc1 < argc; argc1++) {
+	for (argc1=first+1;argc1 < argc; argc1++) {
 		if ((eq = strchr(argv[argc1],'='))) {
 			*eq = 0;
 			set_var(argv[argc1],eq+1);
@@ -419,6 +499,6 @@ int main(int argc, char **argv)
 
 	/* parse command args for x=y and set varz */
 	
-	parse_file(argv[1]);
-	return 0;
+	parse_file(argv[first]);
+	return global_mismatch_count ? 1 : 0;
 }
@@ -0,0 +1,525 @@
+/*
+ * CallWeaver -- An open source telephony toolkit.
+ *
+ * See http://www.callweaver.org for more information about
+ * the CallWeaver project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*
+ * Check the res_odbc connection pool against a stub ODBC driver. Only the
+ * unixODBC headers are needed, not a driver manager or a database.
+ *
+ * It covers a thread's nested requests sharing its connection, the
+ * statement cache being reset and trimmed as connections are handed back,
+ * and a lost connection (SQLSTATE 08xxx) being reconnected with backoff.
+ *
+ * res_odbc.c is built into this file, so its static pool functions and
+ * fields can be checked directly.
+ *
+ * configure doesn't build the ODBC modules at the moment, so build it by
+ * hand from a configured tree with something like
+ *
+ *     gcc -fgnu89-inline -D_GNU_SOURCE -include include/confdefs.h
+ *         -Iinclude -I$(top_srcdir)/include utils/check_odbc.c -lpthread
+ *
+ * Exits non-zero if any check fails.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define CW_API_MODULE		/* utils.c builds these for the core, res_odbc.c needs them here */
+#include "callweaver/strings.h"
+
+#define CW_API_MODULE		/* utils.c builds these for the core, res_odbc.c needs them here */
+#include "callweaver/time.h"
+
+#include "../res/res_odbc.c"
+
+static unsigned int global_checks = 0;
+static unsigned int global_failures = 0;
+
+#define CHECK(x) check((x), #x, __LINE__)
+
+static void check(int ok, const char *what, int line)
+{
+	global_checks++;
+	if (ok)
+		return;
+	global_failures++;
+	printf("FAILED: line %d: %s\n", line, what);
+}
+
+/* ************************************************************************** */
+
+/* The parts of the core res_odbc uses. Pools are made by hand, so there is
+   never any configuration to read */
+
+int option_verbose = 0;
+
+void cw_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
+{
+}
+
+void cw_cli(int fd, char *fmt, ...)
+{
+}
+
+int cw_cli_register(struct cw_cli_entry *e)
+{
+	return 0;
+}
+
+int cw_cli_unregister(struct cw_cli_entry *e)
+{
+	return 0;
+}
+
+struct cw_config *cw_config_load(const char *filename)
+{
+	return NULL;
+}
+
+void cw_config_destroy(struct cw_config *config)
+{
+}
+
+char *cw_category_browse(struct cw_config *config, const char *prev)
+{
+	return NULL;
+}
+
+struct cw_variable *cw_variable_browse(const struct cw_config *config, const char *category)
+{
+	return NULL;
+}
+
+int cw_true(const char *val)
+{
+	return 0;
+}
+
+int cw_softhangup(struct cw_channel *chan, int cause)
+{
+	return 0;
+}
+
+void cw_update_use_count(void)
+{
+}
+
+struct timeval cw_tvadd(struct timeval a, struct timeval b)
+{
+	a.tv_sec += b.tv_sec;
+	a.tv_usec += b.tv_usec;
+	if (a.tv_usec >= 1000000)
+	{
+		a.tv_sec++;
+		a.tv_usec -= 1000000;
+	}
+	return a;
+}
+
+void cw_register_file_version(const char *file, const char *version)
+{
+}
+
+void cw_unregister_file_version(const char *file)
+{
+}
+
+/* ************************************************************************** */
+
+/* The stub driver. Statements remember what was done to them, and the
+   connection can be made to fail on demand */
+
+struct stub_stmt
+{
+	int closes;
+	int unbinds;
+	int resets;
+};
+
+static int stub_env;
+static int stub_connects = 0;
+static int stub_connect_fails = 0;
+static int stub_disconnects = 0;
+static int stub_stmt_allocs = 0;
+static int stub_stmt_frees = 0;
+static const char *stub_exec_state = NULL;	/* SQLSTATE the next execute fails with */
+static const char *stub_diag_state = NULL;
+
+SQLRETURN SQLAllocHandle(SQLSMALLINT HandleType, SQLHANDLE InputHandle, SQLHANDLE *OutputHandle)
+{
+	switch (HandleType)
+	{
+	case SQL_HANDLE_ENV:
+		*OutputHandle = &stub_env;
+		return SQL_SUCCESS;
+	case SQL_HANDLE_DBC:
+		*OutputHandle = malloc(1);
+		return SQL_SUCCESS;
+	case SQL_HANDLE_STMT:
+		*OutputHandle = calloc(1, sizeof(struct stub_stmt));
+		stub_stmt_allocs++;
+		return SQL_SUCCESS;
+	}
+	return SQL_ERROR;
+}
+
+SQLRETURN SQLFreeHandle(SQLSMALLINT HandleType, SQLHANDLE Handle)
+{
+	switch (HandleType)
+	{
+	case SQL_HANDLE_DBC:
+		free(Handle);
+		break;
+	case SQL_HANDLE_STMT:
+		free(Handle);
+		stub_stmt_frees++;
+		break;
+	}
+	return SQL_SUCCESS;
+}
+
+SQLRETURN SQLSetEnvAttr(SQLHENV EnvironmentHandle, SQLINTEGER Attribute, SQLPOINTER Value, SQLINTEGER StringLength)
+{
+	return SQL_SUCCESS;
+}
+
+SQLRETURN SQLSetConnectAttr(SQLHDBC ConnectionHandle, SQLINTEGER Attribute, SQLPOINTER Value, SQLINTEGER StringLength)
+{
+	return SQL_SUCCESS;
+}
+
+SQLRETURN SQLConnect(SQLHDBC ConnectionHandle,
+					 SQLCHAR *ServerName, SQLSMALLINT NameLength1,
+					 SQLCHAR *UserName, SQLSMALLINT NameLength2,
+					 SQLCHAR *Authentication, SQLSMALLINT NameLength3)
+{
+	stub_connects++;
+	if (stub_connect_fails > 0)
+	{
+		stub_connect_fails--;
+		stub_diag_state = "08001";
+		return SQL_ERROR;
+	}
+	return SQL_SUCCESS;
+}
+
+SQLRETURN SQLDisconnect(SQLHDBC ConnectionHandle)
+{
+	stub_disconnects++;
+	return SQL_SUCCESS;
+}
+
+SQLRETURN SQLGetDiagRec(SQLSMALLINT HandleType, SQLHANDLE Handle, SQLSMALLINT RecNumber,
+						SQLCHAR *Sqlstate, SQLINTEGER *NativeError, SQLCHAR *MessageText,
+						SQLSMALLINT BufferLength, SQLSMALLINT *TextLength)
+{
+	if (stub_diag_state == NULL)
+		return SQL_NO_DATA;
+	strcpy((char *) Sqlstate, stub_diag_state);
+	*NativeError = 0;
+	cw_copy_string((char *) MessageText, "stub", BufferLength);
+	*TextLength = 4;
+	stub_diag_state = NULL;
+	return SQL_SUCCESS;
+}
+
+SQLRETURN SQLPrepare(SQLHSTMT StatementHandle, SQLCHAR *StatementText, SQLINTEGER TextLength)
+{
+	return SQL_SUCCESS;
+}
+
+SQLRETURN SQLExecute(SQLHSTMT StatementHandle)
+{
+	if (stub_exec_state)
+	{
+		stub_diag_state = stub_exec_state;
+		stub_exec_state = NULL;
+		return SQL_ERROR;
+	}
+	return SQL_SUCCESS;
+}
+
+SQLRETURN SQLExecDirect(SQLHSTMT StatementHandle, SQLCHAR *StatementText, SQLINTEGER TextLength)
+{
+	return SQLExecute(StatementHandle);
+}
+
+SQLRETURN SQLFreeStmt(SQLHSTMT StatementHandle, SQLUSMALLINT Option)
+{
+	struct stub_stmt *s = StatementHandle;
+
+	switch (Option)
+	{
+	case SQL_CLOSE:
+		s->closes++;
+		break;
+	case SQL_UNBIND:
+		s->unbinds++;
+		break;
+	case SQL_RESET_PARAMS:
+		s->resets++;
+		break;
+	}
+	return SQL_SUCCESS;
+}
+
+/* ************************************************************************** */
+
+static odbc_pool *make_pool(const char *name, int size, int wait)
+{
+	odbc_pool *pool;
+
+	pool = new_odbc_pool((char *) name, "stub", NULL, NULL);
+	pool->size = size;
+	pool->wait = wait;
+	pool->idle_check = 0;
+	register_odbc_pool((char *) name, pool);
+	return pool;
+}
+
+static int prepared_count(odbc_obj *obj)
+{
+	struct odbc_prepared *p;
+	int n;
+
+	for (n = 0, p = obj->prepared;  p;  p = p->next)
+		n++;
+	return n;
+}
+
+struct request
+{
+	const char *name;
+	odbc_obj *obj;
+	int release;
+};
+
+static void *request_thread(void *data)
+{
+	struct request *r = data;
+
+	r->obj = odbc_request_obj(r->name, 0);
+	if (r->obj  &&  r->release)
+		odbc_release_obj(r->obj);
+	return NULL;
+}
+
+static odbc_obj *request_elsewhere(const char *name, int release)
+{
+	struct request r;
+	pthread_t t;
+
+	r.name = name;
+	r.obj = NULL;
+	r.release = release;
+	pthread_create(&t, NULL, request_thread, &r);
+	pthread_join(t, NULL);
+	return r.obj;
+}
+
+/* A thread asking again gets the connection it holds, and only its outermost
+   release hands it back. Other threads never share it */
+static void check_nesting(void)
+{
+	odbc_pool *pool;
+	odbc_obj *outer;
+	odbc_obj *inner;
+	odbc_obj *other;
+	int connects;
+
+	pool = make_pool("nesting", 1, 50);
+	connects = stub_connects;
+
+	outer = odbc_request_obj("nesting", 0);
+	CHECK(outer != NULL);
+	CHECK(stub_connects == connects + 1);
+	inner = odbc_request_obj("nesting", 1);
+	CHECK(inner == outer);
+	CHECK(outer->depth == 1);
+	CHECK(stub_connects == connects + 1);
+
+	/* The only connection is ours, so another thread times out */
+	CHECK(request_elsewhere("nesting", 1) == NULL);
+	CHECK(pool->timeouts == 1);
+
+	odbc_release_obj(inner);
+	CHECK(outer->used  &&  outer->depth == 0);
+	CHECK(request_elsewhere("nesting", 1) == NULL);
+
+	odbc_release_obj(outer);
+	CHECK(!outer->used);
+	other = request_elsewhere("nesting", 1);
+	CHECK(other == outer);
+	CHECK(!outer->used);
+
+	/* With room for two, another thread gets a connection of its own */
+	pool->size = 2;
+	outer = odbc_request_obj("nesting", 0);
+	other = request_elsewhere("nesting", 0);
+	CHECK(other != NULL  &&  other != outer);
+	CHECK(pool->count == 2);
+	CHECK(other->depth == 0);
+	odbc_release_obj(other);
+	odbc_release_obj(outer);
+	CHECK(!outer->used  &&  !other->used);
+}
+
+/* Statements are reset for the next user when a connection is handed back,
+   reused by SQL text, and the least recently used spare is dropped once the
+   cache is full */
+static void check_statements(void)
+{
+	odbc_pool *pool;
+	odbc_obj *obj;
+	SQLHSTMT a;
+	SQLHSTMT b;
+	SQLHSTMT a2;
+	SQLHSTMT c;
+	SQLHSTMT s;
+	int allocs;
+	int frees;
+
+	pool = make_pool("statements", 1, 0);
+	pool->cache_size = 2;
+	allocs = stub_stmt_allocs;
+	frees = stub_stmt_frees;
+
+	obj = odbc_request_obj("statements", 0);
+	CHECK(odbc_prepare(obj, "select a", &a) == SQL_SUCCESS);
+	CHECK(odbc_prepare(obj, "select b", &b) == SQL_SUCCESS);
+	/* Still in use, so the same SQL gets a statement of its own */
+	CHECK(odbc_prepare(obj, "select a", &a2) == SQL_SUCCESS);
+	CHECK(a2 != a);
+	/* Over the cache size, but nothing can go while it is all in use */
+	CHECK(prepared_count(obj) == 3);
+	CHECK(stub_stmt_allocs == allocs + 3);
+	CHECK(stub_stmt_frees == frees);
+	odbc_release_obj(obj);
+
+	/* Every statement given out was readied for the next user */
+	CHECK(((struct stub_stmt *) a)->closes == 1);
+	CHECK(((struct stub_stmt *) a)->unbinds == 1);
+	CHECK(((struct stub_stmt *) a)->resets == 1);
+	CHECK(((struct stub_stmt *) b)->closes == 1);
+	CHECK(((struct stub_stmt *) a2)->closes == 1);
+
+	/* The next user gets the cached ones back */
+	obj = odbc_request_obj("statements", 0);
+	CHECK(odbc_prepare(obj, "select b", &s) == SQL_SUCCESS);
+	CHECK(s == b);
+	CHECK(stub_stmt_allocs == allocs + 3);
+	/* A new one drops the least recently used spare. That is the first
+	   "select a", which is at the end of the list */
+	CHECK(odbc_prepare(obj, "select c", &c) == SQL_SUCCESS);
+	CHECK(stub_stmt_allocs == allocs + 4);
+	CHECK(stub_stmt_frees == frees + 1);
+	CHECK(prepared_count(obj) == 3);
+	CHECK(odbc_prepare(obj, "select a", &s) == SQL_SUCCESS);
+	CHECK(s == a2);
+	CHECK(stub_stmt_allocs == allocs + 4);
+	odbc_release_obj(obj);
+
+	/* Only the statements given out this time are reset again */
+	CHECK(((struct stub_stmt *) b)->closes == 2);
+	CHECK(((struct stub_stmt *) c)->closes == 1);
+	CHECK(((struct stub_stmt *) a2)->closes == 2);
+}
+
+/* A connection error marks the connection down, handing it back drops it,
+   and failed reconnects back off, doubling up to the limit */
+static void check_reconnect(void)
+{
+	odbc_pool *pool;
+	odbc_obj *obj;
+	SQLHSTMT s;
+	int connects;
+	int disconnects;
+	int frees;
+
+	pool = make_pool("reconnect", 1, 0);
+	pool->max_backoff = 5;
+
+	obj = odbc_request_obj("reconnect", 0);
+	CHECK(obj != NULL  &&  obj->up);
+	CHECK(odbc_prepare(obj, "select 1", &s) == SQL_SUCCESS);
+
+	/* Other errors leave the connection alone */
+	stub_exec_state = "42S02";
+	CHECK(odbc_smart_execute(obj, s) == SQL_ERROR);
+	CHECK(obj->up);
+
+	stub_exec_state = "08S01";
+	CHECK(odbc_smart_execute(obj, s) == SQL_ERROR);
+	CHECK(!obj->up);
+	disconnects = stub_disconnects;
+	frees = stub_stmt_frees;
+	odbc_release_obj(obj);
+	CHECK(stub_disconnects == disconnects + 1);
+	CHECK(stub_stmt_frees == frees + 1);
+	CHECK(obj->con == SQL_NULL_HANDLE  &&  obj->prepared == NULL);
+
+	/* The server is still away */
+	stub_connect_fails = 5;
+	connects = stub_connects;
+	CHECK(odbc_request_obj("reconnect", 0) == NULL);
+	CHECK(stub_connects == connects + 1);
+	CHECK(pool->backoff == 1);
+	CHECK(pool->retry >= time(NULL));
+	CHECK(!obj->used);
+
+	/* Backing off, so it isn't even tried */
+	CHECK(odbc_request_obj("reconnect", 0) == NULL);
+	CHECK(stub_connects == connects + 1);
+
+	/* Each time the backoff runs out, it fails again for twice as long,
+	   up to max-backoff */
+	pool->retry = 0;
+	CHECK(odbc_request_obj("reconnect", 0) == NULL);
+	CHECK(pool->backoff == 2);
+	pool->retry = 0;
+	CHECK(odbc_request_obj("reconnect", 0) == NULL);
+	CHECK(pool->backoff == 4);
+	pool->retry = 0;
+	CHECK(odbc_request_obj("reconnect", 0) == NULL);
+	CHECK(pool->backoff == 5);
+	pool->retry = 0;
+	CHECK(odbc_request_obj("reconnect", 0) == NULL);
+	CHECK(pool->backoff == 5);
+	CHECK(stub_connects == connects + 5);
+
+	/* Back, and the backoff is forgotten */
+	pool->retry = 0;
+	obj = odbc_request_obj("reconnect", 0);
+	CHECK(obj != NULL  &&  obj->up);
+	CHECK(stub_connects == connects + 6);
+	CHECK(pool->backoff == 0  &&  pool->retry == 0);
+	odbc_release_obj(obj);
+}
+
+int main(int argc, char **argv)
+{
+	odbc_init();
+
+	check_nesting();
+	check_statements();
+	check_reconnect();
+
+	odbc_destroy();
+	printf("Checks: %u  Failures: %u\n", global_checks, global_failures);
+	return (global_failures)  ?  1  :  0;
+}
@@ -0,0 +1,300 @@
+/*
+ * CallWeaver -- An open source telephony toolkit.
+ *
+ * See http://www.callweaver.org for more information about
+ * the CallWeaver project. Please do not directly contact
+ * any of the maintainers of this project for assistance;
+ * the project provides a web site, mailing lists and IRC
+ * channels for your use.
+ *
+ * This program is free software, distributed under the terms of
+ * the GNU General Public License Version 2. See the LICENSE file
+ * at the top of the source tree.
+ */
+
+/*
+ * Check every accelerated PCM kernel this CPU can run against the scalar
+ * ones, bit for bit. Decoding is checked over all 256 codes, encoding over
+ * all 65536 samples, mixing and gain over every sample against a spread of
+ * partners and gains. Each kernel is also run at every element offset in a
+ * vector and every length up to a few vectors, with guard bytes either side
+ * of the output, so the unaligned heads and scalar tails get covered too.
+ *
+ * Exits non-zero if any kernel disagrees.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <sys/time.h>
+
+#include "callweaver/ulaw.h"
+#include "callweaver/alaw.h"
+#include "callweaver/pcm.h"
+#include "callweaver/cli.h"
+
+#define CW_API_MODULE		/* utils.c builds these for the core, pcm.c needs them here */
+#include "callweaver/time.h"
+
+#define MAX_OFFSET	16
+#define MAX_LENGTH	68
+#define GUARD		8
+#define CANARY		0xA5
+
+struct kernels
+{
+	void (*ulaw_to_slin)(int16_t *dst, const uint8_t *src, int samples);
+	void (*slin_to_ulaw)(uint8_t *dst, const int16_t *src, int samples);
+	void (*alaw_to_slin)(int16_t *dst, const uint8_t *src, int samples);
+	void (*slin_to_alaw)(uint8_t *dst, const int16_t *src, int samples);
+	void (*slin_mix)(int16_t *dst, const int16_t *src, int samples);
+	void (*slin_gain)(int16_t *amp, int samples, int16_t gain);
+};
+
+static const int16_t gains[] = {-32768, -2048, -1, 0, 1, 682, 1024, 2048, 4096, 30720, 32767};
+
+static int16_t lin[65536];
+static int16_t lin2[65536];
+static uint8_t law[65536];
+
+static unsigned int global_checks = 0;
+static unsigned int global_failures = 0;
+
+/* The kernels only log if the startup check fails, and never use the CLI
+   here. Our own versions keep us from linking the rest of the core */
+
+void cw_log(int level, const char *file, int line, const char *function, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+	printf("LOG: lev:%d file:%s line:%d func: %s  ", level, file, line, function);
+	vprintf(fmt, ap);
+	va_end(ap);
+}
+
+void cw_cli(int fd, char *fmt, ...)
+{
+}
+
+int cw_cli_register(struct cw_cli_entry *e)
+{
+	return 0;
+}
+
+void cw_register_file_version(const char *file, const char *version)
+{
+}
+
+void cw_unregister_file_version(const char *file)
+{
+}
+
+static void get_kernels(struct kernels *k)
+{
+	k->ulaw_to_slin = cw_ulaw_to_slin;
+	k->slin_to_ulaw = cw_slin_to_ulaw;
+	k->alaw_to_slin = cw_alaw_to_slin;
+	k->slin_to_alaw = cw_slin_to_alaw;
+	k->slin_mix = cw_slin_mix;
+	k->slin_gain = cw_slin_gain;
+}
+
+static void check(int ok, const char *impl, const char *kernel, const char *what, int offset, int samples)
+{
+	global_checks++;
+	if (ok)
+		return;
+	global_failures++;
+	printf("MISMATCH: %s %s %s offset %d length %d\n", impl, kernel, what, offset, samples);
+}
+
+static int guards_ok(const uint8_t *buf, int start, int bytes, int size)
+{
+	int i;
+
+	for (i = 0;  i < start;  i++)
+	{
+		if (buf[i] != CANARY)
+			return 0;
+	}
+	for (i = start + bytes;  i < size;  i++)
+	{
+		if (buf[i] != CANARY)
+			return 0;
+	}
+	return 1;
+}
+
+/* Whole range checks, one call over every possible input */
+static void check_full(const struct kernels *ref, const struct kernels *cur, const char *impl)
+{
+	static int16_t a[65536];
+	static int16_t b[65536];
+	static uint8_t u[65536];
+	static uint8_t v[65536];
+	int i;
+	int j;
+
+	for (i = 0;  i < 256;  i++)
+		u[i] = (uint8_t) i;
+	ref->ulaw_to_slin(a, u, 256);
+	cur->ulaw_to_slin(b, u, 256);
+	check(memcmp(a, b, 256*sizeof(int16_t)) == 0, impl, "ulaw decode", "all codes", 0, 256);
+	ref->alaw_to_slin(a, u, 256);
+	cur->alaw_to_slin(b, u, 256);
+	check(memcmp(a, b, 256*sizeof(int16_t)) == 0, impl, "alaw decode", "all codes", 0, 256);
+
+	for (i = 0;  i < 65536;  i++)
+		a[i] = (int16_t) (i - 32768);
+	ref->slin_to_ulaw(u, a, 65536);
+	cur->slin_to_ulaw(v, a, 65536);
+	check(memcmp(u, v, 65536) == 0, impl, "ulaw encode", "all samples", 0, 65536);
+	ref->slin_to_alaw(u, a, 65536);
+	cur->slin_to_alaw(v, a, 65536);
+	check(memcmp(u, v, 65536) == 0, impl, "alaw encode", "all samples", 0, 65536);
+
+	for (j = 0;  j < 65536;  j += 257)
+	{
+		for (i = 0;  i < 65536;  i++)
+			a[i] = b[i] = (int16_t) (((i + j) & 0xFFFF) - 32768);
+		ref->slin_mix(a, lin, 65536);
+		cur->slin_mix(b, lin, 65536);
+		check(memcmp(a, b, 65536*sizeof(int16_t)) == 0, impl, "mix", "all samples", j, 65536);
+	}
+
+	for (j = 0;  j < (int) (sizeof(gains)/sizeof(gains[0]));  j++)
+	{
+		for (i = 0;  i < 65536;  i++)
+			a[i] = b[i] = (int16_t) (i - 32768);
+		ref->slin_gain(a, 65536, gains[j]);
+		cur->slin_gain(b, 65536, gains[j]);
+		check(memcmp(a, b, 65536*sizeof(int16_t)) == 0, impl, "gain", "all samples", gains[j], 65536);
+	}
+}
+
+/* Every start offset within a vector and every short length, so the
+   unaligned loads and the tails are exercised. The source also moves
+   through the test data, so each run sees different values */
+static void check_edges(const struct kernels *ref, const struct kernels *cur, const char *impl)
+{
+	int16_t a[GUARD + MAX_OFFSET + MAX_LENGTH + GUARD];
+	int16_t b[GUARD + MAX_OFFSET + MAX_LENGTH + GUARD];
+	uint8_t u[GUARD + MAX_OFFSET + MAX_LENGTH + GUARD];
+	uint8_t v[GUARD + MAX_OFFSET + MAX_LENGTH + GUARD];
+	const int16_t *slin;
+	const uint8_t *codes;
+	int offset;
+	int samples;
+	int base;
+	int j;
+
+	base = 0;
+	for (offset = 0;  offset < MAX_OFFSET;  offset++)
+	{
+		for (samples = 0;  samples < MAX_LENGTH;  samples++)
+		{
+			base = (base + 7919) & 0xFFFF;
+			if (base > 65536 - MAX_LENGTH - MAX_OFFSET)
+				base -= 32768;
+			/* Misalign the source too, by a different amount */
+			slin = lin + base + ((offset*5) & (MAX_OFFSET - 1));
+			codes = law + base + ((offset*3) & (MAX_OFFSET - 1));
+
+			memset(a, CANARY, sizeof(a));
+			memset(b, CANARY, sizeof(b));
+			ref->ulaw_to_slin(a + GUARD + offset, codes, samples);
+			cur->ulaw_to_slin(b + GUARD + offset, codes, samples);
+			check(memcmp(a, b, sizeof(a)) == 0
+				  &&  guards_ok((uint8_t *) b, (GUARD + offset)*sizeof(int16_t), samples*sizeof(int16_t), sizeof(b)),
+				  impl, "ulaw decode", "edges", offset, samples);
+			memset(a, CANARY, sizeof(a));
+			memset(b, CANARY, sizeof(b));
+			ref->alaw_to_slin(a + GUARD + offset, codes, samples);
+			cur->alaw_to_slin(b + GUARD + offset, codes, samples);
+			check(memcmp(a, b, sizeof(a)) == 0
+				  &&  guards_ok((uint8_t *) b, (GUARD + offset)*sizeof(int16_t), samples*sizeof(int16_t), sizeof(b)),
+				  impl, "alaw decode", "edges", offset, samples);
+
+			memset(u, CANARY, sizeof(u));
+			memset(v, CANARY, sizeof(v));
+			ref->slin_to_ulaw(u + GUARD + offset, slin, samples);
+			cur->slin_to_ulaw(v + GUARD + offset, slin, samples);
+			check(memcmp(u, v, sizeof(u)) == 0  &&  guards_ok(v, GUARD + offset, samples, sizeof(v)),
+				  impl, "ulaw encode", "edges", offset, samples);
+			memset(u, CANARY, sizeof(u));
+			memset(v, CANARY, sizeof(v));
+			ref->slin_to_alaw(u + GUARD + offset, slin, samples);
+			cur->slin_to_alaw(v + GUARD + offset, slin, samples);
+			check(memcmp(u, v, sizeof(u)) == 0  &&  guards_ok(v, GUARD + offset, samples, sizeof(v)),
+				  impl, "alaw encode", "edges", offset, samples);
+
+			memset(a, CANARY, sizeof(a));
+			memcpy(a + GUARD + offset, lin2 + base, samples*sizeof(int16_t));
+			memcpy(b, a, sizeof(a));
+			ref->slin_mix(a + GUARD + offset, slin, samples);
+			cur->slin_mix(b + GUARD + offset, slin, samples);
+			check(memcmp(a, b, sizeof(a)) == 0, impl, "mix", "edges", offset, samples);
+
+			for (j = 0;  j < (int) (sizeof(gains)/sizeof(gains[0]));  j++)
+			{
+				memset(a, CANARY, sizeof(a));
+				memcpy(a + GUARD + offset, slin, samples*sizeof(int16_t));
+				memcpy(b, a, sizeof(a));
+				ref->slin_gain(a + GUARD + offset, samples, gains[j]);
+				cur->slin_gain(b + GUARD + offset, samples, gains[j]);
+				check(memcmp(a, b, sizeof(a)) == 0, impl, "gain", "edges", offset, samples);
+			}
+		}
+	}
+}
+
+int main(int argc, char **argv)
+{
+	static const char *impls[] = {"sse2", "avx2", "neon"};
+	struct kernels ref;
+	struct kernels cur;
+	uint32_t seed;
+	int i;
+
+	cw_ulaw_init();
+	cw_alaw_init();
+	cw_pcm_init();
+
+	/* Random looking test data, with the extremes in it */
+	seed = 1;
+	for (i = 0;  i < 65536;  i++)
+	{
+		seed = seed*1103515245 + 12345;
+		lin[i] = (int16_t) (seed >> 16);
+		seed = seed*1103515245 + 12345;
+		lin2[i] = (int16_t) (seed >> 16);
+		law[i] = (uint8_t) (seed >> 8);
+	}
+	for (i = 0;  i < 65536;  i += 61)
+	{
+		lin[i] = (i & 64)  ?  32767  :  -32768;
+		lin2[i] = (i & 128)  ?  -32768  :  32767;
+	}
+
+	cw_pcm_use("scalar");
+	get_kernels(&ref);
+
+	for (i = 0;  i < (int) (sizeof(impls)/sizeof(impls[0]));  i++)
+	{
+		if (cw_pcm_use(impls[i]))
+		{
+			printf("%-6s not supported here, skipped\n", impls[i]);
+			continue;
+		}
+		get_kernels(&cur);
+		check_full(&ref, &cur, impls[i]);
+		check_edges(&ref, &cur, impls[i]);
+		printf("%-6s checked\n", impls[i]);
+	}
+
+	printf("Checks: %u  Failures: %u\n", global_checks, global_failures);
+	return (global_failures)  ?  1  :  0;
+}